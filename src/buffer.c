@@ -800,6 +800,7 @@ void eb_free(EditBuffer **bp)
             qe_free(&cb);
         }
 
+        eb_unwatch_file(b);
         eb_delete_properties(b, 0, INT_MAX);
         eb_cache_remove(b);
         eb_clear(b);
@@ -2006,6 +2007,131 @@ static int raw_buffer_load(EditBuffer *b, FILE *f)
     return -1;
 }
 
+/* Auto-revert: the directory of the file is watched and unmodified
+ * buffers are updated by replacing only the range that differs from
+ * the file contents on disk.
+ */
+
+#define REVERT_DELAY  200   /* ms, coalesce bursts of write events */
+
+static int eb_revert_changes(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    u8 buf1[IOBUF_SIZE], buf2[IOBUF_SIZE];
+    int fd, len, i, start, end1, end2, size, saved;
+    struct stat st;
+
+    if (b->modified || b->map_address || b->data_type != &raw_data_type
+    ||  (b->flags & (BF_LOADING | BF_SAVING)))
+        return 0;
+
+    fd = open(b->filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+    ||  st.st_size > qs->max_load_size) {
+        close(fd);
+        return -1;
+    }
+    size = st.st_size;
+
+    /* skip the common prefix */
+    for (start = 0; start < size && start < b->total_size; start += len) {
+        len = min3(IOBUF_SIZE, size - start, b->total_size - start);
+        len = pread(fd, buf1, len, start);
+        if (len <= 0 || eb_read(b, start, buf2, len) != len)
+            break;
+        for (i = 0; i < len && buf1[i] == buf2[i]; i++)
+            continue;
+        if (i < len) {
+            start += i;
+            break;
+        }
+    }
+    /* skip the common suffix */
+    end1 = size;
+    end2 = b->total_size;
+    while (end1 > start && end2 > start) {
+        len = min3(IOBUF_SIZE, end1 - start, end2 - start);
+        if (pread(fd, buf1, len, end1 - len) != len
+        ||  eb_read(b, end2 - len, buf2, len) != len)
+            break;
+        for (i = len; i > 0 && buf1[i - 1] == buf2[i - 1]; i--)
+            continue;
+        end1 -= len - i;
+        end2 -= len - i;
+        if (i > 0)
+            break;
+    }
+    if (end1 == start && end2 == start) {
+        close(fd);
+        return 0;
+    }
+
+    /* the undo log does not apply to the new contents */
+    saved = b->save_log;
+    b->save_log = 0;
+    eb_delete(b, start, end2 - start);
+    while (start < end1) {
+        len = pread(fd, buf1, min(IOBUF_SIZE, end1 - start), start);
+        if (len <= 0)
+            break;
+        start += eb_insert(b, start, buf1, len);
+    }
+    b->save_log = saved;
+    eb_free_log_buffer(b);
+    b->modified = 0;
+    close(fd);
+    return 1;
+}
+
+static void eb_revert_timer_cb(void *opaque)
+{
+    EditBuffer *b = opaque;
+
+    b->revert_timer = NULL;
+    if (!b->file_watch) {
+        /* the directory watch was lost: try and restore it */
+        eb_watch_file(b);
+    }
+    if (eb_revert_changes(b) > 0) {
+        put_status(NULL, "Reverted buffer %s", b->name);
+        url_request_display();
+    }
+}
+
+static void eb_file_watch_cb(void *opaque, int event, const char *name)
+{
+    EditBuffer *b = opaque;
+
+    if (event == QE_WATCH_RESCAN) {
+        /* directory was moved or deleted: the watch is useless */
+        qe_watch_remove(&b->file_watch);
+    } else
+    if (!strequal(name, get_basename(b->filename))) {
+        return;
+    }
+    if (!b->revert_timer)
+        b->revert_timer = qe_add_timer(REVERT_DELAY, b, eb_revert_timer_cb);
+}
+
+void eb_watch_file(EditBuffer *b)
+{
+    char dir[MAX_FILENAME_SIZE];
+
+    if (b->file_watch || !b->filename[0])
+        return;
+
+    get_dirname(dir, sizeof(dir), b->filename);
+    b->file_watch = qe_watch_add(dir, eb_file_watch_cb, b);
+}
+
+void eb_unwatch_file(EditBuffer *b)
+{
+    qe_watch_remove(&b->file_watch);
+    qe_kill_timer(&b->revert_timer);
+}
+
 /* Write bytes between <start> and <end> to file filename,
  * return bytes written or -1 if error
  */
@@ -2059,6 +2185,8 @@ static void raw_buffer_close(qe__unused__ EditBuffer *b)
    filename. Find a unique buffer name */
 void eb_set_filename(EditBuffer *b, const char *filename)
 {
+    if (!strequal(b->filename, filename))
+        eb_unwatch_file(b);
     pstrcpy((char *)b->filename, sizeof(b->filename), filename);
     eb_set_buffer_name(b, get_basename(filename));
 }
@@ -2132,6 +2260,60 @@ int eb_insert_uchars(EditBuffer *b, int offset, int c, int n)
     return size;
 }
 
+/* Insert UTF-8 text with '\n' line ends through the charset
+ * from_utf8_func hook, translating line ends to the buffer eol_type.
+ * Conversion stops before an incomplete UTF-8 sequence, `*pp` is
+ * updated past the text converted.
+ * Return number of bytes inserted.
+ */
+static int eb_insert_utf8_bulk(EditBuffer *b, int offset,
+                               const u8 **pp, const u8 *end)
+{
+    QECharset *charset = b->charset;
+    u8 buf[4096];
+    char eol[MAX_CHAR_BYTES * 2];
+    const u8 *p = *pp, *line_end;
+    int size, len, n, eol_len;
+
+    eol_len = eb_encode_uchar(b, eol, '\n');
+    size = len = 0;
+    while (p < end) {
+        line_end = end;
+        if (b->eol_type != EOL_UNIX) {
+            line_end = memchr(p, '\n', end - p);
+            if (!line_end)
+                line_end = end;
+        }
+        while (p < line_end) {
+            n = charset->from_utf8_func(charset, buf + len, ssizeof(buf) - len,
+                                        &p, line_end);
+            len += n;
+            if (p < line_end) {
+                /* output buffer full or incomplete sequence */
+                if (len == 0)
+                    goto done;
+                size += eb_insert(b, offset + size, buf, len);
+                len = 0;
+            }
+        }
+        if (p < end) {
+            /* *p is '\n' */
+            if (len + eol_len > ssizeof(buf)) {
+                size += eb_insert(b, offset + size, buf, len);
+                len = 0;
+            }
+            memcpy(buf + len, eol, eol_len);
+            len += eol_len;
+            p++;
+        }
+    }
+ done:
+    if (len > 0)
+        size += eb_insert(b, offset + size, buf, len);
+    *pp = p;
+    return size;
+}
+
 /* Insert buffer with utf8 chars according to buffer encoding */
 /* Return number of bytes inserted */
 int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
@@ -2144,11 +2326,16 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
         const char *bufend = buf + len;
 
         size = size1 = 0;
+        /* the UTF-8 from_utf8_func copies the text without validation */
+        if (b->charset->from_utf8_func && b->charset != &charset_utf8) {
+            size = eb_insert_utf8_bulk(b, offset, (const u8 **)(void *)&buf,
+                                       (const u8 *)bufend);
+        }
         while (buf < bufend) {
             int c = utf8_decode(&buf);
             int clen = eb_encode_uchar(b, buf1 + size1, c);
             size1 += clen;
-            if (size1 > ssizeof(buf) - MAX_CHAR_BYTES || buf >= bufend) {
+            if (size1 > ssizeof(buf1) - MAX_CHAR_BYTES || buf >= bufend) {
                 size += eb_insert(b, offset + size, buf1, size1);
                 size1 = 0;
             }
@@ -2347,6 +2534,98 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
     }
 }
 
+/* Convert the contents of `src` from `*offsetp` to `offset_max` a page
+ * at a time through UTF-8 with the charset bulk conversion hooks and
+ * insert it into `dest` at `dest_offset`. `*offsetp` is updated to the
+ * first character left for the char by char conversion: an incomplete
+ * or unrepresentable character or a final '\r' of an EOL_DOS buffer.
+ * Return number of bytes inserted.
+ */
+static int eb_insert_buffer_bulk(EditBuffer *dest, int dest_offset,
+                                 EditBuffer *src, int *offsetp,
+                                 int offset_max)
+{
+    QECharset *charset = src->charset;
+    u8 inbuf[4096];
+    u8 buf[4096 + 1];   /* room for a pending '\r' */
+    const u8 *p, *end;
+    u8 *q, *start;
+    int offset = *offsetp, size = 0, len = 0, n, pending_cr = 0;
+
+    if (offset >= offset_max
+    ||  !charset->to_utf8_func || !dest->charset->from_utf8_func)
+        return 0;
+    /* UTF-8 cannot carry the surrogates and non-characters UCS-2 and
+       UCS-4 text may hold: conversions between them stay exact char
+       by char */
+    if (charset->char_size > 1 && dest->charset->char_size > 1)
+        return 0;
+
+    for (;;) {
+        n = eb_read(src, offset, inbuf + len,
+                    min(ssizeof(inbuf) - len, offset_max - offset));
+        offset += n;
+        len += n;
+        p = inbuf;
+        end = inbuf + len;
+        q = buf + 1;
+        q += charset->to_utf8_func(&src->charset_state, q, ssizeof(buf) - 1,
+                                   &p, end);
+        if (p == inbuf)
+            break;
+        len = end - p;
+        memmove(inbuf, p, len);
+
+        /* translate line ends to '\n' as eb_nextc() does */
+        start = buf + 1;
+        if (pending_cr) {
+            *--start = '\r';
+            pending_cr = 0;
+        }
+        if (src->eol_type == EOL_DOS) {
+            u8 *r = start, *w = start, *cr;
+
+            while ((cr = memchr(r, '\r', q - r)) != NULL) {
+                n = cr - r;
+                memmove(w, r, n);
+                w += n;
+                r = cr + 1;
+                if (r == q) {
+                    /* defer until the next character is known */
+                    pending_cr = 1;
+                } else
+                if (*r == '\n') {
+                    *w++ = *r++;
+                } else {
+                    *w++ = '\r';
+                }
+            }
+            n = q - r;
+            memmove(w, r, n);
+            q = w + n;
+        } else
+        if (src->eol_type == EOL_MAC) {
+            u8 *r;
+
+            for (r = start; r < q; r++) {
+                if (*r == '\r')
+                    *r = '\n';
+                else
+                if (*r == '\n')
+                    *r = '\r';
+            }
+        }
+        p = start;
+        size += eb_insert_utf8_bulk(dest, dest_offset + size, &p, q);
+    }
+    /* let the char by char conversion handle the remaining bytes */
+    offset -= len;
+    if (pending_cr)
+        offset -= charset->char_size;
+    *offsetp = offset;
+    return size;
+}
+
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Charset converson between source and destination buffer is
@@ -2375,13 +2654,21 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
             offset1 = 0;
         }
 
-        /* well, not very fast, but simple */
+        /* styled text and charsets without bulk conversion hooks are
+           converted char by char */
         /* XXX: should optimize save_log system for insert sequences */
         offset_max = min(src->total_size, src_offset + size);
         size = 0;
         for (offset = src_offset; offset < offset_max;) {
             char buf[MAX_CHAR_BYTES];
-            QETermStyle style = eb_get_style(src, offset);
+            QETermStyle style;
+            if (!styles_flags) {
+                size += eb_insert_buffer_bulk(b, offset1 + size, src,
+                                              &offset, offset_max);
+                if (offset >= offset_max)
+                    break;
+            }
+            style = eb_get_style(src, offset);
             int c = eb_nextc(src, offset, &offset);
             int len = eb_encode_uchar(b, buf, c);
             b->cur_style = style;
@@ -2574,60 +2861,160 @@ int eb_next_line(EditBuffer *b, int offset)
 
 /* buffer property handling */
 
+static inline unsigned int qe_prop_type_bit(int type) {
+    return 1U << (type & 31);
+}
+
+static void qe_prop_update(QEProperty *p) {
+    p->types = qe_prop_type_bit(p->type);
+    if (p->left)
+        p->types |= p->left->types;
+    if (p->right)
+        p->types |= p->right->types;
+}
+
+/* detach child c from parent p: its offset becomes absolute */
+static inline QEProperty *qe_prop_detach(QEProperty *c, int base) {
+    if (c) {
+        c->offset += base;
+        c->parent = NULL;
+    }
+    return c;
+}
+
+/* attach absolute subtree c below parent p at absolute offset base */
+static inline QEProperty *qe_prop_attach(QEProperty *c, QEProperty *p, int base) {
+    if (c) {
+        c->offset -= base;
+        c->parent = p;
+    }
+    return c;
+}
+
+/* split tree t into properties before offset and the others */
+static void qe_prop_split(QEProperty *t, int offset,
+                          QEProperty **pl, QEProperty **pr)
+{
+    QEProperty *a, *b;
+
+    if (!t) {
+        *pl = *pr = NULL;
+        return;
+    }
+    if (t->offset < offset) {
+        qe_prop_split(qe_prop_detach(t->right, t->offset), offset, &a, &b);
+        t->right = qe_prop_attach(a, t, t->offset);
+        qe_prop_update(t);
+        *pl = t;
+        *pr = b;
+    } else {
+        qe_prop_split(qe_prop_detach(t->left, t->offset), offset, &a, &b);
+        t->left = qe_prop_attach(b, t, t->offset);
+        qe_prop_update(t);
+        *pl = a;
+        *pr = t;
+    }
+}
+
+/* merge trees l and r, all properties of l are before those of r */
+static QEProperty *qe_prop_merge(QEProperty *l, QEProperty *r)
+{
+    if (!l)
+        return r;
+    if (!r)
+        return l;
+    if (l->priority > r->priority) {
+        QEProperty *c = qe_prop_detach(l->right, l->offset);
+        l->right = qe_prop_attach(qe_prop_merge(c, r), l, l->offset);
+        qe_prop_update(l);
+        return l;
+    } else {
+        QEProperty *c = qe_prop_detach(r->left, r->offset);
+        r->left = qe_prop_attach(qe_prop_merge(l, c), r, r->offset);
+        qe_prop_update(r);
+        return r;
+    }
+}
+
+static QEProperty *qe_prop_first(QEProperty *p) {
+    if (p) {
+        while (p->left)
+            p = p->left;
+    }
+    return p;
+}
+
+static void qe_prop_free_tree(QEProperty *p)
+{
+    while (p) {
+        QEProperty *next = p->right;
+        qe_prop_free_tree(p->left);
+        if (p->type & QE_PROP_FREE) {
+            qe_free(&p->data);
+        }
+        qe_free(&p);
+        p = next;
+    }
+}
+
+/* remove properties anchored in [offset, offset2), shift the following
+ * ones by delta.
+ */
+static void eb_prop_remove(EditBuffer *b, int offset, int offset2, int delta)
+{
+    QEProperty *l, *m, *r;
+
+    qe_prop_split(b->property_tree, offset, &l, &r);
+    qe_prop_split(r, offset2, &m, &r);
+    if (m && (m->types & qe_prop_type_bit(QE_PROP_TAG))) {
+        /* the name index may point to removed tags */
+        qe_hash_free(&b->tag_names);
+    }
+    qe_prop_free_tree(m);
+    if (r)
+        r->offset += delta;
+    b->property_tree = qe_prop_merge(l, r);
+}
+
 static void eb_plist_callback(EditBuffer *b, void *opaque, int edge,
                               enum LogOperation op, int offset, int size)
 {
-    QEProperty **pp;
-    QEProperty *p;
+    QEProperty *l, *r;
 
     /* update properties */
     if (op == LOGOP_INSERT) {
-        for (p = b->property_list; p; p = p->next) {
-            if (p->offset >= offset)
-                p->offset += size;
-        }
+        qe_prop_split(b->property_tree, offset, &l, &r);
+        if (r)
+            r->offset += size;
+        b->property_tree = qe_prop_merge(l, r);
     } else
     if (op == LOGOP_DELETE) {
-        for (pp = &b->property_list; (p = *pp) != NULL;) {
-            if (p->offset >= offset) {
-                if (p->offset < offset + size) {
-                    /* property is anchored inside block: remove it */
-                    *pp = (*pp)->next;
-                    if (p->type & QE_PROP_FREE) {
-                        qe_free(&p->data);
-                    }
-                    qe_free(&p);
-                    continue;
-                }
-                p->offset -= size;
-            }
-            pp = &(*pp)->next;
-        }
+        /* properties anchored inside block are removed */
+        eb_prop_remove(b, offset, offset + size, -size);
     }
 }
 
 void eb_add_property(EditBuffer *b, int offset, int type, void *data) {
-    QEProperty *p;
-    QEProperty **pp;
+    static unsigned int seed = 1;
+    QEProperty *p, *l, *m, *r;
 
-    if (!b->property_list) {
+    if (!b->property_tree) {
         eb_add_callback(b, eb_plist_callback, NULL, 0);
     }
 
-    for (pp = &b->property_list; (p = *pp) != NULL; pp = &(*pp)->next) {
-        if (p->offset >= offset) {
-            if (p->offset == offset) {
-                if (p->type == type && type == QE_PROP_TAG) {
-                    /* prevent tag duplicates */
-                    if (strequal(p->data, data)) {
-                        if (type & QE_PROP_FREE)
-                            qe_free(&data);
-                        return;
-                    }
-                }
-                continue;
+    /* m holds the properties at the same offset */
+    qe_prop_split(b->property_tree, offset, &l, &r);
+    qe_prop_split(r, offset + 1, &m, &r);
+
+    if (type == QE_PROP_TAG) {
+        /* prevent tag duplicates */
+        for (p = qe_prop_first(m); p; p = eb_next_property(p)) {
+            if (p->type == type && strequal(p->data, data)) {
+                if (type & QE_PROP_FREE)
+                    qe_free(&data);
+                b->property_tree = qe_prop_merge(qe_prop_merge(l, m), r);
+                return;
             }
-            break;
         }
     }
 
@@ -2635,43 +3022,117 @@ void eb_add_property(EditBuffer *b, int offset, int type, void *data) {
     p->offset = offset;
     p->type = type;
     p->data = data;
-    p->next = *pp;
-    *pp = p;
+    seed = seed * 1103515245 + 12345;
+    p->priority = seed;
+    qe_prop_update(p);
+    /* new property goes after those at the same offset */
+    m = qe_prop_merge(m, p);
+    b->property_tree = qe_prop_merge(qe_prop_merge(l, m), r);
+
+    if (type == QE_PROP_TAG && b->tag_names.count) {
+        /* keep the name index up to date once it is built */
+        QEProperty *p1 = qe_hash_find(&b->tag_names, data);
+        if ((!p1 || eb_property_offset(p1) > offset)
+        &&  qe_hash_add(&b->tag_names, data, p, 1) < 0) {
+            qe_hash_free(&b->tag_names);
+        }
+    }
 }
 
-QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type) {
-    QEProperty *found = NULL;
-    QEProperty *p;
-    for (p = b->property_list; p && p->offset < offset2; p = p->next) {
-        if (p->offset >= offset && p->type == type) {
-            /* return the last property between offset and offset2 */
-            found = p;
+static QEProperty *qe_prop_find_last(QEProperty *t, int base, int offset,
+                                     int offset2, int type)
+{
+    QEProperty *found;
+    int pos;
+
+    while (t && (t->types & qe_prop_type_bit(type))) {
+        pos = base + t->offset;
+        if (pos >= offset2) {
+            t = t->left;
+        } else
+        if (pos < offset) {
+            t = t->right;
+        } else {
+            found = qe_prop_find_last(t->right, pos, offset, offset2, type);
+            if (found)
+                return found;
+            if (t->type == type)
+                return t;
+            t = t->left;
         }
+        base = pos;
     }
-    return found;
+    return NULL;
+}
+
+QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type) {
+    /* return the last property between offset and offset2 */
+    return qe_prop_find_last(b->property_tree, 0, offset, offset2, type);
 }
 
 void eb_delete_properties(EditBuffer *b, int offset, int offset2) {
+    if (!b->property_tree)
+        return;
+
+    if (offset < offset2)
+        eb_prop_remove(b, offset, offset2, 0);
+
+    if (!b->property_tree) {
+        eb_free_callback(b, eb_plist_callback, NULL);
+        qe_hash_free(&b->tag_names);
+    }
+}
+
+QEProperty *eb_first_property(EditBuffer *b) {
+    return qe_prop_first(b->property_tree);
+}
+
+QEProperty *eb_next_property(QEProperty *p) {
+    if (p->right) {
+        for (p = p->right; p->left; p = p->left)
+            continue;
+        return p;
+    }
+    while (p->parent && p == p->parent->right)
+        p = p->parent;
+    return p->parent;
+}
+
+int eb_property_offset(const QEProperty *p) {
+    int offset = 0;
+
+    for (; p; p = p->parent)
+        offset += p->offset;
+    return offset;
+}
+
+/* return the first tag property named `name` */
+QEProperty *eb_find_tag(EditBuffer *b, const char *name) {
     QEProperty *p;
-    QEProperty **pp;
 
-    if (!b->property_list)
-        return;
+    if (!b->property_tree
+    ||  !(b->property_tree->types & qe_prop_type_bit(QE_PROP_TAG)))
+        return NULL;
 
-    for (pp = &b->property_list; (p = *pp) != NULL && p->offset < offset2;) {
-        if (p->offset >= offset && p->offset < offset2) {
-            *pp = (*pp)->next;
-            if (p->type & QE_PROP_FREE) {
-                qe_free(&p->data);
+    if (!b->tag_names.count) {
+        /* index the tags in offset order: the first one of each name is kept */
+        for (p = qe_prop_first(b->property_tree); p; p = eb_next_property(p)) {
+            if (p->type == QE_PROP_TAG
+            &&  qe_hash_add(&b->tag_names, p->data, p, 0) < 0) {
+                qe_hash_free(&b->tag_names);
+                break;
             }
-            qe_free(&p);
-        } else {
-            pp = &(*pp)->next;
         }
     }
-    if (!b->property_list) {
-        eb_free_callback(b, eb_plist_callback, NULL);
+    if (b->tag_names.count)
+        return qe_hash_find(&b->tag_names, name);
+
+    /* out of memory: scan the properties */
+    for (p = qe_prop_first(b->property_tree); p; p = eb_next_property(p)) {
+        if (p->type == QE_PROP_TAG && strequal(p->data, name))
+            return p;
     }
+    return NULL;
 }
 
 /* buffer data type handling */
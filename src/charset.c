@@ -19,6 +19,11 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#ifdef __SSE2__
+/* must be included before qe.h redefines malloc and free */
+#include <emmintrin.h>
+#endif
+
 #include "qe.h"
 
 /* XXX: Should move this to QEmacsState, and find a way for html2png */
@@ -128,6 +133,8 @@ struct QECharset charset_raw = {
     charset_get_chars_8bit,
     charset_goto_char_8bit,
     charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
     1, 0, 0, 10, 0, 0, table_idem, NULL, NULL,
 };
 
@@ -196,6 +203,8 @@ struct QECharset charset_8859_1 = {
     charset_get_chars_8bit,
     charset_goto_char_8bit,
     charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
     1, 0, 0, 10, 0, 0, table_idem, NULL, NULL,
 };
 
@@ -223,6 +232,8 @@ struct QECharset charset_vt100 = {
     charset_get_chars_8bit,
     charset_goto_char_8bit,
     charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
     1, 0, 0, 10, 0, 0, table_idem, NULL, NULL,
 };
 
@@ -250,9 +261,218 @@ static struct QECharset charset_7bit = {
     charset_get_chars_8bit,
     charset_goto_char_8bit,
     charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
     1, 0, 0, 10, 0, 0, table_idem, NULL, NULL,
 };
 
+/********************************************************/
+/* Scanning kernels */
+
+/* These helpers process 16 bytes at a time with SSE2 when the compiler
+ * targets it (always the case on x86_64), or 8 bytes at a time in a
+ * general purpose register otherwise.
+ */
+
+#ifndef __SSE2__
+#define ONES64  0x0101010101010101ULL
+#define HIGH64  0x8080808080808080ULL
+
+static inline uint64_t load64(const u8 *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+/* number of bytes with the high bit set in `t` masked with HIGH64 */
+static inline int count_high64(uint64_t t)
+{
+    return (int)(((t >> 7) * ONES64) >> 56);
+}
+#endif
+
+/* count the bytes equal to `c` */
+static int count_bytes(const u8 *p, int size, int c)
+{
+    int i = 0, count = 0;
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi8((char)c);
+    __m128i zero = _mm_setzero_si128();
+
+    while (size - i >= 16) {
+        /* byte counters overflow after 255 iterations */
+        __m128i acc = zero;
+        int n = min((size - i) >> 4, 255);
+        for (; n > 0; n--, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+#else
+    uint64_t pattern = ONES64 * (u8)c;
+
+    for (; size - i >= 8; i += 8) {
+        uint64_t x = load64(p + i) ^ pattern;
+        /* exact test for zero bytes */
+        count += count_high64(~(((x & ~HIGH64) + ~HIGH64) | x) & HIGH64);
+    }
+#endif
+    for (; i < size; i++) {
+        count += (p[i] == c);
+    }
+    return count;
+}
+
+/* count the UTF-8 trailing bytes (0x80..0xBF) */
+static int count_utf8_trailing(const u8 *p, int size)
+{
+    int i = 0, count = 0;
+#ifdef __SSE2__
+    __m128i limit = _mm_set1_epi8(-64);     /* 0xC0 */
+    __m128i zero = _mm_setzero_si128();
+
+    while (size - i >= 16) {
+        __m128i acc = zero;
+        int n = min((size - i) >> 4, 255);
+        for (; n > 0; n--, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+            /* signed comparison: 0x80..0xBF are -128..-65 */
+            acc = _mm_sub_epi8(acc, _mm_cmplt_epi8(v, limit));
+        }
+        acc = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(acc) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    }
+#else
+    for (; size - i >= 8; i += 8) {
+        uint64_t x = load64(p + i);
+        /* bit 7 set and bit 6 clear */
+        count += count_high64(x & ~(x << 1) & HIGH64);
+    }
+#endif
+    for (; i < size; i++) {
+        count += ((p[i] & 0xC0) == 0x80);
+    }
+    return count;
+}
+
+/* return the length of the initial run of ASCII bytes */
+static int skip_ascii(const u8 *p, int size)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; size - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        if (_mm_movemask_epi8(v))
+            break;
+    }
+#else
+    for (; size - i >= 8; i += 8) {
+        if (load64(p + i) & HIGH64)
+            break;
+    }
+#endif
+    while (i < size && p[i] < 0x80)
+        i++;
+    return i;
+}
+
+/* return the length of the initial run of printable ASCII bytes
+ * (0x20..0x7E), set `*spaces` if it contains spaces. */
+static int skip_ascii_printable(const u8 *p, int size, int *spaces)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i lo = _mm_set1_epi8(0x1F);
+    __m128i hi = _mm_set1_epi8(0x7F);
+    __m128i space = _mm_set1_epi8(' ');
+
+    for (; size - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        /* signed comparisons also exclude bytes >= 0x80 */
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            break;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, space)))
+            *spaces = 1;
+    }
+#else
+    for (; size - i >= 8; i += 8) {
+        uint64_t x = load64(p + i);
+        uint64_t y = x & ~HIGH64;
+        uint64_t z = x ^ (ONES64 * ' ');
+        if ((x | ((y + ONES64) & HIGH64)) & HIGH64)
+            break;  /* byte >= 0x7F */
+        if (((y + ONES64 * 0x60) & HIGH64) != HIGH64)
+            break;  /* control character */
+        if (~(((z & ~HIGH64) + ~HIGH64) | z) & HIGH64)
+            *spaces = 1;
+    }
+#endif
+    for (; i < size && p[i] >= 0x20 && p[i] < 0x7F; i++) {
+        if (p[i] == ' ')
+            *spaces = 1;
+    }
+    return i;
+}
+
+/* narrow the initial run of ASCII UCS-2 code units among the `n`
+ * units at `p` to bytes at `q`, return the number of units converted */
+static int narrow_ascii16(u8 *q, const u8 *p, int n, int be)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i mask = _mm_set1_epi16((short)0xFF80);
+    __m128i zero = _mm_setzero_si128();
+
+    for (; n - i >= 8; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + 2 * i));
+        if (be)
+            v = _mm_or_si128(_mm_srli_epi16(v, 8), _mm_slli_epi16(v, 8));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, mask), zero)) != 0xFFFF)
+            break;
+        _mm_storel_epi64((__m128i *)(void *)(q + i), _mm_packus_epi16(v, v));
+    }
+#endif
+    p += be;
+    for (; i < n && p[2 * i] < 0x80 && p[2 * i + 1 - 2 * be] == 0; i++) {
+        q[i] = p[2 * i];
+    }
+    return i;
+}
+
+/* widen the initial run of ASCII bytes among the `n` bytes at `p` to
+ * UCS-2 code units at `q`, return the number of bytes converted */
+static int widen_ascii16(u8 *q, const u8 *p, int n, int be)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + i));
+        if (_mm_movemask_epi8(v))
+            break;
+        if (be) {
+            _mm_storeu_si128((__m128i *)(void *)(q + 2 * i), _mm_unpacklo_epi8(zero, v));
+            _mm_storeu_si128((__m128i *)(void *)(q + 2 * i + 16), _mm_unpackhi_epi8(zero, v));
+        } else {
+            _mm_storeu_si128((__m128i *)(void *)(q + 2 * i), _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i *)(void *)(q + 2 * i + 16), _mm_unpackhi_epi8(v, zero));
+        }
+    }
+#endif
+    for (; i < n && p[i] < 0x80; i++) {
+        q[2 * i + be] = p[i];
+        q[2 * i + 1 - be] = 0;
+    }
+    return i;
+}
+
 /********************************************************/
 /* UTF8 */
 
@@ -374,6 +594,9 @@ static int probe_utf8(qe__unused__ QECharset *charset, const u8 *buf, int size)
     count_spaces = count_lines = count_utf8 = 0;
 
     while (p < p_end) {
+        p += skip_ascii_printable(p, p_end - p, &count_spaces);
+        if (p >= p_end)
+            break;
         c = p[0];
         p += 1;
         if (c <= 32) {
@@ -445,32 +668,67 @@ static u8 *encode_utf8(qe__unused__ QECharset *charset, u8 *q, int c)
     return q + utf8_encode((char*)q, c);
 }
 
+/* copy complete UTF-8 sequences, replacing invalid ones with U+FFFD
+   exactly as decode_utf8_func does */
+static int to_utf8_utf8(qe__unused__ CharsetDecodeState *s, u8 *buf, int size,
+                        const u8 **pp, const u8 *end)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int n;
+
+    while (p < end) {
+        n = skip_ascii(p, min(end - p, q_end - q));
+        memcpy(q, p, n);
+        p += n;
+        q += n;
+        if (p >= end || q_end - q < 6 || end - p < utf8_length[*p])
+            break;
+        q += utf8_encode((char *)q, utf8_decode((const char **)(void *)&p));
+    }
+    *pp = p;
+    return q - buf;
+}
+
+/* UTF-8 text is stored unchanged */
+static int from_utf8_utf8(qe__unused__ QECharset *charset, u8 *buf, int size,
+                          const u8 **pp, const u8 *end)
+{
+    int n = min(size, end - *pp);
+
+    memcpy(buf, *pp, n);
+    *pp += n;
+    return n;
+}
+
 /* return the number of lines and column position for a buffer */
 static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
                                  int *line_ptr, int *col_ptr)
 {
-    const u8 *p, *p1, *lp;
-    int nl, line, col;
+    const u8 *p1, *lp;
+    int nl, line, col, n;
 
     QASSERT(size >= 0);
 
-    line = 0;
-    lp = p = buf;
-    p1 = p + size;
+    p1 = buf + size;
     nl = s->eol_char;
 
-    for (;;) {
-        p = memchr(p, nl, p1 - p);
-        if (!p)
-            break;
-        p++;
-        lp = p;
-        line++;
+    line = count_bytes(buf, size, nl);
+    lp = buf;
+    if (line) {
+        /* find the start of the last line */
+        for (lp = p1; lp[-1] != nl; lp--)
+            continue;
     }
     /* now compute number of chars (XXX: potential problem if out of
      * block, but for UTF8 it works) */
     col = 0;
     while (lp < p1) {
+        n = skip_ascii(lp, p1 - lp);
+        col += n;
+        lp += n;
+        if (lp >= p1)
+            break;
         col++;
         lp += utf8_length[*lp];
     }
@@ -481,28 +739,20 @@ static void charset_get_pos_utf8(CharsetDecodeState *s, const u8 *buf, int size,
 static int charset_get_chars_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
-    int nb_chars, c;
-    const u8 *buf_end, *buf_ptr;
+    int nb_chars;
 
-    nb_chars = 0;
-    buf_ptr = buf;
-    buf_end = buf_ptr + size;
-    while (buf_ptr < buf_end) {
-        c = *buf_ptr++;
-        if (c == '\n' && s->eol_type == EOL_DOS) {
-            /* ignore \n in EOL_DOS scan, but count \r.
-             * XXX: potentially incorrect if buffer contains
-             * \n not preceded by \r and requires special state
-             * data to handle \r\n sequence at page boundary.
-             */
-            continue;
-        }
-        /* ignoring trailing bytes: will produce incorrect
-         * count on isolated and trailing bytes and overlong
-         * sequences.
+    /* ignoring trailing bytes: will produce incorrect
+     * count on isolated and trailing bytes and overlong
+     * sequences.
+     */
+    nb_chars = size - count_utf8_trailing(buf, size);
+    if (s->eol_type == EOL_DOS) {
+        /* ignore \n in EOL_DOS scan, but count \r.
+         * XXX: potentially incorrect if buffer contains
+         * \n not preceded by \r and requires special state
+         * data to handle \r\n sequence at page boundary.
          */
-        if (c < 0x80 || c >= 0xc0)
-            nb_chars++;
+        nb_chars -= count_bytes(buf, size, '\n');
     }
     /* CG: nb_chars is the number of character boundaries, trailing
      * utf-8 sequence at start of buffer is ignored in count while
@@ -518,12 +768,22 @@ static int charset_get_chars_utf8(CharsetDecodeState *s,
 static int charset_goto_char_utf8(CharsetDecodeState *s,
                                   const u8 *buf, int size, int pos)
 {
-    int nb_chars, c;
+    int nb_chars, c, n;
     const u8 *buf_ptr, *buf_end;
 
     nb_chars = 0;
     buf_ptr = buf;
     buf_end = buf_ptr + size;
+    /* skip whole blocks that end before the target character */
+    while (buf_end - buf_ptr >= 64) {
+        n = 64 - count_utf8_trailing(buf_ptr, 64);
+        if (s->eol_type == EOL_DOS)
+            n -= count_bytes(buf_ptr, 64, '\n');
+        if (nb_chars + n > pos)
+            break;
+        nb_chars += n;
+        buf_ptr += 64;
+    }
     for (; buf_ptr < buf_end; buf_ptr++) {
         c = *buf_ptr;
         if (c >= 0x80 && c < 0xc0) {
@@ -554,6 +814,8 @@ struct QECharset charset_utf8 = {
     charset_get_chars_utf8,
     charset_goto_char_utf8,
     charset_goto_line_8bit,
+    to_utf8_utf8,
+    from_utf8_utf8,
     1, 1, 0, 10, 0, 0, table_utf8, NULL, NULL,
 };
 
@@ -749,6 +1011,75 @@ static u8 *encode_ucs2be(qe__unused__ QECharset *charset, u8 *p, int c)
     return p + 2;
 }
 
+/* XXX: should handle surrogates, they are converted one code unit at
+   a time like decode_ucs2le and encode_ucs2le do */
+static int ucs2_to_utf8(u8 *buf, int size, const u8 **pp, const u8 *end,
+                        int be)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int n, c;
+
+    while (end - p >= 2) {
+        n = narrow_ascii16(q, p, min((end - p) >> 1, q_end - q), be);
+        p += 2 * n;
+        q += n;
+        if (end - p < 2 || q_end - q < 3)
+            break;
+        c = be ? (p[0] << 8) + p[1] : p[0] + (p[1] << 8);
+        p += 2;
+        q += utf8_encode((char *)q, c);
+    }
+    *pp = p;
+    return q - buf;
+}
+
+static int ucs2_from_utf8(u8 *buf, int size, const u8 **pp, const u8 *end,
+                          int be)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int n, c;
+
+    while (p < end) {
+        n = widen_ascii16(q, p, min(end - p, (q_end - q) >> 1), be);
+        p += n;
+        q += 2 * n;
+        if (p >= end || q_end - q < 2 || end - p < utf8_length[*p])
+            break;
+        c = utf8_decode((const char **)(void *)&p);
+        q[be] = c;
+        q[1 - be] = c >> 8;
+        q += 2;
+    }
+    *pp = p;
+    return q - buf;
+}
+
+static int to_utf8_ucs2le(qe__unused__ CharsetDecodeState *s, u8 *buf,
+                          int size, const u8 **pp, const u8 *end)
+{
+    return ucs2_to_utf8(buf, size, pp, end, 0);
+}
+
+static int from_utf8_ucs2le(qe__unused__ QECharset *charset, u8 *buf,
+                            int size, const u8 **pp, const u8 *end)
+{
+    return ucs2_from_utf8(buf, size, pp, end, 0);
+}
+
+static int to_utf8_ucs2be(qe__unused__ CharsetDecodeState *s, u8 *buf,
+                          int size, const u8 **pp, const u8 *end)
+{
+    return ucs2_to_utf8(buf, size, pp, end, 1);
+}
+
+static int from_utf8_ucs2be(qe__unused__ QECharset *charset, u8 *buf,
+                            int size, const u8 **pp, const u8 *end)
+{
+    return ucs2_from_utf8(buf, size, pp, end, 1);
+}
+
 static int charset_get_chars_ucs2(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
@@ -820,6 +1151,8 @@ struct QECharset charset_ucs2le = {
     charset_get_chars_ucs2,
     charset_goto_char_ucs2,
     charset_goto_line_ucs2,
+    to_utf8_ucs2le,
+    from_utf8_ucs2le,
     2, 0, 0, 10, 0, 0, table_none, NULL, NULL,
 };
 
@@ -834,6 +1167,8 @@ struct QECharset charset_ucs2be = {
     charset_get_chars_ucs2,
     charset_goto_char_ucs2,
     charset_goto_line_ucs2,
+    to_utf8_ucs2be,
+    from_utf8_ucs2be,
     2, 0, 0, 10, 0, 0, table_none, NULL, NULL,
 };
 
@@ -1025,6 +1360,89 @@ static u8 *encode_ucs4be(qe__unused__ QECharset *charset, u8 *p, int c)
     return p + 4;
 }
 
+static int ucs4_to_utf8(u8 *buf, int size, const u8 **pp, const u8 *end,
+                        int be)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int c;
+
+    while (end - p >= 4 && q_end - q >= 6) {
+        if (be)
+            c = (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+        else
+            c = p[0] + (p[1] << 8) + (p[2] << 16) + (p[3] << 24);
+        if (c < 0) {
+            /* not representable in UTF-8 */
+            break;
+        }
+        p += 4;
+        if (c < 0x80)
+            *q++ = c;
+        else
+            q += utf8_encode((char *)q, c);
+    }
+    *pp = p;
+    return q - buf;
+}
+
+static int ucs4_from_utf8(u8 *buf, int size, const u8 **pp, const u8 *end,
+                          int be)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int c;
+
+    while (p < end && q_end - q >= 4) {
+        c = *p;
+        if (c < 0x80) {
+            p++;
+        } else {
+            if (end - p < utf8_length[c])
+                break;
+            c = utf8_decode((const char **)(void *)&p);
+        }
+        if (be) {
+            q[0] = c >> 24;
+            q[1] = c >> 16;
+            q[2] = c >> 8;
+            q[3] = c;
+        } else {
+            q[0] = c;
+            q[1] = c >> 8;
+            q[2] = c >> 16;
+            q[3] = c >> 24;
+        }
+        q += 4;
+    }
+    *pp = p;
+    return q - buf;
+}
+
+static int to_utf8_ucs4le(qe__unused__ CharsetDecodeState *s, u8 *buf,
+                          int size, const u8 **pp, const u8 *end)
+{
+    return ucs4_to_utf8(buf, size, pp, end, 0);
+}
+
+static int from_utf8_ucs4le(qe__unused__ QECharset *charset, u8 *buf,
+                            int size, const u8 **pp, const u8 *end)
+{
+    return ucs4_from_utf8(buf, size, pp, end, 0);
+}
+
+static int to_utf8_ucs4be(qe__unused__ CharsetDecodeState *s, u8 *buf,
+                          int size, const u8 **pp, const u8 *end)
+{
+    return ucs4_to_utf8(buf, size, pp, end, 1);
+}
+
+static int from_utf8_ucs4be(qe__unused__ QECharset *charset, u8 *buf,
+                            int size, const u8 **pp, const u8 *end)
+{
+    return ucs4_from_utf8(buf, size, pp, end, 1);
+}
+
 static int charset_get_chars_ucs4(CharsetDecodeState *s,
                                   const u8 *buf, int size)
 {
@@ -1094,6 +1512,8 @@ struct QECharset charset_ucs4le = {
     charset_get_chars_ucs4,
     charset_goto_char_ucs4,
     charset_goto_line_ucs4,
+    to_utf8_ucs4le,
+    from_utf8_ucs4le,
     4, 0, 0, 10, 0, 0, table_none, NULL, NULL,
 };
 
@@ -1108,6 +1528,8 @@ struct QECharset charset_ucs4be = {
     charset_get_chars_ucs4,
     charset_goto_char_ucs4,
     charset_goto_line_ucs4,
+    to_utf8_ucs4be,
+    from_utf8_ucs4be,
     4, 0, 0, 10, 0, 0, table_none, NULL, NULL,
 };
 
@@ -1595,6 +2017,74 @@ u8 *encode_8bit(QECharset *charset, u8 *q, int c)
     return q;
 }
 
+int to_utf8_8bit(CharsetDecodeState *s, u8 *buf, int size,
+                 const u8 **pp, const u8 *end)
+{
+    const unsigned short *table = s->table;
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size;
+    int i, n, ascii;
+
+    /* ASCII runs can be copied if the table does not remap them */
+    for (i = 0; i < 0x80 && table[i] == i; i++)
+        continue;
+    ascii = (i == 0x80);
+
+    while (p < end) {
+        if (ascii) {
+            n = skip_ascii(p, min(end - p, q_end - q));
+            memcpy(q, p, n);
+            p += n;
+            q += n;
+            if (p >= end)
+                break;
+        }
+        /* the table only holds BMP code points */
+        if (q_end - q < 3)
+            break;
+        q += utf8_encode((char *)q, table[*p++]);
+    }
+    *pp = p;
+    return q - buf;
+}
+
+int from_utf8_8bit(QECharset *charset, u8 *buf, int size,
+                   const u8 **pp, const u8 *end)
+{
+    const u8 *p = *pp;
+    u8 *q = buf, *q_end = buf + size, *q1;
+    int n, c, ascii;
+
+    ascii = (charset->encode_table == table_idem || charset->min_char >= 0x80);
+
+    while (p < end && q < q_end) {
+        if (ascii) {
+            n = skip_ascii(p, min(end - p, q_end - q));
+            memcpy(q, p, n);
+            p += n;
+            q += n;
+            if (p >= end || q >= q_end)
+                break;
+        }
+        c = *p;
+        if (c < 0x80) {
+            p++;
+        } else {
+            if (end - p < utf8_length[c])
+                break;
+            c = utf8_decode((const char **)(void *)&p);
+        }
+        q1 = charset->encode_func(charset, q, c);
+        if (q1) {
+            q = q1;
+        } else {
+            *q++ = '?';
+        }
+    }
+    *pp = p;
+    return q - buf;
+}
+
 /* return the number of lines and column position for a buffer */
 void charset_get_pos_8bit(CharsetDecodeState *s, const u8 *buf, int size,
                           int *line_ptr, int *col_ptr)
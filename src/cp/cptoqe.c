@@ -240,6 +240,8 @@ static void handle_cp(FILE *f0, const char *name, const char *fname)
            "\n" "    charset_get_chars_8bit,"
            "\n" "    charset_goto_char_8bit,"
            "\n" "    charset_goto_line_8bit,"
+           "\n" "    to_utf8_8bit,"
+           "\n" "    from_utf8_8bit,"
            "\n" "    .char_size = 1,"
            "\n" "    .variable_size = 0,"
            "\n" "    .table_alloc = 1,"
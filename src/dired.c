@@ -22,6 +22,8 @@
 #include "qe.h"
 #include "variables.h"
 
+#include <dirent.h>
+#include <fnmatch.h>
 #include <grp.h>
 #include <pwd.h>
 
@@ -39,7 +41,8 @@ enum {
     DIRED_SORT_EXTENSION = 2,
     DIRED_SORT_SIZE = 4,
     DIRED_SORT_DATE = 8,
-    DIRED_SORT_MASK = 1+2+4+8,
+    DIRED_SORT_USAGE = 64,
+    DIRED_SORT_MASK = 1+2+4+8+64,
     DIRED_SORT_GROUP = 16,
     DIRED_SORT_DESCENDING = 32,
 };
@@ -65,6 +68,8 @@ enum time_format {
 
 typedef struct DiredState DiredState;
 typedef struct DiredItem DiredItem;
+typedef struct DiredStatJob DiredStatJob;
+typedef struct DiredUsageJob DiredUsageJob;
 
 struct DiredState {
     QEModeData base;    /* derived from QEModeData */
@@ -73,15 +78,26 @@ struct DiredState {
     int show_dot_files;
     int show_ds_store;
     int hflag, nflag;
+    int show_usage;
     int sort_mode;
     DiredItem *last_cur;
     long long total_bytes;
     int ndirs, nfiles, ndirs_hidden, nfiles_hidden;
     int blocksize;
     int last_width;
-    int no_blocks, no_mode, no_link, no_uid, no_gid, no_size, no_date;
-    int blockslen, modelen, linklen, uidlen, gidlen, sizelen, datelen, namelen;
+    int no_blocks, no_mode, no_link, no_uid, no_gid, no_size, no_usage, no_date;
+    int blockslen, modelen, linklen, uidlen, gidlen, sizelen, usagelen, datelen;
+    int namelen;
     int fnamecol;
+    int nb_pending;     /* number of items waiting for stat data */
+    int stat_updated;   /* stat data arrived since last update */
+    int rows_updated;   /* some rows must be updated in place */
+    DiredStatJob *stat_jobs;    /* stat jobs in progress */
+    DiredUsageJob *usage_jobs;  /* disk usage jobs in progress */
+    DiredItem *top_item;    /* keep this item on the first row while pending */
+    QEWatch *watch;     /* directory watch for live updates */
+    int stat_scheduled; /* dired_stat_bh() is registered */
+    int need_rescan;    /* directory must be read again */
     char path[MAX_FILENAME_SIZE]; /* current path */
 };
 
@@ -95,12 +111,44 @@ struct DiredItem {
     dev_t   rdev;   /* device type, for special file inode */
     time_t  mtime;
     off_t   size;
+    off_t   usage;  /* disk usage, recursive for directories */
     int     offset;
     char    hidden;
     char    mark;
+    char    pending;    /* stat data not yet available */
+    char    need_stat;  /* stat data must be requested */
+    char    invalid;    /* file could not be stat'ed or was removed */
+    char    updated;    /* stat data arrived, row must be updated */
+    int     stat_gen;   /* incremented for each new stat request */
+    char    usage_state;    /* DIRED_USAGE_xxx */
     char    name[1];
 };
 
+enum {
+    DIRED_USAGE_NONE,       /* recursive usage not computed */
+    DIRED_USAGE_PENDING,    /* directory walk in progress */
+    DIRED_USAGE_VALID,
+};
+
+/* File attributes are retrieved in batches by worker threads so the
+ * list of names can be displayed before all files have been stat'ed.
+ */
+#define DIRED_STAT_BATCH  256
+
+struct DiredStatJob {
+    DiredStatJob *next;
+    DiredState *ds;     /* NULL if the list was freed */
+    QEJob *job;
+    int nb_entries;
+    struct DiredStatEntry {
+        DiredItem *dip;     /* only accessed from the main thread */
+        int stat_gen;
+        char *fullname;
+        struct stat st;
+        int rc;
+    } entries[DIRED_STAT_BATCH];
+};
+
 static ModeDef dired_mode;
 
 static time_t dired_curtime;
@@ -111,6 +159,7 @@ static int dired_show_ds_store = 0;
 static int dired_nflag = 0; /* 0=name, 1=numeric, 2=hidden */
 static int dired_hflag = 0; /* 0=exact, 1=human-decimal, 2=human-binary */
 static int dired_sort_mode = DIRED_SORT_GROUP | DIRED_SORT_NAME;
+static int dired_show_usage = 0;
 
 static QVarType dired_sort_mode_set_value(EditState *s, VarDef *vp,
     void *ptr, const char *str, int sort_mode);
@@ -120,7 +169,7 @@ static QVarType dired_time_format_set_value(EditState *s, VarDef *vp,
 static VarDef dired_variables[] = {
     G_VAR_F( "dired-sort-mode", dired_sort_mode, VAR_NUMBER, VAR_RW_SAVE,
             dired_sort_mode_set_value,
-            "Sort order for dired display: any combination of `nesdgur+-`" )
+            "Sort order for dired display: any combination of `nesadgur+-`" )
     G_VAR_F( "dired-time-format", dired_time_format, VAR_NUMBER, VAR_RW_SAVE,
             dired_time_format_set_value,
             "Format used for file times (default, compact, dos, dos-long, touch, touch-long, full, seconds)" )
@@ -128,6 +177,8 @@ static VarDef dired_variables[] = {
           "Set to show hidden files (starting with a `.`)" )
     G_VAR( "dired-show-ds-store", dired_show_ds_store, VAR_NUMBER, VAR_RW_SAVE,
           "Set to show OS/X system file .DS_Store" )
+    G_VAR( "dired-show-usage", dired_show_usage, VAR_NUMBER, VAR_RW_SAVE,
+          "Set to show the disk usage of files and the recursive disk usage of directories" )
 };
 
 static inline DiredState *dired_get_state(EditState *e, int status)
@@ -148,11 +199,36 @@ static DiredItem *dired_get_cur_item(DiredState *ds, EditState *s) {
     return NULL;
 }
 
+static void dired_stat_bh(void *opaque);
+static void dired_usage_cancel(DiredState *ds);
+static void dired_usage_items(DiredState *ds);
+
 static void dired_free(DiredState *ds)
 {
     if (ds) {
+        DiredStatJob *sj;
         int i;
 
+        /* detach pending stat jobs, they are freed upon completion */
+        while ((sj = ds->stat_jobs) != NULL) {
+            ds->stat_jobs = sj->next;
+            sj->next = NULL;
+            sj->ds = NULL;
+            if (sj->job)
+                qe_job_cancel(sj->job);
+        }
+        dired_usage_cancel(ds);
+        qe_watch_remove(&ds->watch);
+        if (ds->stat_scheduled) {
+            unregister_bottom_half(dired_stat_bh, ds);
+            ds->stat_scheduled = 0;
+        }
+        ds->nb_pending = 0;
+        ds->stat_updated = 0;
+        ds->rows_updated = 0;
+        ds->need_rescan = 0;
+        ds->top_item = NULL;
+
         for (i = 0; i < ds->items.nb_items; i++) {
             DiredItem *dip = ds->items.items[i]->opaque;
             qe_free(&dip->fullname);
@@ -203,7 +279,24 @@ static int dired_find_target(DiredState *ds, const char *target)
                 row++;
         }
     }
-    return DIRED_HEADER;
+    return -1;
+}
+
+/* move to the target file or to the first item if not found */
+static void dired_goto_target(DiredState *ds, EditState *s, const char *target)
+{
+    int row = dired_find_target(ds, target);
+
+    ds->top_item = NULL;
+    if (row < 0) {
+        s->offset = eb_goto_pos(s->b, DIRED_HEADER, ds->fnamecol);
+        /* stay on the first row while stat data arrives and the list
+         * is sorted again */
+        if (ds->nb_pending)
+            ds->top_item = dired_get_cur_item(ds, s);
+    } else {
+        s->offset = eb_goto_pos(s->b, row, ds->fnamecol);
+    }
 }
 
 /* sort alphabetically with directories first */
@@ -236,6 +329,12 @@ static int dired_sort_func(void *opaque, const void *p1, const void *p2)
                 break;
             }
         }
+        if (sort_mode & DIRED_SORT_USAGE) {
+            if (dip1->usage != dip2->usage) {
+                res = (dip1->usage < dip2->usage) ? -1 : 1;
+                break;
+            }
+        }
         if (sort_mode & DIRED_SORT_EXTENSION) {
             res = qe_strcollate(get_extension(dip1->name),
                                 get_extension(dip2->name));
@@ -517,6 +616,41 @@ static char *compute_attr(char *atts, mode_t mode)
     return atts;
 }
 
+static int dired_item_hidden(DiredState *ds, const DiredItem *dip)
+{
+    if (dip->invalid)
+        return 1;
+    if (*dip->name == '.') {
+        if ((!ds->show_dot_files)
+        ||  (!ds->show_ds_store && strequal(dip->name, ".DS_Store")))
+            return 1;
+    }
+    /* XXX: should apply other filters? */
+    return 0;
+}
+
+/* add (n = 1) or remove (n = -1) an item from the header counts */
+static void dired_count_item(DiredState *ds, const DiredItem *dip, int n)
+{
+    /* files removed after the directory was read are not counted */
+    if (!dip->invalid) {
+        if (dip->hidden) {
+            if (S_ISDIR(dip->mode)) {
+                ds->ndirs_hidden += n;
+            } else {
+                ds->nfiles_hidden += n;
+            }
+        } else {
+            if (S_ISDIR(dip->mode)) {
+                ds->ndirs += n;
+            } else {
+                ds->nfiles += n;
+                ds->total_bytes += n * (long long)dip->size;
+            }
+        }
+    }
+}
+
 static void dired_filter_files(DiredState *ds)
 {
     int i;
@@ -529,92 +663,259 @@ static void dired_filter_files(DiredState *ds)
 
     for (i = 0; i < ds->items.nb_items; i++) {
         DiredItem *dip = ds->items.items[i]->opaque;
-        const char *p = ds->items.items[i]->str;
-        int hidden = 0;
 
-        if (*p == '.') {
-            if ((!dired_show_dot_files)
-            ||  (!dired_show_ds_store && strequal(p, ".DS_Store")))
-                hidden = 1;
-        }
-        /* XXX: should apply other filters? */
-        dip->hidden = hidden;
-        if (hidden) {
-            if (S_ISDIR(dip->mode)) {
-                ds->ndirs_hidden++;
-            } else {
-                ds->nfiles_hidden++;
-            }
-        } else {
-            if (S_ISDIR(dip->mode)) {
-                ds->ndirs++;
-            } else {
-                ds->nfiles++;
-                ds->total_bytes += dip->size;
-            }
-        }
+        dip->hidden = dired_item_hidden(ds, dip);
+        dired_count_item(ds, dip, 1);
     }
 }
 
-static void dired_compute_columns(DiredState *ds)
+/* widen the columns to fit the attributes of an item */
+static void dired_item_columns(DiredState *ds, const DiredItem *dip)
 {
     char buf[32];
-    int i, len;
+    int len;
+
+    len = strlen(dip->name);
+    if (ds->namelen < len)
+        ds->namelen = len;
+
+    if (dip->pending || dip->invalid)
+        return;
+
+    len = snprintf(buf, sizeof(buf), "%ld",
+                   (long)(((long long)dip->size + ds->blocksize - 1) /
+                          ds->blocksize));
+    if (ds->blockslen < len)
+        ds->blockslen = len;
+
+    ds->modelen = 10;
+
+    len = snprintf(buf, sizeof(buf), "%d", (int)dip->nlink);
+    if (ds->linklen < len)
+        ds->linklen = len;
+
+    len = format_uid(buf, sizeof(buf), ds->nflag, dip->uid);
+    if (ds->uidlen < len)
+        ds->uidlen = len;
+
+    len = format_gid(buf, sizeof(buf), ds->nflag, dip->gid);
+    if (ds->gidlen < len)
+        ds->gidlen = len;
+
+    len = format_size(buf, sizeof(buf), ds->hflag, dip);
+    if (ds->sizelen < len)
+        ds->sizelen = len;
+
+    if (dip->usage_state == DIRED_USAGE_VALID) {
+        len = format_number(buf, sizeof(buf), ds->hflag, dip->usage);
+        if (ds->usagelen < len)
+            ds->usagelen = len;
+    }
+
+    len = format_date(buf, sizeof(buf), dip->mtime, ds->time_format);
+    if (ds->datelen < len)
+        ds->datelen = len;
+}
+
+static void dired_compute_columns(DiredState *ds)
+{
+    int i;
 
     dired_curtime = time(NULL);
     ds->time_format = dired_time_format;
     ds->hflag = dired_hflag;
     ds->nflag = dired_nflag;
+    ds->show_usage = dired_show_usage;
     ds->blockslen = ds->modelen = ds->linklen = 0;
     ds->uidlen = ds->gidlen = 0;
-    ds->sizelen = ds->datelen = ds->namelen = 0;
+    ds->sizelen = ds->usagelen = ds->datelen = ds->namelen = 0;
 
     for (i = 0; i < ds->items.nb_items; i++) {
-        DiredItem *dip = ds->items.items[i]->opaque;
-
-        len = strlen(dip->name);
-        if (ds->namelen < len)
-            ds->namelen = len;
+        dired_item_columns(ds, ds->items.items[i]->opaque);
+    }
+}
 
-        len = snprintf(buf, sizeof(buf), "%ld",
-                       (long)(((long long)dip->size + ds->blocksize - 1) /
-                              ds->blocksize));
-        if (ds->blockslen < len)
-            ds->blockslen = len;
+/* width of the attribute columns printed before the file name */
+static int dired_attr_width(DiredState *ds)
+{
+    int width = 0;
+
+    if (!ds->no_blocks)
+        width += ds->blockslen + 1;
+    if (!ds->no_mode)
+        width += ds->modelen + 1;
+    if (!ds->no_link)
+        width += ds->linklen + 1;
+    if (!ds->no_uid)
+        width += ds->uidlen + 1;
+    if (!ds->no_gid)
+        width += ds->gidlen + 1;
+    if (!ds->no_size)
+        width += 1 + ds->sizelen + 2;
+    if (!ds->no_usage)
+        width += ds->usagelen + 2;
+    if (!ds->no_date)
+        width += ds->datelen + 2;
+    return width;
+}
 
-        ds->modelen = 10;
+#define inflect(n, singular, plural)  ((n) == 1 ? (singular) : (plural))
 
-        len = snprintf(buf, sizeof(buf), "%d", (int)dip->nlink);
-        if (ds->linklen < len)
-            ds->linklen = len;
+/* Insert formatted text with a style at *offsetp and advance *offsetp,
+ * return the number of bytes inserted.
+ */
+static int dired_insert_printf(EditBuffer *b, int *offsetp, QETermStyle style,
+                               const char *fmt, ...) qe__attr_printf(4,5);
 
-        len = format_uid(buf, sizeof(buf), ds->nflag, dip->uid);
-        if (ds->uidlen < len)
-            ds->uidlen = len;
+static int dired_insert_printf(EditBuffer *b, int *offsetp, QETermStyle style,
+                               const char *fmt, ...)
+{
+    char buf[2 * MAX_FILENAME_SIZE];
+    va_list ap;
+    int len;
 
-        len = format_gid(buf, sizeof(buf), ds->nflag, dip->gid);
-        if (ds->gidlen < len)
-            ds->gidlen = len;
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    len = clamp(len, 0, (int)sizeof(buf) - 1);
+    b->cur_style = style;
+    len = eb_insert_utf8_buf(b, *offsetp, buf, len);
+    *offsetp += len;
+    return len;
+}
 
-        len = format_size(buf, sizeof(buf), ds->hflag, dip);
-        if (ds->sizelen < len)
-            ds->sizelen = len;
+/* insert the first header line at offset, return the offset after it */
+static int dired_insert_header(DiredState *ds, EditBuffer *b, int offset)
+{
+    dired_insert_printf(b, &offset, DIRED_STYLE_HEADER, "  Directory of ");
+    dired_insert_printf(b, &offset, DIRED_STYLE_DIRECTORY, "%s", ds->path);
+    dired_insert_printf(b, &offset, DIRED_STYLE_HEADER, "\n");
+    return offset;
+}
 
-        len = format_date(buf, sizeof(buf), dip->mtime, dired_time_format);
-        if (ds->datelen < len)
-            ds->datelen = len;
+/* insert the summary header line at offset, return the offset after it */
+static int dired_insert_summary(DiredState *ds, EditBuffer *b, int offset)
+{
+    char buf[32];
+    int seq = ' ';
+    int style = DIRED_STYLE_HEADER;
+
+    dired_insert_printf(b, &offset, style, "  ");
+    if (ds->ndirs) {
+        dired_insert_printf(b, &offset, style, "%c %d %s", seq, ds->ndirs,
+                            inflect(ds->ndirs, "directory", "directories"));
+        seq = ',';
+    }
+    if (ds->ndirs_hidden) {
+        dired_insert_printf(b, &offset, style, "%c %d %s", seq, ds->ndirs_hidden,
+                            inflect(ds->ndirs_hidden, "hidden directory", "hidden directories"));
+        seq = ',';
+    }
+    if (ds->nfiles) {
+        dired_insert_printf(b, &offset, style, "%c %d %s", seq, ds->nfiles,
+                            inflect(ds->nfiles, "file", "files"));
+        seq = ',';
+    }
+    if (ds->nfiles_hidden) {
+        dired_insert_printf(b, &offset, style, "%c %d %s", seq, ds->nfiles_hidden,
+                            inflect(ds->nfiles_hidden, "hidden file", "hidden files"));
+        seq = ',';
+    }
+    if (ds->total_bytes) {
+        format_number(buf, sizeof(buf), ds->hflag, ds->total_bytes);
+        dired_insert_printf(b, &offset, style, "%c %s %s", seq, buf,
+                            inflect(ds->total_bytes, "byte", "bytes"));
+        seq = ',';
+    }
+    if (ds->nb_pending) {
+        dired_insert_printf(b, &offset, style, "%c reading %d %s", seq, ds->nb_pending,
+                            inflect(ds->nb_pending, "entry", "entries"));
+        seq = ',';
     }
+    if (ds->ndirs + ds->ndirs_hidden + ds->nfiles + ds->nfiles_hidden == 0) {
+        dired_insert_printf(b, &offset, style, "%c empty", seq);
+    }
+    dired_insert_printf(b, &offset, style, "\n");
+    return offset;
 }
 
-#define inflect(n, singular, plural)  ((n) == 1 ? (singular) : (plural))
+/* insert the row of an item at offset, return the offset after it */
+static int dired_insert_item(DiredState *ds, EditBuffer *b, int offset,
+                             const DiredItem *dip)
+{
+    char buf[MAX_FILENAME_SIZE];
+    int style = DIRED_STYLE_NORMAL;
+    int col, trailchar;
+
+    col = dired_insert_printf(b, &offset, style, "%c ", dip->mark);
+    if (dip->pending) {
+        /* leave the attribute columns blank until stat data arrives */
+        col += dired_insert_printf(b, &offset, style, "%*s",
+                                   dired_attr_width(ds), "");
+    } else {
+        if (!ds->no_blocks) {
+            col += dired_insert_printf(b, &offset, style, "%*ld ", ds->blockslen,
+                                       (long)(((long long)dip->size +
+                                               ds->blocksize - 1) / ds->blocksize));
+        }
+        if (!ds->no_mode) {
+            compute_attr(buf, dip->mode);
+            col += dired_insert_printf(b, &offset, style, "%s ", buf);
+        }
+        if (!ds->no_link) {
+            col += dired_insert_printf(b, &offset, style, "%*d ", ds->linklen,
+                                       (int)dip->nlink);
+        }
+        if (!ds->no_uid) {
+            format_uid(buf, sizeof(buf), ds->nflag, dip->uid);
+            col += dired_insert_printf(b, &offset, style, "%-*s ", ds->uidlen, buf);
+        }
+        if (!ds->no_gid) {
+            format_gid(buf, sizeof(buf), ds->nflag, dip->gid);
+            col += dired_insert_printf(b, &offset, style, "%-*s ", ds->gidlen, buf);
+        }
+        if (!ds->no_size) {
+            format_size(buf, sizeof(buf), ds->hflag, dip);
+            col += dired_insert_printf(b, &offset, style, " %*s  ", ds->sizelen, buf);
+        }
+        if (!ds->no_usage) {
+            *buf = '\0';
+            if (dip->usage_state == DIRED_USAGE_VALID)
+                format_number(buf, sizeof(buf), ds->hflag, dip->usage);
+            col += dired_insert_printf(b, &offset, style, "%*s  ", ds->usagelen, buf);
+        }
+        if (!ds->no_date) {
+            format_date(buf, sizeof(buf), dip->mtime, dired_time_format);
+            col += dired_insert_printf(b, &offset, style, "%s  ", buf);
+        }
+    }
+    ds->fnamecol = col - 1;
+
+    if (S_ISDIR(dip->mode))
+        style = DIRED_STYLE_DIRECTORY;
+    else
+        style = DIRED_STYLE_FILENAME;
+
+    dired_insert_printf(b, &offset, style, "%s", dip->name);
+
+    trailchar = get_trailchar(dip->mode);
+    if (trailchar) {
+        dired_insert_printf(b, &offset, style, "%c", trailchar);
+    }
+    if (S_ISLNK(dip->mode)
+    &&  getentryslink(buf, sizeof(buf), ds->path, dip->name)) {
+        dired_insert_printf(b, &offset, style, " -> %s", buf);
+    }
+    dired_insert_printf(b, &offset, DIRED_STYLE_NORMAL, "\n");
+    return offset;
+}
 
 /* `b` is valid, `ds` and `s` may be NULL */
 static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
                                 int flags)
 {
-    char buf[MAX_FILENAME_SIZE];
     DiredItem *dip, *cur_item;
-    int i, col, w, width, window_width, top_line;
+    int i, col, w, width, window_width, top_line, offset;
 
     if (!ds)
         return;
@@ -656,10 +957,16 @@ static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
 
     if (ds->time_format != dired_time_format
     ||  ds->nflag != dired_nflag
-    ||  ds->hflag != dired_hflag) {
+    ||  ds->hflag != dired_hflag
+    ||  ds->show_usage != dired_show_usage) {
         flags |= DIRED_UPDATE_COLUMNS;
     }
 
+    if ((flags & (DIRED_UPDATE_SORT | DIRED_UPDATE_COLUMNS))
+    &&  (dired_show_usage || (dired_sort_mode & DIRED_SORT_USAGE))) {
+        dired_usage_items(ds);
+    }
+
     if (flags & DIRED_UPDATE_COLUMNS) {
         flags |= DIRED_UPDATE_REBUILD;
         dired_compute_columns(ds);
@@ -672,6 +979,7 @@ static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
     ds->last_cur = NULL;
     width -= clamp(ds->namelen, 16, 40);
     ds->no_size = ((width -= ds->sizelen + 2) < 0);
+    ds->no_usage = !ds->show_usage || ((width -= ds->usagelen + 2) < 0);
     ds->no_date = ((width -= ds->datelen + 2) < 0);
     ds->no_mode = ((width -= ds->modelen + 1) < 0);
     ds->no_uid = (ds->nflag == 2) || ((width -= ds->uidlen + 1) < 0);
@@ -684,113 +992,114 @@ static void dired_update_buffer(DiredState *ds, EditBuffer *b, EditState *s,
     /* deleting buffer contents resets s->offset and s->offset_top */
     eb_clear(b);
 
+    offset = 0;
     if (DIRED_HEADER) {
-        int seq = ' ';
-        b->cur_style = DIRED_STYLE_HEADER;
-        eb_puts(b, "  Directory of ");
-        b->cur_style = DIRED_STYLE_DIRECTORY;
-        eb_puts(b, ds->path);
-        b->cur_style = DIRED_STYLE_HEADER;
-        eb_puts(b, "\n  ");
-        if (ds->ndirs) {
-            eb_printf(b, "%c %d %s", seq, ds->ndirs,
-                      inflect(ds->ndirs, "directory", "directories"));
-            seq = ',';
-        }
-        if (ds->ndirs_hidden) {
-            eb_printf(b, "%c %d %s", seq, ds->ndirs_hidden,
-                      inflect(ds->ndirs_hidden, "hidden directory", "hidden directories"));
-            seq = ',';
-        }
-        if (ds->nfiles) {
-            eb_printf(b, "%c %d %s", seq, ds->nfiles,
-                      inflect(ds->nfiles, "file", "files"));
-            seq = ',';
-        }
-        if (ds->nfiles_hidden) {
-            eb_printf(b, "%c %d %s", seq, ds->nfiles_hidden,
-                      inflect(ds->nfiles_hidden, "hidden file", "hidden files"));
-            seq = ',';
-        }
-        if (ds->total_bytes) {
-            format_number(buf, sizeof(buf), ds->hflag, ds->total_bytes);
-            eb_printf(b, "%c %s %s", seq, buf,
-                      inflect(ds->total_bytes, "byte", "bytes"));
-            seq = ',';
-        }
-        if (ds->ndirs + ds->ndirs_hidden + ds->nfiles + ds->nfiles_hidden == 0) {
-            eb_printf(b, "%c empty", seq);
-        }
-        eb_putc(b, '\n');
+        offset = dired_insert_header(ds, b, offset);
+        offset = dired_insert_summary(ds, b, offset);
     }
-    b->cur_style = DIRED_STYLE_NORMAL;
 
     for (i = 0; i < ds->items.nb_items; i++) {
         dip = ds->items.items[i]->opaque;
-        dip->offset = b->total_size;
+        dip->offset = offset;
+        dip->updated = 0;
         if (dip == cur_item) {
             ds->last_cur = dip;
             if (s)
-                s->offset = b->total_size;
+                s->offset = offset;
         }
         if (dip->hidden)
             continue;
-        col = eb_printf(b, "%c ", dip->mark);
-        if (!ds->no_blocks) {
-            col += eb_printf(b, "%*ld ", ds->blockslen,
-                             (long)(((long long)dip->size + ds->blocksize - 1) /
-                                    ds->blocksize));
-        }
-        if (!ds->no_mode) {
-            compute_attr(buf, dip->mode);
-            col += eb_printf(b, "%s ", buf);
-        }
-        if (!ds->no_link) {
-            col += eb_printf(b, "%*d ", ds->linklen, (int)dip->nlink);
-        }
-        if (!ds->no_uid) {
-            format_uid(buf, sizeof(buf), ds->nflag, dip->uid);
-            col += eb_printf(b, "%-*s ", ds->uidlen, buf);
-        }
-        if (!ds->no_gid) {
-            format_gid(buf, sizeof(buf), ds->nflag, dip->gid);
-            col += eb_printf(b, "%-*s ", ds->gidlen, buf);
-        }
-        if (!ds->no_size) {
-            format_size(buf, sizeof(buf), ds->hflag, dip);
-            col += eb_printf(b, " %*s  ", ds->sizelen, buf);
-        }
-        if (!ds->no_date) {
-            format_date(buf, sizeof(buf), dip->mtime, dired_time_format);
-            col += eb_printf(b, "%s  ", buf);
-        }
-        ds->fnamecol = col - 1;
+        offset = dired_insert_item(ds, b, offset, dip);
+    }
+    b->cur_style = DIRED_STYLE_NORMAL;
+    b->modified = 0;
+    b->flags |= BF_READONLY;
+    if (s) {
+        s->offset_top = eb_goto_pos(b, top_line, 0);
+    }
+}
 
-        if (S_ISDIR(dip->mode))
-            b->cur_style = DIRED_STYLE_DIRECTORY;
-        else
-            b->cur_style = DIRED_STYLE_FILENAME;
+/* Replace the rows of the items whose stat data arrived since the last
+ * update, without sorting the list again: the list is sorted when all
+ * the items have been stat'ed.  Return 0 if the column widths changed
+ * and the whole buffer must be rebuilt.
+ */
+static int dired_update_rows(DiredState *ds, EditBuffer *b, EditState *s)
+{
+    int lens[9];
+    int i, row, offset, offset1, line, col, top_line, top_col, readonly;
 
-        eb_puts(b, dip->name);
+    if (ds->time_format != dired_time_format
+    ||  ds->nflag != dired_nflag
+    ||  ds->hflag != dired_hflag
+    ||  ds->show_usage != dired_show_usage
+    ||  ds->sort_mode != dired_sort_mode
+    ||  ds->show_dot_files != dired_show_dot_files
+    ||  ds->show_ds_store != dired_show_ds_store
+    ||  (s && ds->last_width != s->width)) {
+        return 0;
+    }
 
-        if (1) {
-            int trailchar = get_trailchar(dip->mode);
-            if (trailchar) {
-                eb_putc(b, trailchar);
-            }
-        }
-        if (S_ISLNK(dip->mode)
-        &&  getentryslink(buf, sizeof(buf), ds->path, dip->name)) {
-            eb_printf(b, " -> %s", buf);
+    lens[0] = ds->blockslen;
+    lens[1] = ds->modelen;
+    lens[2] = ds->linklen;
+    lens[3] = ds->uidlen;
+    lens[4] = ds->gidlen;
+    lens[5] = ds->sizelen;
+    lens[6] = ds->usagelen;
+    lens[7] = ds->datelen;
+    lens[8] = ds->namelen;
+    for (i = 0; i < ds->items.nb_items; i++) {
+        DiredItem *dip = ds->items.items[i]->opaque;
+        if (dip->updated)
+            dired_item_columns(ds, dip);
+    }
+    if (lens[0] != ds->blockslen || lens[1] != ds->modelen
+    ||  lens[2] != ds->linklen || lens[3] != ds->uidlen
+    ||  lens[4] != ds->gidlen || lens[5] != ds->sizelen
+    ||  lens[6] != ds->usagelen || lens[7] != ds->datelen
+    ||  lens[8] != ds->namelen) {
+        return 0;
+    }
+
+    line = col = top_line = top_col = 0;
+    if (s) {
+        eb_get_pos(b, &line, &col, s->offset);
+        eb_get_pos(b, &top_line, &top_col, s->offset_top);
+    }
+    readonly = b->flags & BF_READONLY;
+    b->flags &= ~BF_READONLY;
+
+    if (DIRED_HEADER) {
+        offset = eb_goto_pos(b, 1, 0);
+        offset1 = eb_goto_pos(b, 2, 0);
+        eb_delete(b, offset, offset1 - offset);
+        dired_insert_summary(ds, b, offset);
+    }
+    row = DIRED_HEADER;
+    for (i = 0; i < ds->items.nb_items; i++) {
+        DiredItem *dip = ds->items.items[i]->opaque;
+
+        if (dip->hidden)
+            continue;
+        if (dip->updated) {
+            dip->updated = 0;
+            offset = eb_goto_pos(b, row, 0);
+            offset1 = eb_next_line(b, offset);
+            eb_delete(b, offset, offset1 - offset);
+            dired_insert_item(ds, b, offset, dip);
         }
-        b->cur_style = DIRED_STYLE_NORMAL;
-        eb_putc(b, '\n');
+        row++;
     }
+
+    b->cur_style = DIRED_STYLE_NORMAL;
     b->modified = 0;
-    b->flags |= BF_READONLY;
+    b->flags |= readonly;
     if (s) {
+        s->offset = eb_goto_pos(b, line, col);
         s->offset_top = eb_goto_pos(b, top_line, 0);
     }
+    return 1;
 }
 
 /* dired-mode commands */
@@ -861,6 +1170,10 @@ static QVarType dired_sort_mode_set_value(EditState *s, VarDef *vp,
             sort_mode &= ~DIRED_SORT_MASK;
             sort_mode |= DIRED_SORT_SIZE;
             break;
+        case 'a':       /* allocated disk usage */
+            sort_mode &= ~DIRED_SORT_MASK;
+            sort_mode |= DIRED_SORT_USAGE;
+            break;
         case 'd':       /* date */
             sort_mode &= ~DIRED_SORT_MASK;
             sort_mode |= DIRED_SORT_DATE;
@@ -930,6 +1243,560 @@ static void dired_set_time_format(EditState *s, int format)
                                 NULL, format);
 }
 
+/* runs on a worker thread: only access the job's own data */
+static void dired_stat_work(void *opaque, QEJob *job)
+{
+    DiredStatJob *sj = opaque;
+    int i;
+
+    for (i = 0; i < sj->nb_entries; i++) {
+        if (job && qe_job_cancelled(job))
+            break;
+        sj->entries[i].rc = lstat(sj->entries[i].fullname, &sj->entries[i].st);
+    }
+}
+
+static void dired_stat_done(void *opaque, int cancelled)
+{
+    DiredStatJob *sj = opaque, **pp;
+    DiredState *ds = sj->ds;
+    int i;
+
+    if (ds) {
+        for (pp = &ds->stat_jobs; *pp; pp = &(*pp)->next) {
+            if (*pp == sj) {
+                *pp = sj->next;
+                break;
+            }
+        }
+        for (i = 0; i < sj->nb_entries; i++) {
+            DiredItem *dip = sj->entries[i].dip;
+            const struct stat *st = &sj->entries[i].st;
+
+            /* ignore results superseded by a more recent request */
+            if (sj->entries[i].stat_gen != dip->stat_gen)
+                continue;
+            dired_count_item(ds, dip, -1);
+            if (cancelled || sj->entries[i].rc < 0) {
+                dip->invalid = 1;
+            } else {
+                dip->mode = st->st_mode;
+                dip->nlink = st->st_nlink;
+                dip->uid = st->st_uid;
+                dip->gid = st->st_gid;
+                dip->rdev = st->st_rdev;
+                dip->mtime = st->st_mtime;
+                dip->size = st->st_size;
+                dip->usage = (off_t)st->st_blocks * 512;
+                /* directory contents may have changed */
+                dip->usage_state = S_ISDIR(dip->mode) ?
+                    DIRED_USAGE_NONE : DIRED_USAGE_VALID;
+                dip->invalid = 0;
+            }
+            if (dip->pending) {
+                dip->pending = 0;
+                ds->nb_pending--;
+            }
+            if (dired_item_hidden(ds, dip) != dip->hidden) {
+                /* rows must be added or removed */
+                dip->hidden ^= 1;
+                ds->stat_updated = 1;
+            }
+            dired_count_item(ds, dip, 1);
+            dip->updated = 1;
+        }
+        /* The display hook updates the rows of the items as batches
+         * complete and sorts the list once all items are known.
+         */
+        if (ds->nb_pending == 0)
+            ds->stat_updated = 1;
+        else
+            ds->rows_updated = 1;
+        url_request_display();
+    }
+    for (i = 0; i < sj->nb_entries; i++) {
+        qe_free(&sj->entries[i].fullname);
+    }
+    qe_free(&sj);
+}
+
+/* submit stat requests for items that need them, in batches */
+static void dired_stat_items(DiredState *ds)
+{
+    DiredStatJob *sj = NULL;
+    int i;
+
+    for (i = 0; i <= ds->items.nb_items; i++) {
+        DiredItem *dip = NULL;
+
+        if (i < ds->items.nb_items) {
+            dip = ds->items.items[i]->opaque;
+            if (!dip->need_stat)
+                continue;
+            dip->need_stat = 0;
+        }
+        if (sj && (!dip || sj->nb_entries == DIRED_STAT_BATCH)) {
+            sj->next = ds->stat_jobs;
+            ds->stat_jobs = sj;
+            sj->job = qe_job_submit(dired_stat_work, dired_stat_done, sj);
+            if (!sj->job) {
+                /* cannot submit job: stat files synchronously */
+                dired_stat_work(sj, NULL);
+                dired_stat_done(sj, 0);
+            }
+            sj = NULL;
+        }
+        if (!dip)
+            break;
+        if (!sj) {
+            sj = qe_mallocz(DiredStatJob);
+            if (!sj) {
+                dip->invalid = 1;
+                if (dip->pending) {
+                    dip->pending = 0;
+                    ds->nb_pending--;
+                }
+                continue;
+            }
+            sj->ds = ds;
+        }
+        sj->entries[sj->nb_entries].dip = dip;
+        sj->entries[sj->nb_entries].stat_gen = dip->stat_gen;
+        sj->entries[sj->nb_entries].fullname = qe_strdup(dip->fullname);
+        sj->entries[sj->nb_entries].rc = -1;
+        sj->nb_entries++;
+    }
+}
+
+/* Recursive disk usage of directories is computed by walking each
+ * subdirectory on a worker thread. The usage of the files directly in
+ * a directory is cached by device, inode and modification time, and
+ * saved across sessions: a cached directory is read again, but only its
+ * subdirectories are stat'ed. The cache misses files modified in place,
+ * which do not update the modification time of their directory.
+ */
+
+typedef struct DiredUsageEntry {
+    dev_t dev;
+    ino_t ino;      /* 0 for an empty slot */
+    time_t mtime;
+    off_t usage;    /* directory itself and its non directory entries */
+} DiredUsageEntry;
+
+#define DIRED_USAGE_CACHE_MAX  (1 << 20)
+
+/* The cache is read by the walkers without locking, it is only
+ * modified when no walker is running. */
+static DiredUsageEntry *dired_usage_cache;
+static int dired_usage_cache_size, dired_usage_cache_count;
+static int dired_usage_cache_loaded;
+static DiredUsageEntry *dired_usage_new;    /* entries waiting for merge */
+static int dired_usage_new_count, dired_usage_new_size;
+static int dired_usage_running;
+
+struct DiredUsageJob {
+    DiredUsageJob *next;
+    DiredState *ds;     /* NULL if the list was freed */
+    QEJob *job;
+    DiredItem *dip;     /* only accessed from the main thread */
+    int stat_gen;
+    off_t usage;
+    int nb_entries, entries_size;
+    DiredUsageEntry *entries;   /* directories scanned by the walker */
+    char path[1];
+};
+
+static DiredUsageEntry *dired_usage_find(dev_t dev, ino_t ino)
+{
+    DiredUsageEntry *ep;
+    unsigned int h;
+
+    if (!dired_usage_cache_size)
+        return NULL;
+    h = ((unsigned int)ino * 0x9E3779B1U) ^ (unsigned int)dev;
+    for (;;) {
+        ep = &dired_usage_cache[h & (dired_usage_cache_size - 1)];
+        if (ep->ino == ino && ep->dev == dev)
+            return ep;
+        if (ep->ino == 0)
+            return NULL;
+        h++;
+    }
+}
+
+static void dired_usage_store(const DiredUsageEntry *e)
+{
+    DiredUsageEntry *ep, *old_cache;
+    int i, old_size;
+
+    if (dired_usage_cache_count + 1 > dired_usage_cache_size / 2) {
+        if (dired_usage_cache_count >= DIRED_USAGE_CACHE_MAX) {
+            /* start over rather than grow without bounds */
+            old_size = 0;
+        } else {
+            old_size = dired_usage_cache_size;
+        }
+        old_cache = dired_usage_cache;
+        dired_usage_cache_size = max(1024, old_size * 2);
+        dired_usage_cache = qe_mallocz_array(DiredUsageEntry,
+                                             dired_usage_cache_size);
+        dired_usage_cache_count = 0;
+        if (!dired_usage_cache) {
+            dired_usage_cache = old_cache;
+            dired_usage_cache_size = old_size;
+            return;
+        }
+        for (i = 0; i < old_size; i++) {
+            if (old_cache[i].ino)
+                dired_usage_store(&old_cache[i]);
+        }
+        qe_free(&old_cache);
+    }
+    ep = dired_usage_find(e->dev, e->ino);
+    if (!ep) {
+        unsigned int h = ((unsigned int)e->ino * 0x9E3779B1U) ^ (unsigned int)e->dev;
+        while (dired_usage_cache[h & (dired_usage_cache_size - 1)].ino)
+            h++;
+        ep = &dired_usage_cache[h & (dired_usage_cache_size - 1)];
+        dired_usage_cache_count++;
+    }
+    *ep = *e;
+}
+
+static char *dired_usage_cache_path(char *buf, int buf_size)
+{
+    const char *home = getenv("HOME");
+
+    if (!home || !*home)
+        return NULL;
+    makepath(buf, buf_size, home, ".qe");
+    return makepath(buf, buf_size, buf, "dired-usage.cache");
+}
+
+static void dired_usage_load(void)
+{
+    char filename[MAX_FILENAME_SIZE];
+    unsigned long long dev, ino;
+    long long mtime, usage;
+    DiredUsageEntry e;
+    FILE *f;
+
+    dired_usage_cache_loaded = 1;
+    if (!dired_usage_cache_path(filename, sizeof(filename)))
+        return;
+    f = fopen(filename, "r");
+    if (!f)
+        return;
+    while (fscanf(f, "%llu %llu %lld %lld\n", &dev, &ino, &mtime, &usage) == 4) {
+        e.dev = dev;
+        e.ino = ino;
+        e.mtime = mtime;
+        e.usage = usage;
+        if (e.ino)
+            dired_usage_store(&e);
+    }
+    fclose(f);
+}
+
+static void dired_usage_save(void)
+{
+    char filename[MAX_FILENAME_SIZE];
+    char tmpname[MAX_FILENAME_SIZE];
+    DiredUsageEntry *ep;
+    FILE *f;
+    int i;
+
+    if (!dired_usage_cache_path(filename, sizeof(filename)))
+        return;
+    f = qe_fopen_tmp(tmpname, sizeof(tmpname), filename);
+    if (!f)
+        return;
+    for (i = 0; i < dired_usage_cache_size; i++) {
+        ep = &dired_usage_cache[i];
+        if (ep->ino) {
+            fprintf(f, "%llu %llu %lld %lld\n",
+                    (unsigned long long)ep->dev, (unsigned long long)ep->ino,
+                    (long long)ep->mtime, (long long)ep->usage);
+        }
+    }
+    qe_fclose_tmp(f, tmpname, filename);
+}
+
+/* runs on a worker thread: the cache is not modified while walkers run */
+static off_t dired_usage_walk(DiredUsageJob *uj, QEJob *job, int parent_fd,
+                              const char *name, const struct stat *st)
+{
+    const DiredUsageEntry *ep;
+    struct dirent *dp;
+    struct stat st1;
+    DIR *dir;
+    off_t usage, subdirs = 0;
+    int fd, cached;
+
+    usage = (off_t)st->st_blocks * 512;
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0)
+        return usage;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return usage;
+    }
+    ep = dired_usage_find(st->st_dev, st->st_ino);
+    cached = (ep && ep->mtime == st->st_mtime);
+    if (cached)
+        usage = ep->usage;
+
+    while ((dp = readdir(dir)) != NULL) {
+        if (job && qe_job_cancelled(job))
+            break;
+        if (dp->d_name[0] == '.'
+        &&  (dp->d_name[1] == '\0' ||
+             (dp->d_name[1] == '.' && dp->d_name[2] == '\0')))
+            continue;
+#ifdef DT_DIR
+        /* only subdirectories are needed for a cached directory */
+        if (cached && dp->d_type != DT_DIR && dp->d_type != DT_UNKNOWN)
+            continue;
+#endif
+        if (fstatat(fd, dp->d_name, &st1, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (S_ISDIR(st1.st_mode)) {
+            /* do not cross file system boundaries */
+            if (st1.st_dev == st->st_dev)
+                subdirs += dired_usage_walk(uj, job, fd, dp->d_name, &st1);
+        } else
+        if (!cached) {
+            usage += (off_t)st1.st_blocks * 512;
+        }
+    }
+    closedir(dir);
+
+    if (!cached && !(job && qe_job_cancelled(job))) {
+        if (uj->nb_entries >= uj->entries_size) {
+            int n = max(16, uj->entries_size * 2);
+            if (qe_realloc(&uj->entries, n * sizeof(*uj->entries)))
+                uj->entries_size = n;
+        }
+        if (uj->nb_entries < uj->entries_size) {
+            DiredUsageEntry *e = &uj->entries[uj->nb_entries++];
+            e->dev = st->st_dev;
+            e->ino = st->st_ino;
+            e->mtime = st->st_mtime;
+            e->usage = usage;
+        }
+    }
+    return usage + subdirs;
+}
+
+static void dired_usage_work(void *opaque, QEJob *job)
+{
+    DiredUsageJob *uj = opaque;
+    struct stat st;
+
+    if (lstat(uj->path, &st) == 0 && S_ISDIR(st.st_mode))
+        uj->usage = dired_usage_walk(uj, job, AT_FDCWD, uj->path, &st);
+}
+
+static void dired_usage_done(void *opaque, int cancelled)
+{
+    DiredUsageJob *uj = opaque, **pp;
+    DiredState *ds = uj->ds;
+    int i;
+
+    if (ds) {
+        for (pp = &ds->usage_jobs; *pp; pp = &(*pp)->next) {
+            if (*pp == uj) {
+                *pp = uj->next;
+                break;
+            }
+        }
+        if (!cancelled && uj->stat_gen == uj->dip->stat_gen) {
+            uj->dip->usage = uj->usage;
+            uj->dip->usage_state = DIRED_USAGE_VALID;
+            ds->stat_updated = 1;
+            url_request_display();
+        }
+    }
+    /* directories completely scanned are valid even if cancelled */
+    if (uj->nb_entries) {
+        int n = dired_usage_new_count + uj->nb_entries;
+        if (n > dired_usage_new_size
+        &&  qe_realloc(&dired_usage_new, n * sizeof(*dired_usage_new))) {
+            dired_usage_new_size = n;
+        }
+        for (i = 0; i < uj->nb_entries; i++) {
+            if (dired_usage_new_count >= dired_usage_new_size)
+                break;
+            dired_usage_new[dired_usage_new_count++] = uj->entries[i];
+        }
+    }
+    if (--dired_usage_running == 0 && dired_usage_new_count) {
+        for (i = 0; i < dired_usage_new_count; i++) {
+            dired_usage_store(&dired_usage_new[i]);
+        }
+        qe_free(&dired_usage_new);
+        dired_usage_new_count = dired_usage_new_size = 0;
+        dired_usage_save();
+    }
+    qe_free(&uj->entries);
+    qe_free(&uj);
+}
+
+/* start computing the recursive usage of directories */
+static void dired_usage_items(DiredState *ds)
+{
+    DiredUsageJob *uj;
+    int i, len;
+
+    for (i = 0; i < ds->items.nb_items; i++) {
+        DiredItem *dip = ds->items.items[i]->opaque;
+
+        if (dip->pending || dip->invalid || !S_ISDIR(dip->mode)
+        ||  dip->usage_state != DIRED_USAGE_NONE)
+            continue;
+        if (!dired_usage_cache_loaded && !dired_usage_running)
+            dired_usage_load();
+        len = strlen(dip->fullname);
+        uj = qe_mallocz_hack(DiredUsageJob, len);
+        if (!uj)
+            break;
+        memcpy(uj->path, dip->fullname, len + 1);
+        uj->ds = ds;
+        uj->dip = dip;
+        uj->stat_gen = dip->stat_gen;
+        uj->next = ds->usage_jobs;
+        ds->usage_jobs = uj;
+        dip->usage_state = DIRED_USAGE_PENDING;
+        dired_usage_running++;
+        uj->job = qe_job_submit(dired_usage_work, dired_usage_done, uj);
+        if (!uj->job) {
+            dired_usage_work(uj, NULL);
+            dired_usage_done(uj, 0);
+        }
+    }
+}
+
+static void dired_usage_cancel(DiredState *ds)
+{
+    DiredUsageJob *uj;
+
+    while ((uj = ds->usage_jobs) != NULL) {
+        ds->usage_jobs = uj->next;
+        uj->next = NULL;
+        uj->ds = NULL;
+        if (uj->job)
+            qe_job_cancel(uj->job);
+    }
+}
+
+/* add a new item, stat data is requested by dired_stat_items() */
+static DiredItem *dired_add_item(DiredState *ds, const char *filename)
+{
+    char line[1024];
+    const char *p = get_basename(filename);
+    StringItem *item;
+    DiredItem *dip;
+    int plen = strlen(p);
+
+    pstrcpy(line, sizeof(line), p);
+    item = add_string(&ds->items, line, 0);
+    if (!item)
+        return NULL;
+
+    dip = qe_mallocz_hack(DiredItem, plen);
+    dip->fullname = qe_strdup(filename);
+    dip->hidden = 0;
+    dip->mark = ' ';
+    dip->pending = 1;
+    dip->need_stat = 1;
+    memcpy(dip->name, p, plen + 1);
+    item->opaque = dip;
+    ds->nb_pending++;
+    return dip;
+}
+
+static void dired_stat_bh(void *opaque)
+{
+    DiredState *ds = opaque;
+
+    ds->stat_scheduled = 0;
+    dired_stat_items(ds);
+}
+
+/* update the list incrementally upon directory change notifications */
+static void dired_watch_cb(void *opaque, int event, const char *name)
+{
+    char filename[MAX_FILENAME_SIZE];
+    char dir[MAX_FILENAME_SIZE];
+    DiredState *ds = opaque;
+    DiredItem *dip = NULL;
+    int i;
+
+    if (event == QE_WATCH_RESCAN) {
+        ds->need_rescan = 1;
+        url_request_display();
+        return;
+    }
+    if (!is_directory(ds->path)
+    &&  fnmatch(get_basename(ds->path), name, 0) != 0) {
+        return;
+    }
+    for (i = 0; i < ds->items.nb_items; i++) {
+        DiredItem *dip1 = ds->items.items[i]->opaque;
+        if (strequal(dip1->name, name)) {
+            dip = dip1;
+            break;
+        }
+    }
+    switch (event) {
+    case QE_WATCH_CREATE:
+        if (!dip) {
+            pstrcpy(dir, sizeof(dir), ds->path);
+            if (!is_directory(dir))
+                get_dirname(dir, sizeof(dir), ds->path);
+            makepath(filename, sizeof(filename), dir, name);
+            if (!dired_add_item(ds, filename))
+                return;
+            break;
+        }
+        if (dip->invalid && !dip->pending) {
+            dip->pending = 1;
+            ds->nb_pending++;
+        }
+        dip->invalid = 0;
+        dip->need_stat = 1;
+        dip->stat_gen++;
+        break;
+    case QE_WATCH_DELETE:
+        if (!dip || dip->invalid)
+            return;
+        dip->invalid = 1;
+        dip->need_stat = 0;
+        dip->stat_gen++;
+        if (dip->pending) {
+            dip->pending = 0;
+            ds->nb_pending--;
+        }
+        ds->stat_updated = 1;
+        url_request_display();
+        return;
+    case QE_WATCH_MODIFY:
+        if (!dip || dip->invalid)
+            return;
+        dip->need_stat = 1;
+        dip->stat_gen++;
+        break;
+    default:
+        return;
+    }
+    /* coalesce stat requests for bursts of events */
+    if (!ds->stat_scheduled) {
+        ds->stat_scheduled = 1;
+        register_bottom_half(dired_stat_bh, ds);
+    }
+}
+
 /* `ds` and `b` are valid, `s` and `target` may be NULL */
 static void dired_build_list(DiredState *ds, const char *path,
                              const char *target, EditBuffer *b, EditState *s)
@@ -937,11 +1804,8 @@ static void dired_build_list(DiredState *ds, const char *path,
     FindFileState *ffst;
     char filename[MAX_FILENAME_SIZE];
     char dir[MAX_FILENAME_SIZE];
-    char line[1024];
     const char *p;
     const char *pattern;
-    struct stat st;
-    StringItem *item;
 
     /* free previous list, if any */
     dired_free(ds);
@@ -967,17 +1831,13 @@ static void dired_build_list(DiredState *ds, const char *path,
     /* XXX: should scan directory for subdirectories and filter with
      * pattern only for regular files.
      * XXX: should handle generalized file patterns.
-     * XXX: should use a separate thread to make the scan asynchronous.
-     * XXX: should compute recursive size data.
-     * XXX: should track file creation, deletion and modifications.
      */
-    ffst = find_file_open(dir, pattern);
-    /* Should scan directory/filespec before computing lines to adjust
-     * filename gutter width.
+    /* Only collect the names here: file attributes are retrieved
+     * asynchronously by dired_stat_items() and the list is refreshed
+     * as they arrive.
      */
+    ffst = find_file_open(dir, pattern);
     while (find_file_next(ffst, filename, sizeof(filename)) == 0) {
-        if (lstat(filename, &st) < 0)
-            continue;
         p = get_basename(filename);
 
 #if 1   /* CG: bad idea, but causes spurious bugs */
@@ -985,32 +1845,18 @@ static void dired_build_list(DiredState *ds, const char *path,
         if (strequal(p, ".") || strequal(p, ".."))
             continue;
 #endif
-        pstrcpy(line, sizeof(line), p);
-        item = add_string(&ds->items, line, 0);
-        if (item) {
-            DiredItem *dip;
-            int plen = strlen(p);
-
-            dip = qe_malloc_hack(DiredItem, plen);
-            dip->fullname = qe_strdup(filename);
-            dip->mode = st.st_mode;
-            dip->nlink = st.st_nlink;
-            dip->uid = st.st_uid;
-            dip->gid = st.st_gid;
-            dip->rdev = st.st_rdev;
-            dip->mtime = st.st_mtime;
-            dip->size = st.st_size;
-            dip->hidden = 0;
-            dip->mark = ' ';
-            memcpy(dip->name, p, plen + 1);
-            item->opaque = dip;
-        }
+        dired_add_item(ds, filename);
     }
     find_file_close(&ffst);
 
+    dired_stat_items(ds);
+
+    /* track file creation, deletion and modifications */
+    ds->watch = qe_watch_add(dir, dired_watch_cb, ds);
+
     dired_update_buffer(ds, b, s, DIRED_UPDATE_ALL);
     if (s) {
-        s->offset = eb_goto_pos(b, dired_find_target(ds, target), ds->fnamecol);
+        dired_goto_target(ds, s, target);
     }
 }
 
@@ -1133,6 +1979,11 @@ static void dired_toggle_nflag(EditState *s)
     dired_nflag = (dired_nflag + 1) % 3;
 }
 
+static void dired_toggle_usage(EditState *s)
+{
+    dired_show_usage = !dired_show_usage;
+}
+
 static void dired_refresh(EditState *s)
 {
     DiredState *ds;
@@ -1165,7 +2016,7 @@ static void dired_display_hook(EditState *s)
     char filename[MAX_FILENAME_SIZE];
     DiredState *ds;
     DiredItem *dip;
-    int flags = 0;
+    int flags = 0, top = 0;
 
     if (!(ds = dired_get_state(s, 0)))
         return;
@@ -1182,8 +2033,33 @@ static void dired_display_hook(EditState *s)
         flags |= DIRED_UPDATE_REBUILD;
     }
 
+    if (ds->need_rescan) {
+        /* the directory was moved or events were lost */
+        dired_refresh(s);
+    }
+
+    if (ds->rows_updated && !ds->stat_updated) {
+        ds->rows_updated = 0;
+        if (!dired_update_rows(ds, s->b, s))
+            flags |= DIRED_UPDATE_REBUILD;
+    }
+
+    if (ds->stat_updated) {
+        ds->stat_updated = 0;
+        ds->rows_updated = 0;
+        flags |= DIRED_UPDATE_ALL;
+        if (ds->top_item && ds->top_item != dired_get_cur_item(ds, s))
+            ds->top_item = NULL;
+        top = (ds->top_item != NULL);
+    }
+
     dired_update_buffer(ds, s->b, s, flags);
 
+    if (top) {
+        s->offset = eb_goto_pos(s->b, DIRED_HEADER, ds->fnamecol);
+        ds->top_item = ds->nb_pending ? dired_get_cur_item(ds, s) : NULL;
+    }
+
     if (s->x1 == 0) {
         /* open file so that user can see it before it is selected */
         /* XXX: find a better solution (callback) */
@@ -1305,8 +2181,7 @@ void do_dired(EditState *s, int argval)
 
     ds = dired_get_state(e, 0);
     if (ds) {
-        e->offset = eb_goto_pos(e->b, dired_find_target(ds, target),
-                                ds->fnamecol);
+        dired_goto_target(ds, e, target);
     }
     /* modify active window */
     qs->active_window = e;
@@ -1330,7 +2205,7 @@ static CmdDef dired_commands[] = {
           "dired-unmark-backward", dired_mark, -1)
     CMD2( 's', KEY_NONE,
           "dired-sort", dired_sort, ESs,
-          "s{Sort order [nesdug+-r]: }|sortkey|")
+          "s{Sort order [nesadug+-r]: }|sortkey|")
     CMD2( 't', KEY_NONE,
           "dired-set-time-format", dired_set_time_format, ESi,
           "i{Time format: }[timeformat]")
@@ -1368,6 +2243,8 @@ static CmdDef dired_commands[] = {
           "dired-toggle-human", dired_toggle_human)
     CMD0( 'N', KEY_NONE,
           "dired-toggle-nflag", dired_toggle_nflag)
+    CMD0( 'z', KEY_NONE,
+          "dired-toggle-usage", dired_toggle_usage)
     CMD_DEF_END,
 };
 
@@ -182,6 +182,13 @@ static inline void dpy_flush(QEditScreen *s)
     s->dpy.dpy_flush(s);
 }
 
+static inline int dpy_is_user_input_pending(QEditScreen *s)
+{
+    if (s->dpy.dpy_is_user_input_pending)
+        return s->dpy.dpy_is_user_input_pending(s);
+    return 0;
+}
+
 static inline QEFont *open_font(QEditScreen *s,
                                 int style, int size)
 {
@@ -19,96 +19,685 @@
  */
 
 #include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
 
 #include "qe.h"
 #include "qfribidi.h"
 #include "variables.h"
 
-static int qe_skip_comments(EditState *s, int offset, int *offsetp)
-{
-    unsigned int buf[COLORED_MAX_LINE_SIZE];
-    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
-    int line_num, col_num, len, pos;
-    int offset0, offset1;
+/* compare-windows: line based diff engine.
+ * Lines are identified by a 64-bit hash of their contents, the edit
+ * script between the two line sequences is computed by diff_run() with
+ * Myers' algorithm using the linear space middle snake refinement.
+ * Lines that do not appear at all in the other buffer are discarded
+ * beforehand, and the search is cut short on very expensive inputs,
+ * which keeps the comparison interactive on files with millions of
+ * lines.
+ */
 
-    if (!s->colorize_func && !s->b->b_styles)
-        return 0;
+#define DIFF_IGNORE_SPACES    1
+#define DIFF_IGNORE_COMMENTS  2
 
-    eb_get_pos(s->b, &line_num, &col_num, offset);
-    offset0 = eb_goto_bol2(s->b, offset, &pos);
-    len = get_colorized_line(s, buf, countof(buf), sbuf,
-                             offset0, &offset1, line_num);
-    if (len > countof(buf))
-        len = countof(buf);
-    if (pos >= len)
-        return 0;
-    if (sbuf[pos] != QE_STYLE_COMMENT)
-        return 0;
-    while (pos < len && sbuf[pos] == QE_STYLE_COMMENT) {
-        offset = eb_next(s->b, offset);
-        pos++;
+#define DIFF_HASH_INIT   0xcbf29ce484222325ULL
+#define DIFF_HASH(h, c)  (((h) ^ (c)) * 0x100000001b3ULL)
+/* distinguishes a last line without a newline */
+#define DIFF_HASH_NOEOL  0x9e3779b97f4a7c15ULL
+
+typedef struct DiffHunk {
+    int start[2];   /* first line of the hunk in each buffer */
+    int count[2];   /* number of lines in each buffer */
+} DiffHunk;
+
+/* maximum number of line pairs of a hunk compared word by word at once */
+#define DIFF_WORDS_MAX_PAIRS  1024
+
+typedef struct DiffWordSpan {
+    int start, end;     /* changed characters of a line */
+} DiffWordSpan;
+
+/* intra-line differences of the paired lines of a hunk, computed when
+ * the hunk is first displayed, and their scratch buffers.
+ */
+typedef struct DiffWords {
+    unsigned int line[2][COLORED_MAX_LINE_SIZE];
+    unsigned int words[2][COLORED_MAX_LINE_SIZE];
+    int pos[2][COLORED_MAX_LINE_SIZE + 1];
+    u8 changed[2][COLORED_MAX_LINE_SIZE];
+    int hunk;           /* hunk of the cached line pairs or -1 */
+    int first, count;   /* cached line pairs of the hunk */
+    int *index[2];      /* first span of each line pair, count + 1 entries */
+    DiffWordSpan *spans[2];
+    int nb_spans[2], spans_size[2];
+} DiffWords;
+
+struct DiffState {
+    EditState *s[2];    /* compared windows */
+    EditBuffer *b[2];   /* compared buffers */
+    int valid;          /* cleared when either buffer is modified */
+    int flags;          /* DIFF_IGNORE_xxx flags used for the comparison */
+    DiffHunk *hunks;
+    int nb_hunks;
+    DiffWords *dw;
+};
+
+static DiffState diff_state;
+
+typedef struct DiffLines {
+    uint64_t *hash;
+    unsigned int *ids;
+    u8 *changed;
+    int nb_lines, size;
+} DiffLines;
+
+static int diff_add_line(DiffLines *dl, uint64_t h)
+{
+    if (dl->nb_lines >= dl->size) {
+        int size = dl->size + (dl->size >> 1) + 1024;
+        if (!qe_realloc(&dl->hash, size * sizeof(*dl->hash)))
+            return -1;
+        dl->size = size;
     }
-    *offsetp = offset;
-    return 1;
+    dl->hash[dl->nb_lines++] = h;
+    return 0;
 }
 
+static inline uint64_t diff_hash_char(uint64_t h, int c)
+{
+    char buf[MAX_CHAR_BYTES];
+    int i, len;
+
+    if (c < 0x80)
+        return DIFF_HASH(h, c);
+
+    /* hash the UTF-8 encoding to match the raw UTF-8 buffers */
+    len = utf8_encode(buf, c);
+    for (i = 0; i < len; i++)
+        h = DIFF_HASH(h, (u8)buf[i]);
+    return h;
+}
 
-static int qe_skip_spaces(EditState *s, int offset, int *offsetp)
+/* Compute the hash of each line of the buffer of window s */
+static int diff_hash_lines(DiffLines *dl, EditState *s, int flags)
 {
-    int offset0 = offset, offset1;
+    EditBuffer *b = s->b;
+    int ignore_spaces = flags & DIFF_IGNORE_SPACES;
+    uint64_t h = DIFF_HASH_INIT;
+    int offset, offset1, pending, c;
+
+    dl->nb_lines = 0;
+    pending = 0;
+    if ((flags & DIFF_IGNORE_COMMENTS) && (s->colorize_func || b->b_styles)) {
+        unsigned int buf[COLORED_MAX_LINE_SIZE];
+        QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+        int i, len, line_num;
+
+        for (offset = line_num = 0; offset < b->total_size; line_num++) {
+            len = get_colorized_line(s, buf, countof(buf), sbuf,
+                                     offset, &offset1, line_num);
+            if (len > countof(buf))
+                len = countof(buf);
+            h = DIFF_HASH_INIT;
+            for (i = 0; i < len; i++) {
+                c = buf[i];
+                if (sbuf[i] == QE_STYLE_COMMENT
+                ||  (ignore_spaces && qe_isspace(c)))
+                    continue;
+                h = diff_hash_char(h, c);
+            }
+            if (diff_add_line(dl, h))
+                return -1;
+            if (offset1 <= offset)
+                break;
+            offset = offset1;
+        }
+    } else
+    if (b->charset == &charset_utf8 && b->eol_type != EOL_MAC) {
+        /* fast path: hash the raw bytes */
+        u8 buf[65536];
+        int cr = 0, i, len;
+
+        for (offset = 0; offset < b->total_size; offset += len) {
+            len = eb_read(b, offset, buf, sizeof(buf));
+            if (len <= 0)
+                break;
+            for (i = 0; i < len; i++) {
+                c = buf[i];
+                if (c == '\n') {
+                    if (diff_add_line(dl, h))
+                        return -1;
+                    h = DIFF_HASH_INIT;
+                    pending = cr = 0;
+                    continue;
+                }
+                pending = 1;
+                if (cr) {
+                    /* not part of a CRLF sequence */
+                    cr = 0;
+                    if (!ignore_spaces)
+                        h = DIFF_HASH(h, '\r');
+                }
+                if (c == '\r' && b->eol_type == EOL_DOS) {
+                    cr = 1;
+                    continue;
+                }
+                if (ignore_spaces && qe_isspace(c))
+                    continue;
+                h = DIFF_HASH(h, c);
+            }
+        }
+        if (cr && !ignore_spaces)
+            h = DIFF_HASH(h, '\r');
+    } else {
+        for (offset = 0; offset < b->total_size;) {
+            c = eb_nextc(b, offset, &offset);
+            if (c == '\n') {
+                if (diff_add_line(dl, h))
+                    return -1;
+                h = DIFF_HASH_INIT;
+                pending = 0;
+                continue;
+            }
+            pending = 1;
+            if (ignore_spaces && qe_isspace(c))
+                continue;
+            h = diff_hash_char(h, c);
+        }
+    }
+    if (pending && diff_add_line(dl, h))
+        return -1;
+    if (dl->nb_lines > 0 && eb_prevc(b, b->total_size, &offset1) != '\n')
+        dl->hash[dl->nb_lines - 1] ^= DIFF_HASH_NOEOL;
+    return 0;
+}
 
-    while (offset < s->b->total_size
-        && qe_isspace(eb_nextc(s->b, offset, &offset1))) {
-        offset = offset1;
+/* Number the distinct lines of both buffers and count their
+ * occurrences in each buffer into count[2 * id + side].
+ */
+static int *diff_index_lines(DiffLines *dl)
+{
+    uint64_t *id_hash;
+    unsigned int *table;
+    int *count;
+    int n, size, k, i, nb_ids, id;
+    unsigned int slot;
+
+    n = dl[0].nb_lines + dl[1].nb_lines;
+    for (size = 1024; size < 2 * n; size <<= 1)
+        continue;
+    table = qe_malloc_array(unsigned int, size);
+    id_hash = qe_malloc_array(uint64_t, n + 1);
+    count = qe_mallocz_array(int, 2 * n + 2);
+    if (!table || !id_hash || !count) {
+        qe_free(&table);
+        qe_free(&id_hash);
+        qe_free(&count);
+        return NULL;
+    }
+    memset(table, 0xff, size * sizeof(*table));
+    nb_ids = 0;
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < dl[k].nb_lines; i++) {
+            uint64_t h = dl[k].hash[i];
+
+            slot = (unsigned int)((h * 0x9e3779b97f4a7c15ULL) >> 32);
+            for (;;) {
+                slot &= size - 1;
+                id = table[slot];
+                if (id < 0) {
+                    id = table[slot] = nb_ids++;
+                    id_hash[id] = h;
+                    break;
+                }
+                if (id_hash[id] == h)
+                    break;
+                slot++;
+            }
+            dl[k].ids[i] = id;
+            count[2 * id + k]++;
+        }
     }
-    if (offset != offset0) {
-        *offsetp = offset;
-        return 1;
+    qe_free(&table);
+    qe_free(&id_hash);
+    return count;
+}
+
+static int diff_add_hunk(DiffState *ds, int *nb_allocated,
+                         int start0, int count0, int start1, int count1)
+{
+    DiffHunk *hp;
+
+    if (ds->nb_hunks >= *nb_allocated) {
+        int n = *nb_allocated + (*nb_allocated >> 1) + 256;
+        if (!qe_realloc(&ds->hunks, n * sizeof(*ds->hunks)))
+            return -1;
+        *nb_allocated = n;
     }
+    hp = &ds->hunks[ds->nb_hunks++];
+    hp->start[0] = start0;
+    hp->count[0] = count0;
+    hp->start[1] = start1;
+    hp->count[1] = count1;
     return 0;
 }
 
-static void compare_resync(EditState *s1, EditState *s2,
-                           int save1, int save2,
-                           int *offset1_ptr, int *offset2_ptr)
+/* Compute the list of differing hunks between the compared buffers */
+static int diff_compute(DiffState *ds)
 {
-    int pos1, off1, pos2, off2;
-    int ch1, ch2;
-
-    off1 = save1;
-    off2 = save2;
-    /* try skipping blanks */
-    while (qe_isblank(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
-        continue;
-    while (qe_isblank(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
-        continue;
-    /* XXX: should try and detect a simple insertion first
-       by comparing from the end of both lines */
-    if (ch1 != ch2) {
-        /* try skipping current words and subsequent blanks */
-        off1 = pos1;
-        off2 = pos2;
-        while (!qe_isspace(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
-            continue;
-        while (!qe_isspace(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
-            continue;
-        while (qe_isblank(ch1 = eb_nextc(s1->b, pos1 = off1, &off1)))
-            continue;
-        while (qe_isblank(ch2 = eb_nextc(s2->b, pos2 = off2, &off2)))
+    DiffLines dl[2];
+    unsigned int *fa[2] = { NULL, NULL };
+    int *fx[2] = { NULL, NULL };
+    u8 *fc[2] = { NULL, NULL };
+    int fn[2];
+    int *count = NULL;
+    int k, i, j, n0, n1, start0, start1, nb_allocated;
+    int ret = -1;
+
+    memset(dl, 0, sizeof(dl));
+    ds->nb_hunks = 0;
+    for (k = 0; k < 2; k++) {
+        if (diff_hash_lines(&dl[k], ds->s[k], ds->flags))
+            goto fail;
+        n0 = dl[k].nb_lines + 1;
+        dl[k].ids = qe_malloc_array(unsigned int, n0);
+        dl[k].changed = qe_malloc_array(u8, n0);
+        fa[k] = qe_malloc_array(unsigned int, n0);
+        fx[k] = qe_malloc_array(int, n0);
+        fc[k] = qe_malloc_array(u8, n0);
+        if (!dl[k].ids || !dl[k].changed || !fa[k] || !fx[k] || !fc[k])
+            goto fail;
+    }
+    count = diff_index_lines(dl);
+    if (!count)
+        goto fail;
+
+    /* lines absent from the other buffer cannot match: discard them */
+    for (k = 0; k < 2; k++) {
+        fn[k] = 0;
+        for (i = 0; i < dl[k].nb_lines; i++) {
+            unsigned int id = dl[k].ids[i];
+            if (count[2 * id + 1 - k]) {
+                dl[k].changed[i] = 0;
+                fa[k][fn[k]] = id;
+                fx[k][fn[k]] = i;
+                fn[k]++;
+            } else {
+                dl[k].changed[i] = 1;
+            }
+        }
+    }
+    if (diff_run(fa[0], fn[0], fa[1], fn[1], fc[0], fc[1]))
+        goto fail;
+    for (k = 0; k < 2; k++) {
+        for (j = 0; j < fn[k]; j++)
+            dl[k].changed[fx[k][j]] = fc[k][j];
+    }
+
+    /* collect the hunks */
+    n0 = dl[0].nb_lines;
+    n1 = dl[1].nb_lines;
+    nb_allocated = 0;
+    for (i = j = 0; i < n0 || j < n1;) {
+        if (i < n0 && j < n1 && !dl[0].changed[i] && !dl[1].changed[j]) {
+            i++;
+            j++;
             continue;
-        if (ch1 != ch2) {
-            /* Try to resync from end of line */
-            pos1 = eb_goto_eol(s1->b, save1);
-            pos2 = eb_goto_eol(s2->b, save2);
+        }
+        start0 = i;
+        start1 = j;
+        while (i < n0 && dl[0].changed[i])
+            i++;
+        while (j < n1 && dl[1].changed[j])
+            j++;
+        if (i == start0 && j == start1) {
+            /* unbalanced matches, should not happen */
+            i = n0;
+            j = n1;
+        }
+        if (diff_add_hunk(ds, &nb_allocated, start0, i - start0,
+                          start1, j - start1))
+            goto fail;
+    }
+    ret = 0;
+
+ fail:
+    for (k = 0; k < 2; k++) {
+        qe_free(&dl[k].hash);
+        qe_free(&dl[k].ids);
+        qe_free(&dl[k].changed);
+        qe_free(&fa[k]);
+        qe_free(&fx[k]);
+        qe_free(&fc[k]);
+    }
+    qe_free(&count);
+    return ret;
+}
+
+static void diff_callback(qe__unused__ EditBuffer *b, void *opaque,
+                          qe__unused__ int arg, qe__unused__ enum LogOperation op,
+                          qe__unused__ int offset, qe__unused__ int size)
+{
+    DiffState *ds = opaque;
+
+    /* the hunks are stale, stop highlighting them */
+    ds->valid = 0;
+}
+
+static void diff_reset(DiffState *ds)
+{
+    int k;
+
+    for (k = 0; k < 2; k++) {
+        if (check_window(&ds->s[k]) && ds->s[k]->diff_state == ds)
+            ds->s[k]->diff_state = NULL;
+        if (check_buffer(&ds->b[k]) && (k == 0 || ds->b[1] != ds->b[0]))
+            eb_free_callback(ds->b[k], diff_callback, ds);
+        ds->s[k] = NULL;
+        ds->b[k] = NULL;
+    }
+    ds->valid = 0;
+    ds->nb_hunks = 0;
+    qe_free(&ds->hunks);
+    if (ds->dw)
+        ds->dw->hunk = -1;
+}
+
+void diff_free(void)
+{
+    DiffWords *dw = diff_state.dw;
+    int k;
+
+    diff_reset(&diff_state);
+    if (dw) {
+        for (k = 0; k < 2; k++) {
+            qe_free(&dw->index[k]);
+            qe_free(&dw->spans[k]);
+        }
+        qe_free(&diff_state.dw);
+    }
+}
+
+/* Stop highlighting differences in window s and the window it is
+ * compared with.
+ */
+void diff_clear_hilite(EditState *s)
+{
+    DiffState *ds = s->diff_state;
+    int k;
+
+    if (ds) {
+        for (k = 0; k < 2; k++) {
+            if (check_window(&ds->s[k]) && ds->s[k]->diff_state == ds)
+                ds->s[k]->diff_state = NULL;
+        }
+    }
+    s->diff_state = NULL;
+}
+
+/* Compare the buffers of windows s1 and s2, reusing the previous
+ * comparison if they were not modified since.
+ */
+static DiffState *diff_update(EditState *s1, EditState *s2)
+{
+    QEmacsState *qs = s1->qe_state;
+    DiffState *ds = &diff_state;
+    int flags = 0;
+
+    if (qs->ignore_spaces)
+        flags |= DIFF_IGNORE_SPACES;
+    if (qs->ignore_comments)
+        flags |= DIFF_IGNORE_COMMENTS;
+
+    if (ds->valid && ds->flags == flags
+    &&  check_window(&ds->s[0]) && check_window(&ds->s[1])
+    &&  ds->s[0]->b == ds->b[0] && ds->s[1]->b == ds->b[1]
+    &&  ((ds->s[0] == s1 && ds->s[1] == s2)
+    ||   (ds->s[0] == s2 && ds->s[1] == s1))) {
+        s1->diff_state = s2->diff_state = ds;
+        return ds;
+    }
+    diff_reset(ds);
+    ds->s[0] = s1;
+    ds->s[1] = s2;
+    ds->b[0] = s1->b;
+    ds->b[1] = s2->b;
+    ds->flags = flags;
+    if (diff_compute(ds)) {
+        put_status(s1, "Not enough memory to compare windows");
+        diff_reset(ds);
+        return NULL;
+    }
+    eb_add_callback(ds->b[0], diff_callback, ds, 0);
+    if (ds->b[1] != ds->b[0])
+        eb_add_callback(ds->b[1], diff_callback, ds, 0);
+    ds->valid = 1;
+    s1->diff_state = s2->diff_state = ds;
+    return ds;
+}
+
+/* Move both compared windows to the next or previous hunk from the
+ * current line of window s. If skip is not set, a hunk at the current
+ * line is selected.
+ */
+static void diff_goto_hunk(EditState *s, DiffState *ds, int dir, int skip)
+{
+    EditState *e1, *e2;
+    const DiffHunk *hp;
+    int k, i, line, col, offset1, offset2, next1, next2;
+
+    k = (s == ds->s[1]);
+    e1 = ds->s[k];
+    e2 = ds->s[1 - k];
+    if (!ds->nb_hunks) {
+        put_status(s, "No difference");
+        return;
+    }
+    eb_get_pos(e1->b, &line, &col, e1->offset);
+    if (dir > 0) {
+        for (i = 0; i < ds->nb_hunks; i++) {
+            hp = &ds->hunks[i];
+            if (skip ? hp->start[k] > line :
+                hp->start[k] + max(hp->count[k], 1) > line)
+                break;
+        }
+        if (i == ds->nb_hunks) {
+            put_status(s, "No more differences");
+            return;
+        }
+    } else {
+        for (i = ds->nb_hunks; i-- > 0;) {
+            if (ds->hunks[i].start[k] < line)
+                break;
+        }
+        if (i < 0) {
+            put_status(s, "No previous difference");
+            return;
+        }
+    }
+    hp = &ds->hunks[i];
+    offset1 = eb_goto_pos(e1->b, hp->start[k], 0);
+    offset2 = eb_goto_pos(e2->b, hp->start[1 - k], 0);
+    if (hp->count[0] && hp->count[1]) {
+        /* move to the first difference on the line */
+        while (offset1 < e1->b->total_size && offset2 < e2->b->total_size) {
+            int c1 = eb_nextc(e1->b, offset1, &next1);
+            int c2 = eb_nextc(e2->b, offset2, &next2);
+            if (c1 != c2 || c1 == '\n')
+                break;
+            offset1 = next1;
+            offset2 = next2;
+        }
+    }
+    e1->offset = offset1;
+    e2->offset = offset2;
+    put_status(s, "Difference %d/%d: @@ -%d,%d +%d,%d @@",
+               i + 1, ds->nb_hunks,
+               hp->start[k] + (hp->count[k] != 0), hp->count[k],
+               hp->start[1 - k] + (hp->count[1 - k] != 0), hp->count[1 - k]);
+}
+
+/* Split a line into words, runs of blanks and other characters */
+static int diff_split_words(const unsigned int *buf, int len,
+                            unsigned int *words, int *pos)
+{
+    uint64_t h;
+    int i, j, n;
+
+    for (i = n = 0; i < len; n++) {
+        j = i++;
+        if (qe_isword(buf[j])) {
+            while (i < len && qe_isword(buf[i]))
+                i++;
+        } else
+        if (qe_isblank(buf[j])) {
+            while (i < len && qe_isblank(buf[i]))
+                i++;
+        }
+        for (h = DIFF_HASH_INIT; j < i; j++)
+            h = DIFF_HASH(h, buf[j]);
+        words[n] = (unsigned int)(h ^ (h >> 32));
+        pos[n] = i;
+    }
+    return n;
+}
+
+static int diff_add_word_span(DiffWords *dw, int k, int start, int end)
+{
+    DiffWordSpan *sp;
+
+    if (dw->nb_spans[k] > 0) {
+        sp = &dw->spans[k][dw->nb_spans[k] - 1];
+        if (sp->end == start) {
+            /* merge adjacent changed words */
+            sp->end = end;
+            return 0;
         }
     }
-    while (pos1 > save1 && pos2 > save2
-       &&  eb_prevc(s1->b, pos1, &off1) == eb_prevc(s2->b, pos2, &off2)) {
-           pos1 = off1;
-           pos2 = off2;
+    if (dw->nb_spans[k] >= dw->spans_size[k]) {
+        int n = dw->spans_size[k] + (dw->spans_size[k] >> 1) + 256;
+        if (!qe_realloc(&dw->spans[k], n * sizeof(*dw->spans[k])))
+            return -1;
+        dw->spans_size[k] = n;
+    }
+    sp = &dw->spans[k][dw->nb_spans[k]++];
+    sp->start = start;
+    sp->end = end;
+    return 0;
+}
+
+/* Compare word by word the paired lines of hunk h from line pair
+ * `first`, and cache the changed spans of both sides.
+ */
+static int diff_words_compute(DiffState *ds, DiffWords *dw, int h, int first)
+{
+    const DiffHunk *hp = &ds->hunks[h];
+    int offset[2], len[2], nw[2];
+    int k, n, p, i, start, next;
+
+    dw->hunk = -1;
+    n = min(min(hp->count[0], hp->count[1]) - first, DIFF_WORDS_MAX_PAIRS);
+    for (k = 0; k < 2; k++) {
+        if (!dw->index[k]
+        &&  !(dw->index[k] = qe_malloc_array(int, DIFF_WORDS_MAX_PAIRS + 1)))
+            return -1;
+        dw->nb_spans[k] = 0;
+        offset[k] = eb_goto_pos(ds->b[k], hp->start[k] + first, 0);
+    }
+    for (p = 0; p < n; p++) {
+        for (k = 0; k < 2; k++) {
+            len[k] = eb_get_line(ds->b[k], dw->line[k], countof(dw->line[k]),
+                                 offset[k], &next);
+            nw[k] = diff_split_words(dw->line[k], len[k],
+                                     dw->words[k], dw->pos[k]);
+            offset[k] = eb_next_line(ds->b[k], offset[k]);
+        }
+        if (diff_run(dw->words[0], nw[0], dw->words[1], nw[1],
+                     dw->changed[0], dw->changed[1]))
+            return -1;
+        for (k = 0; k < 2; k++) {
+            dw->index[k][p] = dw->nb_spans[k];
+            for (i = start = 0; i < nw[k]; start = dw->pos[k][i++]) {
+                if (dw->changed[k][i]
+                &&  diff_add_word_span(dw, k, start, dw->pos[k][i]))
+                    return -1;
+            }
+        }
+    }
+    for (k = 0; k < 2; k++)
+        dw->index[k][n] = dw->nb_spans[k];
+    dw->hunk = h;
+    dw->first = first;
+    dw->count = n;
+    return 0;
+}
+
+/* Highlight the line of window s if it belongs to a hunk of the active
+ * comparison, and the changed words if it is paired with a line of the
+ * other buffer.
+ */
+void diff_colorize_line(EditState *s, unsigned int *buf, int len,
+                        QETermStyle *sbuf, int line_num)
+{
+    DiffState *ds = s->diff_state;
+    const DiffHunk *hp;
+    const DiffWordSpan *sp, *sp_end;
+    DiffWords *dw;
+    int k, h, lo, hi, mid, pair, i, j;
+
+    if (!ds || !ds->valid)
+        return;
+    if (s == ds->s[0] && s->b == ds->b[0])
+        k = 0;
+    else
+    if (s == ds->s[1] && s->b == ds->b[1])
+        k = 1;
+    else
+        return;
+
+    /* find the last hunk starting at or before line_num */
+    for (lo = 0, hi = ds->nb_hunks; lo < hi;) {
+        mid = (lo + hi) >> 1;
+        if (ds->hunks[mid].start[k] <= line_num)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return;
+    h = lo - 1;
+    hp = &ds->hunks[h];
+    if (line_num >= hp->start[k] + hp->count[k])
+        return;
+
+    for (i = 0; i <= len; i++)
+        sbuf[i] = QE_STYLE_DIFF_HILITE;
+
+    pair = line_num - hp->start[k];
+    if (!s->qe_state->compare_words
+    ||  pair >= hp->count[1 - k]
+    ||  !check_buffer(&ds->b[1 - k]))
+        return;
+
+    if (!ds->dw) {
+        if (!(ds->dw = qe_mallocz(DiffWords)))
+            return;
+        ds->dw->hunk = -1;
+    }
+    dw = ds->dw;
+    if (dw->hunk != h || pair < dw->first || pair >= dw->first + dw->count) {
+        /* very large hunks are compared in slices around the line */
+        int first = pair < DIFF_WORDS_MAX_PAIRS ? 0 :
+            pair - DIFF_WORDS_MAX_PAIRS / 2;
+        if (diff_words_compute(ds, dw, h, first))
+            return;
+    }
+    pair -= dw->first;
+    sp = dw->spans[k] + dw->index[k][pair];
+    sp_end = dw->spans[k] + dw->index[k][pair + 1];
+    for (; sp < sp_end; sp++) {
+        for (j = sp->start; j < sp->end && j < len; j++)
+            sbuf[j] = QE_STYLE_DIFF_WORD_HILITE;
     }
-    *offset1_ptr = pos1;
-    *offset2_ptr = pos2;
 }
 
 void do_compare_windows(EditState *s, int argval)
@@ -116,10 +705,7 @@ void do_compare_windows(EditState *s, int argval)
     QEmacsState *qs = s->qe_state;
     EditState *s1;
     EditState *s2;
-    int offset1, offset2, size1, size2, ch1, ch2;
-    int tries, resync = 0;
-    char buf1[MAX_CHAR_BYTES + 2], buf2[MAX_CHAR_BYTES + 2];
-    const char *comment = "";
+    DiffState *ds;
 
     s1 = s;
     /* Should use same internal function as for next_window */
@@ -142,75 +728,27 @@ void do_compare_windows(EditState *s, int argval)
             qs->ignore_comments ^= 1;
     }
 
-    size1 = s1->b->total_size;
-    size2 = s2->b->total_size;
-
-    if (qs->last_cmd_func == (CmdFunc)do_compare_windows) {
-        resync = 1;
+    ds = diff_update(s1, s2);
+    if (ds) {
+        /* repeated invocations move to the next difference */
+        diff_goto_hunk(s1, ds, 1,
+                       qs->last_cmd_func == (CmdFunc)do_compare_windows);
     }
+}
 
-    for (tries = 0;; resync = 0) {
-
-        if (++tries >= 100000) {
-            tries = 0;
-            //if (check_input())
-            //    return;
-        }
+void do_compare_next_difference(EditState *s, int dir)
+{
+    DiffState *ds = s->diff_state;
+    EditState *e;
 
-        if (s1->offset >= size1) {
-            offset1 = s1->offset;
-            ch1 = EOF;
-        } else {
-            ch1 = eb_nextc(s1->b, s1->offset, &offset1);
-        }
-        if (s2->offset >= size2) {
-            offset2 = s2->offset;
-            ch2 = EOF;
-        } else {
-            ch2 = eb_nextc(s2->b, s2->offset, &offset2);
-        }
-        if (ch1 != ch2) {
-            if (qs->ignore_spaces) {
-                /* UTF-8 issue */
-                if (qe_isspace(ch1) || qe_isspace(ch2)) {
-                    qe_skip_spaces(s1, s1->offset, &s1->offset);
-                    qe_skip_spaces(s2, s2->offset, &s2->offset);
-                    if (!*comment)
-                        comment = "Skipped spaces, ";
-                    continue;
-                }
-            }
-            if (qs->ignore_comments) {
-                if (qe_skip_comments(s1, s1->offset, &s1->offset) |
-                    qe_skip_comments(s2, s2->offset, &s2->offset)) {
-                    comment = "Skipped comments, ";
-                    continue;
-                }
-            }
-            if (ch1 == EOF || ch2 == EOF) {
-                put_status(s, "%sExtra characters", comment);
-                break;
-            }
-            if (resync) {
-                int save1 = s1->offset, save2 = s2->offset;
-                compare_resync(s1, s2, save1, save2, &s1->offset, &s2->offset);
-                put_status(s, "Skipped %d and %d bytes",
-                           s1->offset - save1, s2->offset - save2);
-                break;
-            }
-            put_status(s, "%sDifference: '%s' [0x%02X] <-> '%s' [0x%02X]", comment,
-                       utf8_char_to_string(buf1, ch1), ch1,
-                       utf8_char_to_string(buf2, ch2), ch2);
-            break;
-        }
-        if (ch1 != EOF) {
-            s1->offset = offset1;
-            s2->offset = offset2;
-            continue;
-        }
-        put_status(s, "%sNo difference", comment);
-        break;
+    if (!ds || (s != ds->s[0] && s != ds->s[1])
+    ||  !(e = check_window(&ds->s[s == ds->s[0]]))) {
+        put_status(s, "No windows compared");
+        return;
     }
+    ds = diff_update(s, e);
+    if (ds)
+        diff_goto_hunk(s, ds, dir, 1);
 }
 
 void do_compare_files(EditState *s, const char *filename, int bflags)
@@ -220,6 +758,7 @@ void do_compare_files(EditState *s, const char *filename, int bflags)
     int pathlen, parent_pathlen;
     const char *tail;
     EditState *e;
+    DiffState *ds;
 
     pathlen = get_basename_offset(filename);
     get_default_path(s->b, s->offset, dir, sizeof(dir));
@@ -258,10 +797,13 @@ void do_compare_files(EditState *s, const char *filename, int bflags)
 
     do_find_file(s, filename, bflags);
     do_delete_other_windows(s, 0);
-    e = qe_split_window(s, 50, SW_STACKED);
+    e = qe_split_window(s, 50, SW_SIDE_BY_SIDE);
     if (e) {
         s->qe_state->active_window = e;
         do_find_file(e, buf, bflags);
+        ds = diff_update(s, e);
+        if (ds)
+            diff_goto_hunk(s, ds, 1, 0);
     }
 }
 
@@ -846,6 +1388,7 @@ static int qe_unregister_binding1(unsigned int *keys, int nb_keys, ModeDef *m)
             p = *lp;
             *lp = (*lp)->next;
             qe_free(&p);
+            qs->key_generation++;
             return 1;
         }
         lp = &(*lp)->next;
@@ -1553,15 +2096,51 @@ static void do_describe_screen(EditState *e, int argval)
 
 /*---------------- buffer contents sorting ----------------*/
 
-struct chunk_ctx {
+/* Lines are sorted on keys extracted once per line in a form that
+ * compares with memcmp(): characters are folded and filtered according
+ * to the flags and encoded in UTF-8, numbers are encoded as '0', the
+ * count of significant digits and the digits. The keys are sorted in
+ * parallel parts that are merged. Beyond `sort-memory-limit`, sorted
+ * runs are spilled to temporary files and merged.
+ */
+
+#define SORT_MIN_PART  16384    /* minimum lines sorted by a thread */
+#define SORT_MAX_PARTS 16
+#define SORT_OUTPUT_SIZE  65536
+
+typedef struct SortItem {
+    uint64_t prefix;    /* first 8 bytes of the key, big endian */
+    int start, end;     /* line or paragraph, without the newline */
+    unsigned int key, key_len;  /* key offset in the arena and length */
+} SortItem;
+
+typedef struct SortRun {
+    FILE *f;
+    SortItem item;      /* current item, key is in `key_buf` */
+    u8 *key_buf;
+    unsigned int key_size;
+} SortRun;
+
+typedef struct SortContext {
     EditBuffer *b;
     int flags;
     int col;
-};
-
-struct chunk {
-    int start, end;
-};
+    u8 *keys;           /* key arena */
+    size_t keys_len, keys_size;
+    SortItem *items, *tmp;
+    int nb_items, items_size;
+    int nb_parts;
+    int part[SORT_MAX_PARTS + 1];
+    SortRun *runs;
+    int nb_runs;
+    u8 *text;           /* copy of the sorted span when sorting in memory */
+    int text_start;
+    u8 *out;            /* output staging buffer */
+    int out_len;
+    int out_start, out_end;     /* sorted lines inserted after the span */
+    int nl_len;
+    char nl[MAX_CHAR_BYTES + 1];    /* encoded newline */
+} SortContext;
 
 static int eb_skip_to_basename(EditBuffer *b, int pos) {
     int base = pos;
@@ -1573,149 +2152,412 @@ static int eb_skip_to_basename(EditBuffer *b, int pos) {
     return base;
 }
 
-static int chunk_cmp(void *vp0, const void *vp1, const void *vp2) {
-    const struct chunk_ctx *cp = vp0;
-    const struct chunk *p1 = vp1;
-    const struct chunk *p2 = vp2;
-    int pos1, pos2, col;
+static int sort_key_cmp(int flags, const u8 *k1, unsigned int len1, int start1,
+                        const u8 *k2, unsigned int len2, int start2)
+{
+    int res = memcmp(k1, k2, min(len1, len2));
 
-    if (cp->flags & SF_REVERSE) {
-        p1 = vp2;
-        p2 = vp1;
-    }
+    if (!res)
+        res = (len1 > len2) - (len1 < len2);
+    /* make sort stable by comparing offsets of equal elements */
+    if (!res)
+        res = (start1 > start2) - (start1 < start2);
+    return (flags & SF_REVERSE) ? -res : res;
+}
 
-    pos1 = p1->start;
-    pos2 = p2->start;
-    if (cp->flags & SF_BASENAME) {
-        pos1 = eb_skip_to_basename(cp->b, pos1);
-        pos2 = eb_skip_to_basename(cp->b, pos2);
+static int sort_item_cmp(void *vp0, const void *vp1, const void *vp2) {
+    const SortContext *sc = vp0;
+    const SortItem *p1 = vp1;
+    const SortItem *p2 = vp2;
+
+    if (p1->prefix != p2->prefix) {
+        int res = (p1->prefix < p2->prefix) ? -1 : 1;
+        return (sc->flags & SF_REVERSE) ? -res : res;
     }
-    if (cp->col) {
-        for (col = cp->col; col-- > 0 && pos1 < p1->end;)
-            eb_nextc(cp->b, pos1, &pos1);
-        for (col = cp->col; col-- > 0 && pos2 < p2->end;)
-            eb_nextc(cp->b, pos2, &pos2);
+    return sort_key_cmp(sc->flags, sc->keys + p1->key, p1->key_len, p1->start,
+                        sc->keys + p2->key, p2->key_len, p2->start);
+}
+
+static int sort_reserve(SortContext *sc, size_t size)
+{
+    if (sc->keys_len + size > sc->keys_size) {
+        size_t n = max(sc->keys_size + (sc->keys_size >> 1), 4096);
+        while (n < sc->keys_len + size)
+            n += n >> 1;
+        if (n > UINT_MAX || !qe_realloc(&sc->keys, n))
+            return -1;
+        sc->keys_size = n;
     }
-    for (;;) {
-        int c1 = 0, c2 = 0;
-        while (pos1 < p1->end) {
-            c1 = eb_nextc(cp->b, pos1, &pos1);
-            if (!(cp->flags & SF_DICT) || qe_isalpha(c1))
-                break;
-            c1 = 0;
-        }
-        while (pos2 < p2->end) {
-            c2 = eb_nextc(cp->b, pos2, &pos2);
-            if (!(cp->flags & SF_DICT) || qe_isalpha(c2))
-                break;
-            c2 = 0;
-        }
-        if ((cp->flags & SF_NUMBER) && qe_isdigit(c1) && qe_isdigit(c2)) {
-            unsigned long long n1 = c1 - '0';
-            unsigned long long n2 = c2 - '0';
-            c1 = 0;
-            while (pos1 < p1->end) {
-                c1 = eb_nextc(cp->b, pos1, &pos1);
-                if (!qe_isdigit(c1))
+    return 0;
+}
+
+/* append the key of the line at [start, end) to the arena */
+static int sort_add_item(SortContext *sc, int start, int end)
+{
+    EditBuffer *b = sc->b;
+    int flags = sc->flags;
+    int pos = start, col, c, i, n;
+    SortItem *ip;
+    u8 *p;
+
+    if (sc->nb_items >= sc->items_size) {
+        n = max(sc->items_size + (sc->items_size >> 1), 256);
+        if (!qe_realloc(&sc->items, n * sizeof(*sc->items)))
+            return -1;
+        sc->items_size = n;
+    }
+    ip = &sc->items[sc->nb_items];
+    ip->start = start;
+    ip->end = end;
+    ip->key = sc->keys_len;
+
+    if (flags & SF_BASENAME)
+        pos = eb_skip_to_basename(b, pos);
+    for (col = sc->col; col-- > 0 && pos < end;)
+        eb_nextc(b, pos, &pos);
+    while (pos < end) {
+        c = eb_nextc(b, pos, &pos);
+        if ((flags & SF_DICT) && !qe_isalpha(c))
+            continue;
+        if (sort_reserve(sc, MAX_CHAR_BYTES + 2) < 0)
+            return -1;
+        if ((flags & SF_NUMBER) && qe_isdigit(c)) {
+            sc->keys[sc->keys_len++] = '0';
+            i = sc->keys_len++;
+            for (n = 0;;) {
+                /* leading zeros are not significant */
+                if (n > 0 || c != '0') {
+                    if (sort_reserve(sc, MAX_CHAR_BYTES + 1) < 0)
+                        return -1;
+                    sc->keys[sc->keys_len++] = c;
+                    n++;
+                }
+                if (pos >= end) {
+                    c = 0;
                     break;
-                n1 = n1 * 10 + c1 - '0';
-                c1 = 0;
-            }
-            c2 = 0;
-            while (pos2 < p2->end) {
-                c2 = eb_nextc(cp->b, pos2, &pos2);
-                if (!qe_isdigit(c2))
+                }
+                c = eb_nextc(b, pos, &pos);
+                if (!qe_isdigit(c))
                     break;
-                n2 = n2 * 10 + c2 - '0';
-                c2 = 0;
             }
-            if (n1 < n2)
-                return -1;
-            if (n1 > n2)
-                return +1;
+            sc->keys[i] = min(n, 255);
+            /* the character after the number is not filtered */
+            if (!c)
+                break;
+        }
+        if (c == 0) {
+            /* a null character compares as the end of the line */
+            break;
         }
-        if (cp->flags & SF_FOLD) {
+        if (flags & SF_FOLD) {
             // XXX: should support unicode case folding
-            c1 = qe_toupper(c1);
-            c2 = qe_toupper(c2);
+            c = qe_toupper(c);
         }
-        if (c1 < c2)
-            return -1;
-        if (c1 > c2)
-            return +1;
-        if (c1 == 0)
-            break;
+        sc->keys_len += utf8_encode((char *)sc->keys + sc->keys_len, c);
     }
-    /* make sort stable by comparing offsets of equal elements */
-    return (p1->start > p2->start) - (p1->start < p2->start);
+    ip->key_len = sc->keys_len - ip->key;
+    p = sc->keys + ip->key;
+    for (ip->prefix = 0, i = 0; i < 8; i++) {
+        ip->prefix = (ip->prefix << 8) | (i < (int)ip->key_len ? p[i] : 0);
+    }
+    sc->nb_items++;
+    return 0;
 }
 
-static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags) {
-    struct chunk_ctx ctx;
-    EditBuffer *b1;
-    int p1 = *pp1, p2 = *pp2;
-    int i, offset, line1, line2, col1, col2, line, col, lines;
-    struct chunk *chunk_array;
+static void sort_part(void *opaque, int i)
+{
+    SortContext *sc = opaque;
 
-    if (p1 > p2) {
-        int tmp = p1;
-        p1 = p2;
-        p2 = tmp;
-    }
-    ctx.b = b;
-    ctx.flags = flags;
-    ctx.col = 0;
-    eb_get_pos(b, &line1, &col1, p1); /* line1 is included */
-    eb_get_pos(b, &line2, &col2, p2); /* line2 is excluded */
-    if (col1 > 0) {
-        p1 = eb_goto_bol(b, p1);
-    }
-    if (col2 > 0) { /* include incomplete end line */
-        line2++;
-        p2 = eb_next_line(b, p2);
-    }
-    /* XXX: should also support rectangular selection */
-    if (flags & SF_COLUMN) {
-        eb_get_pos(b, &line, &col, cur_offset);
-        ctx.col = col ? col : col1;
+    qe_qsort_r(sc->items + sc->part[i], sc->part[i + 1] - sc->part[i],
+               sizeof(*sc->items), sc, sort_item_cmp);
+}
+
+/* merge parts 2*i and 2*i+1 into the temporary array */
+static void sort_merge_parts(void *opaque, int i)
+{
+    SortContext *sc = opaque;
+    int a = sc->part[2 * i], a_end = sc->part[min(2 * i + 1, sc->nb_parts)];
+    int b = a_end, b_end = sc->part[min(2 * i + 2, sc->nb_parts)];
+    SortItem *dest = sc->tmp + a;
+
+    while (a < a_end && b < b_end) {
+        if (sort_item_cmp(sc, &sc->items[b], &sc->items[a]) < 0)
+            *dest++ = sc->items[b++];
+        else
+            *dest++ = sc->items[a++];
     }
-    lines = line2 - line1;
-    chunk_array = qe_malloc_array(struct chunk, lines);
-    if (!chunk_array) {
+    while (a < a_end)
+        *dest++ = sc->items[a++];
+    while (b < b_end)
+        *dest++ = sc->items[b++];
+}
+
+static int sort_items(SortContext *sc)
+{
+    SortItem *tmp;
+    int i, n;
+
+    n = clamp(sc->nb_items / SORT_MIN_PART, 1, SORT_MAX_PARTS);
+    for (i = 0; i <= n; i++)
+        sc->part[i] = (int)((long long)sc->nb_items * i / n);
+    sc->nb_parts = n;
+    qe_job_parallel(n, sort_part, sc);
+    if (n == 1)
+        return 0;
+
+    if (!qe_realloc(&sc->tmp, sc->nb_items * sizeof(*sc->tmp)))
         return -1;
+    while (sc->nb_parts > 1) {
+        n = (sc->nb_parts + 1) / 2;
+        qe_job_parallel(n, sort_merge_parts, sc);
+        tmp = sc->items;
+        sc->items = sc->tmp;
+        sc->tmp = tmp;
+        for (i = 0; i <= n; i++)
+            sc->part[i] = sc->part[min(2 * i, sc->nb_parts)];
+        sc->nb_parts = n;
+    }
+    qe_free(&sc->tmp);
+    return 0;
+}
+
+/* sort the pending items and write them to a temporary file */
+static int sort_spill_run(SortContext *sc)
+{
+    SortRun *run;
+    int i;
+
+    if (sort_items(sc) < 0)
+        return -1;
+    if (!qe_realloc(&sc->runs, (sc->nb_runs + 1) * sizeof(*sc->runs)))
+        return -1;
+    run = memset(&sc->runs[sc->nb_runs], 0, sizeof(*run));
+    if (!(run->f = tmpfile()))
+        return -1;
+    sc->nb_runs++;
+    for (i = 0; i < sc->nb_items; i++) {
+        SortItem *ip = &sc->items[i];
+        fwrite(ip, sizeof(*ip), 1, run->f);
+        fwrite(sc->keys + ip->key, 1, ip->key_len, run->f);
+    }
+    if (fflush(run->f) || ferror(run->f))
+        return -1;
+    rewind(run->f);
+    sc->nb_items = 0;
+    sc->keys_len = 0;
+    return 0;
+}
+
+/* read the next item of a run, return 0 at end of run */
+static int sort_run_next(SortRun *run)
+{
+    if (fread(&run->item, sizeof(run->item), 1, run->f) != 1)
+        return 0;
+    if (run->item.key_len > run->key_size) {
+        if (!qe_realloc(&run->key_buf, run->item.key_len))
+            return -1;
+        run->key_size = run->item.key_len;
+    }
+    if (fread(run->key_buf, 1, run->item.key_len, run->f) != run->item.key_len)
+        return -1;
+    return 1;
+}
+
+static int sort_run_cmp(SortContext *sc, SortRun *r1, SortRun *r2)
+{
+    return sort_key_cmp(sc->flags, r1->key_buf, r1->item.key_len, r1->item.start,
+                        r2->key_buf, r2->item.key_len, r2->item.start);
+}
+
+static void sort_flush(SortContext *sc)
+{
+    sc->out_end += eb_insert(sc->b, sc->out_end, sc->out, sc->out_len);
+    sc->out_len = 0;
+}
+
+/* append a line after the span: lines are buffered to insert large
+   blocks, the span itself is not modified until all lines are copied */
+static void sort_emit(SortContext *sc, const SortItem *ip)
+{
+    int len = ip->end - ip->start;
+    int pos, n;
+
+    /* XXX: should keep track of point if sorting full buffer */
+    if (sc->out_len + len + sc->nl_len > SORT_OUTPUT_SIZE)
+        sort_flush(sc);
+    if (len + sc->nl_len > SORT_OUTPUT_SIZE) {
+        for (pos = ip->start; pos < ip->end; pos += n) {
+            n = eb_read(sc->b, pos, sc->out, min(ip->end - pos, SORT_OUTPUT_SIZE));
+            if (n <= 0)
+                break;
+            sc->out_len = n;
+            sort_flush(sc);
+        }
+    } else
+    if (sc->text) {
+        memcpy(sc->out + sc->out_len, sc->text + ip->start - sc->text_start, len);
+        sc->out_len += len;
+    } else {
+        sc->out_len += eb_read(sc->b, ip->start, sc->out + sc->out_len, len);
+    }
+    memcpy(sc->out + sc->out_len, sc->nl, sc->nl_len);
+    sc->out_len += sc->nl_len;
+}
+
+/* k-way merge of the runs, using a binary heap of runs */
+static int sort_merge_runs(SortContext *sc)
+{
+    SortRun **heap, *run;
+    int i, j, n, rc;
+
+    heap = qe_malloc_array(SortRun *, sc->nb_runs);
+    if (!heap)
+        return -1;
+    for (n = i = 0; i < sc->nb_runs; i++) {
+        if ((rc = sort_run_next(&sc->runs[i])) < 0)
+            goto fail;
+        if (rc == 0)
+            continue;
+        /* sift up */
+        for (j = n++; j > 0 && sort_run_cmp(sc, &sc->runs[i], heap[(j - 1) / 2]) < 0;
+             j = (j - 1) / 2) {
+            heap[j] = heap[(j - 1) / 2];
+        }
+        heap[j] = &sc->runs[i];
+    }
+    while (n > 0) {
+        run = heap[0];
+        sort_emit(sc, &run->item);
+        if ((rc = sort_run_next(run)) < 0)
+            goto fail;
+        if (rc == 0)
+            run = heap[--n];
+        /* sift down */
+        for (i = 0; (j = 2 * i + 1) < n; i = j) {
+            if (j + 1 < n && sort_run_cmp(sc, heap[j + 1], heap[j]) < 0)
+                j++;
+            if (sort_run_cmp(sc, run, heap[j]) <= 0)
+                break;
+            heap[i] = heap[j];
+        }
+        if (n > 0)
+            heap[i] = run;
+    }
+    qe_free(&heap);
+    return 0;
+
+ fail:
+    qe_free(&heap);
+    return -1;
+}
+
+static int eb_sort_span(EditBuffer *b, int *pp1, int *pp2, int cur_offset, int flags) {
+    QEmacsState *qs = &qe_state;
+    SortContext ctx, *sc = &ctx;
+    int p1 = *pp1, p2 = *pp2;
+    int i, offset, start, end, line1, line2, col1, col2, line, col;
+    size_t limit;
+    int res = -1;
+
+    if (p1 > p2) {
+        int tmp = p1;
+        p1 = p2;
+        p2 = tmp;
+    }
+    memset(sc, 0, sizeof(*sc));
+    sc->b = b;
+    sc->flags = flags;
+    sc->col = 0;
+    limit = max(qs->sort_memory_limit, 1 << 20);
+    eb_get_pos(b, &line1, &col1, p1); /* line1 is included */
+    eb_get_pos(b, &line2, &col2, p2); /* line2 is excluded */
+    if (col1 > 0) {
+        p1 = eb_goto_bol(b, p1);
+    }
+    if (col2 > 0) { /* include incomplete end line */
+        line2++;
+        p2 = eb_next_line(b, p2);
+    }
+    /* XXX: should also support rectangular selection */
+    if (flags & SF_COLUMN) {
+        eb_get_pos(b, &line, &col, cur_offset);
+        sc->col = col ? col : col1;
     }
     offset = p1;
-    for (i = 0; i < lines && offset < p2; i++) {
-        chunk_array[i].start = offset;
-        chunk_array[i].end = offset = eb_goto_eol(b, offset);
+    for (i = line1; i < line2 && offset < p2; i++) {
+        start = offset;
+        end = offset = eb_goto_eol(b, offset);
         offset = eb_next(b, offset);
         if (flags & SF_PARAGRAPH) {
             int offset1;
             /* paragraph sorting: skip continuation lines */
             while (offset < p2 && qe_isspace(eb_nextc(b, offset, &offset1))) {
-                chunk_array[i].end = offset = eb_goto_eol(b, offset);
+                end = offset = eb_goto_eol(b, offset);
                 offset = eb_next(b, offset);
             }
         }
+        if (sc->nb_items > 0
+        &&  sc->keys_len + sc->nb_items * 2 * sizeof(SortItem) > limit
+        &&  sort_spill_run(sc) < 0) {
+            goto done;
+        }
+        if (sort_add_item(sc, start, end) < 0)
+            goto done;
+    }
+    if (sc->nb_runs && sc->nb_items && sort_spill_run(sc) < 0)
+        goto done;
+    if (!sc->nb_runs && sort_items(sc) < 0)
+        goto done;
+
+    sc->out = qe_malloc_array(u8, SORT_OUTPUT_SIZE);
+    if (!sc->out)
+        goto done;
+    sc->nl_len = eb_encode_uchar(b, sc->nl, '\n');
+    sc->out_start = sc->out_end = p2;
+    if (!sc->nb_runs) {
+        /* lines are copied in random order: read the span sequentially
+           once instead of looking up the buffer pages for each line.
+           Spilled runs only hold keys and offsets, lines are then read
+           from the buffer to stay within the memory limit. */
+        sc->text = qe_malloc_array(u8, p2 - p1);
+        if (sc->text) {
+            sc->text_start = p1;
+            eb_read(b, p1, sc->text, p2 - p1);
+        }
     }
-    lines = i;
-    qe_qsort_r(chunk_array, lines, sizeof(*chunk_array), &ctx, chunk_cmp);
-
-    b1 = eb_new("*sorted*", BF_SYSTEM);
-    eb_set_charset(b1, b->charset, b->eol_type);
-
-    for (i = 0; i < lines; i++) {
-        /* XXX: should keep track of point if sorting full buffer */
-        eb_insert_buffer(b1, b1->total_size, b, chunk_array[i].start,
-                         chunk_array[i].end - chunk_array[i].start);
-        eb_putc(b1, '\n');
+    if (sc->nb_runs) {
+        /* release the keys while the runs are merged */
+        qe_free(&sc->keys);
+        qe_free(&sc->items);
+        if (sort_merge_runs(sc) < 0)
+            goto done;
+    } else {
+        for (i = 0; i < sc->nb_items; i++)
+            sort_emit(sc, &sc->items[i]);
     }
+    sort_flush(sc);
+    /* the sorted lines were inserted after the span: remove the span */
     eb_delete_range(b, p1, p2);
     *pp1 = p1;
-    *pp2 = p1 + eb_insert_buffer(b, p1, b1, 0, b1->total_size);
-    eb_free(&b1);
-    qe_free(&chunk_array);
-    return 0;
+    *pp2 = p1 + sc->out_end - sc->out_start;
+    res = 0;
+
+ done:
+    if (res < 0 && sc->out_end > sc->out_start) {
+        /* remove the lines already copied */
+        eb_delete_range(b, sc->out_start, sc->out_end);
+    }
+    for (i = 0; i < sc->nb_runs; i++) {
+        fclose(sc->runs[i].f);
+        qe_free(&sc->runs[i].key_buf);
+    }
+    qe_free(&sc->runs);
+    qe_free(&sc->text);
+    qe_free(&sc->out);
+    qe_free(&sc->keys);
+    qe_free(&sc->items);
+    qe_free(&sc->tmp);
+    return res;
 }
 
 static void do_sort_span(EditState *s, int p1, int p2, int flags, int argval) {
@@ -1739,6 +2581,827 @@ static void do_sort_buffer(EditState *s, int flags, int argval) {
     do_sort_span(s, 0, s->b->total_size, flags, argval);
 }
 
+/* Project tag index: the tags of the files of a directory tree are
+ * saved in a binary file in ~/.qe that is mapped in memory and searched
+ * through a hash table. The tree is walked and the files are read on
+ * worker threads, the tags are extracted by the mode colorizers on the
+ * main loop because they are not reentrant. Files whose size and
+ * modification time did not change keep their tags when the index is
+ * refreshed.
+ */
+
+#define TAG_INDEX_MAGIC          "QETAGS1\n"
+#define TAG_INDEX_MAX_FILES      100000
+#define TAG_INDEX_MAX_FILE_SIZE  (4 << 20)  /* larger files are skipped */
+#define TAG_INDEX_BATCH_SIZE     (1 << 20)  /* bytes read by a job */
+#define TAG_INDEX_MAX_JOBS       4          /* read jobs in flight */
+#define TAG_INDEX_TEXT_SIZE      256        /* max line contents saved */
+#define TAG_INDEX_DUP            1          /* same name as a previous tag */
+
+/* On disk layout: header, files, tags, hash table and strings.
+   Names are offsets in the string section. */
+typedef struct TagIndexHeader {
+    char magic[8];
+    uint32_t nb_files, nb_tags, hash_size, strings_size;
+    uint32_t root;          /* indexed directory */
+    uint32_t reserved;
+} TagIndexHeader;
+
+typedef struct TagIndexFile {
+    uint32_t name;          /* relative to the root directory */
+    uint32_t first_tag, nb_tags;
+    uint32_t reserved;
+    int64_t mtime, size;
+} TagIndexFile;
+
+typedef struct TagIndexTag {
+    uint32_t name, text;    /* tag and contents of its line */
+    uint32_t file, line, col;
+    uint32_t next;          /* next tag in hash chain + 1, 0 at end */
+    uint32_t flags;
+} TagIndexTag;
+
+typedef struct TagIndex {
+    void *map;
+    size_t map_size;
+    const TagIndexHeader *hdr;
+    const TagIndexFile *files;
+    const TagIndexTag *tags;
+    const uint32_t *hash;
+    const char *strings;
+    const char *root;
+} TagIndex;
+
+typedef struct TagIndexEntry {
+    char *name;             /* relative to the root directory */
+    ModeDef *mode;          /* NULL if the file is not indexed */
+    time_t mtime;
+    off_t size;
+    int old;                /* file number in the previous index or -1 */
+    int first_tag, nb_tags; /* scanned tags */
+    int file;               /* build file number of a read job entry */
+    char *contents;         /* read by a job */
+    int len;
+} TagIndexEntry;
+
+typedef struct TagIndexItem {
+    char *name, *text;
+    int line, col;
+} TagIndexItem;
+
+typedef struct TagIndexJob TagIndexJob;
+
+typedef struct TagIndexBuild {
+    TagIndex *old;          /* previous index of the same directory */
+    TagIndexJob *jobs;      /* jobs in flight */
+    int verbose;
+    int nb_files;
+    TagIndexEntry *files;
+    int next_file;          /* next file to read */
+    int nb_tags, tags_size;
+    TagIndexItem *tags;
+    EditBuffer *b;          /* scratch buffer for the colorizers */
+    EditState *s;
+    char root[MAX_FILENAME_SIZE];
+} TagIndexBuild;
+
+struct TagIndexJob {
+    TagIndexJob *next;
+    TagIndexBuild *tb;      /* NULL if the build was cancelled */
+    QEJob *job;
+    int nb_entries, entries_size;
+    TagIndexEntry *entries; /* files found or read by the worker */
+    char root[1];
+};
+
+static TagIndex *tag_index;
+static TagIndexBuild *tag_index_build;
+
+static unsigned int tag_index_hash(const char *name)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+static char *tag_index_path(char *buf, int buf_size, const char *root)
+{
+    const char *home = getenv("HOME");
+    char name[32];
+
+    if (!home || !*home)
+        return NULL;
+    snprintf(name, sizeof(name), "tags-%08x.index", tag_index_hash(root));
+    makepath(buf, buf_size, home, ".qe");
+    return makepath(buf, buf_size, buf, name);
+}
+
+static void tag_index_close(TagIndex **tip)
+{
+    TagIndex *ti = *tip;
+
+    if (ti) {
+        munmap(ti->map, ti->map_size);
+        qe_free(tip);
+    }
+}
+
+/* map the index of directory `root`, return NULL if absent or invalid */
+static TagIndex *tag_index_open(const char *root)
+{
+    char filename[MAX_FILENAME_SIZE];
+    const TagIndexHeader *hdr;
+    TagIndex *ti;
+    struct stat st;
+    uint64_t size;
+    void *map;
+    uint32_t i;
+    int fd;
+
+    if (!tag_index_path(filename, sizeof(filename), root))
+        return NULL;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    ti = qe_mallocz(TagIndex);
+    if (!ti) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    ti->map = map;
+    ti->map_size = st.st_size;
+    ti->hdr = hdr = map;
+    size = sizeof(*hdr) + (uint64_t)hdr->nb_files * sizeof(TagIndexFile) +
+        (uint64_t)hdr->nb_tags * sizeof(TagIndexTag) +
+        (uint64_t)hdr->hash_size * sizeof(uint32_t) + hdr->strings_size;
+    if (memcmp(hdr->magic, TAG_INDEX_MAGIC, sizeof(hdr->magic))
+    ||  size != (uint64_t)st.st_size
+    ||  hdr->hash_size == 0 || (hdr->hash_size & (hdr->hash_size - 1))
+    ||  hdr->strings_size == 0 || hdr->root >= hdr->strings_size)
+        goto fail;
+    ti->files = (const TagIndexFile *)(hdr + 1);
+    ti->tags = (const TagIndexTag *)(ti->files + hdr->nb_files);
+    ti->hash = (const uint32_t *)(ti->tags + hdr->nb_tags);
+    ti->strings = (const char *)(ti->hash + hdr->hash_size);
+    ti->root = ti->strings + hdr->root;
+
+    /* validate the offsets once so lookups need not check them */
+    if (ti->strings[hdr->strings_size - 1] != '\0'
+    ||  !strequal(ti->root, root))
+        goto fail;
+    for (i = 0; i < hdr->nb_files; i++) {
+        const TagIndexFile *fp = &ti->files[i];
+        if (fp->name >= hdr->strings_size || fp->first_tag > hdr->nb_tags
+        ||  fp->nb_tags > hdr->nb_tags - fp->first_tag)
+            goto fail;
+    }
+    for (i = 0; i < hdr->nb_tags; i++) {
+        const TagIndexTag *tp = &ti->tags[i];
+        if (tp->name >= hdr->strings_size || tp->text >= hdr->strings_size
+        ||  tp->file >= hdr->nb_files || tp->next > hdr->nb_tags)
+            goto fail;
+    }
+    for (i = 0; i < hdr->hash_size; i++) {
+        if (ti->hash[i] > hdr->nb_tags)
+            goto fail;
+    }
+    return ti;
+
+ fail:
+    tag_index_close(&ti);
+    return NULL;
+}
+
+/* return the first tag named `name` or NULL */
+static const TagIndexTag *tag_index_find(TagIndex *ti, const char *name)
+{
+    uint32_t n;
+
+    n = ti->hash[tag_index_hash(name) & (ti->hdr->hash_size - 1)];
+    while (n) {
+        const TagIndexTag *tp = &ti->tags[n - 1];
+        if (strequal(ti->strings + tp->name, name))
+            return tp;
+        n = tp->next;
+    }
+    return NULL;
+}
+
+static int tag_index_add_string(QString *q, const char *str)
+{
+    int pos = q->len;
+
+    if (qmemcat(q, (const u8 *)str, strlen(str) + 1) < 0)
+        return -1;
+    return pos;
+}
+
+static int tag_index_write(TagIndexBuild *tb)
+{
+    char filename[MAX_FILENAME_SIZE];
+    char tmpname[MAX_FILENAME_SIZE];
+    TagIndexHeader hdr;
+    TagIndexFile *files = NULL;
+    TagIndexTag *tags = NULL;
+    uint32_t *hash = NULL;
+    QString strings;
+    TagIndex *old = tb->old;
+    int i, j, nb_files, nb_tags, hash_size, res = -1;
+    FILE *f;
+
+    if (!tag_index_path(filename, sizeof(filename), tb->root))
+        return -1;
+
+    qstrinit(&strings);
+    nb_tags = 0;
+    for (i = 0; i < tb->nb_files; i++) {
+        TagIndexEntry *ep = &tb->files[i];
+        if (ep->old >= 0)
+            nb_tags += old->files[ep->old].nb_tags;
+        else
+            nb_tags += ep->nb_tags;
+    }
+    for (hash_size = 16; hash_size < 2 * nb_tags; hash_size *= 2)
+        continue;
+    files = qe_malloc_array(TagIndexFile, max(tb->nb_files, 1));
+    tags = qe_malloc_array(TagIndexTag, max(nb_tags, 1));
+    hash = qe_mallocz_array(uint32_t, hash_size);
+    if (!files || !tags || !hash)
+        goto done;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TAG_INDEX_MAGIC, sizeof(hdr.magic));
+    if (tag_index_add_string(&strings, tb->root) < 0)
+        goto done;
+    nb_files = nb_tags = 0;
+    for (i = 0; i < tb->nb_files; i++) {
+        TagIndexEntry *ep = &tb->files[i];
+        TagIndexFile *fp;
+        int name, text;
+
+        if (!ep->mode)
+            continue;
+        fp = &files[nb_files];
+        memset(fp, 0, sizeof(*fp));
+        if ((name = tag_index_add_string(&strings, ep->name)) < 0)
+            goto done;
+        fp->name = name;
+        fp->first_tag = nb_tags;
+        fp->mtime = ep->mtime;
+        fp->size = ep->size;
+        if (ep->old >= 0) {
+            const TagIndexFile *ofp = &old->files[ep->old];
+            for (j = 0; j < (int)ofp->nb_tags; j++) {
+                const TagIndexTag *otp = &old->tags[ofp->first_tag + j];
+                TagIndexTag *tp = &tags[nb_tags++];
+                if ((name = tag_index_add_string(&strings, old->strings + otp->name)) < 0
+                ||  (text = tag_index_add_string(&strings, old->strings + otp->text)) < 0)
+                    goto done;
+                tp->name = name;
+                tp->text = text;
+                tp->line = otp->line;
+                tp->col = otp->col;
+            }
+        } else {
+            for (j = 0; j < ep->nb_tags; j++) {
+                const TagIndexItem *ip = &tb->tags[ep->first_tag + j];
+                TagIndexTag *tp = &tags[nb_tags++];
+                if ((name = tag_index_add_string(&strings, ip->name)) < 0
+                ||  (text = tag_index_add_string(&strings, ip->text)) < 0)
+                    goto done;
+                tp->name = name;
+                tp->text = text;
+                tp->line = ip->line;
+                tp->col = ip->col;
+            }
+        }
+        for (j = fp->first_tag; j < nb_tags; j++)
+            tags[j].file = nb_files;
+        fp->nb_tags = nb_tags - fp->first_tag;
+        nb_files++;
+    }
+    /* chain the tags in file order, flag duplicate names */
+    for (i = nb_tags; i-- > 0;) {
+        const char *name = (const char *)strings.data + tags[i].name;
+        unsigned int h = tag_index_hash(name) & (hash_size - 1);
+        tags[i].next = hash[h];
+        tags[i].flags = 0;
+        hash[h] = i + 1;
+    }
+    for (i = 0; i < nb_tags; i++) {
+        const char *name = (const char *)strings.data + tags[i].name;
+        unsigned int h = tag_index_hash(name) & (hash_size - 1);
+        for (j = hash[h]; j != i + 1; j = tags[j - 1].next) {
+            if (strequal((const char *)strings.data + tags[j - 1].name, name)) {
+                tags[i].flags |= TAG_INDEX_DUP;
+                break;
+            }
+        }
+    }
+    hdr.nb_files = nb_files;
+    hdr.nb_tags = nb_tags;
+    hdr.hash_size = hash_size;
+    hdr.strings_size = strings.len;
+    hdr.root = 0;
+
+    f = qe_fopen_tmp(tmpname, sizeof(tmpname), filename);
+    if (!f)
+        goto done;
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(files, sizeof(*files), nb_files, f);
+    fwrite(tags, sizeof(*tags), nb_tags, f);
+    fwrite(hash, sizeof(*hash), hash_size, f);
+    fwrite(strings.data, 1, strings.len, f);
+    if (qe_fclose_tmp(f, tmpname, filename) == 0)
+        res = nb_tags;
+
+ done:
+    qstrfree(&strings);
+    qe_free(&files);
+    qe_free(&tags);
+    qe_free(&hash);
+    return res;
+}
+
+static void tag_index_free_build(TagIndexBuild **tbp)
+{
+    TagIndexBuild *tb = *tbp;
+    TagIndexJob *tj;
+    int i;
+
+    if (!tb)
+        return;
+    while ((tj = tb->jobs) != NULL) {
+        tb->jobs = tj->next;
+        tj->next = NULL;
+        tj->tb = NULL;
+        qe_job_cancel(tj->job);
+    }
+    for (i = 0; i < tb->nb_files; i++) {
+        qe_free(&tb->files[i].name);
+        qe_free(&tb->files[i].contents);
+    }
+    qe_free(&tb->files);
+    for (i = 0; i < tb->nb_tags; i++) {
+        qe_free(&tb->tags[i].name);
+        qe_free(&tb->tags[i].text);
+    }
+    qe_free(&tb->tags);
+    qe_free(&tb->s);
+    eb_free(&tb->b);
+    if (tag_index_build == tb)
+        tag_index_build = NULL;
+    qe_free(tbp);
+}
+
+static void tag_index_free_job(TagIndexJob **tjp)
+{
+    TagIndexJob *tj = *tjp;
+    int i;
+
+    for (i = 0; i < tj->nb_entries; i++) {
+        qe_free(&tj->entries[i].name);
+        qe_free(&tj->entries[i].contents);
+    }
+    qe_free(&tj->entries);
+    qe_free(tjp);
+}
+
+static TagIndexJob *tag_index_new_job(TagIndexBuild *tb)
+{
+    int len = strlen(tb->root);
+    TagIndexJob *tj = qe_mallocz_hack(TagIndexJob, len);
+
+    if (tj) {
+        memcpy(tj->root, tb->root, len + 1);
+        tj->tb = tb;
+        tj->next = tb->jobs;
+        tb->jobs = tj;
+    }
+    return tj;
+}
+
+static void tag_index_unlink_job(TagIndexBuild *tb, TagIndexJob *tj)
+{
+    TagIndexJob **pp;
+
+    for (pp = &tb->jobs; *pp; pp = &(*pp)->next) {
+        if (*pp == tj) {
+            *pp = tj->next;
+            break;
+        }
+    }
+}
+
+static TagIndexEntry *tag_index_new_entry(TagIndexJob *tj)
+{
+    if (tj->nb_entries >= tj->entries_size) {
+        int n = max(64, tj->entries_size * 2);
+        if (!qe_realloc(&tj->entries, n * sizeof(*tj->entries)))
+            return NULL;
+        tj->entries_size = n;
+    }
+    return memset(&tj->entries[tj->nb_entries++], 0, sizeof(*tj->entries));
+}
+
+/* runs on a worker thread */
+static void tag_index_walk(TagIndexJob *tj, QEJob *job, int parent_fd,
+                           const char *name, const char *path, dev_t dev)
+{
+    char subpath[MAX_FILENAME_SIZE];
+    struct dirent *dp;
+    struct stat st;
+    TagIndexEntry *ep;
+    DIR *dir;
+    int fd;
+
+    fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (fd < 0)
+        return;
+    dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    while ((dp = readdir(dir)) != NULL) {
+        if (qe_job_cancelled(job) || tj->nb_entries >= TAG_INDEX_MAX_FILES)
+            break;
+        /* skip ., .. and hidden files such as .git */
+        if (dp->d_name[0] == '.')
+            continue;
+        if (fstatat(fd, dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (*path)
+            snprintf(subpath, sizeof(subpath), "%s/%s", path, dp->d_name);
+        else
+            pstrcpy(subpath, sizeof(subpath), dp->d_name);
+        if (S_ISDIR(st.st_mode)) {
+            if (st.st_dev == dev)
+                tag_index_walk(tj, job, fd, dp->d_name, subpath, dev);
+        } else
+        if (S_ISREG(st.st_mode) && st.st_size <= TAG_INDEX_MAX_FILE_SIZE) {
+            if ((ep = tag_index_new_entry(tj)) == NULL)
+                break;
+            ep->name = qe_strdup(subpath);
+            ep->mtime = st.st_mtime;
+            ep->size = st.st_size;
+            ep->old = -1;
+        }
+    }
+    closedir(dir);
+}
+
+static void tag_index_walk_work(void *opaque, QEJob *job)
+{
+    TagIndexJob *tj = opaque;
+    struct stat st;
+
+    if (stat(tj->root, &st) == 0 && S_ISDIR(st.st_mode))
+        tag_index_walk(tj, job, AT_FDCWD, tj->root, "", st.st_dev);
+}
+
+/* runs on a worker thread */
+static void tag_index_read_work(void *opaque, QEJob *job)
+{
+    TagIndexJob *tj = opaque;
+    char filename[MAX_FILENAME_SIZE];
+    TagIndexEntry *ep;
+    int i, fd, len;
+
+    for (i = 0; i < tj->nb_entries && !qe_job_cancelled(job); i++) {
+        ep = &tj->entries[i];
+        makepath(filename, sizeof(filename), tj->root, ep->name);
+        fd = open(filename, O_RDONLY);
+        if (fd < 0)
+            continue;
+        ep->contents = qe_malloc_array(char, ep->size + 1);
+        if (ep->contents) {
+            len = read(fd, ep->contents, ep->size);
+            ep->len = max(len, 0);
+        }
+        close(fd);
+    }
+}
+
+static int tag_index_add_item(TagIndexBuild *tb, const char *name,
+                              const char *text, int line, int col)
+{
+    TagIndexItem *ip;
+
+    if (tb->nb_tags >= tb->tags_size) {
+        int n = max(256, tb->tags_size * 2);
+        if (!qe_realloc(&tb->tags, n * sizeof(*tb->tags)))
+            return -1;
+        tb->tags_size = n;
+    }
+    ip = &tb->tags[tb->nb_tags];
+    ip->name = qe_strdup(name);
+    ip->text = qe_strdup(text);
+    ip->line = line;
+    ip->col = col;
+    if (!ip->name || !ip->text) {
+        qe_free(&ip->name);
+        qe_free(&ip->text);
+        return -1;
+    }
+    tb->nb_tags++;
+    return 0;
+}
+
+/* collect the tags of a file by running its mode colorizer */
+static void tag_index_scan(TagIndexBuild *tb, TagIndexEntry *ep)
+{
+    unsigned int buf[COLORED_MAX_LINE_SIZE];
+    char text[TAG_INDEX_TEXT_SIZE];
+    QEColorizeContext cctx;
+    EditBuffer *b = tb->b;
+    QEProperty *p;
+    int offset, len, bom, line, col;
+
+    eb_delete(b, 0, b->total_size);
+    eb_delete_properties(b, 0, INT_MAX);
+    eb_insert(b, 0, ep->contents, ep->len);
+    qe_free(&ep->contents);
+
+    tb->s->mode = ep->mode;
+    memset(&cctx, 0, sizeof(cctx));
+    cctx.s = tb->s;
+    cctx.b = b;
+    cctx.state_only = 1;
+    for (offset = 0; offset < b->total_size;) {
+        cctx.offset = offset;
+        len = eb_get_line(b, buf, countof(buf) - 1, offset, &offset);
+        if (buf[len] != '\n') {
+            /* line was truncated */
+            offset = eb_next_line(b, cctx.offset);
+        }
+        buf[len] = '\0';
+        bom = (buf[0] == 0xFEFF);
+        if (bom)
+            cctx.offset = eb_next(b, cctx.offset);
+        ep->mode->colorize_func(&cctx, buf + bom, len - bom, ep->mode);
+    }
+
+    ep->first_tag = tb->nb_tags;
+    for (p = eb_first_property(b); p; p = eb_next_property(p)) {
+        if (p->type == QE_PROP_TAG) {
+            offset = eb_property_offset(p);
+            eb_get_pos(b, &line, &col, offset);
+            len = eb_fgets(b, text, sizeof(text), eb_goto_bol(b, offset), &offset);
+            while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == '\r'))
+                text[--len] = '\0';
+            if (tag_index_add_item(tb, p->data, text, line, col) < 0)
+                break;
+        }
+    }
+    ep->nb_tags = tb->nb_tags - ep->first_tag;
+}
+
+static void tag_index_read_done(void *opaque, int cancelled);
+
+/* start read jobs for the files to scan, save the index when done */
+static void tag_index_next(TagIndexBuild *tb)
+{
+    char root[MAX_FILENAME_SIZE];
+    TagIndexJob *tj;
+    TagIndexEntry *ep;
+    int nb_jobs, size, nb_tags;
+
+    for (nb_jobs = 0, tj = tb->jobs; tj; tj = tj->next)
+        nb_jobs++;
+
+    while (nb_jobs < TAG_INDEX_MAX_JOBS && tb->next_file < tb->nb_files) {
+        if (!(tj = tag_index_new_job(tb)))
+            break;
+        for (size = 0; tb->next_file < tb->nb_files && size < TAG_INDEX_BATCH_SIZE;) {
+            TagIndexEntry *fp = &tb->files[tb->next_file++];
+            if (!fp->mode || fp->old >= 0)
+                continue;
+            if ((ep = tag_index_new_entry(tj)) == NULL)
+                break;
+            ep->name = qe_strdup(fp->name);
+            ep->size = fp->size;
+            ep->file = tb->next_file - 1;
+            size += fp->size;
+        }
+        nb_jobs++;
+        tj->job = qe_job_submit(tag_index_read_work, tag_index_read_done, tj);
+        if (!tj->job) {
+            tag_index_unlink_job(tb, tj);
+            tag_index_free_job(&tj);
+            tag_index_free_build(&tb);
+            return;
+        }
+    }
+    if (tb->jobs || tb->next_file < tb->nb_files)
+        return;
+
+    pstrcpy(root, sizeof(root), tb->root);
+    nb_tags = tag_index_write(tb);
+    if (tb->verbose) {
+        if (nb_tags < 0)
+            put_status(NULL, "Cannot save tag index for %s", tb->root);
+        else
+            put_status(NULL, "Indexed %d tags in %s", nb_tags, tb->root);
+        url_request_display();
+    }
+    tag_index_free_build(&tb);
+    if (nb_tags >= 0) {
+        /* no build is running anymore: the previous index can go */
+        tag_index_close(&tag_index);
+        tag_index = tag_index_open(root);
+    }
+}
+
+static void tag_index_read_done(void *opaque, int cancelled)
+{
+    TagIndexJob *tj = opaque;
+    TagIndexBuild *tb = tj->tb;
+    int i;
+
+    if (tb) {
+        tag_index_unlink_job(tb, tj);
+        if (cancelled) {
+            tag_index_free_build(&tb);
+        } else {
+            for (i = 0; i < tj->nb_entries; i++) {
+                TagIndexEntry *ep = &tb->files[tj->entries[i].file];
+                ep->contents = tj->entries[i].contents;
+                ep->len = tj->entries[i].len;
+                tj->entries[i].contents = NULL;
+                if (ep->contents)
+                    tag_index_scan(tb, ep);
+                else
+                    ep->mode = NULL;
+            }
+            tag_index_next(tb);
+        }
+    }
+    tag_index_free_job(&tj);
+}
+
+static void tag_index_walk_done(void *opaque, int cancelled)
+{
+    TagIndexJob *tj = opaque;
+    TagIndexBuild *tb = tj->tb;
+    QEHashIndex old_files;
+    TagIndex *old;
+    intptr_t n;
+    int i;
+
+    if (tb) {
+        tag_index_unlink_job(tb, tj);
+        if (cancelled) {
+            tag_index_free_build(&tb);
+            tag_index_free_job(&tj);
+            return;
+        }
+        /* files with the same size and time keep their tags */
+        memset(&old_files, 0, sizeof(old_files));
+        if ((old = tb->old) != NULL) {
+            for (i = 0; i < (int)old->hdr->nb_files; i++) {
+                qe_hash_add(&old_files, old->strings + old->files[i].name,
+                            (void *)(intptr_t)(i + 1), 0);
+            }
+        }
+        for (i = 0; i < tj->nb_entries; i++) {
+            TagIndexEntry *ep = &tj->entries[i];
+            ep->mode = qe_find_mode_filename(ep->name, MODEF_SYNTAX);
+            if (ep->mode && !ep->mode->colorize_func)
+                ep->mode = NULL;
+            n = (intptr_t)qe_hash_find(&old_files, ep->name);
+            if (n && old->files[n - 1].mtime == ep->mtime
+            &&  old->files[n - 1].size == ep->size) {
+                ep->old = n - 1;
+            }
+        }
+        qe_hash_free(&old_files);
+        tb->files = tj->entries;
+        tb->nb_files = tj->nb_entries;
+        tj->entries = NULL;
+        tj->nb_entries = 0;
+        tag_index_next(tb);
+    }
+    tag_index_free_job(&tj);
+}
+
+/* index the directory tree `root` in the background */
+static void tag_index_start(const char *root, int verbose)
+{
+    TagIndexBuild *tb;
+    TagIndexJob *tj;
+
+    tag_index_free_build(&tag_index_build);
+    if (tag_index && !strequal(tag_index->root, root))
+        tag_index_close(&tag_index);
+
+    tb = qe_mallocz(TagIndexBuild);
+    if (!tb)
+        return;
+    pstrcpy(tb->root, sizeof(tb->root), root);
+    tb->old = tag_index;
+    tb->verbose = verbose;
+    tb->b = eb_new("*tag-index*", BF_SYSTEM | BF_UTF8);
+    tb->s = qe_mallocz(EditState);
+    if (!tb->b || !tb->s || !(tj = tag_index_new_job(tb))) {
+        tag_index_free_build(&tb);
+        return;
+    }
+    tb->s->qe_state = &qe_state;
+    tb->s->b = tb->b;
+    tag_index_build = tb;
+    tj->job = qe_job_submit(tag_index_walk_work, tag_index_walk_done, tj);
+    if (!tj->job) {
+        tag_index_unlink_job(tb, tj);
+        tag_index_free_job(&tj);
+        tag_index_free_build(&tb);
+    }
+}
+
+/* Return the index of the directory tree containing the buffer file:
+ * an index saved in a previous session is loaded and refreshed.
+ */
+static TagIndex *tag_index_get(EditState *s)
+{
+    char dir[MAX_FILENAME_SIZE];
+    TagIndex *ti;
+    int len;
+
+    if (!*s->b->filename)
+        return tag_index;
+    if (tag_index) {
+        len = strlen(tag_index->root);
+        if (strstart(s->b->filename, tag_index->root, NULL)
+        &&  s->b->filename[len] == '/')
+            return tag_index;
+    }
+    if (tag_index_build)
+        return tag_index;
+    get_dirname(dir, sizeof(dir), s->b->filename);
+    for (;;) {
+        if ((ti = tag_index_open(dir)) != NULL) {
+            tag_index_close(&tag_index);
+            tag_index = ti;
+            tag_index_start(dir, 0);
+            break;
+        }
+        len = strlen(dir);
+        while (len > 0 && dir[len - 1] != '/')
+            len--;
+        if (len <= 1)
+            break;
+        dir[len - 1] = '\0';
+    }
+    return tag_index;
+}
+
+static void do_index_tags(EditState *s, const char *dirname)
+{
+    char root[MAX_FILENAME_SIZE];
+    int len;
+
+    canonicalize_absolute_path(s, root, sizeof(root), dirname);
+    len = strlen(root);
+    while (len > 1 && root[len - 1] == '/')
+        root[--len] = '\0';
+    if (!is_directory(root)) {
+        put_status(s, "Not a directory: %s", root);
+        return;
+    }
+    put_status(s, "Indexing tags in %s", root);
+    tag_index_start(root, 1);
+}
+
+static int tag_index_goto(EditState *s, TagIndex *ti, const TagIndexTag *tp)
+{
+    char filename[MAX_FILENAME_SIZE];
+
+    makepath(filename, sizeof(filename), ti->root,
+             ti->strings + ti->files[tp->file].name);
+    if (qe_load_file(s, filename, 0, 0) < 0)
+        return -1;
+    s->offset = eb_goto_pos(s->b, tp->line, tp->col);
+    return 0;
+}
+
+void tag_index_free(void)
+{
+    tag_index_free_build(&tag_index_build);
+    tag_index_close(&tag_index);
+}
+
 static void tag_buffer(EditState *s) {
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
@@ -1753,15 +3416,28 @@ static void tag_buffer(EditState *s) {
 }
 
 static void tag_complete(CompleteState *cp) {
-    /* XXX: only support current buffer */
+    EditBuffer *b = NULL;
     QEProperty *p;
+    TagIndex *ti = tag_index;
+    uint32_t i;
 
     if (cp->target) {
         tag_buffer(cp->target);
 
-        for (p = cp->target->b->property_list; p; p = p->next) {
-            if (p->type == QE_PROP_TAG) {
+        b = cp->target->b;
+        for (p = eb_first_property(b); p; p = eb_next_property(p)) {
+            if (p->type == QE_PROP_TAG)
                 complete_test(cp, p->data);
+        }
+        ti = tag_index_get(cp->target);
+    }
+    if (ti) {
+        /* add the project tags not already found in the buffer */
+        for (i = 0; i < ti->hdr->nb_tags; i++) {
+            const char *name = ti->strings + ti->tags[i].name;
+            if (!(ti->tags[i].flags & TAG_INDEX_DUP)
+            &&  !(b && eb_find_tag(b, name))) {
+                complete_test(cp, name);
             }
         }
     }
@@ -1774,15 +3450,19 @@ static int tag_print_entry(CompleteState *cp, EditState *s, const char *name) {
         if (!s->colorize_func && cp->target->colorize_func) {
             set_colorize_func(s, cp->target->colorize_func, cp->target->colorize_mode);
         }
-        for (p = b->property_list; p; p = p->next) {
-            if (p->type == QE_PROP_TAG && strequal(p->data, name)) {
-                int offset = eb_goto_bol(b, p->offset);
-                int offset1 = eb_goto_eol(b, p->offset);
-                return eb_insert_buffer_convert(s->b, s->b->total_size,
-                                                b, offset, offset1 - offset);
-            }
+        if ((p = eb_find_tag(b, name)) != NULL) {
+            int pos = eb_property_offset(p);
+            int offset = eb_goto_bol(b, pos);
+            int offset1 = eb_goto_eol(b, pos);
+            return eb_insert_buffer_convert(s->b, s->b->total_size,
+                                            b, offset, offset1 - offset);
         }
     }
+    if (tag_index) {
+        const TagIndexTag *tp = tag_index_find(tag_index, name);
+        if (tp)
+            return eb_puts(s->b, tag_index->strings + tp->text);
+    }
     return eb_puts(s->b, name);
 }
 
@@ -1802,15 +3482,22 @@ static int tag_get_entry(EditState *s, char *dest, int size, int offset)
 }
 
 static void do_find_tag(EditState *s, const char *str) {
+    const TagIndexTag *tp;
     QEProperty *p;
+    TagIndex *ti;
 
     tag_buffer(s);
 
-    for (p = s->b->property_list; p; p = p->next) {
-        if (p->type == QE_PROP_TAG && strequal(p->data, str)) {
-            s->offset = p->offset;
-            return;
-        }
+    if ((p = eb_find_tag(s->b, str)) != NULL) {
+        s->offset = eb_property_offset(p);
+        return;
+    }
+    /* look for the tag in the other files of the project */
+    ti = tag_index_get(s);
+    if (ti && (tp = tag_index_find(ti, str)) != NULL) {
+        if (tag_index_goto(s, ti, tp) < 0)
+            put_status(s, "Cannot load file for tag %s", str);
+        return;
     }
     put_status(s, "Tag not found: %s", str);
 }
@@ -1833,12 +3520,49 @@ static void do_goto_tag(EditState *s) {
 
 /* XXX: should have next-tag and previous-tag */
 
-static void do_list_tags(EditState *s) {
+/* list the tags of the project index in grep format */
+static void tag_index_list(EditState *s)
+{
+    char buf[MAX_FILENAME_SIZE + 32];
+    const TagIndexFile *fp;
+    const TagIndexTag *tp;
+    EditBuffer *b;
+    TagIndex *ti;
+    uint32_t i, j;
+
+    ti = tag_index_get(s);
+    if (!ti) {
+        put_status(s, "No tag index: use index-tags");
+        return;
+    }
+    b = new_help_buffer();
+    if (!b)
+        return;
+
+    for (i = 0; i < ti->hdr->nb_files; i++) {
+        fp = &ti->files[i];
+        for (j = 0; j < fp->nb_tags; j++) {
+            tp = &ti->tags[fp->first_tag + j];
+            eb_printf(b, "%s:%u: %s\n", ti->strings + fp->name,
+                      tp->line + 1, ti->strings + tp->text);
+        }
+    }
+    b->flags |= BF_READONLY;
+    snprintf(buf, sizeof(buf), "Tags in directory %s", ti->root);
+    show_popup(s, b, buf);
+}
+
+static void do_list_tags(EditState *s, int argval) {
     char buf[MAX_FILENAME_SIZE + 16];
     EditBuffer *b;
     QEProperty *p;
     EditState *e1;
 
+    if (argval != NO_ARG) {
+        tag_index_list(s);
+        return;
+    }
+
     b = new_help_buffer();
     if (!b)
         return;
@@ -1846,11 +3570,12 @@ static void do_list_tags(EditState *s) {
     tag_buffer(s);
 
     snprintf(buf, sizeof(buf), "Tags in file %s", s->b->filename);
-    for (p = s->b->property_list; p; p = p->next) {
+    for (p = eb_first_property(s->b); p; p = eb_next_property(p)) {
         if (p->type == QE_PROP_TAG) {
-            //eb_printf(b, "%12d  %s\n", p->offset, (char*)p->data);
-            int offset = eb_goto_bol(s->b, p->offset);
-            int offset1 = eb_goto_eol(s->b, p->offset);
+            int pos = eb_property_offset(p);
+            //eb_printf(b, "%12d  %s\n", pos, (char*)p->data);
+            int offset = eb_goto_bol(s->b, pos);
+            int offset1 = eb_goto_eol(s->b, pos);
             eb_insert_buffer_convert(b, b->total_size, s->b, offset, offset1 - offset);
             eb_putc(b, '\n');
         }
@@ -1870,6 +3595,10 @@ static CompletionDef tag_completion = {
 static CmdDef extra_commands[] = {
     CMD2( KEY_META('='), KEY_NONE,
           "compare-windows", do_compare_windows, ESi, "ui" )
+    CMD3( KEY_NONE, KEY_NONE,
+          "compare-next-difference", do_compare_next_difference, ESi, 1, "v")
+    CMD3( KEY_NONE, KEY_NONE,
+          "compare-previous-difference", do_compare_next_difference, ESi, -1, "v")
     CMD3( KEY_CTRLX(KEY_CTRL('l')), KEY_NONE,
           "compare-files", do_compare_files, ESsi, 0,
           "s{Compare file: }[file]|file|"
@@ -1959,13 +3688,16 @@ static CmdDef extra_commands[] = {
     CMD3( KEY_NONE, KEY_NONE,
           "reverse-sort-region", do_sort_region, ESii, SF_REVERSE, "*vui")
 
-    CMD0( KEY_NONE, KEY_NONE,
-          "list-tags", do_list_tags)
+    CMD2( KEY_NONE, KEY_NONE,
+          "list-tags", do_list_tags, ESi, "ui")
     CMD0( KEY_CTRLX(','), KEY_META(KEY_F1),
           "goto-tag", do_goto_tag)
     CMD2( KEY_CTRLX('.'), KEY_NONE,
           "find-tag", do_find_tag, ESs,
           "s{Find tag: }[tag]|tag|")
+    CMD2( KEY_NONE, KEY_NONE,
+          "index-tags", do_index_tags, ESs,
+          "s{Index tags in directory: }[file]|file|")
 
     CMD_DEF_END,
 };
@@ -27,6 +27,13 @@
 
 #define SCROLL_MHEIGHT     10
 #define HTML_ERROR_BUFFER       "*xml-error*"
+#define HTML_MAX_EDITS     64
+
+/* buffer change not yet applied to the boxes: the 'size' bytes at
+   'offset' were replaced by 'size + delta' bytes */
+typedef struct HTMLEdit {
+    int offset, size, delta;
+} HTMLEdit;
 
 /* mode state */
 typedef struct HTMLState {
@@ -43,6 +50,9 @@ typedef struct HTMLState {
     CSSRect invalid_rect; /* this rectangle should be redrawn */
     int up_to_date;    /* true if css representation is synced with
                           buffer content */
+    int reparse;       /* true if the buffer must be parsed again */
+    int nb_edits;      /* pending text changes, if no reparse needed */
+    HTMLEdit edits[HTML_MAX_EDITS];
     int parse_flags;   /* can contain XML_HTML and XML_IGNORE_CASE */
 } HTMLState;
 
@@ -146,6 +156,86 @@ static int html_test_abort(qe__unused__ void *opaque)
     return is_user_input_pending();
 }
 
+/* Apply the pending text changes to the boxes. Return -1 if the
+   document structure may have changed and must be parsed again. */
+static int html_update_boxes(HTMLState *hs, EditBuffer *b)
+{
+    CSSBox *boxes[HTML_MAX_EDITS];
+    HTMLEdit *e;
+    int i, n, offset;
+
+    n = hs->nb_edits;
+    hs->nb_edits = 0;
+    css_merge_split_boxes(hs->top_box);
+    for (i = 0; i < n; i++) {
+        e = &hs->edits[i];
+        boxes[i] = css_update_offsets(hs->top_box, e->offset, e->size,
+                                      e->delta);
+        if (!boxes[i])
+            return -1;
+    }
+    /* the changed text boxes must still be plain text: a '<' would
+       start a new tag */
+    for (i = 0; i < n; i++) {
+        if (i > 0 && boxes[i] == boxes[i - 1])
+            continue;
+        if (boxes[i]->u.buffer.start >= boxes[i]->u.buffer.end)
+            return -1;
+        for (offset = boxes[i]->u.buffer.start;
+             offset < boxes[i]->u.buffer.end;) {
+            if (eb_nextc(b, offset, &offset) == '<')
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* parse the buffer and compute the styles of the boxes */
+static int html_parse_document(EditState *s, HTMLState *hs)
+{
+    EditBuffer *b;
+
+    hs->reparse = 0;
+    hs->nb_edits = 0;
+
+    /* delete previous document */
+    css_delete_box(&hs->top_box);
+    css_delete_document(&hs->css_ctx);
+
+    /* find error message buffer */
+    b = eb_find(HTML_ERROR_BUFFER);
+    if (b) {
+        eb_delete(b, 0, b->total_size);
+    }
+
+    hs->css_ctx = css_new_document(s->screen, s->b);
+    if (!hs->css_ctx)
+        return -1;
+
+    /* prepare default style sheet */
+    hs->css_ctx->style_sheet = css_new_style_sheet();
+    css_merge_style_sheet(hs->css_ctx->style_sheet, hs->default_style_sheet);
+
+    /* default colors */
+    hs->css_ctx->selection_bgcolor = qe_styles[QE_STYLE_SELECTION].bg_color;
+    hs->css_ctx->selection_fgcolor = qe_styles[QE_STYLE_SELECTION].fg_color;
+    hs->css_ctx->default_bgcolor = qe_styles[QE_STYLE_CSS_DEFAULT].bg_color;
+
+    timer_start();
+    hs->top_box = xml_parse_buffer(s->b, 0, s->b->total_size,
+                                   hs->css_ctx->style_sheet,
+                                   hs->parse_flags,
+                                   html_test_abort, NULL);
+    timer_stop("xml_parse_buffer");
+    if (!hs->top_box)
+        return -1;
+
+    timer_start();
+    css_compute(hs->css_ctx, hs->top_box);
+    timer_stop("css_compute");
+    return 0;
+}
+
 static void html_display(EditState *s)
 {
     HTMLState *hs;
@@ -153,19 +243,20 @@ static void html_display(EditState *s)
     DirType dirc;
     int n, cursor_found, d, ret, sel_start, sel_end;
     CSSRect rect;
-    EditBuffer *b;
 
     if (!(hs = html_get_state(s, 0)))
         return;
 
     /* XXX: should be generic ? */
     if (hs->last_width != s->width) {
+        /* only the layout depends on the width */
         hs->last_width = s->width;
         hs->up_to_date = 0;
     }
     if (s->b->charset != hs->last_charset) {
         hs->last_charset = s->b->charset;
         hs->up_to_date = 0;
+        hs->reparse = 1;
     }
 
     /* reparse & layout if needed */
@@ -177,42 +268,13 @@ static void html_display(EditState *s)
             dpy_flush(s->screen);
         }
 
-        /* delete previous document */
-        css_delete_box(&hs->top_box);
-        css_delete_document(&hs->css_ctx);
-
-        /* find error message buffer */
-        b = eb_find(HTML_ERROR_BUFFER);
-        if (b) {
-            eb_delete(b, 0, b->total_size);
-        }
-
-        hs->css_ctx = css_new_document(s->screen, s->b);
-        if (!hs->css_ctx)
-            return;
-
-        /* prepare default style sheet */
-        hs->css_ctx->style_sheet = css_new_style_sheet();
-        css_merge_style_sheet(hs->css_ctx->style_sheet, hs->default_style_sheet);
-
-        /* default colors */
-        hs->css_ctx->selection_bgcolor = qe_styles[QE_STYLE_SELECTION].bg_color;
-        hs->css_ctx->selection_fgcolor = qe_styles[QE_STYLE_SELECTION].fg_color;
-        hs->css_ctx->default_bgcolor = qe_styles[QE_STYLE_CSS_DEFAULT].bg_color;
-
-        timer_start();
-        hs->top_box = xml_parse_buffer(s->b, 0, s->b->total_size,
-                                       hs->css_ctx->style_sheet,
-                                       hs->parse_flags,
-                                       html_test_abort, NULL);
-        timer_stop("xml_parse_buffer");
-        if (!hs->top_box)
+        /* keep the boxes and their computed styles if only text was
+           modified */
+        if (!hs->reparse && hs->top_box && html_update_boxes(hs, s->b) < 0)
+            hs->reparse = 1;
+        if ((hs->reparse || !hs->top_box) && html_parse_document(s, hs) < 0)
             return;
 
-        timer_start();
-        css_compute(hs->css_ctx, hs->top_box);
-        timer_stop("css_compute");
-
         timer_start();
         ret = css_layout(hs->css_ctx, hs->top_box, s->width,
                          html_test_abort, NULL);
@@ -778,17 +840,44 @@ static void html_mouse_goto(EditState *s, int x, int y)
     }
 }
 
-/* invalidate the html data if modification done (XXX: be more precise) */
+/* invalidate the html data if modification done: the change is
+   recorded to update the boxes if it only touches text */
 static void html_callback(qe__unused__ EditBuffer *b,
                           void *opaque, qe__unused__ int arg,
-                          qe__unused__ enum LogOperation op,
-                          qe__unused__ int offset,
-                          qe__unused__ int size)
+                          enum LogOperation op, int offset, int size)
 {
     HTMLState *hs = opaque;
+    HTMLEdit *e;
 
-    if (hs)
-        hs->up_to_date = 0;
+    if (!hs)
+        return;
+
+    hs->up_to_date = 0;
+    if (hs->reparse)
+        return;
+    if (hs->nb_edits >= HTML_MAX_EDITS) {
+        hs->reparse = 1;
+        return;
+    }
+    e = &hs->edits[hs->nb_edits++];
+    e->offset = offset;
+    switch (op) {
+    case LOGOP_INSERT:
+        e->size = 0;
+        e->delta = size;
+        break;
+    case LOGOP_DELETE:
+        e->size = size;
+        e->delta = -size;
+        break;
+    case LOGOP_WRITE:
+        e->size = size;
+        e->delta = 0;
+        break;
+    default:
+        hs->reparse = 1;
+        break;
+    }
 }
 
 static void load_default_style_sheet(HTMLState *hs, const char *stylesheet_str,
@@ -818,6 +907,7 @@ int gxml_mode_init(EditBuffer *b, int flags, const char *default_stylesheet)
     hs->parse_flags = flags;
     load_default_style_sheet(hs, default_stylesheet, flags);
     hs->up_to_date = 0;
+    hs->reparse = 1;
 
     return 0;
 }
@@ -835,6 +925,7 @@ static int html_mode_init(EditState *s, EditBuffer *b, int flags)
                               html_style);
     }
     hs->up_to_date = 0;
+    hs->reparse = 1;
     return 0;
 }
 
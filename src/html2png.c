@@ -27,11 +27,17 @@
 #include <png.h>
 #endif
 
+#ifdef CONFIG_PTHREAD
+#include <pthread.h>
+#endif
+
 #define DEFAULT_WIDTH 640
 #ifdef CONFIG_PNG_OUTPUT
 #define DEFAULT_OUTFILENAME "a.png"
+#define DEFAULT_EXTENSION   ".png"
 #else
 #define DEFAULT_OUTFILENAME "a.ppm"
+#define DEFAULT_EXTENSION   ".ppm"
 #endif
 
 /* file I/O for the qHTML library */
@@ -102,6 +108,68 @@ int find_resource_file(qe__unused__ char *path, qe__unused__ int path_size,
     return -1;
 }
 
+/* parallel loops for the qHTML library: the iterations are shared
+   between the calling thread and a few helper threads */
+
+#define MAX_THREADS  8
+
+#ifdef CONFIG_PTHREAD
+typedef struct ParallelState {
+    pthread_mutex_t mutex;
+    void (*work)(void *opaque, int i);
+    void *opaque;
+    int n, next;
+} ParallelState;
+
+static void *parallel_worker(void *opaque)
+{
+    ParallelState *ps = opaque;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&ps->mutex);
+        i = ps->next++;
+        pthread_mutex_unlock(&ps->mutex);
+        if (i >= ps->n)
+            break;
+        ps->work(ps->opaque, i);
+    }
+    return NULL;
+}
+#endif
+
+void qe_job_parallel(int n, void (*work)(void *opaque, int i), void *opaque)
+{
+    int i;
+#ifdef CONFIG_PTHREAD
+    pthread_t threads[MAX_THREADS - 1];
+    ParallelState ps;
+    int nb_threads;
+
+    nb_threads = clamp((int)sysconf(_SC_NPROCESSORS_ONLN), 1, MAX_THREADS);
+    nb_threads = min(nb_threads, n) - 1;
+    if (nb_threads > 0) {
+        pthread_mutex_init(&ps.mutex, NULL);
+        ps.work = work;
+        ps.opaque = opaque;
+        ps.n = n;
+        ps.next = 0;
+        for (i = 0; i < nb_threads; i++) {
+            if (pthread_create(&threads[i], NULL, parallel_worker, &ps))
+                break;
+        }
+        nb_threads = i;
+        parallel_worker(&ps);
+        for (i = 0; i < nb_threads; i++)
+            pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&ps.mutex);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+        work(opaque, i);
+}
+
 /* display driver based on cfb driver */
 
 static int ppm_init(QEditScreen *s, int w, int h);
@@ -187,9 +255,17 @@ static void ppm_close(QEditScreen *s)
     qe_free(&s->priv_data);
 }
 
-static int ppm_save(QEditScreen *s, const char *filename)
+/* a rendered page, detached from the screen so that it can be saved
+   while the next page is rendered */
+typedef struct PageImage {
+    struct PageImage *next;
+    char *filename;
+    unsigned char *base;
+    int width, height, wrap;
+} PageImage;
+
+static int ppm_save(PageImage *img, const char *filename)
 {
-    CFBContext *cfb = s->priv_data;
     int w, h, x, y;
     unsigned int r, g, b, v;
     unsigned int *data;
@@ -198,9 +274,9 @@ static int ppm_save(QEditScreen *s, const char *filename)
     f = fopen(filename, "w");
     if (!f)
         return -1;
-    data = (unsigned int *)(void *)cfb->base;
-    w = s->width;
-    h = s->height;
+    data = (unsigned int *)(void *)img->base;
+    w = img->width;
+    h = img->height;
 
     fprintf(f, "P6\n%d %d\n%d\n", w, h, 255);
     for (y = 0; y < h; y++) {
@@ -213,7 +289,7 @@ static int ppm_save(QEditScreen *s, const char *filename)
             fputc(g, f);
             fputc(b, f);
         }
-        data = (void *)((char *)data + cfb->wrap);
+        data = (void *)((char *)data + img->wrap);
     }
     fclose(f);
     return 0;
@@ -221,9 +297,8 @@ static int ppm_save(QEditScreen *s, const char *filename)
 
 #ifdef CONFIG_PNG_OUTPUT
 
-static int png_save(QEditScreen *s, const char *filename)
+static int png_save(PageImage *img, const char *filename)
 {
-    CFBContext *cfb = s->priv_data;
     struct png_save_data {
         FILE *f;
         png_structp png_ptr;
@@ -248,7 +323,7 @@ static int png_save(QEditScreen *s, const char *filename)
     if (!d.info_ptr)
         goto fail;
 
-    d.row_buf = qe_malloc_array(u8, 3 * s->width);
+    d.row_buf = qe_malloc_array(u8, 3 * img->width);
     if (!d.row_buf)
         goto fail;
 
@@ -260,9 +335,9 @@ static int png_save(QEditScreen *s, const char *filename)
 
         png_init_io(d.png_ptr, d.f);
 
-        data = (unsigned int *)(void *)cfb->base;
-        w = s->width;
-        h = s->height;
+        data = (unsigned int *)(void *)img->base;
+        w = img->width;
+        h = img->height;
 
         png_set_IHDR(d.png_ptr, d.info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB,
                      PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
@@ -284,10 +359,11 @@ static int png_save(QEditScreen *s, const char *filename)
                 row_ptr += 3;
             }
             png_write_rows(d.png_ptr, row_pointers, 1);
-            data = (void *)((char *)data + cfb->wrap);
+            data = (void *)((char *)data + img->wrap);
         }
         png_write_end(d.png_ptr, d.info_ptr);
         png_destroy_write_struct(&d.png_ptr, &d.info_ptr);
+        qe_free(&d.row_buf);
         fclose(d.f);
         return 0;
     } else {
@@ -306,6 +382,134 @@ static int png_save(QEditScreen *s, const char *filename)
 
 #endif
 
+static int save_image(PageImage *img)
+{
+#ifdef CONFIG_PNG_OUTPUT
+    if (!strstr(img->filename, ".ppm"))
+        return png_save(img, img->filename);
+#endif
+    return ppm_save(img, img->filename);
+}
+
+static void free_image(PageImage **imgp)
+{
+    if (*imgp) {
+        qe_free(&(*imgp)->filename);
+        qe_free(&(*imgp)->base);
+        qe_free(imgp);
+    }
+}
+
+/* In batch mode, the pages are encoded and written by a pool of
+ * threads while the main thread renders the next ones: the rendering
+ * itself stays on the main thread because the fonts are shared.
+ */
+
+#ifdef CONFIG_PTHREAD
+static pthread_mutex_t save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t save_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t save_done_cond = PTHREAD_COND_INITIALIZER;
+static PageImage *save_queue, **save_queue_tail = &save_queue;
+static pthread_t save_threads[MAX_THREADS];
+static int save_nb_threads;
+static int save_nb_pending;     /* queued or being saved */
+static int save_ending;
+#endif
+static int save_errors;
+
+static void save_page_sync(PageImage *img)
+{
+    if (save_image(img) < 0) {
+        fprintf(stderr, "%s: could not save image\n", img->filename);
+        save_errors++;
+    }
+    free_image(&img);
+}
+
+#ifdef CONFIG_PTHREAD
+static void *save_worker(qe__unused__ void *opaque)
+{
+    PageImage *img;
+    int ret;
+
+    for (;;) {
+        pthread_mutex_lock(&save_mutex);
+        while (!save_queue && !save_ending)
+            pthread_cond_wait(&save_cond, &save_mutex);
+        img = save_queue;
+        if (!img) {
+            pthread_mutex_unlock(&save_mutex);
+            break;
+        }
+        if (!(save_queue = img->next))
+            save_queue_tail = &save_queue;
+        pthread_mutex_unlock(&save_mutex);
+
+        ret = save_image(img);
+        if (ret < 0)
+            fprintf(stderr, "%s: could not save image\n", img->filename);
+        free_image(&img);
+
+        pthread_mutex_lock(&save_mutex);
+        if (ret < 0)
+            save_errors++;
+        save_nb_pending--;
+        pthread_cond_signal(&save_done_cond);
+        pthread_mutex_unlock(&save_mutex);
+    }
+    return NULL;
+}
+#endif
+
+static void save_start(qe__unused__ int nb_threads)
+{
+#ifdef CONFIG_PTHREAD
+    while (save_nb_threads < min(nb_threads, MAX_THREADS)) {
+        if (pthread_create(&save_threads[save_nb_threads], NULL,
+                           save_worker, NULL))
+            break;
+        save_nb_threads++;
+    }
+#endif
+}
+
+static void save_page(PageImage *img)
+{
+#ifdef CONFIG_PTHREAD
+    if (save_nb_threads > 0) {
+        pthread_mutex_lock(&save_mutex);
+        /* bound the memory used by the pages not saved yet */
+        while (save_nb_pending >= 2 * save_nb_threads)
+            pthread_cond_wait(&save_done_cond, &save_mutex);
+        img->next = NULL;
+        *save_queue_tail = img;
+        save_queue_tail = &img->next;
+        save_nb_pending++;
+        pthread_cond_signal(&save_cond);
+        pthread_mutex_unlock(&save_mutex);
+        return;
+    }
+#endif
+    save_page_sync(img);
+}
+
+/* wait for all the pages to be saved, return the number of errors */
+static int save_end(void)
+{
+#ifdef CONFIG_PTHREAD
+    int i;
+
+    pthread_mutex_lock(&save_mutex);
+    save_ending = 1;
+    pthread_cond_broadcast(&save_cond);
+    pthread_mutex_unlock(&save_mutex);
+    for (i = 0; i < save_nb_threads; i++)
+        pthread_join(save_threads[i], NULL);
+    save_nb_threads = 0;
+#endif
+    return save_errors;
+}
+
 #if 0
 void test_display(QEditScreen *screen)
 {
@@ -333,7 +537,7 @@ static int html_test_abort(qe__unused__ void *opaque)
 
 #define IO_BUF_SIZE 4096
 
-static int draw_html(QEditScreen *scr,
+static int draw_html(QEditScreen *scr, CSSStyleSheet *default_style_sheet,
                      const char *filename, QECharset *charset, int flags)
 {
     CSSContext *s = NULL;
@@ -351,8 +555,7 @@ static int draw_html(QEditScreen *scr,
 
     /* prepare default style sheet */
     s->style_sheet = css_new_style_sheet();
-
-    css_parse_style_sheet_str(s->style_sheet, html_style, flags);
+    css_merge_style_sheet(s->style_sheet, default_style_sheet);
 
     /* default colors */
     s->selection_bgcolor = QERGB(0x00, 0x00, 0xff);
@@ -409,30 +612,114 @@ static int draw_html(QEditScreen *scr,
     return -1;
 }
 
+typedef struct RenderContext {
+    QEditScreen *screen;
+    CSSStyleSheet *default_style_sheet;
+    QECharset *charset;
+    int flags;
+} RenderContext;
+
+/* render 'infilename' and queue the image to be saved */
+static int render_page(RenderContext *rc, const char *infilename,
+                       const char *outfilename)
+{
+    CFBContext *cfb = rc->screen->priv_data;
+    PageImage *img;
+
+    if (draw_html(rc->screen, rc->default_style_sheet, infilename,
+                  rc->charset, rc->flags) < 0) {
+        fprintf(stderr, "%s: could not render page\n", infilename);
+        return -1;
+    }
+    img = qe_mallocz(PageImage);
+    if (!img)
+        return -1;
+    img->filename = qe_strdup(outfilename);
+    if (!img->filename) {
+        free_image(&img);
+        return -1;
+    }
+    /* take the bitmap: the next page gets a new one */
+    img->base = cfb->base;
+    img->width = rc->screen->width;
+    img->height = rc->screen->height;
+    img->wrap = cfb->wrap;
+    cfb->base = NULL;
+    save_page(img);
+    return 0;
+}
+
+/* render the pages listed in a manifest file, one per line: the input
+   file optionally followed by the output file. The default output
+   file is the input file with the image extension. */
+static int render_manifest(RenderContext *rc, const char *manifest,
+                           const char *extension)
+{
+    char line[1024], infilename[1024], outfilename[1024];
+    const char *p;
+    FILE *f;
+    int ret;
+
+    if (strequal(manifest, "-")) {
+        f = stdin;
+    } else {
+        f = fopen(manifest, "r");
+        if (!f) {
+            fprintf(stderr, "%s: cannot open manifest\n", manifest);
+            return -1;
+        }
+    }
+    ret = 0;
+    while (fgets(line, sizeof(line), f)) {
+        p = line;
+        get_str(&p, infilename, sizeof(infilename), "");
+        if (*infilename == '\0' || *infilename == '#')
+            continue;
+        get_str(&p, outfilename, sizeof(outfilename), "");
+        if (*outfilename == '\0') {
+            pstrcpy(outfilename, sizeof(outfilename), infilename);
+            strip_extension(outfilename);
+            pstrcat(outfilename, sizeof(outfilename), extension);
+        }
+        if (render_page(rc, infilename, outfilename) < 0)
+            ret = -1;
+    }
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
+
 static void help(void)
 {
     printf("html2png version %s (c) 2002 Fabrice Bellard\n"
            "\n"
            "usage: html2png [-h] [-x] [-w width] [-o outfile] [-f charset] infile\n"
+           "       html2png [-h] [-x] [-w width] [-f charset] [-j jobs] -b manifest\n"
            "Convert the HTML page 'infile' into the png/ppm image file 'outfile'\n"
            "\n"
-           "-h         : display this help\n"
-           "-x         : use strict XML parser (xhtml type parsing)\n"
-           "-w width   : set the image width (default=%d)\n"
-           "-f charset : set the default charset (default='%s')\n"
-           "             use -f ? to list supported charsets\n"
-           "-o outfile : set the output filename (default='%s')\n",
+           "-h          : display this help\n"
+           "-x          : use strict XML parser (xhtml type parsing)\n"
+           "-w width    : set the image width (default=%d)\n"
+           "-f charset  : set the default charset (default='%s')\n"
+           "              use -f ? to list supported charsets\n"
+           "-o outfile  : set the output filename (default='%s')\n"
+           "-b manifest : convert the pages listed in 'manifest' ('-' for stdin),\n"
+           "              one 'infile [outfile]' per line (default outfile is\n"
+           "              infile with the '%s' extension)\n"
+           "-j jobs     : number of threads saving the images in batch mode\n",
            QE_VERSION,
            DEFAULT_WIDTH,
            "8859-1",
-           DEFAULT_OUTFILENAME);
+           DEFAULT_OUTFILENAME,
+           DEFAULT_EXTENSION);
 }
 
 int main(int argc, char **argv)
 {
     QEditScreen screen1, *screen = &screen1;
-    int page_width, c, strict_xml, flags;
-    const char *outfilename, *infilename;
+    RenderContext rc1, *rc = &rc1;
+    int page_width, c, strict_xml, flags, nb_jobs, ret;
+    const char *outfilename, *infilename, *manifest;
     QECharset *charset;
 
     charset_init();
@@ -444,9 +731,11 @@ int main(int argc, char **argv)
     outfilename = DEFAULT_OUTFILENAME;
     charset = &charset_8859_1;
     strict_xml = 0;
+    manifest = NULL;
+    nb_jobs = clamp((int)sysconf(_SC_NPROCESSORS_ONLN), 1, MAX_THREADS);
 
     for (;;) {
-        c = getopt(argc, argv, "h?w:o:f:x");
+        c = getopt(argc, argv, "h?w:o:f:xb:j:");
         if (c == -1)
             break;
         switch (c) {
@@ -475,13 +764,18 @@ int main(int argc, char **argv)
         case 'x':
             strict_xml = 1;
             break;
+        case 'b':
+            manifest = optarg;
+            break;
+        case 'j':
+            nb_jobs = atoi(optarg);
+            break;
         }
     }
-    if (optind >= argc) {
+    if (!manifest && optind >= argc) {
         help();
         exit(1);
     }
-    infilename = argv[optind];
 
     /* init display driver with dummy height */
     if (screen_init(screen, &ppm_dpy, page_width, 1) < 0) {
@@ -493,19 +787,26 @@ int main(int argc, char **argv)
     if (!strict_xml)
         flags |= XML_IGNORE_CASE | XML_HTML_SYNTAX;
 
-    draw_html(screen, infilename, charset, flags);
+    /* the default style sheet is parsed once for all the pages */
+    rc->screen = screen;
+    rc->default_style_sheet = css_new_style_sheet();
+    css_parse_style_sheet_str(rc->default_style_sheet, html_style, flags);
+    rc->charset = charset;
+    rc->flags = flags;
 
-    /* save ppm file */
-#ifdef CONFIG_PNG_OUTPUT
-    if (strstr(outfilename, ".ppm"))
-        ppm_save(screen, outfilename);
-    else
-        png_save(screen, outfilename);
-#else
-    ppm_save(screen, outfilename);
-#endif
+    if (manifest) {
+        save_start(nb_jobs);
+        ret = render_manifest(rc, manifest, DEFAULT_EXTENSION);
+    } else {
+        infilename = argv[optind];
+        ret = render_page(rc, infilename, outfilename);
+    }
+    if (save_end() > 0)
+        ret = -1;
+
+    css_free_style_sheet(&rc->default_style_sheet);
 
     /* close screen */
     dpy_close(screen);
-    return 0;
+    return ret < 0;
 }
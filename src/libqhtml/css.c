@@ -45,6 +45,10 @@
 
 #include <assert.h>
 
+#ifdef CONFIG_PTHREAD
+#include <pthread.h>
+#endif
+
 static void css_counter_str(char *text, int text_size,
                             int index, int list_style_type, int adjust);
 
@@ -784,6 +788,19 @@ static int css_eval(CSSContext *s,
         css_eval_property(s, state, p, state_parent, box);
     }
 
+    /* note: counters depend on the document order, they are updated
+       by css_eval_counters() */
+
+    /* border colors are set to color by default */
+    for (i = 0; i < 4; i++) {
+        if (state->border_colors[i] == COLOR_TRANSPARENT)
+            state->border_colors[i] = state->color;
+    }
+    return pelement_found;
+}
+
+static void css_eval_counters(CSSContext *s, CSSState *state)
+{
     /* first reset counters */
     if (state->counter_reset) {
         eval_counter_update(s, state->counter_reset);
@@ -792,18 +809,6 @@ static int css_eval(CSSContext *s,
     if (state->counter_increment) {
         eval_counter_update(s, state->counter_increment);
     }
-    /* alternate content if image (need more ideas) */
-    if (state->content_alt &&
-        box->content_type == CSS_CONTENT_TYPE_IMAGE) {
-        box->u.image.content_alt = eval_content(s, state->content_alt, box);
-    }
-
-    /* border colors are set to color by default */
-    for (i = 0; i < 4; i++) {
-        if (state->border_colors[i] == COLOR_TRANSPARENT)
-            state->border_colors[i] = state->color;
-    }
-    return pelement_found;
 }
 
 static void set_default_props(CSSContext *s, CSSState *props)
@@ -864,27 +869,43 @@ static int is_equal_props(CSSState *p1, CSSState *p2)
     return 1;
 }
 
+#ifdef CONFIG_PTHREAD
+/* the boxes are computed on several threads, they share the
+   properties table */
+static pthread_mutex_t props_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /* allocate a memory slot for 'props' which is shared with others */
 static CSSState *allocate_props(CSSContext *s, CSSState *props)
 {
     CSSState **pp, *p;
-    pp = &s->hash_props[hash_props(props)];
+    unsigned int h;
+
+    h = hash_props(props);
+#ifdef CONFIG_PTHREAD
+    pthread_mutex_lock(&props_mutex);
+#endif
+    pp = &s->hash_props[h];
     for (;;) {
         p = *pp;
         if (!p)
             break;
         /* if properties are already there, then no need to allocate */
         if (is_equal_props(p, props))
-            return p;
+            goto done;
         pp = &p->hash_next;
     }
     /* add new props */
     p = qe_malloc_dup(props, sizeof(CSSState));
-    if (!p)
-        return NULL;
-    s->nb_props++;
-    *pp = p;
-    p->hash_next = NULL;
+    if (p) {
+        s->nb_props++;
+        p->hash_next = NULL;
+        *pp = p;
+    }
+ done:
+#ifdef CONFIG_PTHREAD
+    pthread_mutex_unlock(&props_mutex);
+#endif
     return p;
 }
 
@@ -904,7 +925,10 @@ static CSSBox *add_before_after_box(CSSContext *s,
     CSSBox *box1;
     char *content;
 
+    /* css_eval() only sets the properties listed in the table */
+    memset(pelement_props, 0, sizeof(*pelement_props));
     css_eval(s, pelement_props, box, pelement, box->props);
+    css_eval_counters(s, pelement_props);
     if (!pelement_props->content)
         return NULL;
     content = eval_content(s, pelement_props->content, box);
@@ -1107,23 +1131,21 @@ static CSSBox *add_marker_box(CSSContext *s, CSSBox *box)
     return box1;
 }
 
-/* compute the CSS properties of a box */
-static int css_compute_block(CSSContext *s, CSSBox *box,
+/* compute the CSS properties of a box, but not of its childs. The
+   boxes which depend on the document order (counters, markers,
+   :before and :after) are added by css_compute_generated(), so that
+   the boxes can be computed in any order once their parent is. */
+static int css_compute_props(CSSContext *s, CSSBox *box,
                              CSSState *parent_props)
 {
-    CSSState *aprops;
     CSSState props1, *props = &props1;
-    CSSBox *box1, *box_next, **pbox;
-    int pelement_found;
-    CSSCounterValue *counter_stack;
 
-    pelement_found = css_eval(s, props, box, 0, parent_props);
+    box->pelement_found = css_eval(s, props, box, 0, parent_props);
 
     /* allocate the properties for this box */
-    aprops = allocate_props(s, props);
-    if (!aprops)
+    box->props = allocate_props(s, props);
+    if (!box->props)
         return -1;
-    box->props = aprops;
 
     /* if the box is of type block, then it must contains childs,
        so we add a child as a dummy box */
@@ -1132,6 +1154,25 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
         box->content_type != CSS_CONTENT_TYPE_IMAGE) {
         css_make_child_box(box);
     }
+    return 0;
+}
+
+/* evaluate the counters and add the generated boxes of a box and its
+   childs, in document order */
+static int css_compute_generated(CSSContext *s, CSSBox *box)
+{
+    CSSState *props = box->props;
+    CSSBox *box1, *box_next, **pbox;
+    int pelement_found = box->pelement_found;
+    CSSCounterValue *counter_stack;
+
+    css_eval_counters(s, props);
+
+    /* alternate content if image (need more ideas) */
+    if (props->content_alt &&
+        box->content_type == CSS_CONTENT_TYPE_IMAGE) {
+        box->u.image.content_alt = eval_content(s, props->content_alt, box);
+    }
 
     /* if boxes are inside, then evaluate their properties too */
     if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
@@ -1142,7 +1183,7 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
         for (box1 = box->u.child.first; box1 != NULL; box1 = box_next) {
             /* need to take next here because of :after inserted boxes */
             box_next = box1->next;
-            if (css_compute_block(s, box1, props) < 0)
+            if (css_compute_generated(s, box1) < 0)
                 return -1;
         }
 
@@ -1208,6 +1249,138 @@ static int css_compute_block(CSSContext *s, CSSBox *box,
     return 0;
 }
 
+static int css_compute_props_tree(CSSContext *s, CSSBox *box,
+                                  CSSState *parent_props)
+{
+    CSSBox *box1;
+
+    if (css_compute_props(s, box, parent_props) < 0)
+        return -1;
+    if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+        for (box1 = box->u.child.first; box1 != NULL; box1 = box1->next) {
+            if (css_compute_props_tree(s, box1, box->props) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* compute the CSS properties of a box and its childs */
+static int css_compute_block(CSSContext *s, CSSBox *box,
+                             CSSState *parent_props)
+{
+    if (css_compute_props_tree(s, box, parent_props) < 0)
+        return -1;
+    return css_compute_generated(s, box);
+}
+
+/* The properties of a box only depend on the properties of its
+ * parent: the tree is computed one level at a time and the boxes of
+ * a level are split between the worker threads.
+ */
+
+#define CSS_COMPUTE_MIN_PART   256   /* minimum boxes computed by a thread */
+#define CSS_COMPUTE_MAX_PARTS  16
+
+typedef struct CSSComputeItem {
+    CSSBox *box;
+    CSSState *parent_props;
+} CSSComputeItem;
+
+typedef struct CSSComputeLevel {
+    CSSContext *ctx;
+    CSSComputeItem *items;
+    int nb_items;
+    int nb_parts;
+    int ret[CSS_COMPUTE_MAX_PARTS];
+} CSSComputeLevel;
+
+static void css_compute_part(void *opaque, int i)
+{
+    CSSComputeLevel *cl = opaque;
+    int k, k_end;
+
+    k = (int)((long long)cl->nb_items * i / cl->nb_parts);
+    k_end = (int)((long long)cl->nb_items * (i + 1) / cl->nb_parts);
+    cl->ret[i] = 0;
+    for (; k < k_end; k++) {
+        if (css_compute_props(cl->ctx, cl->items[k].box,
+                              cl->items[k].parent_props) < 0) {
+            cl->ret[i] = -1;
+            break;
+        }
+    }
+}
+
+static int css_compute_levels(CSSContext *s, CSSBox *box,
+                              CSSState *parent_props)
+{
+    CSSComputeLevel cl;
+    CSSComputeItem *next_items, *tmp;
+    CSSBox *box1;
+    int i, k, nb_next, items_size, next_size, ret;
+
+    cl.ctx = s;
+    cl.items = qe_malloc(CSSComputeItem);
+    next_items = NULL;
+    next_size = 0;
+    ret = -1;
+    if (!cl.items)
+        goto done;
+    cl.items[0].box = box;
+    cl.items[0].parent_props = parent_props;
+    cl.nb_items = 1;
+    items_size = 1;
+
+    while (cl.nb_items > 0) {
+        cl.nb_parts = clamp(cl.nb_items / CSS_COMPUTE_MIN_PART,
+                            1, CSS_COMPUTE_MAX_PARTS);
+        qe_job_parallel(cl.nb_parts, css_compute_part, &cl);
+        for (i = 0; i < cl.nb_parts; i++) {
+            if (cl.ret[i] < 0)
+                goto done;
+        }
+
+        /* the childs of this level make the next one */
+        nb_next = 0;
+        for (k = 0; k < cl.nb_items; k++) {
+            box = cl.items[k].box;
+            if (box->content_type != CSS_CONTENT_TYPE_CHILDS)
+                continue;
+            for (box1 = box->u.child.first; box1; box1 = box1->next)
+                nb_next++;
+        }
+        if (nb_next > next_size) {
+            if (!qe_realloc(&next_items, nb_next * sizeof(*next_items)))
+                goto done;
+            next_size = nb_next;
+        }
+        nb_next = 0;
+        for (k = 0; k < cl.nb_items; k++) {
+            box = cl.items[k].box;
+            if (box->content_type != CSS_CONTENT_TYPE_CHILDS)
+                continue;
+            for (box1 = box->u.child.first; box1; box1 = box1->next) {
+                next_items[nb_next].box = box1;
+                next_items[nb_next].parent_props = box->props;
+                nb_next++;
+            }
+        }
+        tmp = cl.items;
+        cl.items = next_items;
+        next_items = tmp;
+        i = items_size;
+        items_size = next_size;
+        next_size = i;
+        cl.nb_items = nb_next;
+    }
+    ret = 0;
+ done:
+    qe_free(&cl.items);
+    qe_free(&next_items);
+    return ret;
+}
+
 /* compute the CSS properties of a complete document */
 int css_compute(CSSContext *s, CSSBox *box)
 {
@@ -1218,7 +1391,9 @@ int css_compute(CSSContext *s, CSSBox *box)
     set_default_props(s, default_props);
     s->counter_stack_base = NULL;
     s->counter_stack_ptr = NULL;
-    ret = css_compute_block(s, box, default_props);
+    ret = css_compute_levels(s, box, default_props);
+    if (!ret)
+        ret = css_compute_generated(s, box);
     pop_counters(s, NULL);
 
     //    printf("nb_props=%d\n", s->nb_props);
@@ -1260,6 +1435,36 @@ static void css_box_split(CSSBox *box1, int offset)
     box2->parent = box1->parent;
 }
 
+/* merge back the boxes split by a previous layout and reset the
+   layout info so that the tree can be laid out again */
+void css_merge_split_boxes(CSSBox *box)
+{
+    CSSBox *box1;
+
+    for (; box != NULL; box = box->next) {
+        /* some layout passes update the position incrementally */
+        memset(&box->bbox, 0, sizeof(box->bbox));
+        box->x = box->y = 0;
+        box->width = box->height = 0;
+        box->padding_top = box->padding_bottom = 0;
+        box->ascent = 0;
+        box->embedding_level = 0;
+        box->absolute_pos = 0;
+        box->last_space = 0;
+        box->next_inline = NULL;
+        if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+            css_merge_split_boxes(box->u.child.first);
+            continue;
+        }
+        while ((box1 = box->next) != NULL && box1->split) {
+            box->u.buffer.end = box1->u.buffer.end;
+            box->content_eol = box1->content_eol;
+            box->next = box1->next;
+            qe_free(&box1);
+        }
+    }
+}
+
 /******************************************************************/
 /* text layout */
 
@@ -3756,6 +3961,9 @@ int css_layout(CSSContext *s, CSSBox *box, int width,
     s->abort_func = abort_func;
     s->abort_opaque = abort_opaque;
 
+    /* undo the splits of the previous layout if any */
+    css_merge_split_boxes(box);
+
     /* bidi compute */
     ret = css_layout_bidir_block(s, box);
     if (ret)
@@ -4514,6 +4722,54 @@ void css_set_text_buffer(CSSBox *box, EditBuffer *b,
     box->u.buffer.end = offset2;
 }
 
+typedef struct CSSOffsetUpdate {
+    int offset, size, delta;
+    CSSBox *found;  /* text box containing the change */
+    int overlap;    /* true if the change overlaps other text boxes */
+} CSSOffsetUpdate;
+
+static void css_update_box_offsets(CSSOffsetUpdate *s, CSSBox *box)
+{
+    for (; box != NULL; box = box->next) {
+        if (box->content_type == CSS_CONTENT_TYPE_CHILDS) {
+            css_update_box_offsets(s, box->u.child.first);
+            continue;
+        }
+        if (box->content_type != CSS_CONTENT_TYPE_BUFFER)
+            continue;
+        if (!s->found && box->u.buffer.start <= s->offset
+        &&  s->offset + s->size <= box->u.buffer.end) {
+            s->found = box;
+            box->u.buffer.end += s->delta;
+        } else
+        if (box->u.buffer.start >= s->offset + s->size) {
+            box->u.buffer.start += s->delta;
+            box->u.buffer.end += s->delta;
+        } else
+        if (box->u.buffer.end > s->offset) {
+            s->overlap = 1;
+        }
+    }
+}
+
+/* Update the buffer offsets of the text boxes after the 'size' bytes
+   at 'offset' were replaced by 'size + delta' bytes. Return the text
+   box containing the change, or NULL if the change is not inside a
+   single text box, in which case the tree must be built again. The
+   boxes split by the layout must have been merged first. */
+CSSBox *css_update_offsets(CSSBox *box, int offset, int size, int delta)
+{
+    CSSOffsetUpdate s;
+
+    s.offset = offset;
+    s.size = size;
+    s.delta = delta;
+    s.found = NULL;
+    s.overlap = 0;
+    css_update_box_offsets(&s, box);
+    return s.overlap ? NULL : s.found;
+}
+
 /* note: the string is reallocated */
 void css_set_text_string(CSSBox *box, const char *string)
 {
@@ -380,6 +380,9 @@ struct CSSBox {
     /* true if there was a space in the previous box (useful in inline
        formatting context) */
     unsigned char last_space;
+    /* pseudo elements found by css_compute() for this box
+       (CSS_PCLASS_BEFORE, CSS_PCLASS_AFTER) */
+    unsigned short pelement_found;
     /* next inline box in an inline formatting context. Only used
        during bidi pass, so we could put this field in another field
        to save space */
@@ -631,6 +634,8 @@ void css_set_text_buffer(CSSBox *box, EditBuffer *b,
 void css_set_text_string(CSSBox *box, const char *string);
 void css_make_child_box(CSSBox *box);
 void css_set_child_box(CSSBox *parent_box, CSSBox *box);
+void css_merge_split_boxes(CSSBox *box);
+CSSBox *css_update_offsets(CSSBox *box, int offset, int size, int delta);
 
 /* box tree display (debug) */
 void css_dump_box(CSSBox *box, int level);
@@ -97,6 +97,11 @@ ModeDef *qe_find_mode(const char *name, int flags)
     QEmacsState *qs = &qe_state;
     ModeDef *m;
 
+    /* the index holds the first mode registered with this name */
+    m = qe_hash_find(&qs->mode_index, name);
+    if (!m || (m->flags & flags) == flags)
+        return m;
+
     for (m = qs->first_mode; m; m = m->next) {
         if ((m->flags & flags) == flags) {
             if ((m->name && !strcasecmp(m->name, name))
@@ -138,6 +143,12 @@ void qe_register_mode(ModeDef *m, int flags)
             break;
         }
     }
+    /* mode names are matched case insensitively */
+    qs->mode_index.nocase = 1;
+    if (m->name)
+        qe_hash_add(&qs->mode_index, m->name, m, 0);
+    if (m->alt_name)
+        qe_hash_add(&qs->mode_index, m->alt_name, m, 0);
 
     m->flags |= flags;
 
@@ -230,18 +241,8 @@ static CompletionDef mode_completion = {
 CmdDef *qe_find_cmd(const char *cmd_name)
 {
     QEmacsState *qs = &qe_state;
-    CmdDef *d;
 
-    d = qs->first_cmd;
-    while (d != NULL) {
-        while (d->name != NULL) {
-            if (strequal(cmd_name, d->name))
-                return d;
-            d++;
-        }
-        d = d->action.next;
-    }
-    return NULL;
+    return qe_hash_find(&qs->cmd_index, cmd_name);
 }
 
 void command_complete(CompleteState *cp)
@@ -332,6 +333,7 @@ static int qe_register_binding1(unsigned int *keys, int nb_keys,
 #endif
     p->next = *lp;
     *lp = p;
+    qs->key_generation++;
     return 0;
 }
 
@@ -370,8 +372,11 @@ void qe_register_cmd_table(CmdDef *cmds, ModeDef *m)
     for (ld = &qs->first_cmd;;) {
         d = *ld;
         if (d == NULL) {
-            /* link new command table */
+            /* link new command table, the first definition of a name
+               takes precedence */
             *ld = cmds;
+            for (d = cmds; d->name != NULL; d++)
+                qe_hash_add(&qs->cmd_index, d->name, d, 0);
             break;
         }
         if (d == cmds) {
@@ -453,6 +458,7 @@ void do_toggle_control_h(EditState *s, int set)
         return;
 
     qs->backspace_is_control_h = set;
+    qs->key_generation++;
 
     /* CG: This hack in incompatible with support for multiple
      * concurrent input consoles.
@@ -1896,6 +1902,10 @@ void do_break(EditState *s)
     s->region_style = QE_STYLE_DEFAULT;
     /* deactivate search hilite */
     s->isearch_state = NULL;
+    /* deactivate difference hilite */
+#ifndef CONFIG_TINY
+    diff_clear_hilite(s);
+#endif
 
     /* well, currently nothing needs to be aborted in global context */
     /* CG: Should remove popups, sidepanes, helppanes... */
@@ -2155,6 +2165,9 @@ static int reload_buffer(EditState *s, EditBuffer *b)
         }
         return -1;
     } else {
+        if (s->qe_state->auto_revert && b->data_type == &raw_data_type
+        &&  !b->map_address)
+            eb_watch_file(b);
         return 0;
     }
 }
@@ -2489,10 +2502,9 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, len, i;
+    int i;
     EditBufferCallbackList *cb;
     int pos[32];
-    char buf[MAX_CHAR_BYTES];
 
     eol_type = s->b->eol_type;
     charset = read_charset(s, charset_str, &eol_type);
@@ -2513,14 +2525,7 @@ void do_convert_buffer_file_coding_system(EditState *s,
         }
     }
 
-    /* slow, but simple iterative method */
-    for (offset = 0; offset < b->total_size;) {
-        QETermStyle style = eb_get_style(b, offset);
-        int c = eb_nextc(b, offset, &offset);
-        b1->cur_style = style;
-        len = eb_encode_uchar(b1, buf, c);
-        eb_insert(b1, b1->total_size, buf, len);
-    }
+    eb_insert_buffer_convert(b1, 0, b, 0, b->total_size);
 
     /* replace current buffer with conversion */
     /* quick hack to transfer styles from tmp buffer to b */
@@ -4209,7 +4214,7 @@ static int syntax_get_colorized_line(EditState *s,
 {
     QEColorizeContext cctx;
     EditBuffer *b = s->b;
-    int i, len, line, n, col, bom;
+    int i, len, line, n, col, bom, truncated;
 
     /* invalidate cache if needed */
     if (s->colorize_max_valid_offset != INT_MAX) {
@@ -4251,22 +4256,42 @@ static int syntax_get_colorized_line(EditState *s,
         cctx.state_only = 1;
 
         for (line = s->colorize_nb_valid_lines; line <= line_num; line++) {
+            unsigned int *lbuf = buf;
+            int lbuf_size = buf_size;
+
             cctx.offset = offset;
-            len = eb_get_line(b, buf, buf_size - 1, offset, &offset);
-            if (buf[len] != '\n') {
-                /* line was truncated */
-                /* XXX: should use reallocatable buffer */
-                offset = eb_goto_pos(b, line, 0);
+            for (;;) {
+                len = eb_get_line(b, lbuf, lbuf_size - 1, cctx.offset, &offset);
+                if (lbuf[len] == '\n')
+                    break;
+                /* line was truncated: colorize it in full from a
+                   temporary buffer so the next line state is correct */
+                lbuf_size *= 2;
+                if (lbuf == buf) {
+                    lbuf = qe_malloc_array(unsigned int, lbuf_size);
+                } else
+                if (!qe_realloc(&lbuf, lbuf_size * sizeof(*lbuf))) {
+                    qe_free(&lbuf);
+                }
+                if (!lbuf) {
+                    /* out of memory: colorize the truncated line */
+                    lbuf = buf;
+                    len = eb_get_line(b, lbuf, buf_size - 1, cctx.offset, &offset);
+                    offset = eb_next_line(b, offset);
+                    break;
+                }
             }
-            buf[len] = '\0';
+            lbuf[len] = '\0';
 
             /* skip byte order mark if present */
-            bom = (buf[0] == 0xFEFF);
+            bom = (lbuf[0] == 0xFEFF);
             if (bom) {
                 cctx.offset = eb_next(b, cctx.offset);
             }
-            s->colorize_func(&cctx, buf + bom, len - bom, s->colorize_mode);
+            s->colorize_func(&cctx, lbuf + bom, len - bom, s->colorize_mode);
             s->colorize_states[line] = cctx.colorize_state;
+            if (lbuf != buf)
+                qe_free(&lbuf);
         }
     }
 
@@ -4275,9 +4300,9 @@ static int syntax_get_colorized_line(EditState *s,
     cctx.state_only = 0;
     cctx.offset = offset;
     len = eb_get_line(b, buf, buf_size - 1, offset, offsetp);
-    if (buf[len] != '\n') {
+    truncated = (buf[len] != '\n');
+    if (truncated) {
         /* line was truncated */
-        /* XXX: should use reallocatable buffer */
         *offsetp = eb_next_line(b, offset);
     }
     buf[len] = '\0';
@@ -4301,11 +4326,15 @@ static int syntax_get_colorized_line(EditState *s,
     buf[len + 1] = 0;
 
     /* XXX: if state is same as previous, minimize invalid region? */
-    s->colorize_states[line_num + 1] = cctx.colorize_state;
+    if (!truncated) {
+        /* the state after a truncated line is computed when
+           propagating, from the whole line */
+        s->colorize_states[line_num + 1] = cctx.colorize_state;
 
-    /* Extend valid area */
-    if (s->colorize_nb_valid_lines < line_num + 2)
-        s->colorize_nb_valid_lines = line_num + 2;
+        /* Extend valid area */
+        if (s->colorize_nb_valid_lines < line_num + 2)
+            s->colorize_nb_valid_lines = line_num + 2;
+    }
 
     /* Extract styles from colored codepoint array */
     for (i = 0; i <= len + 1; i++) {
@@ -4395,23 +4424,65 @@ int get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
     }
 }
 
+/* Get the colorized line at `offset` into the window line buffers.
+ * The buffers are grown geometrically until the whole line fits, so
+ * long lines are colorized without truncation, but their size is
+ * bounded by COLORED_LINE_BUF_MAX. Returns the number of chars or -1
+ * if the buffers cannot be allocated.
+ */
+static int get_colorized_line_buf(EditState *s, int offset, int *offsetp,
+                                  int line_num)
+{
+    int len, n;
+
+    for (n = COLORED_MAX_LINE_SIZE;; n *= 2) {
+        if (n > s->line_buf_size) {
+            if (!qe_realloc(&s->line_buf, n * sizeof(*s->line_buf))
+            ||  !qe_realloc(&s->line_sbuf, n * sizeof(*s->line_sbuf))) {
+                return -1;
+            }
+            s->line_buf_size = n;
+        }
+        if (n < s->line_buf_size)
+            continue;
+        len = get_colorized_line(s, s->line_buf, n, s->line_sbuf,
+                                 offset, offsetp, line_num);
+        /* get_colorized_line reads at most n - 2 chars */
+        if (len < n - 2 || *offsetp >= s->b->total_size
+        ||  n >= COLORED_LINE_BUF_MAX)
+            return len;
+    }
+}
+
+/* Test if the rest of the line being laid out is outside the window:
+ * below the bottom for wrapped lines, beyond the right border for
+ * truncated LTR lines.
+ */
+static int display_past_window(DisplayState *ds)
+{
+    if (ds->wrap == WRAP_TRUNCATE || ds->wrap == WRAP_AUTO)
+        return ds->base == DIR_LTR && ds->x > ds->width;
+    else
+        return ds->y >= ds->height;
+}
+
 #define RLE_EMBEDDINGS_SIZE    128
 
 /* Display one line in the window */
 int text_display_line(EditState *s, DisplayState *ds, int offset)
 {
     int c;
-    int offset0, offset1, line_num, col_num;
+    int offset0, offset1, offset_next, line_num, col_num;
     TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
-    unsigned int buf[COLORED_MAX_LINE_SIZE];
-    QETermStyle sbuf[COLORED_MAX_LINE_SIZE];
+    unsigned int *buf = NULL;
+    QETermStyle *sbuf = NULL;
     int i, char_index, colored_nb_chars;
 
     line_num = 0;
     /* XXX: should test a flag, to avoid this call in hex/binary */
-    if (s->bools.get.line_numbers || s->colorize_func) {
+    if (s->bools.get.line_numbers || s->colorize_func || s->diff_state) {
         eb_get_pos(s->b, &line_num, &col_num, offset);
     }
 
@@ -4456,10 +4527,16 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
         || s->b->b_styles
         || s->bools.get.hl_current_line
         || s->region_style != QE_STYLE_DEFAULT
-        || s->isearch_state) {
-        /* XXX: deal with truncation */
-        colored_nb_chars = get_colorized_line(s, buf, countof(buf), sbuf,
-                                              offset, &offset0, line_num);
+        || s->isearch_state
+        || s->diff_state) {
+        colored_nb_chars = get_colorized_line_buf(s, offset, &offset0,
+                                                  line_num);
+        if (colored_nb_chars < 0) {
+            colored_nb_chars = 0;
+            offset0 = eb_next_line(s->b, offset);
+        }
+        buf = s->line_buf;
+        sbuf = s->line_sbuf;
         if (s->mode == &list_mode) {
             QEmacsState *qs = s->qe_state;
             int i;
@@ -4482,6 +4559,11 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
         if (s->isearch_state) {
             isearch_colorize_matches(s, buf, colored_nb_chars, sbuf, offset);
         }
+#ifndef CONFIG_TINY
+        if (s->diff_state) {
+            diff_colorize_line(s, buf, colored_nb_chars, sbuf, line_num);
+        }
+#endif
     }
 
     /* line numbers */
@@ -4541,6 +4623,7 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
 
     bd = embeds + 1;
     char_index = 0;
+    offset_next = -1;
     while (1) {
         offset0 = offset;
         if (offset >= s->b->total_size) {
@@ -4551,6 +4634,23 @@ int text_display_line(EditState *s, DisplayState *ds, int offset)
             offset = -1; /* signal end of text */
             break;
         } else {
+            if (ds->do_disp == DISP_PRINT && !(s->flags & WF_MINIBUF)
+            &&  display_past_window(ds)) {
+                /* Early bailout: the rest of a long line is not visible,
+                   skip it unless the cursor is still to be found there. */
+                if (offset_next < 0)
+                    offset_next = eb_next_line(s->b, offset0);
+                if (ds->eod || s->offset < offset0
+                ||  (s->offset >= offset_next && offset_next < s->b->total_size)) {
+                    display_eol(ds, -1, -1);
+                    offset = offset_next;
+                    if (offset >= s->b->total_size
+                    &&  eb_prevc(s->b, offset, &offset0) != '\n') {
+                        offset = -1; /* signal end of text */
+                    }
+                    break;
+                }
+            }
             ds->style = (char_index < colored_nb_chars) ?
                 sbuf[char_index] : QE_STYLE_DEFAULT;
 
@@ -5399,6 +5499,7 @@ void do_execute_macro_keys(qe__unused__ EditState *s, const char *keys)
 void do_define_kbd_macro(EditState *s, const char *name, const char *keys,
                          const char *key_bind)
 {
+    QEmacsState *qs = s->qe_state;
     CmdDef *def;
     int namelen, size;
     char *buf;
@@ -5420,8 +5521,10 @@ void do_define_kbd_macro(EditState *s, const char *name, const char *keys,
         /* XXX: freeing the current macro definition may cause a crash if it
          * is currently executing.
          */
-        qe_free((char **)&def->name);
+        char *old_name = (char *)def->name;
         def->name = buf;
+        qe_hash_add(&qs->cmd_index, def->name, def, 1);
+        qe_free(&old_name);
     } else {
         def = qe_mallocz_array(CmdDef, 2);
         def->key = def->alt_key = KEY_NONE;
@@ -5569,9 +5672,147 @@ KeyDef *qe_find_binding(unsigned int *keys, int nb_keys, KeyDef *kd)
     return kd;
 }
 
+/* Key bindings index: every prefix of the key sequences bound in a
+ * mode, its fallback modes and the global keymap, mapped to the first
+ * binding a linear search of these lists would find.  Indexes are
+ * built on first use and rebuilt after qs->key_generation changes.
+ */
+struct KeyIndex {
+    KeyIndex *next;
+    ModeDef *mode;          /* owner: ModeDef structures may be copied */
+    int generation;
+    int size;               /* power of 2, at most half full */
+    struct KeyIndexEntry {
+        KeyDef *kd;
+        unsigned int hash;
+        int nb_keys;
+    } *table;
+};
+
+static struct KeyIndexEntry *qe_key_index_lookup(KeyIndex *ki,
+    const unsigned int *keys, int nb_keys, unsigned int hash)
+{
+    unsigned int mask = ki->size - 1;
+    unsigned int i = hash & mask;
+    struct KeyIndexEntry *e;
+
+    for (;;) {
+        e = &ki->table[i];
+        if (!e->kd
+        ||  (e->hash == hash && e->nb_keys == nb_keys
+        &&   !memcmp(e->kd->keys, keys, nb_keys * sizeof(keys[0]))))
+            return e;
+        i = (i + 1) & mask;
+    }
+}
+
+static KeyIndex *first_key_index;
+
+static unsigned int qe_hash_keys(const unsigned int *keys, int nb_keys)
+{
+    /* FNV-1a on key codes */
+    unsigned int h = 2166136261U;
+    int i;
+
+    for (i = 0; i < nb_keys; i++)
+        h = (h ^ keys[i]) * 16777619U;
+    return h;
+}
+
+static void qe_key_index_add(KeyIndex *ki, KeyDef *kd)
+{
+    struct KeyIndexEntry *e;
+    unsigned int h;
+    int n;
+
+    for (; kd != NULL; kd = kd->next) {
+        h = 2166136261U;
+        for (n = 1; n <= kd->nb_keys; n++) {
+            h = (h ^ kd->keys[n - 1]) * 16777619U;
+            e = qe_key_index_lookup(ki, kd->keys, n, h);
+            if (!e->kd) {
+                e->kd = kd;
+                e->hash = h;
+                e->nb_keys = n;
+            }
+        }
+    }
+}
+
+static KeyIndex *qe_get_key_index(QEmacsState *qs, ModeDef *m)
+{
+    KeyIndex **kip = m ? &m->key_index : &qs->key_index;
+    KeyIndex *ki = *kip;
+    ModeDef *m1;
+    KeyDef *kd;
+    int total, size;
+
+    if (ki && ki->mode == m && ki->generation == qs->key_generation)
+        return ki;
+
+    if (!ki || ki->mode != m) {
+        ki = qe_mallocz(KeyIndex);
+        if (!ki)
+            return NULL;
+        ki->mode = m;
+        ki->next = first_key_index;
+        first_key_index = ki;
+        *kip = ki;
+    }
+    total = 0;
+    for (m1 = m;; m1 = m1->fallback) {
+        for (kd = m1 ? m1->first_key : qs->first_key; kd; kd = kd->next)
+            total += kd->nb_keys;
+        if (!m1)
+            break;
+    }
+    for (size = 16; size < total * 2; size *= 2)
+        continue;
+    if (ki->size != size) {
+        qe_free(&ki->table);
+        ki->size = 0;
+        ki->table = qe_mallocz_array(struct KeyIndexEntry, size);
+        if (!ki->table)
+            return NULL;
+        ki->size = size;
+    } else {
+        memset(ki->table, 0, size * sizeof(*ki->table));
+    }
+    for (m1 = m; m1; m1 = m1->fallback)
+        qe_key_index_add(ki, m1->first_key);
+    qe_key_index_add(ki, qs->first_key);
+    ki->generation = qs->key_generation;
+    return ki;
+}
+
+#ifndef CONFIG_TINY
+static void qe_free_key_indexes(void)
+{
+    QEmacsState *qs = &qe_state;
+    ModeDef *m;
+
+    while (first_key_index) {
+        KeyIndex *ki = first_key_index;
+        first_key_index = ki->next;
+        qe_free(&ki->table);
+        qe_free(&ki);
+    }
+    qs->key_index = NULL;
+    for (m = qs->first_mode; m; m = m->next)
+        m->key_index = NULL;
+}
+#endif
+
 KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m)
 {
     QEmacsState *qs = &qe_state;
+    KeyIndex *ki;
+
+    ki = qe_get_key_index(qs, m);
+    if (ki) {
+        return qe_key_index_lookup(ki, keys, nb_keys,
+                                   qe_hash_keys(keys, nb_keys))->kd;
+    }
 
     for (; m; m = m->fallback) {
         KeyDef *kd = qe_find_binding(keys, nb_keys, m->first_key);
@@ -5715,8 +5956,13 @@ static void qe_key_process(int key)
                 exec_command(s, d, argval, key);
             }
             qe_key_init(c);
-            edit_display(qs);
-            dpy_flush(&global_screen);
+            if (dpy_is_user_input_pending(qs->screen)) {
+                /* more keys to process: coalesce redisplay */
+                url_request_display();
+            } else {
+                edit_display(qs);
+                dpy_flush(&global_screen);
+            }
             /* CG: should move ungot key handling to generic event dispatch */
             if (qs->ungot_key != -1) {
                 key = qs->ungot_key;
@@ -6095,6 +6341,8 @@ void edit_close(EditState **sp)
         qe_free(&s->prompt);
         qe_free(&s->caption.text);
         qe_free(&s->line_shadow);
+        qe_free(&s->line_buf);
+        qe_free(&s->line_sbuf);
         s->shadow_nb_lines = 0;
         qe_free(sp);
     }
@@ -8385,8 +8633,7 @@ void qe_event_init(void)
 /* see also qe_fast_test_event() */
 int qe__is_user_input_pending(void)
 {
-    QEditScreen *s = &global_screen;
-    return s->dpy.dpy_is_user_input_pending(s);
+    return dpy_is_user_input_pending(&global_screen);
 }
 
 #endif
@@ -9288,6 +9535,10 @@ static void qe_init(void *opaque)
     qs->default_fill_column = DEFAULT_FILL_COLUMN;
     qs->mmap_threshold = MIN_MMAP_SIZE;
     qs->max_load_size = MAX_LOAD_SIZE;
+    qs->sort_memory_limit = SORT_MEMORY_LIMIT;
+    qs->compare_words = 1;
+    qs->display_frame_rate = DEFAULT_DISPLAY_FRAME_RATE;
+    qs->shell_scrollback = DEFAULT_SHELL_SCROLLBACK;
 
     /* setup resource path */
     set_user_option(NULL);
@@ -9495,6 +9746,7 @@ int main(int argc, char **argv)
             EditBuffer *b = qs->first_buffer;
             eb_free(&b);
         }
+        qe_hash_free(&qs->cmd_index);
         while (qs->first_cmd) {
             CmdDef *d = qs->first_cmd;
             CmdDef *d1 = d;
@@ -9507,11 +9759,14 @@ int main(int argc, char **argv)
                 qe_free(&d);
             }
         }
+        qe_free_key_indexes();
         while (qs->first_key) {
             KeyDef *p = qs->first_key;
             qs->first_key = p->next;
             qe_free(&p);
         }
+        qe_hash_free(&qs->mode_index);
+        qe_hash_free(&qs->variable_index);
         while (qs->first_mode) {
             ModeDef *m = qs->first_mode;
             qs->first_mode = m->next;
@@ -9522,6 +9777,11 @@ int main(int argc, char **argv)
                 qe_free(&p);
             }
         }
+#ifndef CONFIG_TINY
+        qe_free_scripts();
+        tag_index_free();
+        diff_free();
+#endif
         css_free_colors();
         free_font_cache(&global_screen);
         qe_free(&qs->buffer_cache);
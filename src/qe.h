@@ -53,6 +53,12 @@
 #ifndef DEFAULT_FILL_COLUMN
 #define DEFAULT_FILL_COLUMN  70
 #endif
+#ifndef DEFAULT_DISPLAY_FRAME_RATE
+#define DEFAULT_DISPLAY_FRAME_RATE  60 /* frames per second */
+#endif
+#ifndef DEFAULT_SHELL_SCROLLBACK
+#define DEFAULT_SHELL_SCROLLBACK  0  /* lines, 0 for unlimited */
+#endif
 
 /* OS specific defines */
 #ifdef __GNUC__
@@ -147,8 +153,10 @@ typedef struct ModeDef ModeDef;
 typedef struct QETimer QETimer;
 typedef struct QEColorizeContext QEColorizeContext;
 typedef struct KeyDef KeyDef;
+typedef struct KeyIndex KeyIndex;
 typedef struct InputMethod InputMethod;
 typedef struct ISearchState ISearchState;
+typedef struct DiffState DiffState;
 typedef struct QEProperty QEProperty;
 
 static inline char *s8(u8 *p) { return (char*)p; }
@@ -179,12 +187,41 @@ int set_pid_handler(int pid,
                     void (*cb)(void *opaque, int status), void *opaque);
 void url_exit(void);
 void url_redisplay(void);
+void url_request_display(void);
 void register_bottom_half(void (*cb)(void *opaque), void *opaque);
 void unregister_bottom_half(void (*cb)(void *opaque), void *opaque);
 
 QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque));
 void qe_kill_timer(QETimer **tip);
 
+/* Jobs: `work` runs on a worker thread, it must not access editor
+   structures and should poll qe_job_cancelled() in long loops.
+   `done` is always called once from the main loop, then the job is
+   freed. */
+typedef struct QEJob QEJob;
+QEJob *qe_job_submit(void (*work)(void *opaque, QEJob *job),
+                     void (*done)(void *opaque, int cancelled),
+                     void *opaque);
+void qe_job_cancel(QEJob *job);
+int qe_job_cancelled(QEJob *job);
+/* Run `work(opaque, i)` for `i` from 0 to `n - 1` on the worker
+   threads and the calling thread, return when all calls are done.
+   The same restrictions as for jobs apply to `work`. */
+void qe_job_parallel(int n, void (*work)(void *opaque, int i), void *opaque);
+
+/* Directory watches */
+enum {
+    QE_WATCH_CREATE,    /* entry created or moved into the directory */
+    QE_WATCH_DELETE,    /* entry deleted or moved out of the directory */
+    QE_WATCH_MODIFY,    /* entry contents or attributes changed */
+    QE_WATCH_RESCAN,    /* directory itself changed or events were lost */
+};
+typedef struct QEWatch QEWatch;
+QEWatch *qe_watch_add(const char *path,
+                      void (*cb)(void *opaque, int event, const char *name),
+                      void *opaque);
+void qe_watch_remove(QEWatch **wp);
+
 /* main loop for Unix programs using liburlio */
 void url_main_loop(void (*init)(void *opaque), void *opaque);
 
@@ -347,6 +384,8 @@ FindFileState *find_file_open(const char *path, const char *pattern);
 int find_file_next(FindFileState *s, char *filename, int filename_size_max);
 void find_file_close(FindFileState **sp);
 int is_directory(const char *path);
+FILE *qe_fopen_tmp(char *tmpname, int size, const char *filename);
+int qe_fclose_tmp(FILE *f, const char *tmpname, const char *filename);
 int is_filepattern(const char *filespec);
 void canonicalize_path(char *buf, int buf_size, const char *path);
 void canonicalize_absolute_path(EditState *s, char *buf, int buf_size, const char *path1);
@@ -546,6 +585,24 @@ StringItem *set_string(StringArray *cs, int index, const char *str, int group);
 StringItem *add_string(StringArray *cs, const char *str, int group);
 void free_strings(StringArray *cs);
 
+/* hash index of named objects: names are not copied and must stay
+   valid while they are indexed */
+typedef struct QEHashEntry {
+    const char *name;
+    void *data;
+} QEHashEntry;
+
+typedef struct QEHashIndex {
+    QEHashEntry *table;
+    int size;       /* power of 2 */
+    int count;
+    int nocase;     /* ASCII case insensitive names */
+} QEHashIndex;
+
+void *qe_hash_find(QEHashIndex *h, const char *name);
+int qe_hash_add(QEHashIndex *h, const char *name, void *data, int replace);
+void qe_hash_free(QEHashIndex *h);
+
 /* simple dynamic strings wrappers. The strings are always terminated
    by zero except if they are empty. */
 typedef struct QString {
@@ -633,6 +690,10 @@ static inline int bstr_equal(bstr_t s1, bstr_t s2) {
 void qe_qsort_r(void *base, size_t nmemb, size_t size, void *thunk,
                 int (*compar)(void *, const void *, const void *));
 
+/* line and word differences for compare-windows */
+int diff_run(const unsigned int *a, int n, const unsigned int *b, int m,
+             u8 *ca, u8 *cb);
+
 /* Command line options */
 enum CmdLineOptionType {
     CMD_LINE_TYPE_NONE   = 0,  /* nothing */
@@ -765,6 +826,14 @@ struct QECharset {
     int (*get_chars_func)(CharsetDecodeState *s, const u8 *buf, int size);
     int (*goto_char_func)(CharsetDecodeState *s, const u8 *buf, int size, int pos);
     int (*goto_line_func)(CharsetDecodeState *s, const u8 *buf, int size, int lines);
+    /* optional bulk conversion to and from UTF-8: convert the complete
+       characters of [*pp, end) into at most size bytes at buf, update
+       *pp and return the number of bytes stored. Line ends are not
+       translated. */
+    int (*to_utf8_func)(CharsetDecodeState *s, u8 *buf, int size,
+                        const u8 **pp, const u8 *end);
+    int (*from_utf8_func)(QECharset *charset, u8 *buf, int size,
+                          const u8 **pp, const u8 *end);
     unsigned int char_size : 3;
     unsigned int variable_size : 1;
     unsigned int table_alloc : 1; /* true if CharsetDecodeState.table must be malloced */
@@ -838,6 +907,10 @@ QECharset *detect_charset(const u8 *buf, int size, EOLType *eol_typep);
 void decode_8bit_init(CharsetDecodeState *s);
 int decode_8bit(CharsetDecodeState *s);
 u8 *encode_8bit(QECharset *charset, u8 *q, int c);
+int to_utf8_8bit(CharsetDecodeState *s, u8 *buf, int size,
+                 const u8 **pp, const u8 *end);
+int from_utf8_8bit(QECharset *charset, u8 *buf, int size,
+                   const u8 **pp, const u8 *end);
 
 int unicode_tty_glyph_width(unsigned int ucs);
 
@@ -982,7 +1055,13 @@ void qe_ungrab_keys(void);
 KeyDef *qe_find_binding(unsigned int *keys, int nb_keys, KeyDef *kd);
 KeyDef *qe_find_current_binding(unsigned int *keys, int nb_keys, ModeDef *m);
 
+/* size of fixed colorized line buffers. The window display uses
+ * reallocatable buffers so longer lines are not truncated, up to
+ * COLORED_LINE_BUF_MAX chars: the rest of a longer line is displayed
+ * without colors.
+ */
 #define COLORED_MAX_LINE_SIZE  4096
+#define COLORED_LINE_BUF_MAX   (1 << 20)
 
 /* colorize & transform a line, lower level then ColorizeFunc */
 /* XXX: should return `len`, the number of valid codepoints copied to
@@ -1016,6 +1095,7 @@ typedef void (*ColorizeFunc)(QEColorizeContext *cp,
 /* begin to mmap files from this size */
 #define MIN_MMAP_SIZE  (2*1024*1024)
 #define MAX_LOAD_SIZE  (512*1024*1024)
+#define SORT_MEMORY_LIMIT  (64*1024*1024)
 
 #define MAX_PAGE_SIZE  4096
 //#define MAX_PAGE_SIZE 16
@@ -1143,7 +1223,8 @@ struct EditBuffer {
 
     /* modification callbacks */
     OWNED EditBufferCallbackList *first_callback;
-    OWNED QEProperty *property_list;
+    OWNED QEProperty *property_tree;
+    QEHashIndex tag_names;  /* first tag property by name, built on demand */
 
 #if 0
     /* asynchronous loading/saving support */
@@ -1180,6 +1261,8 @@ struct EditBuffer {
     /* Should keep a stat buffer to check for file type and
      * asynchronous modifications
      */
+    QEWatch *file_watch;    /* file directory watch for auto-revert */
+    QETimer *revert_timer;  /* pending auto-revert check */
 };
 
 /* the log buffer is used for the undo operation */
@@ -1244,6 +1327,8 @@ void do_undo(EditState *s);
 void do_redo(EditState *s);
 
 int eb_raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+void eb_watch_file(EditBuffer *b);
+void eb_unwatch_file(EditBuffer *b);
 int eb_mmap_buffer(EditBuffer *b, const char *filename);
 void eb_munmap_buffer(EditBuffer *b);
 int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
@@ -1315,18 +1400,28 @@ void eb_set_data_type(EditBuffer *b, EditBufferDataType *bdt);
 void eb_invalidate_raw_data(EditBuffer *b);
 extern EditBufferDataType raw_data_type;
 
+/* Properties are kept in a treap ordered by offset.  Node offsets are
+ * relative to the parent node so edits shift whole subtrees at once:
+ * use eb_property_offset() to get the buffer offset of a property.
+ */
 struct QEProperty {
-    int offset;
+    int offset;             /* relative to parent, absolute for the root */
 #define QE_PROP_FREE  1
 #define QE_PROP_TAG   3
     int type;
     void *data;
-    QEProperty *next;
+    unsigned int priority;  /* heap order for balancing */
+    unsigned int types;     /* mask of property types in subtree */
+    QEProperty *left, *right, *parent;
 };
 
 void eb_add_property(EditBuffer *b, int offset, int type, void *data);
 QEProperty *eb_find_property(EditBuffer *b, int offset, int offset2, int type);
 void eb_delete_properties(EditBuffer *b, int offset, int offset2);
+QEProperty *eb_first_property(EditBuffer *b);
+QEProperty *eb_next_property(QEProperty *p);
+int eb_property_offset(const QEProperty *p);
+QEProperty *eb_find_tag(EditBuffer *b, const char *name);
 
 /* qe module handling */
 
@@ -1461,6 +1556,7 @@ struct EditState {
 
     EditBuffer *last_buffer;    /* for predict_switch_to_buffer */
     ISearchState *isearch_state;  /* active search to colorize matches */
+    DiffState *diff_state;  /* active comparison to colorize differences */
     EditState *target_window;   /* for minibuf, popleft and popup windows */
 
     /* mode specific info */
@@ -1522,6 +1618,10 @@ struct EditState {
     char modeline_shadow[MAX_SCREEN_WIDTH];
     OWNED QELineShadow *line_shadow; /* per window shadow CRC data */
     int shadow_nb_lines;
+    /* reallocatable colorized line buffers, grown for long lines */
+    OWNED unsigned int *line_buf;
+    OWNED QETermStyle *line_sbuf;
+    int line_buf_size;
     /* compose state for input method */
     InputMethod *input_method; /* current input method */
     InputMethod *selected_input_method; /* selected input method (used to switch) */
@@ -1624,6 +1724,7 @@ struct ModeDef {
 
     /* mode specific key bindings */
     struct KeyDef *first_key;
+    KeyIndex *key_index;    /* bindings index, including fallback modes */
 
     ModeDef *fallback;  /* use bindings from fallback mode */
 
@@ -1687,6 +1788,12 @@ struct QEmacsState {
     //struct QECharset *first_charset;
     //struct QETimer *first_timer;
     struct VarDef *first_variable;
+    /* name indexes for the registries above */
+    QEHashIndex mode_index;
+    QEHashIndex cmd_index;
+    QEHashIndex variable_index;
+    KeyIndex *key_index;        /* global key bindings index */
+    int key_generation;         /* incremented when bindings change */
     InputMethod *input_methods;
     EditState *first_window;
     EditState *active_window; /* window in which we edit */
@@ -1760,9 +1867,11 @@ struct QEmacsState {
     //int force_refresh;  /* force a complete screen refresh */
     int ignore_spaces;  /* ignore spaces when comparing windows */
     int ignore_comments;  /* ignore comments when comparing windows */
+    int compare_words;  /* highlight changed words when comparing windows */
     int hilite_region;  /* hilite the current region when selecting */
     int mmap_threshold; /* minimum file size for mmap */
     int max_load_size;  /* maximum file size for loading in memory */
+    int sort_memory_limit;  /* memory used by sort before spilling runs */
     int default_tab_width;      /* DEFAULT_TAB_WIDTH */
     int default_fill_column;    /* DEFAULT_FILL_COLUMN */
     EOLType default_eol_type;  /* EOL_UNIX */
@@ -1771,6 +1880,9 @@ struct QEmacsState {
     int backspace_is_control_h;
     int backup_inhibited;  /* prevent qemacs from backing up files */
     int c_label_indent;
+    int display_frame_rate; /* max number of scheduled redisplays per second */
+    int shell_scrollback;   /* max number of lines kept in shell buffers */
+    int auto_revert;    /* reload unmodified buffers changed on disk */
     const char *user_option;
 };
 
@@ -2355,6 +2467,7 @@ void set_tty_charset(const char *name);
 /* parser.c */
 
 int parse_config_file(EditState *s, const char *filename);
+void qe_free_scripts(void);
 void do_eval_expression(EditState *s, const char *expression, int argval);
 void do_eval_region(EditState *s); /* should pass actual offsets */
 void do_eval_buffer(EditState *s);
@@ -2366,8 +2479,14 @@ void do_save_session(EditState *s, int popup);
 
 void do_compare_windows(EditState *s, int argval);
 void do_compare_files(EditState *s, const char *filename, int bflags);
+void do_compare_next_difference(EditState *s, int dir);
+void diff_colorize_line(EditState *s, unsigned int *buf, int len,
+                        QETermStyle *sbuf, int line_num);
+void diff_free(void);
+void diff_clear_hilite(EditState *s);
 void do_delete_horizontal_space(EditState *s);
 void do_show_date_and_time(EditState *s, int argval);
+void tag_index_free(void);
 
 enum {
     CMD_TRANSPOSE_CHARS = 1,
@@ -37,6 +37,70 @@ typedef struct QEValue {
     } u;
 } QEValue;
 
+/* Scripts are compiled once to a flat array of opcodes for a small
+ * stack machine.  Identifiers are resolved to command definitions
+ * on first execution and kept in the call descriptor.
+ */
+enum {
+    OP_STMT,                // start statement: line number, recovery pc
+    OP_ERROR,               // report compilation error
+    OP_NUM,                 // push number constant
+    OP_CHAR,                // push character constant
+    OP_STR,                 // push string constant
+    OP_GETVAR,              // push variable value
+    OP_SETVAR,              // assign variable from top of stack
+    OP_UNARY,               // prefix operator
+    OP_BINARY,              // binary operator and subscript
+    OP_LENGTH,              // string length property
+    OP_CALL,                // command call
+    OP_POP,                 // drop top of stack
+    OP_TEST,                // convert top of stack to boolean
+    OP_JUMP,                // unconditional jump
+    OP_JUMPZ,               // jump if false
+    OP_JUMPNZ,              // jump if true
+};
+
+#define OPF_KEEP     1      // conditional jump: keep value if jumping
+#define OPF_POSTFIX  2      // assignment: return previous value
+
+typedef struct QEScriptCall {
+    char *name;             // command name
+    CmdDef *d;              // resolved command
+    int argc;               // number of argument expressions
+    int nb_args;            // number of command arguments
+    int bound;              // argument types are cached
+    unsigned char args_type[MAX_CMD_ARGS];
+} QEScriptCall;
+
+typedef struct QEOpcode {
+    short op;               // opcode
+    short arg;              // operator token or flags
+    int len;                // string length or line number
+    union {
+        long long value;    // number and character constants
+        char *str;          // string constant, variable name or message
+        QEScriptCall *call; // command call descriptor
+        int pc;             // jump target
+    } u;
+    VarDef *var;            // resolved variable
+} QEOpcode;
+
+typedef struct QEScript QEScript;
+struct QEScript {
+    QEScript *next;         // compiled file cache
+    char *filename;         // source filename
+    dev_t dev;              // cache key: source file identity and mtime
+    ino_t ino;
+    time_t mtime;
+    off_t size;
+    int refcount;
+    int code_len;
+    int code_size;
+    QEOpcode *code;
+};
+
+static QEScript *first_script;
+
 typedef struct QEmacsDataSource {
     EditState *s;
     char *allocated_buf;
@@ -47,11 +111,17 @@ typedef struct QEmacsDataSource {
     int line_num;           // source line number
     int tok;                // token type
     int len;                // length of TOK_STRING and TOK_ID string
-    QEValue *sp_max;
+    QEScript *sc;           // script being compiled
+    char errbuf[128];       // first error in current statement
     char str[256];          // token source (XXX: should use source code)
-    QEValue stack[16];
 } QEmacsDataSource;
 
+typedef struct QEScriptVM {
+    EditState *s;
+    QEValue *sp_max;
+    QEValue stack[32];
+} QEScriptVM;
+
 enum {
     TOK_EOF = -1, TOK_ERR = -2, TOK_VOID = 0, TOK_ALLOC = 1,
     TOK_NUMBER = 128, TOK_STRING, TOK_CHAR, TOK_ID, TOK_IF, TOK_ELSE,
@@ -67,7 +137,8 @@ enum {
 static const char ops2[] = "*= /= %= += -= <<= >>= &= ^= |= == != << >> <= >= ++ -- || && ";
 static const char ops1[] = "=<>?:|^&+-*/%,;.!~()[]{}";
 
-static const char prec[] = {
+/* token values above 127 do not fit in a plain char */
+static const unsigned char prec[] = {
     '(', '[', '.', TOK_INC, TOK_DEC, 14,
     '*', '/', '%', 13,
     '+', '-', 12,
@@ -124,28 +195,53 @@ static inline void qe_cfg_set_pstr(QEValue *sp, char *str, int len) {
     sp->type = TOK_STRING;
 }
 
+static inline int qe_cfg_truth(const QEValue *sp) {
+    if (sp->type == TOK_STRING)
+        return 1;
+    if (sp->type == TOK_NUMBER || sp->type == TOK_CHAR)
+        return sp->u.value != 0;
+    return 0;
+}
+
 static void qe_cfg_init(QEmacsDataSource *ds) {
     memset(ds, 0, sizeof(*ds));
-    ds->sp_max = ds->stack;
 }
 
-static void qe_cfg_release(QEmacsDataSource *ds) {
+static void qe_cfg_release(QEScriptVM *vm) {
     QEValue *sp;
-    for (sp = ds->stack; sp < ds->sp_max; sp++)
+    for (sp = vm->stack; sp < vm->sp_max; sp++)
         qe_cfg_set_void(sp);
 }
 
 static int qe_cfg_get_prec(int tok) {
-    char *p = strchr(prec, tok);
-    if (p) {
-        while (*++p >= ' ')
-            continue;
-        return *p;
+    const unsigned char *p;
+    int found = 0;
+
+    for (p = prec; p < prec + countof(prec); p++) {
+        if (*p < ' ') {
+            if (found)
+                return *p;
+        } else
+        if (*p == tok) {
+            found = 1;
+        }
     }
     return 0;
 }
 
-static int qe_cfg_parse_string(EditState *s, const char **pp, int delim,
+static int qe_cfg_error(QEmacsDataSource *ds, const char *fmt, ...) {
+    va_list ap;
+
+    /* keep the first error of the statement */
+    if (!ds->errbuf[0]) {
+        va_start(ap, fmt);
+        vsnprintf(ds->errbuf, sizeof(ds->errbuf), fmt, ap);
+        va_end(ap);
+    }
+    return 1;
+}
+
+static int qe_cfg_parse_string(QEmacsDataSource *ds, const char **pp, int delim,
                                char *dest, int size, int *plen)
 {
     char cbuf[8];
@@ -158,7 +254,7 @@ static int qe_cfg_parse_string(EditState *s, const char **pp, int delim,
     for (;;) {
         int c = *p;
         if (c == '\n' || c == '\0') {
-            put_status(s, "unterminated string");
+            qe_cfg_error(ds, "unterminated string");
             res = -1;
             break;
         }
@@ -225,7 +321,7 @@ static int qe_cfg_next_token(QEmacsDataSource *ds)
             return ds->tok = TOK_EOF;
         ds->p++;
         if (c == '\n') {
-            ds->s->qe_state->ec.lineno = ++ds->line_num;
+            ++ds->line_num;
             continue;
         }
         if (qe_isspace(c))
@@ -245,7 +341,7 @@ static int qe_cfg_next_token(QEmacsDataSource *ds)
                         break;
                     }
                     if (c == '\n')
-                        ds->s->qe_state->ec.lineno = ++ds->line_num;
+                        ++ds->line_num;
                     ds->p++;
                 }
                 continue;
@@ -273,13 +369,13 @@ static int qe_cfg_next_token(QEmacsDataSource *ds)
         if (qe_isdigit(c)) {
             strtoll(ds->start_p, (char **)&ds->p, 0);
             if (qe_isalnum_(*ds->p)) {
-                put_status(ds->s, "invalid number");
+                qe_cfg_error(ds, "invalid number");
                 return ds->tok = TOK_ERR;
             }
             return ds->tok = TOK_NUMBER;
         }
         if (c == '\'' || c == '\"') {
-            if (qe_cfg_parse_string(ds->s, &ds->p, c, ds->str, sizeof(ds->str), &ds->len))
+            if (qe_cfg_parse_string(ds, &ds->p, c, ds->str, sizeof(ds->str), &ds->len))
                 return ds->tok = TOK_ERR;
             if (c == '\'') {
                 return ds->tok = TOK_CHAR;
@@ -304,7 +400,7 @@ static int qe_cfg_next_token(QEmacsDataSource *ds)
         if (strchr(ops1, c)) {
             return ds->tok = c;
         }
-        put_status(ds->s, "unsupported operator: %c", c);
+        qe_cfg_error(ds, "unsupported operator: %c", c);
         return ds->tok = TOK_ERR;
     }
 }
@@ -316,38 +412,481 @@ static int expect_token(QEmacsDataSource *ds, int tok)
         return 1;
     } else {
         /* XXX: pretty print token name */
-        put_status(ds->s, "'%c' expected", tok);
+        qe_cfg_error(ds, "'%c' expected", tok);
         return 0;
     }
 }
 
-static int qe_cfg_getvalue(QEmacsDataSource *ds, QEValue *sp) {
-#ifndef CONFIG_TINY
-    if (sp->type == TOK_ID) {
-        char buf[256];
-        int num;
-        switch (qe_get_variable(ds->s, ds->str, buf, sizeof(buf), &num, 0)) {
-        case VAR_CHARS:
-        case VAR_STRING:
-            qe_cfg_set_str(sp, buf, strlen(buf));
+/*---------------- compiler ----------------*/
+
+static QEOpcode *qe_cfg_emit(QEmacsDataSource *ds, int op, int arg) {
+    static QEOpcode dummy;
+    QEScript *sc = ds->sc;
+    QEOpcode *insn;
+
+    if (sc->code_len >= sc->code_size) {
+        int new_size = sc->code_size ? sc->code_size * 2 : 64;
+        if (!qe_realloc(&sc->code, new_size * sizeof(*sc->code))) {
+            qe_cfg_error(ds, "out of memory");
+            memset(&dummy, 0, sizeof(dummy));
+            return &dummy;
+        }
+        sc->code_size = new_size;
+    }
+    insn = &sc->code[sc->code_len++];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = op;
+    insn->arg = arg;
+    return insn;
+}
+
+/* emit an opcode with a copy of `str`, return NULL on failure */
+static QEOpcode *qe_cfg_emit_str(QEmacsDataSource *ds, int op, int arg,
+                                 const char *str, int len) {
+    char *p = qe_malloc_array(char, len + 1);
+    QEOpcode *insn;
+
+    if (!p) {
+        qe_cfg_error(ds, "out of memory");
+        return NULL;
+    }
+    memcpy(p, str, len);
+    p[len] = '\0';
+    insn = qe_cfg_emit(ds, op, arg);
+    if (insn->op != op) {
+        /* emit failed */
+        qe_free(&p);
+        return NULL;
+    }
+    insn->u.str = p;
+    insn->len = len;
+    return insn;
+}
+
+/* emit a variable access, resolving the variable if already defined:
+ * variable definitions are never freed.  Variables created later are
+ * resolved on first execution.
+ */
+static QEOpcode *qe_cfg_emit_var(QEmacsDataSource *ds, int op, int arg,
+                                 const char *name) {
+    QEOpcode *insn = qe_cfg_emit_str(ds, op, arg, name, strlen(name));
+
+    if (insn)
+        insn->var = qe_find_variable(name);
+    return insn;
+}
+
+/* drop opcodes after pc, releasing the strings they own */
+static void qe_cfg_truncate(QEScript *sc, int pc) {
+    while (sc->code_len > pc) {
+        QEOpcode *insn = &sc->code[--sc->code_len];
+        switch (insn->op) {
+        case OP_ERROR:
+        case OP_STR:
+        case OP_GETVAR:
+        case OP_SETVAR:
+            qe_free(&insn->u.str);
             break;
-        case VAR_NUMBER:
-            qe_cfg_set_num(sp, num);
+        case OP_CALL:
+            if (insn->u.call)
+                qe_free(&insn->u.call->name);
+            qe_free(&insn->u.call);
             break;
-        default:
-        case VAR_UNKNOWN:
-            put_status(ds->s, "no variable %s", ds->str);
-            qe_cfg_set_void(sp);
-            return 1;
         }
     }
+}
+
+static void qe_free_script(QEScript **scp) {
+    QEScript *sc = *scp;
+
+    if (sc) {
+        qe_cfg_truncate(sc, 0);
+        qe_free(&sc->code);
+        qe_free(&sc->filename);
+        qe_free(scp);
+    }
+}
+
+static int qe_cfg_expr(QEmacsDataSource *ds, int prec0);
+
+static int qe_cfg_call(QEmacsDataSource *ds, const char *name) {
+    QEScriptCall *call;
+    QEOpcode *insn;
+    int argc = 0;
+
+    /* arguments are matched against the command prototype on first use */
+    if (ds->tok != ')') {
+        for (;;) {
+            if (qe_cfg_expr(ds, PREC_ASSIGN))
+                return qe_cfg_error(ds, "missing arguments for %s", name);
+            if (argc >= MAX_CMD_ARGS)
+                return qe_cfg_error(ds, "too many arguments for %s", name);
+            argc++;
+            if (ds->tok != ',')
+                break;
+            qe_cfg_next_token(ds);
+        }
+    }
+    if (!expect_token(ds, ')'))
+        return qe_cfg_error(ds, "too many arguments for %s", name);
+
+    call = qe_mallocz(QEScriptCall);
+    if (!call || !(call->name = qe_strdup(name))) {
+        qe_free(&call);
+        return qe_cfg_error(ds, "out of memory");
+    }
+    call->argc = argc;
+    insn = qe_cfg_emit(ds, OP_CALL, 0);
+    insn->u.call = call;
+    if (insn->op != OP_CALL) {
+        /* emit failed */
+        qe_free(&call->name);
+        qe_free(&call);
+        return 1;
+    }
+    return 0;
+}
+
+static int qe_cfg_assign(QEmacsDataSource *ds, const char *name, int op, int flags) {
+    QEOpcode *insn;
+
+    if (op == TOK_INC || op == TOK_DEC) {
+        qe_cfg_emit(ds, OP_NUM, 0)->u.value = 1;
+    } else {
+        if (qe_cfg_expr(ds, PREC_ASSIGN))
+            return 1;
+    }
+    insn = qe_cfg_emit_var(ds, OP_SETVAR, op, name);
+    if (!insn)
+        return 1;
+    insn->len = flags;
+    return 0;
+}
+
+static int qe_cfg_expr(QEmacsDataSource *ds, int prec0) {
+    char name[256];
+    int tok = ds->tok;
+    int pc;
+
+    /* handle prefix operators */
+    switch (tok) {
+    case '(':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_expr(ds, PREC_COMMA) || !expect_token(ds, ')'))
+            return 1;
+        break;
+    case '+':
+    case '-':
+    case '~':
+    case '!':
+        qe_cfg_next_token(ds);
+        if (qe_cfg_expr(ds, PREC_SUFFIX))
+            return 1;
+        qe_cfg_emit(ds, OP_UNARY, tok);
+        break;
+    case TOK_INC:
+    case TOK_DEC:
+        qe_cfg_next_token(ds);
+        if (ds->tok != TOK_ID)
+            return qe_cfg_error(ds, "invalid increment");
+        pstrcpy(name, sizeof name, ds->str);
+        qe_cfg_next_token(ds);
+        if (qe_cfg_get_prec(ds->tok) == PREC_SUFFIX)
+            return qe_cfg_error(ds, "invalid increment");
+        if (qe_cfg_assign(ds, name, tok, 0))
+            return 1;
+        break;
+    // case TOK_SIZEOF:
+    case TOK_NUMBER:
+        qe_cfg_emit(ds, OP_NUM, 0)->u.value = strtoll(ds->start_p, NULL, 0);
+        qe_cfg_next_token(ds);
+        break;
+    case TOK_STRING:
+        qe_cfg_emit_str(ds, OP_STR, 0, ds->str, ds->len);
+        qe_cfg_next_token(ds);
+        break;
+#ifndef CONFIG_TINY
+    case TOK_ID:
+        pstrcpy(name, sizeof name, ds->str);
+        qe_cfg_next_token(ds);
+        if (ds->tok == '(') {
+            /* function call */
+            qe_cfg_next_token(ds);
+            if (qe_cfg_call(ds, name))
+                return 1;
+        } else
+        if (qe_cfg_get_prec(ds->tok) == PREC_ASSIGN) {
+            int op = ds->tok;
+            if (prec0 > PREC_ASSIGN)
+                return qe_cfg_error(ds, "invalid assignment");
+            qe_cfg_next_token(ds);
+            if (qe_cfg_assign(ds, name, op, 0))
+                return 1;
+        } else
+        if (ds->tok == TOK_INC || ds->tok == TOK_DEC) {
+            /* post increment / decrement */
+            int op = ds->tok;
+            qe_cfg_next_token(ds);
+            if (qe_cfg_assign(ds, name, op, OPF_POSTFIX))
+                return 1;
+        } else {
+            qe_cfg_emit_var(ds, OP_GETVAR, 0, name);
+        }
+        break;
 #endif
+    case TOK_CHAR: {
+            const char *p = ds->str;
+            int c = utf8_decode(&p);  // XXX: should check for extra characters
+            qe_cfg_emit(ds, OP_CHAR, 0)->u.value = c;
+            qe_cfg_next_token(ds);
+            break;
+        }
+    default:
+        return qe_cfg_error(ds, "invalid expression");
+    }
+
+    for (;;) {
+        int op = ds->tok;
+        int prec = qe_cfg_get_prec(op);
+
+        if (prec < prec0 || op == ':')
+            return 0;
+        qe_cfg_next_token(ds);
+        if (prec == PREC_SUFFIX) {
+            switch (op) {
+            case '(':
+                return qe_cfg_error(ds, "invalid function call");
+            case TOK_INC:
+            case TOK_DEC:
+                return qe_cfg_error(ds, "invalid assignment");
+            case '[': /* subscripting */
+                if (qe_cfg_expr(ds, PREC_COMMA) || !expect_token(ds, ']'))
+                    return 1;
+                qe_cfg_emit(ds, OP_BINARY, op);
+                continue;
+            case '.': /* property / method accessor */
+                if (ds->tok != TOK_ID)
+                    return qe_cfg_error(ds, "expected property name");
+                if (strcmp(ds->str, "length"))
+                    return qe_cfg_error(ds, "no such property '%s'", ds->str);
+                qe_cfg_emit(ds, OP_LENGTH, 0);
+                qe_cfg_next_token(ds);
+                continue;
+            default:
+                return qe_cfg_error(ds, "unsupported operator '%c'", op);
+            }
+        }
+        switch (op) {
+        case '?':
+            /* conditional expression */
+            pc = ds->sc->code_len;
+            qe_cfg_emit(ds, OP_JUMPZ, 0);
+            if (qe_cfg_expr(ds, PREC_COMMA) || !expect_token(ds, ':'))
+                return 1;
+            ds->sc->code[pc].u.pc = ds->sc->code_len + 1;
+            pc = ds->sc->code_len;
+            qe_cfg_emit(ds, OP_JUMP, 0);
+            if (qe_cfg_expr(ds, PREC_QUESTION))
+                return 1;
+            ds->sc->code[pc].u.pc = ds->sc->code_len;
+            continue;
+        case TOK_LAND:
+        case TOK_LOR:
+            /* short circuit evaluation, result is 0 or 1 */
+            qe_cfg_emit(ds, OP_TEST, 0);
+            pc = ds->sc->code_len;
+            qe_cfg_emit(ds, op == TOK_LAND ? OP_JUMPZ : OP_JUMPNZ, OPF_KEEP);
+            if (qe_cfg_expr(ds, prec + 1))
+                return 1;
+            qe_cfg_emit(ds, OP_TEST, 0);
+            ds->sc->code[pc].u.pc = ds->sc->code_len;
+            continue;
+        case ',':
+            qe_cfg_emit(ds, OP_POP, 0);
+            if (qe_cfg_expr(ds, prec + 1))
+                return 1;
+            continue;
+        }
+        if (prec == PREC_ASSIGN)
+            return qe_cfg_error(ds, "invalid assignment");
+        if (qe_cfg_expr(ds, prec + 1))
+            return 1;
+        qe_cfg_emit(ds, OP_BINARY, op);
+    }
+}
+
+static int qe_cfg_skip(QEmacsDataSource *ds) {
+    int level = 0;
+
+    for (;;) {
+        switch (ds->tok) {
+        case TOK_EOF:
+            return ds->tok;
+        case ';':
+            if (!level)
+                goto done;
+            break;
+        case '{':
+        case '[':
+        case '(':
+            level++;
+            break;
+        case '}':
+        case ']':
+        case ')':
+            if (!--level)
+                goto done;
+            break;
+        }
+        qe_cfg_next_token(ds);
+    }
+done:
+    return qe_cfg_next_token(ds);
+}
+
+static int qe_cfg_stmt(QEmacsDataSource *ds) {
+    QEScript *sc = ds->sc;
+    const char *start = ds->start_p;
+    int line_num = ds->line_num;
+    int pc = sc->code_len;
+    int pc1, pc2;
+
+    if (ds->tok != TOK_ERR)
+        ds->errbuf[0] = '\0';
+
+    if (ds->tok == '{') {
+        qe_cfg_next_token(ds);
+        while (ds->tok != '}') {
+            if (ds->tok == TOK_EOF) {
+                qe_cfg_error(ds, "missing '}'");
+                qe_cfg_emit(ds, OP_STMT, 0)->len = ds->line_num;
+                qe_cfg_emit_str(ds, OP_ERROR, 0, ds->errbuf, strlen(ds->errbuf));
+                sc->code[sc->code_len - 2].u.pc = sc->code_len;
+                return 1;
+            }
+            qe_cfg_stmt(ds);
+        }
+        qe_cfg_next_token(ds);
+        return 0;
+    }
+    if (ds->tok == ';') {
+        qe_cfg_next_token(ds);
+        return 0;
+    }
+
+    qe_cfg_emit(ds, OP_STMT, 0)->len = line_num;
+
+    if (ds->tok == TOK_IF) {
+        qe_cfg_next_token(ds);
+        if (qe_cfg_expr(ds, PREC_COMMA))
+            goto fail;
+        pc1 = sc->code_len;
+        qe_cfg_emit(ds, OP_JUMPZ, 0);
+        qe_cfg_stmt(ds);
+        if (ds->tok == TOK_ELSE) {
+            qe_cfg_next_token(ds);
+            pc2 = sc->code_len;
+            qe_cfg_emit(ds, OP_JUMP, 0);
+            sc->code[pc1].u.pc = sc->code_len;
+            qe_cfg_stmt(ds);
+            sc->code[pc2].u.pc = sc->code_len;
+        } else {
+            sc->code[pc1].u.pc = sc->code_len;
+        }
+        sc->code[pc].u.pc = sc->code_len;
+        return 0;
+    }
+    if (qe_cfg_expr(ds, PREC_COMMA))
+        goto fail;
+    if (ds->tok == ';') {
+        qe_cfg_next_token(ds);
+    }
+    if (ds->tok != '}' && ds->tok != TOK_EOF) {
+        // XXX: should check for implicit semicolon at end of line
+    }
+    sc->code[pc].u.pc = sc->code_len;
     return 0;
+
+fail:
+    /* replace the statement with its error message, reported when
+     * the script runs, and resume compilation after it.
+     */
+    qe_cfg_truncate(sc, pc);
+    qe_cfg_emit(ds, OP_STMT, 0)->len = line_num;
+    qe_cfg_emit_str(ds, OP_ERROR, 0, ds->errbuf, strlen(ds->errbuf));
+    sc->code[pc].u.pc = sc->code_len;
+    ds->p = start;
+    ds->line_num = line_num;
+    qe_cfg_next_token(ds);
+    qe_cfg_skip(ds);
+    ds->errbuf[0] = '\0';
+    return 1;
 }
 
-static int qe_cfg_tonum(QEmacsDataSource *ds, QEValue *sp) {
-    if (qe_cfg_getvalue(ds, sp))
+static QEScript *qe_compile_script(EditState *s, QEmacsDataSource *ds)
+{
+    QEScript *sc;
+
+    sc = qe_mallocz(QEScript);
+    if (!sc)
+        return NULL;
+    sc->filename = qe_strdup(ds->filename);
+    sc->refcount = 1;
+
+    ds->s = s;
+    ds->sc = sc;
+    ds->p = ds->buf;
+    ds->line_num = 1;
+
+    qe_cfg_next_token(ds);
+    while (ds->tok != TOK_EOF) {
+        if (ds->tok == TOK_ERR) {
+            /* lexical error at statement level: stop here */
+            qe_cfg_emit(ds, OP_STMT, 0)->len = ds->line_num;
+            qe_cfg_emit_str(ds, OP_ERROR, 0, ds->errbuf, strlen(ds->errbuf));
+            sc->code[sc->code_len - 2].u.pc = sc->code_len;
+            break;
+        }
+        qe_cfg_stmt(ds);
+    }
+    qe_free(&ds->allocated_buf);
+    ds->sc = NULL;
+    return sc;
+}
+
+/*---------------- virtual machine ----------------*/
+
+static int qe_cfg_getvar(QEScriptVM *vm, QEValue *sp, QEOpcode *insn) {
+#ifndef CONFIG_TINY
+    const char *name = insn->u.str;
+    char buf[256];
+    int num, type;
+
+    if (!insn->var)
+        insn->var = qe_find_variable(name);
+    if (insn->var)
+        type = qe_get_vardef(vm->s, insn->var, buf, sizeof(buf), &num, 0);
+    else
+        type = qe_get_variable(vm->s, name, buf, sizeof(buf), &num, 0);
+    switch (type) {
+    case VAR_CHARS:
+    case VAR_STRING:
+        qe_cfg_set_str(sp, buf, strlen(buf));
+        break;
+    case VAR_NUMBER:
+        qe_cfg_set_num(sp, num);
+        break;
+    default:
+    case VAR_UNKNOWN:
+        put_status(vm->s, "no variable %s", name);
+        qe_cfg_set_void(sp);
         return 1;
+    }
+#endif
+    return 0;
+}
+
+static int qe_cfg_tonum(QEScriptVM *vm, QEValue *sp) {
     switch (sp->type) {
     case TOK_NUMBER:
         return 0;
@@ -365,12 +904,10 @@ static int qe_cfg_tonum(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_tostr(QEmacsDataSource *ds, QEValue *sp) {
+static int qe_cfg_tostr(QEScriptVM *vm, QEValue *sp) {
     char buf[64];
     int len;
 
-    if (qe_cfg_getvalue(ds, sp))
-        return 1;
     switch (sp->type) {
     case TOK_STRING:
         return 0;
@@ -389,11 +926,9 @@ static int qe_cfg_tostr(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_tochar(QEmacsDataSource *ds, QEValue *sp) {
+static int qe_cfg_tochar(QEScriptVM *vm, QEValue *sp) {
     const char *p;
 
-    if (qe_cfg_getvalue(ds, sp))
-        return 1;
     switch (sp->type) {
     case TOK_STRING:
         p = sp->u.str;
@@ -410,11 +945,11 @@ static int qe_cfg_tochar(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_append(QEmacsDataSource *ds, QEValue *sp, const char *p, size_t len) {
+static int qe_cfg_append(QEScriptVM *vm, QEValue *sp, const char *p, size_t len) {
     char *new_p;
     int new_len;
 
-    if (qe_cfg_tostr(ds, sp))
+    if (qe_cfg_tostr(vm, sp))
         return 1;
     /* XXX: should cap length and check for malloc failure */
     new_len = sp->len + len;
@@ -426,7 +961,7 @@ static int qe_cfg_append(QEmacsDataSource *ds, QEValue *sp, const char *p, size_
     return 0;
 }
 
-static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
+static int qe_cfg_format(QEScriptVM *vm, QEValue *sp) {
     char buf[256];
     char fmt[16];
     /* prevent warning on variable format */
@@ -434,7 +969,7 @@ static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
     char *start, *p;
     int c, len;
 
-    if (qe_cfg_tostr(ds, sp))
+    if (qe_cfg_tostr(vm, sp))
         return 1;
     len = 0;
 
@@ -452,7 +987,7 @@ static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
             p += strspn(p, "0123456789+- #.");
             c = *p++;
             if (strchr("diouxX", c)) {
-                if (qe_cfg_tonum(ds, sp + 1))
+                if (qe_cfg_tonum(vm, sp + 1))
                     return 1;
                 snprintf(fmt, sizeof fmt, "%.*sll%c", (int)(p - 1 - start), start, c);
                 (*fun)(buf + len, sizeof(buf) - len, fmt, sp[1].u.value);
@@ -460,13 +995,13 @@ static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
                 start = p;
             } else
             if (c == 'c') {
-                if (qe_cfg_tochar(ds, sp + 1))
+                if (qe_cfg_tochar(vm, sp + 1))
                     return 1;
                 goto hasstr;
             } else
             if (c == 's') {
             hasstr:
-                if (qe_cfg_tostr(ds, sp + 1))
+                if (qe_cfg_tostr(vm, sp + 1))
                     return 1;
                 snprintf(fmt, sizeof fmt, "%.*ss", (int)(p - start), start);
                 (*fun)(buf + len, sizeof(buf) - len, sp[1].u.str);
@@ -479,158 +1014,7 @@ static int qe_cfg_format(QEmacsDataSource *ds, QEValue *sp) {
     return 0;
 }
 
-static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, CmdDef *d);
-static int qe_cfg_assign(QEmacsDataSource *ds, QEValue *sp, int op);
-static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op);
-
-static int qe_cfg_expr(QEmacsDataSource *ds, QEValue *sp, int prec0) {
-    int tok = ds->tok;
-
-    if (sp >= ds->sp_max) {
-        if (sp >= ds->stack + countof(ds->stack)) {
-            put_status(ds->s, "stack overflow");
-            return 1;
-        }
-        ds->sp_max = sp + 1;
-    }
-    /* handle prefix operators */
-    switch (tok) {
-    case '(':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_COMMA) || !expect_token(ds, ')'))
-            return 1;
-        break;
-    case '+':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_SUFFIX) || qe_cfg_tonum(ds, sp))
-            return 1;
-        break;
-    case '-':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_SUFFIX) || qe_cfg_tonum(ds, sp))
-            return 1;
-        sp->u.value = -sp->u.value;
-        break;
-    case '~':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_SUFFIX) || qe_cfg_tonum(ds, sp))
-            return 1;
-        sp->u.value = ~sp->u.value;
-        break;
-    case '!':
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_SUFFIX) || qe_cfg_getvalue(ds, sp))
-            return 1;
-        qe_cfg_set_num(sp, (sp->type == TOK_STRING) ? 0 : !sp->u.value);
-        break;
-    case TOK_INC:
-    case TOK_DEC:
-        qe_cfg_next_token(ds);
-        if (qe_cfg_expr(ds, sp, PREC_SUFFIX))
-            return 1;
-        if (sp->type != TOK_ID) {
-            put_status(ds->s, "invalid increment");
-            return 1;
-        }
-        qe_cfg_set_num(sp + 1, 1);
-        if (qe_cfg_assign(ds, sp, tok))
-            return 1;
-        break;
-    // case TOK_SIZEOF:
-    case TOK_NUMBER:
-        qe_cfg_set_num(sp, strtoll(ds->start_p, NULL, 0));
-        qe_cfg_next_token(ds);
-        break;
-    case TOK_STRING:
-#ifndef CONFIG_TINY
-    case TOK_ID:
-#endif
-        qe_cfg_set_str(sp, ds->str, ds->len);   /* XXX: should parse string */
-        sp->type = tok;
-        qe_cfg_next_token(ds);
-        break;
-    case TOK_CHAR: {
-            const char *p = ds->str;
-            int c = utf8_decode(&p);  // XXX: should check for extra characters
-            qe_cfg_set_char(sp, c);
-            qe_cfg_next_token(ds);
-            break;
-        }
-    default:
-        qe_cfg_set_void(sp);
-        put_status(ds->s, "invalid expression");
-        return 1;
-    }
-
-    for (;;) {
-        int op = ds->tok;
-        int prec = qe_cfg_get_prec(op);
-
-        if (prec < prec0)
-            return 0;
-        qe_cfg_next_token(ds);
-        if (prec == PREC_SUFFIX) {
-            switch (op) {
-            case '(': /* function call */
-                if (sp->type == TOK_ID) {
-                    CmdDef *d = qe_find_cmd(sp->u.str);
-                    if (!d) {
-                        put_status(ds->s, "unknown command '%s'", sp->u.str);
-                        return 1;
-                    }
-                    if (qe_cfg_call(ds, sp, d))
-                        return 1;
-                    continue;
-                }
-                put_status(ds->s, "invalid function call");
-                return 1;
-            case TOK_INC: /* post increment */
-            case TOK_DEC: /* post decrement */
-                qe_cfg_set_num(sp + 1, 1);
-                if (qe_cfg_assign(ds, sp, op))
-                    return 1;
-                sp->u.value -= (op == TOK_INC) ? 1 : -1;
-                continue;
-            case '[': /* subscripting */
-                if (qe_cfg_expr(ds, sp + 1, PREC_COMMA) || !expect_token(ds, ']'))
-                    return 1;
-                if (qe_cfg_op(ds, sp, op))
-                    return 1;
-                continue;
-            case '.': /* property / method accessor */
-                if (ds->tok != TOK_ID) {
-                    put_status(ds->s, "expected property name");
-                    return 1;
-                }
-                if (qe_cfg_getvalue(ds, sp))
-                    return 1;
-                if (sp->type == TOK_STRING && !strcmp(ds->str, "length")) {
-                    qe_cfg_set_num(sp, strlen(sp->u.str));  // utf8?
-                    qe_cfg_next_token(ds);
-                    continue;
-                }
-                put_status(ds->s, "no such property '%s'", ds->str);
-                return 1;
-            default:
-                put_status(ds->s, "unsupported operator '%c'", op);
-                return 1;
-            }
-        }
-        if (prec == PREC_ASSIGN) {
-            if (qe_cfg_expr(ds, sp + 1, prec))
-                return 1;
-            return qe_cfg_assign(ds, sp, op);
-        }
-        if (qe_cfg_expr(ds, sp + 1, prec + 1))
-            return 1;
-        if (qe_cfg_getvalue(ds, sp))
-            return 1;
-        if (qe_cfg_op(ds, sp, op))
-            return 1;
-    }
-}
-
-static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
+static int qe_cfg_op(QEScriptVM *vm, QEValue *sp, int op) {
     if (sp->type == TOK_STRING) {
         switch (op) {
         case '<':
@@ -639,20 +1023,20 @@ static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
         case TOK_GE:
         case TOK_EQ:
         case TOK_NE:
-            if (qe_cfg_tostr(ds, sp + 1))
+            if (qe_cfg_tostr(vm, sp + 1))
                 return 1;
             qe_cfg_set_num(sp, strcmp(sp->u.str, sp[1].u.str));
             qe_cfg_set_num(sp + 1, 0);
             goto num;
         case '+':
         case TOK_ADD_EQ:
-            if (qe_cfg_tostr(ds, sp + 1))
+            if (qe_cfg_tostr(vm, sp + 1))
                 return 1;
-            if (qe_cfg_append(ds, sp, sp[1].u.str, sp[1].len))
+            if (qe_cfg_append(vm, sp, sp[1].u.str, sp[1].len))
                 return 1;
             break;
         case '[':
-            if (qe_cfg_tonum(ds, sp + 1))
+            if (qe_cfg_tonum(vm, sp + 1))
                 return 1;
             if (sp[1].u.value >= 0 && sp[1].u.value < sp->len) {
                 qe_cfg_set_char(sp, sp->u.str[sp[1].u.value]);  // XXX: utf-8 ?
@@ -661,15 +1045,15 @@ static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
             }
             break;
         case '%':
-            if (qe_cfg_format(ds, sp))
+            if (qe_cfg_format(vm, sp))
                 return 1;
             break;
         default:
-            put_status(ds->s, "invalid string operator '%c'", op);
+            put_status(vm->s, "invalid string operator '%c'", op);
             return 1;
         }
     } else {
-        if (qe_cfg_tonum(ds, sp) || qe_cfg_tonum(ds, sp + 1))
+        if (qe_cfg_tonum(vm, sp) || qe_cfg_tonum(vm, sp + 1))
             return 1;
     num:
         switch (op) {
@@ -682,7 +1066,7 @@ static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
         case TOK_DIV_EQ:
         case TOK_MOD_EQ:
             if (sp[1].u.value == 0 || (sp->u.value == LLONG_MIN && sp[1].u.value == -1)) {
-                put_status(ds->s, "'%c': division overflow", op);
+                put_status(vm->s, "'%c': division overflow", op);
                 return 1;
             }
             if (op == '/' || op == TOK_DIV_EQ)
@@ -738,285 +1122,350 @@ static int qe_cfg_op(QEmacsDataSource *ds, QEValue *sp, int op) {
         case TOK_OR_EQ:
             sp->u.value |= sp[1].u.value;
             break;
-        case TOK_LAND:
-            sp->u.value = sp->u.value && sp[1].u.value;
-            break;
-        case TOK_LOR:
-            sp->u.value = sp->u.value || sp[1].u.value;
-            break;
-            //case '?':
-        case ',':
-            sp->u.value = sp[1].u.value;
-            break;
         default:
-            put_status(ds->s, "invalid numeric operator '%c'", op);
+            put_status(vm->s, "invalid numeric operator '%c'", op);
             return 1;
         }
     }
     return 0;
 }
 
-static int qe_cfg_assign(QEmacsDataSource *ds, QEValue *sp, int op) {
-    if (sp->type != TOK_ID) {
-        put_status(ds->s, "invalid assignment");
-        return 1;
+/* assign the value at sp to a variable, sp[1] is scratch */
+static int qe_cfg_setvar(QEScriptVM *vm, QEValue *sp, QEOpcode *insn) {
+    const char *name = insn->u.str;
+    int op = insn->arg;
+
+    if (op != '=') {
+        qe_cfg_set_void(sp + 1);
+        sp[1] = sp[0];
+        sp->type = TOK_VOID;
+        if (qe_cfg_getvar(vm, sp, insn) || qe_cfg_op(vm, sp, op))
+            return 1;
     }
 #ifndef CONFIG_TINY
-    {
-        char cmd[128];
-        pstrcpy(cmd, sizeof cmd, sp->u.str);
-        if (qe_cfg_getvalue(ds, sp + 1))
-            return 1;
-        if (op == '=') {
-            qe_cfg_set_void(sp);
-            sp[0] = sp[1];
-            qe_cfg_set_void(sp + 1);
+    if (!insn->var)
+        insn->var = qe_find_variable(name);
+    if (insn->var) {
+        if (sp->type == TOK_STRING) {
+            qe_set_vardef(vm->s, insn->var, sp->u.str, 0);
         } else {
-            if (qe_cfg_getvalue(ds, sp))
-                return 1;
-            if (qe_cfg_op(ds, sp, op))
-                return 1;
+            qe_set_vardef(vm->s, insn->var, NULL, sp->u.value);
         }
+    } else {
+        /* create a user variable */
         if (sp->type == TOK_STRING) {
-            qe_set_variable(ds->s, cmd, sp->u.str, 0);
+            qe_set_variable(vm->s, name, sp->u.str, 0);
         } else {
-            qe_set_variable(ds->s, cmd, NULL, sp->u.value);
+            qe_set_variable(vm->s, name, NULL, sp->u.value);
         }
     }
 #endif
+    if (insn->len & OPF_POSTFIX)
+        sp->u.value -= (op == TOK_INC) ? 1 : -1;
     return 0;
 }
 
-static int qe_cfg_skip(QEmacsDataSource *ds) {
-    int level = 0;
-
-    for (;;) {
-        switch (ds->tok) {
-        case TOK_EOF:
-            return ds->tok;
-        case ';':
-            if (!level)
-                goto done;
-            break;
-        case '{':
-        case '[':
-        case '(':
-            level++;
-            break;
-        case '}':
-        case ']':
-        case ')':
-            if (!--level)
-                goto done;
-            break;
-        }
-        qe_cfg_next_token(ds);
-    }
-done:
-    return qe_cfg_next_token(ds);
-}
-
-static int qe_cfg_call(QEmacsDataSource *ds, QEValue *sp, CmdDef *d) {
-    char str[1024], prompt[64];
-    char *strp;
+/* match the argument expressions with the command prototype */
+static int qe_cfg_bind(QEScriptVM *vm, QEScriptCall *call, char *prompt, int prompt_size) {
+    CmdDef *d = call->d;
     const char *r;
-    int nb_args, sep, i;
-    CmdArg args[MAX_CMD_ARGS];
-    unsigned char args_type[MAX_CMD_ARGS];
-    EditState *s = ds->s;
-    QEmacsState *qs = s->qe_state;
+    int nb_args, i, argc, has_stringval;
 
     nb_args = 0;
+    has_stringval = 0;
 
     /* construct argument type list */
     r = d->name + strlen(d->name) + 1;
-    if (*r == '*') {
+    if (*r == '*')
         r++;
-        if (s->b->flags & BF_READONLY) {
-            put_status(s, "Buffer is read only");
-            return -1;
-        }
-    }
 
     /* first argument is always the window */
-    args_type[nb_args++] = CMD_ARG_WINDOW;
+    call->args_type[nb_args++] = CMD_ARG_WINDOW;
 
     for (;;) {
         unsigned char arg_type;
         int ret;
 
-        ret = parse_arg(&r, &arg_type, prompt, countof(prompt),
-                        NULL, 0, NULL, 0);
+        ret = parse_arg(&r, &arg_type, prompt, prompt_size, NULL, 0, NULL, 0);
         if (ret < 0)
             goto badcmd;
         if (ret == 0)
             break;
         if (nb_args >= MAX_CMD_ARGS) {
         badcmd:
-            put_status(s, "Badly defined command '%s'", d->name);
+            put_status(vm->s, "Badly defined command '%s'", d->name);
             return -1;
         }
-        args[nb_args].p = NULL;
-        args_type[nb_args++] = arg_type & (CMD_ARG_TYPE_MASK | CMD_ARG_USE_ARGVAL);
+        arg_type &= CMD_ARG_TYPE_MASK | CMD_ARG_USE_ARGVAL;
+        if (arg_type == CMD_ARG_STRINGVAL)
+            has_stringval = 1;
+        call->args_type[nb_args++] = arg_type;
     }
 
-    sep = '\0';
-    strp = str;
-
+    argc = 0;
     for (i = 0; i < nb_args; i++) {
-        /* pseudo arguments: skip them */
-        switch (args_type[i]) {
+        switch (call->args_type[i]) {
         case CMD_ARG_WINDOW:
-            args[i].s = s;
-            continue;
         case CMD_ARG_INTVAL:
-            args[i].n = (int)(intptr_t)d->val;
-            continue;
         case CMD_ARG_STRINGVAL:
-            /* CG: kludge for xxx-mode functions and named kbd macros */
-            args[i].p = prompt;
             continue;
         case CMD_ARG_INT | CMD_ARG_USE_ARGVAL:  /* XXX: ui should always be last */
-            if (ds->tok == ')') {
-                args[i].n = NO_ARG;
+            if (argc == call->argc)
                 continue;
-            }
-            args_type[i] &= ~CMD_ARG_USE_ARGVAL;
+            call->args_type[i] &= ~CMD_ARG_USE_ARGVAL;
             break;
         }
-
-        if (sep) {
-            /* CG: Should test for arg list too short. */
-            /* CG: Could supply default arguments. */
-            if (ds->tok != sep) {
-                put_status(s, "missing arguments for %s", d->name);
-                return -1;
-            }
-            qe_cfg_next_token(ds);
+        /* CG: Could supply default arguments. */
+        if (argc >= call->argc) {
+            put_status(vm->s, "missing arguments for %s", d->name);
+            return -1;
         }
-        sep = ',';
+        argc++;
+    }
+    if (argc != call->argc) {
+        put_status(vm->s, "too many arguments for %s", d->name);
+        return -1;
+    }
+    call->nb_args = nb_args;
+    /* CMD_ARG_STRINGVAL is taken from the prototype, which changes
+     * when a keyboard macro is redefined.
+     */
+    call->bound = !has_stringval;
+    return 0;
+}
 
-        if (qe_cfg_expr(ds, sp, PREC_ASSIGN)) {
-            put_status(s, "missing arguments for %s", d->name);
-            return -1;
+static int qe_cfg_exec_call(QEScriptVM *vm, QEValue *sp, QEScriptCall *call) {
+    char prompt[64];
+    CmdArg args[MAX_CMD_ARGS];
+    QEValue *argp;
+    CmdDef *d = call->d;
+    EditState *s = vm->s;
+    QEmacsState *qs = s->qe_state;
+    int i;
+
+    if (!d) {
+        d = call->d = qe_find_cmd(call->name);
+        if (!d) {
+            put_status(s, "unknown command '%s'", call->name);
+            return 1;
         }
+    }
+    if (d->name[strlen(d->name) + 1] == '*' && (s->b->flags & BF_READONLY)) {
+        put_status(s, "Buffer is read only");
+        return 1;
+    }
+    prompt[0] = '\0';
+    if (!call->bound && qe_cfg_bind(vm, call, prompt, countof(prompt)))
+        return 1;
 
-        switch (args_type[i]) {
+    /* argument values are at sp[1 - argc] .. sp[0] */
+    argp = sp + 1 - call->argc;
+    for (i = 0; i < call->nb_args; i++) {
+        /* pseudo arguments: skip them */
+        switch (call->args_type[i]) {
+        case CMD_ARG_WINDOW:
+            args[i].s = s;
+            continue;
+        case CMD_ARG_INTVAL:
+            args[i].n = (int)(intptr_t)d->val;
+            continue;
+        case CMD_ARG_STRINGVAL:
+            /* CG: kludge for xxx-mode functions and named kbd macros */
+            args[i].p = prompt;
+            continue;
+        case CMD_ARG_INT | CMD_ARG_USE_ARGVAL:
+            args[i].n = NO_ARG;
+            continue;
         case CMD_ARG_INT:
-            qe_cfg_tonum(ds, sp); // XXX: should complain about type mismatch?
-            args[i].n = sp->u.value;
+            qe_cfg_tonum(vm, argp); // XXX: should complain about type mismatch?
+            args[i].n = argp->u.value;
             break;
         case CMD_ARG_STRING:
-            qe_cfg_tostr(ds, sp); // XXX: should complain about type mismatch?
-            pstrcpy(strp, str + countof(str) - strp, sp->u.str);
-            args[i].p = strp;
-            if (strp < str + countof(str) - 1)
-                strp += strlen(strp) + 1;
+            qe_cfg_tostr(vm, argp); // XXX: should complain about type mismatch?
+            args[i].p = argp->u.str;
             break;
         }
+        argp++;
     }
-    if (ds->tok != ')') {
-        put_status(s, "too many arguments for %s", d->name);
-        return -1;
-    }
-    qe_cfg_next_token(ds);
 
     qs->this_cmd_func = d->action.func;
     qs->ec.function = d->name;
-    call_func(d->sig, d->action, nb_args, args, args_type);
+    call_func(d->sig, d->action, call->nb_args, args, call->args_type);
     qs->last_cmd_func = qs->this_cmd_func;
     if (qs->active_window)
         s = qs->active_window;
     check_window(&s);
-    ds->s = s;
-    sp->type = TOK_VOID;
+    vm->s = s;
     return 0;
 }
 
-static int qe_cfg_stmt(QEmacsDataSource *ds, QEValue *sp) {
-    const char *start = ds->p;
-    int res = 0;
-
-    if (ds->tok == '{') {
-        qe_cfg_next_token(ds);
-        while (ds->tok != '}') {
-            if (ds->tok == TOK_EOF) {
-                put_status(ds->s, "missing '}'");
-                return 1;
-            }
-            res |= qe_cfg_stmt(ds, sp);
-        }
-        qe_cfg_next_token(ds);
-        return res;
-    }
-
-    if (ds->tok == TOK_IF) {
-        int skip;
-        QEValue *sp = &ds->stack[0];
-
-        qe_cfg_next_token(ds);
-        sp->type = TOK_VOID;
-        if (qe_cfg_expr(ds, sp, PREC_COMMA) || qe_cfg_getvalue(ds, sp))
+static int qe_run_script(EditState *s, QEScript *sc, QEScriptVM *vm)
+{
+    QEmacsState *qs = s->qe_state;
+    QErrorContext ec = qs->ec;
+    QEValue *sp, *sp_end;
+    QEOpcode *insn;
+    int pc, recover;
+
+    memset(vm, 0, sizeof(*vm));
+    vm->s = s;
+    vm->sp_max = vm->stack + 1;
+    /* keep a scratch slot above the top of stack */
+    sp_end = vm->stack + countof(vm->stack) - 1;
+    sp = vm->stack - 1;
+    recover = sc->code_len;
+
+    qs->ec.filename = sc->filename;
+    qs->ec.function = NULL;
+    qs->ec.lineno = 1;
+
+    sc->refcount++;
+    for (pc = 0; pc < sc->code_len;) {
+        insn = &sc->code[pc++];
+        switch (insn->op) {
+        case OP_STMT:
+            qs->ec.lineno = insn->len;
+            recover = insn->u.pc;
+            sp = vm->stack - 1;
+            continue;
+        case OP_ERROR:
+            put_status(vm->s, "%s", insn->u.str);
             goto fail;
-        skip = (sp->type == TOK_STRING) ? 0 : sp->u.value == 0;
-        if (skip) {
-            qe_cfg_skip(ds);
-        } else {
-            qe_cfg_stmt(ds, sp);
-        }
-        if (ds->tok == TOK_ELSE) {
-            if (!skip) {
-                qe_cfg_skip(ds);
+        case OP_NUM:
+        case OP_CHAR:
+        case OP_STR:
+        case OP_GETVAR:
+            if (++sp >= sp_end) {
+                sp--;
+                put_status(vm->s, "stack overflow");
+                goto fail;
+            }
+            if (sp + 2 > vm->sp_max)
+                vm->sp_max = sp + 2;
+            if (insn->op == OP_NUM) {
+                qe_cfg_set_num(sp, insn->u.value);
+            } else
+            if (insn->op == OP_CHAR) {
+                qe_cfg_set_char(sp, (int)insn->u.value);
+            } else
+            if (insn->op == OP_STR) {
+                qe_cfg_set_str(sp, insn->u.str, insn->len);
             } else {
-                qe_cfg_stmt(ds, sp);
+                if (qe_cfg_getvar(vm, sp, insn))
+                    goto fail;
             }
+            continue;
+        case OP_SETVAR:
+            if (qe_cfg_setvar(vm, sp, insn))
+                goto fail;
+            continue;
+        case OP_UNARY:
+            switch (insn->arg) {
+            case '+':
+                qe_cfg_tonum(vm, sp);
+                break;
+            case '-':
+                qe_cfg_tonum(vm, sp);
+                sp->u.value = -sp->u.value;
+                break;
+            case '~':
+                qe_cfg_tonum(vm, sp);
+                sp->u.value = ~sp->u.value;
+                break;
+            case '!':
+                qe_cfg_set_num(sp, (sp->type == TOK_STRING) ? 0 : !sp->u.value);
+                break;
+            }
+            continue;
+        case OP_BINARY:
+            sp--;
+            if (qe_cfg_op(vm, sp, insn->arg))
+                goto fail;
+            continue;
+        case OP_LENGTH:
+            if (sp->type != TOK_STRING) {
+                put_status(vm->s, "no such property 'length'");
+                goto fail;
+            }
+            qe_cfg_set_num(sp, strlen(sp->u.str));  // utf8?
+            continue;
+        case OP_CALL:
+            if (sp + 1 - insn->u.call->argc >= sp_end) {
+                put_status(vm->s, "stack overflow");
+                goto fail;
+            }
+            if (qe_cfg_exec_call(vm, sp, insn->u.call))
+                goto fail;
+            sp -= insn->u.call->argc - 1;
+            if (sp + 2 > vm->sp_max)
+                vm->sp_max = sp + 2;
+            qe_cfg_set_void(sp);
+            continue;
+        case OP_POP:
+            sp--;
+            continue;
+        case OP_TEST:
+            qe_cfg_set_num(sp, qe_cfg_truth(sp));
+            continue;
+        case OP_JUMP:
+            pc = insn->u.pc;
+            continue;
+        case OP_JUMPZ:
+        case OP_JUMPNZ:
+            if (qe_cfg_truth(sp) == (insn->op == OP_JUMPNZ)) {
+                if (!(insn->arg & OPF_KEEP))
+                    sp--;
+                pc = insn->u.pc;
+            } else {
+                sp--;
+            }
+            continue;
         }
-        return res;
+        continue;
+    fail:
+        qe_cfg_set_void(&vm->stack[0]);
+        sp = vm->stack - 1;
+        pc = recover;
     }
-    if (qe_cfg_expr(ds, sp, PREC_COMMA) || qe_cfg_getvalue(ds, sp))
-        goto fail;
-    if (ds->tok == ';') {
-        qe_cfg_next_token(ds);
-    }
-    if (ds->tok != '}' && ds->tok != TOK_EOF) {
-        // XXX: should check for implicit semicolon at end of line
-    }
-    return 0;
-
-fail:
-    ds->p = start;
-    qe_cfg_skip(ds);
-    return 1;
+    qs->ec = ec;
+    if (--sc->refcount == 0)
+        qe_free_script(&sc);
+    return vm->stack[0].type;
 }
 
-static int qe_parse_script(EditState *s, QEmacsDataSource *ds)
+static int qe_parse_script(EditState *s, QEmacsDataSource *ds, QEScriptVM *vm)
 {
-    QEmacsState *qs = s->qe_state;
-    QErrorContext ec = qs->ec;
-    QEValue *sp = &ds->stack[0];
-
-    ds->s = s;
-    ds->p = ds->buf;
-    sp->type = TOK_VOID;
+    QEScript *sc;
+    int res;
 
-    qs->ec.filename = ds->filename;
-    qs->ec.function = NULL;
-    qs->ec.lineno = ds->line_num = 1;
+    sc = qe_compile_script(s, ds);
+    if (!sc) {
+        memset(vm, 0, sizeof(*vm));
+        qe_free(&ds->allocated_buf);
+        put_status(s, "Out of memory");
+        return TOK_VOID;
+    }
+    res = qe_run_script(s, sc, vm);
+    qe_free_script(&sc);
+    return res;
+}
 
-    qe_cfg_next_token(ds);
-    while (ds->tok != TOK_EOF && ds->tok != TOK_ERR) {
-        if (qe_cfg_stmt(ds, sp))
-            sp->type = TOK_VOID;
+/* Drop all compiled config files */
+void qe_free_scripts(void)
+{
+    while (first_script) {
+        QEScript *sc = first_script;
+        first_script = sc->next;
+        if (--sc->refcount == 0)
+            qe_free_script(&sc);
     }
-    qe_free(&ds->allocated_buf);
-    qs->ec = ec;
-    return sp->type;
 }
 
 void do_eval_expression(EditState *s, const char *expression, int argval)
 {
     QEmacsDataSource ds;
-    QEValue *sp = &ds.stack[0];
+    QEScriptVM vm;
+    QEValue *sp = &vm.stack[0];
     char buf[64];
     int len;
 
@@ -1026,7 +1475,7 @@ void do_eval_expression(EditState *s, const char *expression, int argval)
     qe_cfg_init(&ds);
     ds.buf = expression;
     ds.filename = "<string>";
-    switch (qe_parse_script(s, &ds)) {
+    switch (qe_parse_script(s, &ds, &vm)) {
     case TOK_VOID:
         break;
     case TOK_NUMBER:
@@ -1058,7 +1507,7 @@ void do_eval_expression(EditState *s, const char *expression, int argval)
         put_status(s, "unexpected value type: %d", sp->type);
         break;
     }
-    qe_cfg_release(&ds);
+    qe_cfg_release(&vm);
     do_refresh(s);
 }
 
@@ -1067,6 +1516,7 @@ void do_eval_expression(EditState *s, const char *expression, int argval)
 static int do_eval_buffer_region(EditState *s, int start, int stop)
 {
     QEmacsDataSource ds;
+    QEScriptVM vm;
     char *buf;
     int length, res;
 
@@ -1092,9 +1542,9 @@ static int do_eval_buffer_region(EditState *s, int start, int stop)
     buf[length] = '\0';
     ds.buf = ds.allocated_buf = buf;
     ds.filename = s->b->name;
-    res = qe_parse_script(s, &ds);
+    res = qe_parse_script(s, &ds, &vm);
     do_refresh(s);
-    qe_cfg_release(&ds);
+    qe_cfg_release(&vm);
     return res;
 }
 
@@ -1110,37 +1560,78 @@ void do_eval_buffer(EditState *s)
     do_eval_buffer_region(s, 0, s->b->total_size);
 }
 
-int parse_config_file(EditState *s, const char *filename)
+/* Config files are compiled once and cached until they are modified:
+ * .qerc files are parsed again for each file loaded from their
+ * directory tree.
+ */
+static QEScript *qe_load_script(EditState *s, const char *filename)
 {
     QEmacsDataSource ds;
+    QEScript *sc, **scp;
+    struct stat st;
     FILE *fp;
     char *buf;
     long length;
-    int res;
-
-    qe_cfg_init(&ds);
 
     fp = fopen(filename, "r");
     if (!fp)
-        return -1;
+        return NULL;
 
-    fseek(fp, 0, SEEK_END);
-    length = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    if (fstat(fileno(fp), &st)) {
+        fclose(fp);
+        return NULL;
+    }
+    for (scp = &first_script; (sc = *scp) != NULL; scp = &sc->next) {
+        if (sc->dev == st.st_dev && sc->ino == st.st_ino) {
+            if (sc->mtime == st.st_mtime && sc->size == st.st_size) {
+                fclose(fp);
+                return sc;
+            }
+            /* stale entry: may still be running */
+            *scp = sc->next;
+            if (--sc->refcount == 0)
+                qe_free_script(&sc);
+            break;
+        }
+    }
 
+    length = st.st_size;
     if (length > MAX_SCRIPT_LENGTH || !(buf = qe_malloc_array(char, length + 1))) {
         fclose(fp);
         put_status(s, "File too large");
-        return -1;
+        return NULL;
     }
 
     length = fread(buf, 1, length, fp);
     fclose(fp);
     buf[length] = '\0';
+
+    qe_cfg_init(&ds);
     ds.buf = ds.allocated_buf = buf;
     ds.filename = filename;
-    res = qe_parse_script(s, &ds);
-    qe_cfg_release(&ds);
+    sc = qe_compile_script(s, &ds);
+    if (sc) {
+        sc->dev = st.st_dev;
+        sc->ino = st.st_ino;
+        sc->mtime = st.st_mtime;
+        sc->size = st.st_size;
+        sc->next = first_script;
+        first_script = sc;
+    }
+    return sc;
+}
+
+int parse_config_file(EditState *s, const char *filename)
+{
+    QEScriptVM vm;
+    QEScript *sc;
+    int res;
+
+    sc = qe_load_script(s, filename);
+    if (!sc)
+        return -1;
+    res = qe_run_script(s, sc, &vm);
+    qe_cfg_release(&vm);
     return res;
 }
 
@@ -99,6 +99,12 @@
     STYLE_DEF(QE_STYLE_BLANK_HILITE, "blank-hilite", /* black on red */
               QERGB(0x00, 0x00, 0x00), QERGB(0xff, 0x00, 0x00), 
 	          0, 0, 0)
+    STYLE_DEF(QE_STYLE_DIFF_HILITE, "diff-hilite",
+              QERGB(0xff, 0xff, 0xff), QERGB(0x60, 0x40, 0x00),
+              0, 0, 0)
+    STYLE_DEF(QE_STYLE_DIFF_WORD_HILITE, "diff-word-hilite",
+              QERGB(0x00, 0x00, 0x00), QERGB(0xff, 0xc0, 0x00),
+              0, 0, 0)
 
 
     /* HTML coloring styles */
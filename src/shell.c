@@ -57,6 +57,12 @@ typedef struct ShellState {
     int cols, rows;
     int use_alternate_screen;
     int alternate_screen_top;
+    int alternate_save_log;
+    /* start offsets of the alternate screen rows, 0 rows if invalid */
+    int *row_offsets;
+    int nb_row_offsets, row_offsets_size;
+    /* last insertion to check for newlines once in the buffer */
+    int row_insert_offset, row_insert_size;
     int scroll_top, scroll_bottom;  /* scroll region (top included, bottom excluded) */
     int pty_fd;
     int pid; /* -1 if not launched */
@@ -87,6 +93,9 @@ typedef struct ShellState {
     const char *khome, *kend, *kmous, *knp, *kpp;
     const char *caption;  /* process caption for exit message */
     int shell_flags;
+    int scrollback; /* max number of lines to keep, 0 for unlimited */
+    int scrollback_size;  /* buffer size at the last scrollback check */
+    int scrollback_check; /* buffer size for the next scrollback check */
     int last_char;  /* last char sent to the process */
     char curpath[MAX_FILENAME_SIZE]; /* should keep a list with validity ranges */
 } ShellState;
@@ -99,7 +108,7 @@ static int error_col_num = -1;
 static char error_filename[MAX_FILENAME_SIZE];
 
 static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size);
+                               char *buf, int buf_size, int max_lines);
 
 static void set_error_offset(EditBuffer *b, int offset)
 {
@@ -478,23 +487,149 @@ static inline void qe_term_set_style(ShellState *s) {
     s->b->cur_style = QE_TERM_COMPOSITE | s->attr | composite_color;
 }
 
+/* Return non zero if the range contains a newline or is too large to
+ * be checked cheaply.
+ */
+static int qe_term_has_newline(EditBuffer *b, int offset, int size)
+{
+    u8 buf[256];
+    int len;
+
+    if (size > 4096)
+        return 1;
+    while (size > 0) {
+        len = eb_read(b, offset, buf, min(size, countof(buf)));
+        if (len <= 0)
+            break;
+        if (memchr(buf, '\n', len))
+            return 1;
+        offset += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/* Insertions are notified before the text is in the buffer: the
+ * inserted text is checked for newlines on the next notification or
+ * index lookup.
+ */
+static void qe_term_check_insert(ShellState *s)
+{
+    if (s->row_insert_size > 0) {
+        if (s->nb_row_offsets > 0
+        &&  qe_term_has_newline(s->b, s->row_insert_offset, s->row_insert_size)) {
+            /* rows were split */
+            s->nb_row_offsets = 0;
+        }
+        s->row_insert_size = 0;
+    }
+}
+
+/* Keep the alternate screen row index in sync with buffer changes:
+ * rows are shifted by modifications that do not involve newlines,
+ * other modifications invalidate the index.  Deletions and writes are
+ * notified before the buffer is modified, so the text they remove or
+ * overwrite is checked directly.  Inserted text is checked later by
+ * qe_term_check_insert().
+ * Shell output never writes newlines over existing text.
+ */
+static void qe_term_rows_callback(EditBuffer *b, void *opaque,
+                                  qe__unused__ int arg,
+                                  enum LogOperation op, int offset, int size)
+{
+    ShellState *s = opaque;
+    int i;
+
+    qe_term_check_insert(s);
+
+    if (s->nb_row_offsets == 0)
+        return;
+
+    switch (op) {
+    case LOGOP_INSERT:
+        if (offset >= s->row_offsets[0]) {
+            s->row_insert_offset = offset;
+            s->row_insert_size = size;
+        }
+        for (i = 0; i < s->nb_row_offsets; i++) {
+            if (s->row_offsets[i] > offset)
+                s->row_offsets[i] += size;
+        }
+        break;
+    case LOGOP_DELETE:
+        if (offset >= s->row_offsets[0]
+        ?   qe_term_has_newline(b, offset, size)
+        :   offset + size > s->row_offsets[0]) {
+            /* rows were joined or the screen top was deleted */
+            s->nb_row_offsets = 0;
+            break;
+        }
+        for (i = 0; i < s->nb_row_offsets; i++) {
+            if (s->row_offsets[i] > offset)
+                s->row_offsets[i] -= size;
+        }
+        break;
+    case LOGOP_WRITE:
+        if (qe_term_has_newline(b, offset, size))
+            s->nb_row_offsets = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Build the index of the alternate screen rows if needed and return
+ * the number of rows present in the buffer.
+ */
+static int qe_term_index_rows(ShellState *s)
+{
+    EditBuffer *b = s->b;
+    int n, offset, offset1;
+
+    qe_term_check_insert(s);
+    if (s->nb_row_offsets > 0)
+        return s->nb_row_offsets;
+
+    if (s->row_offsets_size < s->rows) {
+        if (!qe_realloc(&s->row_offsets, s->rows * sizeof(*s->row_offsets)))
+            return 0;
+        s->row_offsets_size = s->rows;
+    }
+    offset = minp(&s->alternate_screen_top, b->total_size);
+    s->row_offsets[0] = offset;
+    for (n = 1; n < s->rows && offset < b->total_size; n++) {
+        offset = eb_next_line(b, offset);
+        if (eb_prevc(b, offset, &offset1) != '\n')
+            break;
+        s->row_offsets[n] = offset;
+    }
+    return s->nb_row_offsets = n;
+}
+
 static void qe_term_get_pos(ShellState *s, int destoffset,
                             int *start, int *px, int *py)
 {
-    int total_lines, col_num, offset, offset1, c;
-    int x, y, w, start_line, start_offset;
+    int offset, offset1, c, n;
+    int x, y, w, start_offset, row;
 
     if (s->use_alternate_screen) {
         start_offset = minp(&s->alternate_screen_top, s->b->total_size);
     } else {
-        eb_get_pos(s->b, &total_lines, &col_num, s->b->total_size);
+        /* The screen shows the last s->rows lines of the buffer, the
+         * last one being incomplete or empty if the cursor is at the
+         * end of buffer.  Walk back from the end of buffer instead of
+         * counting lines from the start so the cost does not depend on
+         * the amount of scrollback.
+         * XXX: this is incorrect for overlong lines
+         */
+        n = s->rows;
         if (s->cur_offset >= s->b->total_size
         ||  eb_prevc(s->b, s->b->total_size, &offset1) != '\n')
-            total_lines++;
-
-        /* XXX: this is incorrect for overlong lines */
-        start_line = max(0, total_lines - s->rows);
-        start_offset = eb_goto_pos(s->b, start_line, 0);
+            n--;
+        start_offset = eb_goto_bol(s->b, s->b->total_size);
+        while (n-- > 0 && start_offset > 0) {
+            start_offset = eb_goto_bol(s->b, start_offset - 1);
+        }
     }
     if (start) {
         *start = start_offset;
@@ -502,7 +637,15 @@ static void qe_term_get_pos(ShellState *s, int destoffset,
     if (px || py) {
         destoffset = clamp(destoffset, 0, s->b->total_size);
         offset = start_offset;
-        for (x = y = 0; offset < destoffset;) {
+        row = 0;
+        if (s->use_alternate_screen && destoffset > start_offset
+        &&  (n = qe_term_index_rows(s)) > 0) {
+            /* start from the last row beginning before destoffset */
+            while (row + 1 < n && s->row_offsets[row + 1] <= destoffset)
+                row++;
+            offset = s->row_offsets[row];
+        }
+        for (x = 0, y = row; offset < destoffset;) {
             c = eb_nextc(s->b, offset, &offset);
             if (c == '\n') {
                 y++;
@@ -523,7 +666,7 @@ static void qe_term_get_pos(ShellState *s, int destoffset,
  */
 static void qe_term_goto_xy(ShellState *s, int destx, int desty, int relative)
 {
-    int x, y, w, start_offset, offset, offset1, c;
+    int x, y, w, start_offset, offset, offset1, c, n;
 
     if (relative & 3) {
         qe_term_get_pos(s, s->cur_offset, &start_offset, &x, &y);
@@ -547,6 +690,12 @@ static void qe_term_goto_xy(ShellState *s, int destx, int desty, int relative)
 
     x = y = 0;
     offset = start_offset;
+    if (s->use_alternate_screen && desty > 0
+    &&  (n = qe_term_index_rows(s)) > 0) {
+        /* skip to the start of the destination row or the last row */
+        y = min(desty, n - 1);
+        offset = s->row_offsets[y];
+    }
     while (y < desty || x < destx) {
         if (offset >= s->b->total_size) {
             offset = s->b->total_size;
@@ -618,6 +767,67 @@ static int qe_term_overwrite(ShellState *s, int offset,
     return offset + len;
 }
 
+/* Fast path for runs of plain text in the pty output: scan printable
+ * ASCII characters and complete UTF-8 sequences up to the next control
+ * byte and commit them with a single buffer operation instead of
+ * going through qe_term_emulate() one byte at a time.
+ * Return the number of bytes consumed.
+ */
+static int qe_term_emulate_text(ShellState *s, const u8 *buf, int len)
+{
+    const u8 *p = buf, *end = buf + len;
+    int nchars, offset, offset1, cur_len, c, lastc, n;
+
+    if (s->state != QE_TERM_STATE_NORM || s->shifted)
+        return 0;
+
+    lastc = s->lastc;
+    for (nchars = 0; p < end; nchars++) {
+        c = *p;
+        if (c >= 32 && c < 127) {
+            lastc = c;
+            p++;
+            continue;
+        }
+        if (c < 0xC2 || s->b->charset != &charset_utf8)
+            break;
+        /* accept complete UTF-8 sequences only */
+        n = utf8_length[c];
+        if (n > 4 || end - p < n)
+            break;
+        while (--n > 0 && (p[n] & 0xC0) == 0x80)
+            continue;
+        if (n > 0)
+            break;
+        p += utf8_length[c];
+    }
+    len = p - buf;
+    if (len == 0)
+        return 0;
+
+    s->lastc = lastc;
+    offset = clampp(&s->cur_offset, 0, s->b->total_size);
+
+    /* find the extent of the characters overwritten on the current line */
+    for (offset1 = offset; nchars > 0 && offset1 < s->b->total_size; nchars--) {
+        int next;
+        if (eb_nextc(s->b, offset1, &next) == '\n')
+            break;
+        offset1 = next;
+    }
+    qe_term_set_style(s);
+    cur_len = offset1 - offset;
+    if (cur_len == len) {
+        eb_write(s->b, offset, buf, len);
+    } else {
+        if (cur_len > 0)
+            eb_delete(s->b, offset, cur_len);
+        eb_insert(s->b, offset, buf, len);
+    }
+    s->cur_offset = offset + len;
+    return len;
+}
+
 static int qe_term_put_char(ShellState *s, int offset, int c, int n)
 {
     /* qe_term_put_char purposely ignores charset when writing chars */
@@ -1087,6 +1297,7 @@ static void qe_term_emulate(ShellState *s, int c)
                 if (row >= s->rows - 1) {
                     /* if on the last row, scroll the screen */
                     s->alternate_screen_top = eb_next_line(s->b, offset1);
+                    s->nb_row_offsets = 0;
                 }
                 qe_term_goto_xy(s, 0, 1, 3);
             } else {
@@ -1701,6 +1912,11 @@ static void qe_term_emulate(ShellState *s, int c)
                         }
                         s->use_alternate_screen = 1;
                         s->cur_offset = s->alternate_screen_top = offset;
+                        s->nb_row_offsets = 0;
+                        /* full screen applications redraw constantly:
+                           do not record undo information */
+                        s->alternate_save_log = s->b->save_log;
+                        s->b->save_log = 0;
                     }
                     break;
                 default:
@@ -1781,6 +1997,8 @@ static void qe_term_emulate(ShellState *s, int c)
                         qe_term_goto_xy(s, 0, s->rows, 0);
                         eb_delete_range(s->b, s->cur_offset, s->b->total_size);
                         s->use_alternate_screen = 0;
+                        s->nb_row_offsets = 0;
+                        s->b->save_log = s->alternate_save_log;
                     }
                     s->cur_offset = s->b->total_size;
                     break;
@@ -1891,6 +2109,48 @@ static void qe_term_emulate(ShellState *s, int c)
 
 /* buffer related functions */
 
+/* Remove the oldest lines of the buffer beyond the scrollback limit.
+ * Lines are removed in batches of 1/8th of the limit to avoid moving
+ * the buffer contents on every read.  Every line takes at least one
+ * byte, so lines are only counted again once the buffer has grown by
+ * the number of lines missing to reach the limit, or has shrunk.
+ */
+static void shell_trim_scrollback(ShellState *s)
+{
+    EditBuffer *b = s->b;
+    int nlines, col, limit, offset, save_log;
+
+    if (s->scrollback <= 0 || s->use_alternate_screen)
+        return;
+
+    if (b->total_size >= s->scrollback_size
+    &&  b->total_size < s->scrollback_check)
+        return;
+
+    /* always keep the terminal screen */
+    limit = max(s->scrollback, s->rows);
+    eb_get_pos(b, &nlines, &col, b->total_size);
+    s->scrollback_size = b->total_size;
+    if (nlines <= limit + limit / 8) {
+        s->scrollback_check = b->total_size + limit + limit / 8 - nlines + 1;
+        return;
+    }
+
+    offset = eb_goto_pos(b, nlines - limit, 0);
+    /* undo records before the trimmed text would be invalid */
+    save_log = b->save_log;
+    b->save_log = 0;
+    eb_delete_range(b, 0, offset);
+    b->save_log = save_log;
+    eb_free_log_buffer(b);
+    s->scrollback_size = b->total_size;
+    s->scrollback_check = b->total_size + limit / 8 + 1;
+
+    if (strequal(error_buffer, b->name)) {
+        error_offset = error_offset >= offset ? error_offset - offset : -1;
+    }
+}
+
 /* called when characters are available from the process */
 static void shell_read_cb(void *opaque)
 {
@@ -1920,8 +2180,13 @@ static void shell_read_cb(void *opaque)
 
     if (s->shell_flags & SF_COLOR) {
         /* optional terminal emulation (shell, ssh, make, latex, man modes) */
-        for (i = 0; i < len; i++) {
-            qe_term_emulate(s, buf[i]);
+        for (i = 0; i < len;) {
+            int n = qe_term_emulate_text(s, buf + i, len - i);
+            if (n > 0) {
+                i += n;
+            } else {
+                qe_term_emulate(s, buf[i++]);
+            }
         }
         if (s->last_char == '\000' || s->last_char == '\001'
         ||  s->last_char == '\003'
@@ -1940,7 +2205,10 @@ static void shell_read_cb(void *opaque)
                 b->mark = s->cur_prompt;
             }
         }
-        shell_get_curpath(b, s->cur_offset, s->curpath, sizeof(s->curpath));
+        /* only look for a prompt on the current line */
+        shell_get_curpath(b, s->cur_offset, s->curpath,
+                          sizeof(s->curpath), 1);
+        shell_trim_scrollback(s);
     } else {
         int pos = b->total_size;
         int threshold = 3 << 20;    /* 3MB for large pictures */
@@ -1962,9 +2230,8 @@ static void shell_read_cb(void *opaque)
         b->flags |= save_readonly;
     }
 
-    /* now we do some refresh (should just invalidate?) */
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    /* schedule a redisplay, coalesced with further process output */
+    url_request_display();
 }
 
 static void shell_mode_free(EditBuffer *b, void *state)
@@ -1975,6 +2242,8 @@ static void shell_mode_free(EditBuffer *b, void *state)
     eb_free_callback(b, eb_offset_callback, &s->cur_offset);
     eb_free_callback(b, eb_offset_callback, &s->cur_prompt);
     eb_free_callback(b, eb_offset_callback, &s->alternate_screen_top);
+    eb_free_callback(b, qe_term_rows_callback, s);
+    qe_free(&s->row_offsets);
 
     if (s->pid != -1) {
         kill(s->pid, SIGINT);
@@ -2075,8 +2344,7 @@ static void shell_pid_cb(void *opaque, int status)
         //shell_mode_free(b, s);  // called by qe_free_mode_data
         qe_free_mode_data(&s->base);
     }
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    url_request_display();
 }
 
 EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
@@ -2122,6 +2390,7 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
         eb_add_callback(b, eb_offset_callback, &s->cur_offset, 1);
         eb_add_callback(b, eb_offset_callback, &s->cur_prompt, 0);
         eb_add_callback(b, eb_offset_callback, &s->alternate_screen_top, 0);
+        eb_add_callback(b, qe_term_rows_callback, s, 0);
     }
     s->b = b;
     s->pty_fd = -1;
@@ -2129,6 +2398,7 @@ EditBuffer *new_shell_buffer(EditBuffer *b0, EditState *e,
     s->qe_state = qs;
     s->caption = caption;
     s->shell_flags = shell_flags;
+    s->scrollback = qs->shell_scrollback;
     s->cur_prompt = s->cur_offset = b->total_size;
     qe_term_init(s);
 
@@ -2516,7 +2786,8 @@ static void do_shell_enter(EditState *e)
         ShellState *s = shell_get_state(e, 1);
 
         if (s) {
-            shell_get_curpath(e->b, e->offset, s->curpath, sizeof(s->curpath));
+            shell_get_curpath(e->b, e->offset, s->curpath,
+                              sizeof(s->curpath), 0);
         }
         shell_write_char(e, '\r');
         /* give the process a chance to handle the input */
@@ -2718,6 +2989,7 @@ static void do_shell_refresh(EditState *e)
         /* update the terminal size and notify process */
         s->cols = e->wrap_cols = e->cols;
         s->rows = e->rows;
+        s->nb_row_offsets = 0;
 
         for (e1 = qs->first_window; e1 != NULL; e1 = e1->next_window) {
             if (e1->b == e->b) {
@@ -2764,10 +3036,11 @@ static void do_shell_toggle_input(EditState *e)
     do_return(e, 0);
 }
 
-/* get current directory from prompt on current line */
+/* get current directory from prompt on the line at offset or on
+   previous lines, looking back at most max_lines lines if not 0 */
 /* XXX: should extend behavior to handle more subtile cases */
 static char *shell_get_curpath(EditBuffer *b, int offset,
-                               char *buf, int buf_size)
+                               char *buf, int buf_size, int max_lines)
 {
     char line[1024];
     char curpath[MAX_FILENAME_SIZE];
@@ -2805,8 +3078,7 @@ again:
             return pstrcpy(buf, buf_size, curpath);
         }
     }
-    /* XXX: limit backlook? */
-    if (offset > 0) {
+    if (offset > 0 && --max_lines != 0) {
         offset = eb_prev_line(b, offset);
         goto again;
     }
@@ -2819,11 +3091,11 @@ static char *shell_get_default_path(EditBuffer *b, int offset,
 #if 0
     ShellState *s = qe_get_buffer_mode_data(b, &shell_mode, NULL);
 
-    if (s && (s->curpath[0] || shell_get_curpath(b, offset, s->curpath, sizeof(s->curpath)))) {
+    if (s && (s->curpath[0] || shell_get_curpath(b, offset, s->curpath, sizeof(s->curpath), 0))) {
         return pstrcpy(buf, buf_size, s->curpath);
     }
 #endif
-    return shell_get_curpath(b, offset, buf, buf_size);
+    return shell_get_curpath(b, offset, buf, buf_size, 0);
 }
 
 static void do_shell_command(EditState *e, const char *cmd)
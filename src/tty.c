@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <termios.h>
 #include <unistd.h>
@@ -143,6 +144,8 @@ typedef struct TTYState {
 #define USE_BLINK_AS_BRIGHT_BG  0x08
 #define USE_256_COLORS          0x10
 #define USE_TRUE_COLORS         0x20
+#define USE_SYNC_UPDATE         0x40
+#define USE_SCROLL_REGION       0x80
     /* number of colors supported by the actual terminal */
     const QEColor *term_colors;
     int term_fg_colors_count;
@@ -152,6 +155,10 @@ typedef struct TTYState {
     int tty_fg_colors_count;
     int tty_bg_colors_count;
     unsigned int comb_cache[COMB_CACHE_SIZE];
+    /* output arena: a frame is composed here and written in one call */
+    int out_fd;
+    unsigned char *outbuf;
+    int outbuf_len, outbuf_size;
 } TTYState;
 
 static QEditScreen *tty_screen;   /* for tty_term_exit and tty_term_resize */
@@ -206,10 +213,13 @@ static int tty_dpy_init(QEditScreen *s,
             ts->term_flags |= KBS_CONTROL_H;
         } else if (strstart(ts->term_name, "xterm", NULL)) {
             ts->term_code = TERM_XTERM;
+            ts->term_flags |= USE_SYNC_UPDATE | USE_SCROLL_REGION;
         } else if (strstart(ts->term_name, "tmux", NULL)) {
             ts->term_code = TERM_TMUX;
+            ts->term_flags |= USE_SYNC_UPDATE | USE_SCROLL_REGION;
         } else if (strstart(ts->term_name, "linux", NULL)) {
             ts->term_code = TERM_LINUX;
+            ts->term_flags |= USE_SCROLL_REGION;
         } else if (strstart(ts->term_name, "cygwin", NULL)) {
             ts->term_code = TERM_CYGWIN;
             ts->term_flags |= KBS_CONTROL_H |
@@ -364,6 +374,7 @@ static int tty_dpy_init(QEditScreen *s,
      * causing repaint errors when running in an xterm or in a screen
      * session. */
     fcntl(fileno(s->STDOUT), F_SETFL, 0);
+    ts->out_fd = fileno(s->STDOUT);
 
     set_read_handler(fileno(s->STDIN), tty_read_handler, s);
 
@@ -403,6 +414,7 @@ static void tty_dpy_close(QEditScreen *s)
 
     qe_free(&ts->screen);
     qe_free(&ts->line_updated);
+    qe_free(&ts->outbuf);
 }
 
 static void tty_term_exit(void)
@@ -1092,17 +1104,245 @@ static void tty_dpy_set_clip(qe__unused__ QEditScreen *s,
 {
 }
 
+/* Terminal output is composed in ts->outbuf and sent to the terminal
+ * with a single write() per frame, so the terminal never sees a half
+ * drawn screen and we avoid the stdio overhead of one call per cell.
+ */
+static void tty_out_flush(TTYState *ts)
+{
+    const unsigned char *p = ts->outbuf;
+    int len = ts->outbuf_len;
+
+    while (len > 0) {
+        ssize_t n = write(ts->out_fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                fd_set wfds;
+                FD_ZERO(&wfds);
+                FD_SET(ts->out_fd, &wfds);
+                select(ts->out_fd + 1, NULL, &wfds, NULL, NULL);
+                continue;
+            }
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    ts->outbuf_len = 0;
+}
+
+/* make room for at least n more bytes in the output buffer */
+static unsigned char *tty_out_reserve(TTYState *ts, int n)
+{
+    if (ts->outbuf_len + n > ts->outbuf_size) {
+        int size = max(ts->outbuf_size, 4096);
+        while (size < ts->outbuf_len + n)
+            size += size;
+        if (qe_realloc(&ts->outbuf, size)) {
+            ts->outbuf_size = size;
+        } else {
+            /* out of memory: send what we have and reuse the buffer */
+            tty_out_flush(ts);
+            if (n > ts->outbuf_size)
+                return NULL;
+        }
+    }
+    return ts->outbuf + ts->outbuf_len;
+}
+
+static inline void tty_out_putc(TTYState *ts, int c)
+{
+    if (ts->outbuf_len < ts->outbuf_size || tty_out_reserve(ts, 1))
+        ts->outbuf[ts->outbuf_len++] = c;
+}
+
+static void tty_out_write(TTYState *ts, const void *buf, int n)
+{
+    unsigned char *q = tty_out_reserve(ts, n);
+    if (q) {
+        memcpy(q, buf, n);
+        ts->outbuf_len += n;
+    }
+}
+
+static void tty_out_puts(TTYState *ts, const char *str)
+{
+    tty_out_write(ts, str, strlen(str));
+}
+
+static void tty_out_printf(TTYState *ts, const char *fmt, ...)
+{
+    va_list ap;
+    int n, avail;
+
+    for (avail = 32;;) {
+        unsigned char *q = tty_out_reserve(ts, avail);
+        if (!q)
+            return;
+        va_start(ap, fmt);
+        n = vsnprintf((char *)q, avail, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (n < avail) {
+            ts->outbuf_len += n;
+            return;
+        }
+        avail = n + 1;
+    }
+}
+
+static uint32_t tty_hash_row(const TTYChar *p, int w)
+{
+    uint32_t h = 0;
+
+    while (w-- > 0) {
+        TTYChar cc = *p++;
+        h = (h ^ (uint32_t)cc ^ (uint32_t)(cc >> 31 >> 1)) * 0x01000193;
+    }
+    return h;
+}
+
+/* Move rows [top, bot) of the shadow screen and its hash table up by
+ * n rows if n > 0, down by -n rows otherwise, the same way the terminal
+ * does with delete/insert line in a scroll region.  Rows scrolled in
+ * are invalidated to force their redisplay.
+ */
+static void tty_shift_rows(QEditScreen *s, uint32_t *ho, int top, int bot, int n)
+{
+    TTYState *ts = s->priv_data;
+    TTYChar *sh = ts->screen + ts->screen_size;
+    int w = s->width, y, dst, src, clr;
+
+    if (n > 0) {
+        dst = top;
+        src = top + n;
+        clr = bot - n;
+    } else {
+        n = -n;
+        dst = top + n;
+        src = top;
+        clr = top;
+    }
+    memmove(sh + dst * w, sh + src * w, (bot - top - n) * w * sizeof(TTYChar));
+    memmove(ho + dst, ho + src, (bot - top - n) * sizeof(*ho));
+    memset(sh + clr * w, 0xFF, n * w * sizeof(TTYChar));
+    for (y = clr; y < clr + n; y++) {
+        ho[y] = ~tty_hash_row(ts->screen + y * w, w);
+    }
+    memset(ts->line_updated + top, 1, bot - top);
+}
+
+/* Detect rows moved vertically between the shadow and the new screen
+ * and move them in the terminal with a scroll region and delete/insert
+ * line sequences, so scrolling a window does not retransmit its
+ * contents.  Runs of matching rows are found by comparing line hashes.
+ */
+static void tty_dpy_scroll(QEditScreen *s)
+{
+    TTYState *ts = s->priv_data;
+    const TTYChar *scr = ts->screen;
+    int w = s->width, shadow = ts->screen_size;
+    /* never move the bottom row: its last cell is never output */
+    int h = s->height - 1;
+    uint32_t hn[MAX_SCREEN_LINES], ho[MAX_SCREEN_LINES];
+    int y, y1, k, n, top, bot, score, pass, scrolled;
+    int best_score, best_top, best_bot, best_n;
+
+    if (!(ts->term_flags & USE_SCROLL_REGION) || h < 3)
+        return;
+
+    for (n = y = 0; y < h; y++) {
+        hn[y] = ho[y] = tty_hash_row(scr + y * w, w);
+        if (ts->line_updated[y]) {
+            ho[y] = tty_hash_row(scr + y * w + shadow, w);
+            n += (hn[y] != ho[y]);
+        }
+    }
+    if (n < 3)
+        return;
+
+    scrolled = 0;
+    for (pass = 0; pass < 8; pass++) {
+        best_score = 2;
+        best_top = best_bot = best_n = 0;
+        for (y = 0; y < h; y++) {
+            if (hn[y] == ho[y])
+                continue;
+            for (y1 = 0; y1 < h; y1++) {
+                if (y1 == y || ho[y1] != hn[y])
+                    continue;
+                /* only consider the start of a run */
+                if (y > 0 && y1 > 0 && hn[y - 1] != ho[y - 1]
+                &&  hn[y - 1] == ho[y1 - 1])
+                    continue;
+                for (k = 1; y + k < h && y1 + k < h; k++) {
+                    if (hn[y + k] != ho[y1 + k])
+                        break;
+                }
+                top = min(y, y1);
+                bot = max(y, y1) + k;
+                /* rows fixed by the move minus rows it would break */
+                score = 0;
+                for (n = top; n < bot; n++) {
+                    if (n >= y && n < y + k)
+                        score += (hn[n] != ho[n]);
+                    else
+                        score -= (hn[n] == ho[n]);
+                }
+                if (score > best_score) {
+                    best_score = score;
+                    best_top = top;
+                    best_bot = bot;
+                    best_n = y1 - y;
+                }
+            }
+        }
+        if (!best_n)
+            break;
+
+        /* check the rows for real in case of hash collisions */
+        y = best_n > 0 ? best_top : best_top - best_n;
+        k = best_bot - best_top - abs(best_n);
+        if (memcmp(scr + y * w, scr + (y + best_n) * w + shadow,
+                   k * w * sizeof(TTYChar)))
+            break;
+
+        tty_out_printf(ts, "\033[%d;%dr\033[%d;1H\033[%d%c",
+                       best_top + 1, best_bot, best_top + 1,
+                       abs(best_n), best_n > 0 ? 'M' : 'L');
+        tty_shift_rows(s, ho, best_top, best_bot, best_n);
+        scrolled = 1;
+    }
+    if (scrolled) {
+        /* reset the scroll region to the full screen */
+        tty_out_puts(ts, "\033[r");
+    }
+}
+
 static void tty_dpy_flush(QEditScreen *s)
 {
     TTYState *ts = s->priv_data;
     TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, cc, blankcc;
     int y, shadow, ch, bgcolor, fgcolor, shifted, attr;
 
+    /* Output written to stdio by other parts must go first */
+    fflush(s->STDOUT);
+
+    /* Begin synchronized update: the terminal holds the screen until
+     * the matching end sequence, avoiding tearing on large updates.
+     */
+    if (ts->term_flags & USE_SYNC_UPDATE) {
+        tty_out_puts(ts, "\033[?2026h");
+    }
+
     /* Hide cursor, goto home, reset attributes */
-    TTY_FPUTS("\033[?25l\033[H\033[0m", s->STDOUT);
+    tty_out_puts(ts, "\033[?25l\033[H\033[0m");
 
     if (ts->term_code != TERM_CYGWIN) {
-        TTY_FPUTS("\033(B\033)0", s->STDOUT);
+        tty_out_puts(ts, "\033(B\033)0");
     }
 
     bgcolor = -1;
@@ -1110,9 +1350,7 @@ static void tty_dpy_flush(QEditScreen *s)
     attr = 0;
     shifted = 0;
 
-    /* CG: Should optimize output by computing it in a temporary buffer
-     * and flushing it in one call to fwrite()
-     */
+    tty_dpy_scroll(s);
 
     shadow = ts->screen_size;
     /* We cannot print anything on the bottom right screen cell,
@@ -1188,8 +1426,8 @@ static void tty_dpy_flush(QEditScreen *s)
              * double-width glyphs on the row in front of this
              * difference (actually it should)
              */
-            TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
-                        y + 1, (int)(ptr1 - ptr + 1));
+            tty_out_printf(ts, "\033[%d;%dH",
+                           y + 1, (int)(ptr1 - ptr + 1));
 
             while (ptr1 < ptr4) {
                 cc = *ptr1;
@@ -1205,28 +1443,28 @@ static void tty_dpy_flush(QEditScreen *s)
                         if (ts->term_bg_colors_count > 256 && bgcolor >= 256) {
                             /* XXX: should special case dynamic palette */
                             QEColor rgb = qe_unmap_color(bgcolor, ts->tty_bg_colors_count);
-                            TTY_FPRINTF(s->STDOUT, "\033[48;2;%d;%d;%dm",
-                                        (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
+                            tty_out_printf(ts, "\033[48;2;%d;%d;%dm",
+                                           (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
                         } else
 #endif
                         if (ts->term_bg_colors_count > 16 && bgcolor >= 16) {
-                            TTY_FPRINTF(s->STDOUT, "\033[48;5;%dm", bgcolor);
+                            tty_out_printf(ts, "\033[48;5;%dm", bgcolor);
                         } else
                         if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG) {
                             if (bgcolor > 7) {
                                 if (lastbg <= 7) {
-                                    TTY_FPUTS("\033[5m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[5m");
                                 }
                             } else {
                                 if (lastbg > 7) {
-                                    TTY_FPUTS("\033[25m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[25m");
                                 }
                             }
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm", 40 + (bgcolor & 7));
+                            tty_out_printf(ts, "\033[%dm", 40 + (bgcolor & 7));
                         } else {
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
-                                        bgcolor > 7 ? 100 + bgcolor - 8 :
-                                        40 + bgcolor);
+                            tty_out_printf(ts, "\033[%dm",
+                                           bgcolor > 7 ? 100 + bgcolor - 8 :
+                                           40 + bgcolor);
                         }
                     }
                     /* do not special case SPC on fg color change
@@ -1237,28 +1475,28 @@ static void tty_dpy_flush(QEditScreen *s)
 #if TTY_STYLE_BITS == 32
                         if (ts->term_fg_colors_count > 256 && fgcolor >= 256) {
                             QEColor rgb = qe_unmap_color(fgcolor, ts->tty_fg_colors_count);
-                            TTY_FPRINTF(s->STDOUT, "\033[38;2;%d;%d;%dm",
-                                        (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
+                            tty_out_printf(ts, "\033[38;2;%d;%d;%dm",
+                                           (rgb >> 16) & 255, (rgb >> 8) & 255, (rgb >> 0) & 255);
                         } else
 #endif
                         if (ts->term_fg_colors_count > 16 && fgcolor >= 16) {
-                            TTY_FPRINTF(s->STDOUT, "\033[38;5;%dm", fgcolor);
+                            tty_out_printf(ts, "\033[38;5;%dm", fgcolor);
                         } else
                         if (ts->term_flags & USE_BOLD_AS_BRIGHT_FG) {
                             if (fgcolor > 7) {
                                 if (lastfg <= 7) {
-                                    TTY_FPUTS("\033[1m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[1m");
                                 }
                             } else {
                                 if (lastfg > 7) {
-                                    TTY_FPUTS("\033[22m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[22m");
                                 }
                             }
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm", 30 + (fgcolor & 7));
+                            tty_out_printf(ts, "\033[%dm", 30 + (fgcolor & 7));
                         } else {
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
-                                        fgcolor > 8 ? 90 + fgcolor - 8 :
-                                        30 + fgcolor);
+                            tty_out_printf(ts, "\033[%dm",
+                                           fgcolor > 8 ? 90 + fgcolor - 8 :
+                                           30 + fgcolor);
                         }
                     }
                     if (attr != (int)TTY_CHAR_GET_COL(cc)) {
@@ -1267,61 +1505,60 @@ static void tty_dpy_flush(QEditScreen *s)
 
                         if ((attr ^ lastattr) & TTY_BOLD) {
                             if (attr & TTY_BOLD) {
-                                TTY_FPUTS("\033[1m", s->STDOUT);
+                                tty_out_puts(ts, "\033[1m");
                             } else {
-                                TTY_FPUTS("\033[22m", s->STDOUT);
+                                tty_out_puts(ts, "\033[22m");
                             }
                         }
                         if ((attr ^ lastattr) & TTY_UNDERLINE) {
                             if (attr & TTY_UNDERLINE) {
-                                TTY_FPUTS("\033[4m", s->STDOUT);
+                                tty_out_puts(ts, "\033[4m");
                             } else {
-                                TTY_FPUTS("\033[24m", s->STDOUT);
+                                tty_out_puts(ts, "\033[24m");
                             }
                         }
                         if ((attr ^ lastattr) & TTY_BLINK) {
                             if (attr & TTY_BLINK) {
-                                TTY_FPUTS("\033[5m", s->STDOUT);
+                                tty_out_puts(ts, "\033[5m");
                             } else {
-                                TTY_FPUTS("\033[25m", s->STDOUT);
+                                tty_out_puts(ts, "\033[25m");
                             }
                         }
                         if ((attr ^ lastattr) & TTY_ITALIC) {
                             if (attr & TTY_ITALIC) {
-                                TTY_FPUTS("\033[3m", s->STDOUT);
+                                tty_out_puts(ts, "\033[3m");
                             } else {
-                                TTY_FPUTS("\033[23m", s->STDOUT);
+                                tty_out_puts(ts, "\033[23m");
                             }
                         }
                     }
                     if (shifted) {
                         /* Kludge for linedrawing chars */
                         if (ch < 128 || ch >= 128 + 32) {
-                            TTY_FPUTS("\033(B", s->STDOUT);
+                            tty_out_puts(ts, "\033(B");
                             shifted = 0;
                         }
                     }
 
                     /* do not display escape codes or invalid codes */
                     if (ch < 32 || ch == 127) {
-                        TTY_PUTC('.', s->STDOUT);
+                        tty_out_putc(ts, '.');
                     } else
                     if (ch < 127) {
-                        TTY_PUTC(ch, s->STDOUT);
+                        tty_out_putc(ts, ch);
                     } else
                     if (ch < 128 + 32) {
                         /* Kludges for linedrawing chars */
                         if (ts->term_code == TERM_CYGWIN) {
                             static const char unitab_xterm_poorman[32] =
                                 "*#****o~**+++++-----++++|****L. ";
-                            TTY_PUTC(unitab_xterm_poorman[ch - 128],
-                                     s->STDOUT);
+                            tty_out_putc(ts, unitab_xterm_poorman[ch - 128]);
                         } else {
                             if (!shifted) {
-                                TTY_FPUTS("\033(0", s->STDOUT);
+                                tty_out_puts(ts, "\033(0");
                                 shifted = 1;
                             }
-                            TTY_PUTC(ch - 32, s->STDOUT);
+                            tty_out_putc(ts, ch - 32);
                         }
                     } else
 #if COMB_CACHE_SIZE > 1
@@ -1334,7 +1571,7 @@ static void tty_dpy_flush(QEditScreen *s)
                             while (ncc-- > 1) {
                                 q = s->charset->encode_func(s->charset, buf, *ip++);
                                 if (q) {
-                                    TTY_FWRITE(buf, 1, q - buf, s->STDOUT);
+                                    tty_out_write(ts, buf, q - buf);
                                 }
                             }
                         }
@@ -1364,22 +1601,22 @@ static void tty_dpy_flush(QEditScreen *s)
 
                         nc = q - buf;
                         if (nc == 1) {
-                            TTY_PUTC(*buf, s->STDOUT);
+                            tty_out_putc(ts, *buf);
                         } else {
-                            TTY_FWRITE(buf, 1, nc, s->STDOUT);
+                            tty_out_write(ts, buf, nc);
                         }
                     }
                 }
             }
             if (shifted) {
-                TTY_FPUTS("\033(B", s->STDOUT);
+                tty_out_puts(ts, "\033(B");
                 shifted = 0;
             }
             if (ptr1 < ptr2) {
                 /* More differences to synch in shadow, erase eol */
                 cc = *ptr1;
                 /* the current attribute is already set correctly */
-                TTY_FPUTS("\033[K", s->STDOUT);
+                tty_out_puts(ts, "\033[K");
                 while (ptr1 < ptr2) {
                     ptr1[shadow] = cc;
                     ptr1++;
@@ -1388,7 +1625,7 @@ static void tty_dpy_flush(QEditScreen *s)
 //            if (ts->term_flags & USE_BLINK_AS_BRIGHT_BG)
             {
                 if (bgcolor > 7) {
-                    TTY_FPUTS("\033[0m", s->STDOUT);
+                    tty_out_puts(ts, "\033[0m");
                     fgcolor = bgcolor = -1;
                     attr = 0;
                 }
@@ -1396,12 +1633,15 @@ static void tty_dpy_flush(QEditScreen *s)
         }
     }
 
-    TTY_FPUTS("\033[0m", s->STDOUT);
+    tty_out_puts(ts, "\033[0m");
     if (ts->cursor_y + 1 >= 0 && ts->cursor_x + 1 >= 0) {
-        TTY_FPRINTF(s->STDOUT, "\033[?25h\033[%d;%dH",
-                    ts->cursor_y + 1, ts->cursor_x + 1);
+        tty_out_printf(ts, "\033[?25h\033[%d;%dH",
+                       ts->cursor_y + 1, ts->cursor_x + 1);
     }
-    fflush(s->STDOUT);
+    if (ts->term_flags & USE_SYNC_UPDATE) {
+        tty_out_puts(ts, "\033[?2026l");
+    }
+    tty_out_flush(ts);
 
     /* Update combination cache from screen. Should do this before redisplay */
     comb_cache_clean(ts, ts->screen, ts->screen_size);
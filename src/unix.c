@@ -29,6 +29,15 @@ typedef u_int fdesc_t;
 #include <sys/wait.h>
 typedef int fdesc_t;
 #endif
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+#ifdef CONFIG_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef CONFIG_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 /* NOTE: it is strongly inspirated from the 'links' browser API */
 
@@ -37,6 +46,10 @@ typedef struct URLHandler {
     void (*read_cb)(void *opaque);
     void *write_opaque;
     void (*write_cb)(void *opaque);
+#ifdef CONFIG_EPOLL
+    int events;         /* events registered with epoll */
+    int always_ready;   /* fd cannot be polled (regular file) */
+#endif
 } URLHandler;
 
 typedef struct PidHandler {
@@ -56,42 +69,134 @@ struct QETimer {
     void *opaque;
     void (*cb)(void *opaque);
     int timeout;
-    struct QETimer *next;
+    int index;  /* position in timer_heap */
 };
 
+#ifdef CONFIG_EPOLL
+static int url_epoll_fd = -1;
+static int url_nb_always_ready;
+#else
 static fd_set url_rfds, url_wfds;
+#endif
 static int url_fdmax;
-static URLHandler url_handlers[256];
+static URLHandler *url_handlers;
+static int url_handlers_size;
 static int url_exit_request;
 static int url_display_request;
+static int url_display_time;    /* time of the last scheduled redisplay */
 static LIST_HEAD(pid_handlers);
 static LIST_HEAD(bottom_halves);
-static QETimer *first_timer;
+/* pending timers, as a binary heap ordered by timeout */
+static QETimer **timer_heap;
+static int nb_timers, timer_heap_size;
+#ifndef CONFIG_WIN32
+/* SIGCHLD is notified to the main loop through a pipe */
+static int url_sigchld_fds[2] = { -1, -1 };
+#endif
+
+/* Return the handler slot for fd, growing the table as needed. */
+static URLHandler *url_get_handler(int fd)
+{
+    int size;
 
+#ifdef CONFIG_EPOLL
+    if (fd < 0)
+        return NULL;
+#else
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return NULL;
+#endif
+    if (fd >= url_handlers_size) {
+        size = max(url_handlers_size, 64);
+        while (size <= fd)
+            size += size;
+        if (!qe_realloc(&url_handlers, size * sizeof(*url_handlers)))
+            return NULL;
+        memset(url_handlers + url_handlers_size, 0,
+               (size - url_handlers_size) * sizeof(*url_handlers));
+        url_handlers_size = size;
+    }
+    if (fd > url_fdmax)
+        url_fdmax = fd;
+    return &url_handlers[fd];
+}
 
-void set_read_handler(int fd, void (*cb)(void *opaque), void *opaque)
+/* Update the set of events polled for fd after its handlers changed */
+static void url_update_handler(int fd, URLHandler *uh)
 {
-    url_handlers[fd].read_cb = cb;
-    url_handlers[fd].read_opaque = opaque;
-    if (cb) {
-        if (fd >= url_fdmax)
-            url_fdmax = fd;
-        FD_SET((fdesc_t)fd, &url_rfds);
+#ifdef CONFIG_EPOLL
+    struct epoll_event ev;
+    int events, ret;
+
+    events = (uh->read_cb ? EPOLLIN : 0) | (uh->write_cb ? EPOLLOUT : 0);
+    if (uh->always_ready) {
+        if (events)
+            return;
+        uh->always_ready = 0;
+        url_nb_always_ready--;
+    }
+    if (events == uh->events)
+        return;
+
+    if (url_epoll_fd < 0) {
+        url_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (url_epoll_fd < 0)
+            return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (!events) {
+        /* may fail if fd was already closed: it is then removed */
+        epoll_ctl(url_epoll_fd, EPOLL_CTL_DEL, fd, &ev);
     } else {
+        ret = epoll_ctl(url_epoll_fd, uh->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                        fd, &ev);
+        /* the fd may have been closed and reused behind our back */
+        if (ret < 0 && errno == ENOENT)
+            ret = epoll_ctl(url_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        else
+        if (ret < 0 && errno == EEXIST)
+            ret = epoll_ctl(url_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (ret < 0 && errno == EPERM) {
+            /* regular files are always ready, as with select() */
+            uh->always_ready = 1;
+            url_nb_always_ready++;
+            events = 0;
+        }
+    }
+    uh->events = events;
+#else
+    if (uh->read_cb)
+        FD_SET((fdesc_t)fd, &url_rfds);
+    else
         FD_CLR((fdesc_t)fd, &url_rfds);
+    if (uh->write_cb)
+        FD_SET((fdesc_t)fd, &url_wfds);
+    else
+        FD_CLR((fdesc_t)fd, &url_wfds);
+#endif
+}
+
+void set_read_handler(int fd, void (*cb)(void *opaque), void *opaque)
+{
+    URLHandler *uh = url_get_handler(fd);
+
+    if (uh) {
+        uh->read_cb = cb;
+        uh->read_opaque = opaque;
+        url_update_handler(fd, uh);
     }
 }
 
 void set_write_handler(int fd, void (*cb)(void *opaque), void *opaque)
 {
-    url_handlers[fd].write_cb = cb;
-    url_handlers[fd].write_opaque = opaque;
-    if (cb) {
-        if (fd >= url_fdmax)
-            url_fdmax = fd;
-        FD_SET((fdesc_t)fd, &url_wfds);
-    } else {
-        FD_CLR((fdesc_t)fd, &url_wfds);
+    URLHandler *uh = url_get_handler(fd);
+
+    if (uh) {
+        uh->write_cb = cb;
+        uh->write_opaque = opaque;
+        url_update_handler(fd, uh);
     }
 }
 
@@ -152,36 +257,83 @@ void unregister_bottom_half(void (*cb)(void *opaque), void *opaque)
     }
 }
 
+static inline int timer_before(const QETimer *a, const QETimer *b)
+{
+    return (a->timeout - b->timeout) < 0;
+}
+
+/* move the timer at position i up or down to restore the heap order */
+static void timer_heap_adjust(int i)
+{
+    QETimer *ti = timer_heap[i];
+    int parent, child;
+
+    while (i > 0 && timer_before(ti, timer_heap[parent = (i - 1) / 2])) {
+        timer_heap[i] = timer_heap[parent];
+        timer_heap[i]->index = i;
+        i = parent;
+    }
+    while ((child = 2 * i + 1) < nb_timers) {
+        if (child + 1 < nb_timers
+        &&  timer_before(timer_heap[child + 1], timer_heap[child]))
+            child++;
+        if (!timer_before(timer_heap[child], ti))
+            break;
+        timer_heap[i] = timer_heap[child];
+        timer_heap[i]->index = i;
+        i = child;
+    }
+    timer_heap[i] = ti;
+    ti->index = i;
+}
+
+static void timer_heap_remove(int i)
+{
+    QETimer *last = timer_heap[--nb_timers];
+
+    if (i < nb_timers) {
+        timer_heap[i] = last;
+        timer_heap_adjust(i);
+    }
+}
+
 QETimer *qe_add_timer(int delay, void *opaque, void (*cb)(void *opaque))
 {
     QETimer *ti;
 
+    if (nb_timers >= timer_heap_size) {
+        int size = max(timer_heap_size * 2, 16);
+        if (!qe_realloc(&timer_heap, size * sizeof(*timer_heap)))
+            return NULL;
+        timer_heap_size = size;
+    }
     ti = qe_mallocz(QETimer);
     if (!ti)
         return NULL;
     ti->timeout = get_clock_ms() + delay;
     ti->opaque = opaque;
     ti->cb = cb;
-    ti->next = first_timer;
-    first_timer = ti;
+    timer_heap[nb_timers++] = ti;
+    timer_heap_adjust(nb_timers - 1);
     return ti;
 }
 
+/* Remove a pending timer from the active timers and free it.
+ * Timers are freed once their callback has run: the callback must
+ * clear or replace the references to its timer.
+ */
 void qe_kill_timer(QETimer **tip)
 {
-    if (*tip) {
-        QETimer **pt;
+    QETimer *ti = *tip;
 
-        /* remove timer from list of active timers and free it */
-        for (pt = &first_timer; *pt != NULL; pt = &(*pt)->next) {
-            if (*pt == (*tip)) {
-                *pt = (*tip)->next;
-                qe_free(tip);
-                return;
-            }
+    if (ti) {
+        if (ti->index < nb_timers && timer_heap[ti->index] == ti) {
+            timer_heap_remove(ti->index);
+            qe_free(tip);
+        } else {
+            /* timer not found, was probably already freed */
+            *tip = NULL;
         }
-        /* timer not found, was probably alread freed */
-        *tip = NULL;
     }
 }
 
@@ -208,58 +360,168 @@ static inline void call_bottom_halves(void)
    check_timers() */
 static inline int check_timers(int max_delay)
 {
-    QETimer *ti, **pt;
-    int timeout, cur_time;
+    QETimer *ti;
+    int n, cur_time;
 
     cur_time = get_clock_ms();
-    timeout = cur_time + max_delay;
-    pt = &first_timer;
+    /* only run timers pending on entry: timers added by the callbacks
+     * are handled on the next call.
+     */
+    for (n = nb_timers; n > 0 && nb_timers > 0; n--) {
+        ti = timer_heap[0];
+        if ((ti->timeout - cur_time) > 0)
+            break;
+        /* timer expired : remove it from the heap and call callback */
+        timer_heap_remove(0);
+        /* warning: a new timer can be added in the callback */
+        ti->cb(ti->opaque);
+        qe_free(&ti);
+        call_bottom_halves();
+    }
+    if (nb_timers > 0 && (timer_heap[0]->timeout - cur_time) < max_delay)
+        max_delay = max(timer_heap[0]->timeout - cur_time, 0);
+    return max_delay;
+}
+
+#ifndef CONFIG_WIN32
+/* handle terminated children */
+static void url_reap_children(void)
+{
     while (true) {
-        ti = *pt;
-        if (ti == NULL)
+        int pid, status;
+        PidHandler *ph, *ph1;
+
+        if (list_empty(&pid_handlers))
             break;
-        if ((ti->timeout - cur_time) <= 0) {
-            /* timer expired : suppress it from timer list and call callback */
-            *pt = ti->next;
-            /* warning: a new timer can be added in the callback */
-            ti->cb(ti->opaque);
-            qe_free(&ti);
-            call_bottom_halves();
-        } else {
-            if ((ti->timeout - timeout) < 0)
-                timeout = ti->timeout;
-            pt = &ti->next;
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid <= 0)
+            break;
+        list_for_each_safe(ph, ph1, &pid_handlers) {
+            if (ph->pid == pid && ph->cb) {
+                ph->cb(ph->opaque, status);
+                call_bottom_halves();
+                break;
+            }
         }
     }
-    return timeout - cur_time;
 }
 
+static void url_sigchld_handler(qe__unused__ int sig)
+{
+    int save_errno = errno;
+
+    if (write(url_sigchld_fds[1], "", 1) < 0) {
+        /* pipe full: a notification is already pending */
+    }
+    errno = save_errno;
+}
+
+static void url_sigchld_cb(qe__unused__ void *opaque)
+{
+    char buf[64];
+
+    while (read(url_sigchld_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+    url_reap_children();
+}
+
+/* Reap children from the main loop when SIGCHLD is received instead
+ * of polling waitpid() on every iteration.
+ */
+static void url_sigchld_init(void)
+{
+    struct sigaction sig;
+
+    if (url_sigchld_fds[0] >= 0 || pipe(url_sigchld_fds) < 0)
+        return;
+    fcntl(url_sigchld_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(url_sigchld_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(url_sigchld_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(url_sigchld_fds[1], F_SETFD, FD_CLOEXEC);
+    set_read_handler(url_sigchld_fds[0], url_sigchld_cb, NULL);
+
+    sig.sa_handler = url_sigchld_handler;
+    sigemptyset(&sig.sa_mask);
+    sig.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sig, NULL);
+    /* children may have terminated before the handler was installed */
+    url_sigchld_handler(SIGCHLD);
+}
+#endif
+
 static void url_block_reset(void)
 {
+#ifndef CONFIG_EPOLL
     FD_ZERO(&url_rfds);
     FD_ZERO(&url_wfds);
     url_fdmax = -1;
+#endif
     url_exit_request = 0;
+#ifndef CONFIG_WIN32
+    url_sigchld_init();
+#endif
 }
 
 #define MAX_DELAY 500  /* milliseconds */
 
-/* block until one event */
-static void url_block(void)
+/* display request flags */
+#define URL_DISPLAY_UPDATE   1  /* redraw modified windows */
+#define URL_DISPLAY_REFRESH  2  /* full refresh, eg: screen size changed */
+
+/* call the handlers of a ready fd.
+ * Extra checks on callback function pointers because a callback
+ * may unregister another callback.  This was causing crash bugs
+ * when deleting a running shell output buffer such as a buffer
+ * with a huge compressed file while it decompresses.
+ * The handler table may also be reallocated by a callback.
+ */
+static void url_call_handlers(int fd, int readable, int writable)
+{
+    if (readable && url_handlers[fd].read_cb) {
+        url_handlers[fd].read_cb(url_handlers[fd].read_opaque);
+        call_bottom_halves();
+    }
+    if (writable && url_handlers[fd].write_cb) {
+        url_handlers[fd].write_cb(url_handlers[fd].write_opaque);
+        call_bottom_halves();
+    }
+}
+
+/* block until one event or `max_delay` milliseconds */
+static void url_block(int max_delay)
 {
-    URLHandler *uh;
+#ifdef CONFIG_EPOLL
+    struct epoll_event events[64];
     int ret, i, delay;
-    fd_set rfds, wfds;
-    struct timeval tv;
 
-    delay = check_timers(MAX_DELAY);
-#if 0
-    {
-        static int count;
+    delay = check_timers(max_delay);
+    if (url_nb_always_ready > 0)
+        delay = 0;
+
+    ret = -1;
+    if (url_epoll_fd >= 0)
+        ret = epoll_wait(url_epoll_fd, events, countof(events), delay);
+    else
+        usleep(delay * 1000);
 
-        printf("%5d: delay=%d\n", count++, delay);
+    for (i = 0; i < ret; i++) {
+        int fd = events[i].data.fd;
+        int ev = events[i].events;
+        url_call_handlers(fd, ev & (EPOLLIN | EPOLLHUP | EPOLLERR),
+                          ev & (EPOLLOUT | EPOLLHUP | EPOLLERR));
     }
-#endif
+    if (url_nb_always_ready > 0) {
+        for (i = 0; i <= url_fdmax; i++) {
+            if (url_handlers[i].always_ready)
+                url_call_handlers(i, 1, 1);
+        }
+    }
+#else
+    int ret, i, delay;
+    fd_set rfds, wfds;
+    struct timeval tv;
+
+    delay = check_timers(max_delay);
     tv.tv_sec = delay / 1000;
     tv.tv_usec = (delay % 1000) * 1000;
 
@@ -267,68 +529,487 @@ static void url_block(void)
     wfds = url_wfds;
     ret = select(url_fdmax + 1, &rfds, &wfds, NULL, &tv);
 
-    /* call each handler */
-    /* extra checks on callback function pointers because a callback
-     * may unregister another callback.  This was causing crash bugs
-     * when deleting a running shell output buffer such as a buffer
-     * with a huge compressed file while it decompresses.
-     * XXX: should break from the loop if callback changed the
-     *      structures but need further investigation.
-     */
     if (ret > 0) {
-        uh = url_handlers;
-        for (i = 0;i <= url_fdmax; i++) {
-            if (FD_ISSET(i, &rfds) && uh->read_cb) {
-                uh->read_cb(uh->read_opaque);
-                call_bottom_halves();
-            }
-            if (FD_ISSET(i, &wfds) && uh->write_cb) {
-                uh->write_cb(uh->write_opaque);
-                call_bottom_halves();
-            }
-            uh++;
+        for (i = 0; i <= url_fdmax; i++) {
+            url_call_handlers(i, FD_ISSET(i, &rfds), FD_ISSET(i, &wfds));
         }
     }
-
+#endif
 #ifndef CONFIG_WIN32
-    /* handle terminated children */
-    while (true) {
-        int pid, status;
-        PidHandler *ph, *ph1;
+    if (url_sigchld_fds[0] < 0) {
+        /* no SIGCHLD notification: poll for terminated children */
+        url_reap_children();
+    }
+#endif
+}
 
-        if (list_empty(&pid_handlers))
+/* Worker thread pool: jobs are queued by the main thread, run by the
+ * workers and handed back to the main loop through a pipe registered
+ * with set_read_handler, where their `done` callback is called.
+ */
+
+#define QE_JOB_MAX_WORKERS  8
+
+struct QEJob {
+    struct QEJob *next;
+    void (*work)(void *opaque, QEJob *job);
+    void (*done)(void *opaque, int cancelled);
+    void *opaque;
+    int cancelled;          /* only accessed with atomic builtins */
+};
+
+#ifdef CONFIG_PTHREAD
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static QEJob *job_queue, **job_queue_tail = &job_queue;
+static QEJob *job_done_list;    /* completed jobs, most recent first */
+static int job_nb_workers;
+static int job_fds[2] = { -1, -1 };
+
+/* called with job_mutex held */
+static void qe_job_post_done(QEJob *job)
+{
+    job->next = job_done_list;
+    job_done_list = job;
+    if (write(job_fds[1], "", 1) < 0) {
+        /* pipe full: the main loop is already notified */
+    }
+}
+
+static void *qe_job_worker(qe__unused__ void *arg)
+{
+    QEJob *job;
+
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        while (!job_queue)
+            pthread_cond_wait(&job_cond, &job_mutex);
+        job = job_queue;
+        if (!(job_queue = job->next))
+            job_queue_tail = &job_queue;
+        pthread_mutex_unlock(&job_mutex);
+
+        if (!qe_job_cancelled(job))
+            job->work(job->opaque, job);
+
+        pthread_mutex_lock(&job_mutex);
+        qe_job_post_done(job);
+        pthread_mutex_unlock(&job_mutex);
+    }
+    return NULL;
+}
+
+static void qe_job_done_cb(qe__unused__ void *opaque)
+{
+    char buf[64];
+    QEJob *job, *list;
+
+    while (read(job_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+
+    pthread_mutex_lock(&job_mutex);
+    /* reverse the list to call the callbacks in completion order */
+    for (list = NULL; (job = job_done_list) != NULL;) {
+        job_done_list = job->next;
+        job->next = list;
+        list = job;
+    }
+    pthread_mutex_unlock(&job_mutex);
+
+    while ((job = list) != NULL) {
+        list = job->next;
+        job->done(job->opaque, qe_job_cancelled(job));
+        qe_free(&job);
+        call_bottom_halves();
+    }
+}
+
+/* start the worker threads, return the number of workers available */
+static int qe_job_init(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t set, oldset;
+    long n;
+
+    if (job_nb_workers > 0 || job_fds[0] >= 0)
+        return job_nb_workers;
+
+    if (pipe(job_fds) < 0)
+        return 0;
+    fcntl(job_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(job_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(job_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(job_fds[1], F_SETFD, FD_CLOEXEC);
+    set_read_handler(job_fds[0], qe_job_done_cb, NULL);
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    n = clamp(n, 1, QE_JOB_MAX_WORKERS);
+
+    /* signals must be handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (job_nb_workers < n) {
+        if (pthread_create(&thread, &attr, qe_job_worker, NULL))
             break;
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid <= 0)
+        job_nb_workers++;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    return job_nb_workers;
+}
+#endif
+
+/* run a job synchronously when no worker thread is available */
+static void qe_job_run_done(void *opaque)
+{
+    QEJob *job = opaque;
+
+    job->done(job->opaque, qe_job_cancelled(job));
+    qe_free(&job);
+}
+
+QEJob *qe_job_submit(void (*work)(void *opaque, QEJob *job),
+                     void (*done)(void *opaque, int cancelled),
+                     void *opaque)
+{
+    QEJob *job;
+
+    job = qe_mallocz(QEJob);
+    if (!job)
+        return NULL;
+    job->work = work;
+    job->done = done;
+    job->opaque = opaque;
+
+#ifdef CONFIG_PTHREAD
+    if (qe_job_init() > 0) {
+        pthread_mutex_lock(&job_mutex);
+        *job_queue_tail = job;
+        job_queue_tail = &job->next;
+        pthread_cond_signal(&job_cond);
+        pthread_mutex_unlock(&job_mutex);
+        return job;
+    }
+#endif
+    job->work(job->opaque, job);
+    register_bottom_half(qe_job_run_done, job);
+    return job;
+}
+
+/* Request cancellation of a job: a job still queued is not run,
+ * a running job should stop when it polls qe_job_cancelled().
+ * The job pointer is valid until its `done` callback is called.
+ */
+void qe_job_cancel(QEJob *job)
+{
+#ifdef CONFIG_PTHREAD
+    QEJob **pp;
+
+    pthread_mutex_lock(&job_mutex);
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+    for (pp = &job_queue; *pp; pp = &(*pp)->next) {
+        if (*pp == job) {
+            if (!(*pp = job->next))
+                job_queue_tail = pp;
+            qe_job_post_done(job);
             break;
-        list_for_each_safe(ph, ph1, &pid_handlers) {
-            if (ph->pid == pid && ph->cb) {
-                ph->cb(ph->opaque, status);
-                call_bottom_halves();
+        }
+    }
+    pthread_mutex_unlock(&job_mutex);
+#else
+    __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+#endif
+}
+
+/* may be polled by the worker thread while the main thread cancels */
+int qe_job_cancelled(QEJob *job)
+{
+    return __atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE);
+}
+
+/* Parallel loops: the iterations are shared between the calling
+ * thread and helper jobs. Helpers that start after all iterations
+ * are taken return at once, the context is freed when the last
+ * reference is released.
+ */
+
+typedef struct QEParallel {
+    void (*work)(void *opaque, int i);
+    void *opaque;
+    int n, next, running, refs;
+#ifdef CONFIG_PTHREAD
+    pthread_cond_t cond;
+#endif
+} QEParallel;
+
+#ifdef CONFIG_PTHREAD
+static void qe_parallel_run(QEParallel *par)
+{
+    int i;
+
+    pthread_mutex_lock(&job_mutex);
+    par->running++;
+    while ((i = par->next) < par->n) {
+        par->next++;
+        pthread_mutex_unlock(&job_mutex);
+        par->work(par->opaque, i);
+        pthread_mutex_lock(&job_mutex);
+    }
+    if (--par->running == 0)
+        pthread_cond_broadcast(&par->cond);
+    pthread_mutex_unlock(&job_mutex);
+}
+
+static void qe_parallel_work(void *opaque, qe__unused__ QEJob *job)
+{
+    qe_parallel_run(opaque);
+}
+
+/* called from the main loop */
+static void qe_parallel_release(void *opaque, qe__unused__ int cancelled)
+{
+    QEParallel *par = opaque;
+
+    if (--par->refs == 0) {
+        pthread_cond_destroy(&par->cond);
+        qe_free(&par);
+    }
+}
+#endif
+
+void qe_job_parallel(int n, void (*work)(void *opaque, int i), void *opaque)
+{
+    int i;
+
+#ifdef CONFIG_PTHREAD
+    int nb_helpers = n > 1 ? min(n - 1, qe_job_init()) : 0;
+    QEParallel *par;
+
+    if (nb_helpers > 0 && (par = qe_mallocz(QEParallel)) != NULL) {
+        par->work = work;
+        par->opaque = opaque;
+        par->n = n;
+        par->refs = 1;
+        pthread_cond_init(&par->cond, NULL);
+        for (i = 0; i < nb_helpers; i++) {
+            if (qe_job_submit(qe_parallel_work, qe_parallel_release, par))
+                par->refs++;
+        }
+        qe_parallel_run(par);
+        pthread_mutex_lock(&job_mutex);
+        while (par->running > 0)
+            pthread_cond_wait(&par->cond, &job_mutex);
+        pthread_mutex_unlock(&job_mutex);
+        qe_parallel_release(par, 0);
+        return;
+    }
+#endif
+    for (i = 0; i < n; i++)
+        work(opaque, i);
+}
+
+/* Directory watches: a single inotify descriptor is read from the
+ * main loop and events are dispatched to the watchers of the
+ * directory where they occurred.
+ */
+
+struct QEWatch {
+    struct QEWatch *next;
+    int wd;
+    void (*cb)(void *opaque, int event, const char *name);
+    void *opaque;
+};
+
+#ifdef CONFIG_INOTIFY
+#define QE_WATCH_MASK  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                        IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static QEWatch *watch_list;
+static int watch_fd = -1;
+static int watch_dispatching;   /* removed watches are freed afterwards */
+
+static int qe_watch_event(const struct inotify_event *ev)
+{
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        return QE_WATCH_CREATE;
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        return QE_WATCH_DELETE;
+    if (ev->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))
+        return QE_WATCH_MODIFY;
+    return QE_WATCH_RESCAN;
+}
+
+static void qe_watch_read_cb(qe__unused__ void *opaque)
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    QEWatch *w, **wp;
+    ssize_t len;
+    char *p;
+
+    watch_dispatching++;
+    while ((len = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)(void *)p;
+            for (w = watch_list; w; w = w->next) {
+                if (!w->cb)
+                    continue;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    /* events were lost: all watchers must rescan */
+                    w->cb(w->opaque, QE_WATCH_RESCAN, "");
+                } else
+                if (w->wd == ev->wd) {
+                    if (ev->mask & IN_IGNORED)
+                        w->wd = -1;
+                    w->cb(w->opaque, qe_watch_event(ev),
+                          ev->len ? ev->name : "");
+                }
+            }
+        }
+    }
+    if (--watch_dispatching == 0) {
+        for (wp = &watch_list; (w = *wp) != NULL;) {
+            if (!w->cb) {
+                *wp = w->next;
+                qe_free(&w);
+            } else {
+                wp = &w->next;
+            }
+        }
+    }
+}
+#endif
+
+/* Watch directory `path` for changes: `cb` is called from the main
+ * loop with the event type and the name of the directory entry
+ * concerned, or an empty name for QE_WATCH_RESCAN. Return NULL if
+ * the directory cannot be watched.
+ */
+QEWatch *qe_watch_add(const char *path,
+                      void (*cb)(void *opaque, int event, const char *name),
+                      void *opaque)
+{
+#ifdef CONFIG_INOTIFY
+    QEWatch *w;
+    int wd;
+
+    if (watch_fd < 0) {
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (watch_fd < 0)
+            return NULL;
+        set_read_handler(watch_fd, qe_watch_read_cb, NULL);
+    }
+    /* the same directory watched twice yields the same descriptor,
+       all watches use the same mask */
+    wd = inotify_add_watch(watch_fd, path, QE_WATCH_MASK);
+    if (wd < 0)
+        return NULL;
+    w = qe_mallocz(QEWatch);
+    if (!w)
+        return NULL;
+    w->wd = wd;
+    w->cb = cb;
+    w->opaque = opaque;
+    w->next = watch_list;
+    watch_list = w;
+    return w;
+#else
+    return NULL;
+#endif
+}
+
+void qe_watch_remove(QEWatch **wp)
+{
+#ifdef CONFIG_INOTIFY
+    QEWatch *w = *wp, *w1, **pp;
+    int shared = 0;
+
+    if (!w)
+        return;
+    *wp = NULL;
+    for (w1 = watch_list; w1; w1 = w1->next) {
+        if (w1 != w && w1->cb && w1->wd == w->wd)
+            shared = 1;
+    }
+    if (!shared && w->wd >= 0)
+        inotify_rm_watch(watch_fd, w->wd);
+    w->cb = NULL;
+    if (!watch_dispatching) {
+        for (pp = &watch_list; *pp; pp = &(*pp)->next) {
+            if (*pp == w) {
+                *pp = w->next;
+                qe_free(&w);
                 break;
             }
         }
     }
+#else
+    *wp = NULL;
 #endif
 }
 
+/* minimum delay in milliseconds between scheduled redisplays */
+static int url_frame_delay(QEmacsState *qs)
+{
+    if (qs->display_frame_rate <= 0)
+        return 0;
+    return 1000 / qs->display_frame_rate;
+}
+
+/* compute how long to block before the next scheduled redisplay */
+static int url_display_delay(QEmacsState *qs)
+{
+    int delay;
+
+    if (!url_display_request)
+        return MAX_DELAY;
+    delay = url_display_time + url_frame_delay(qs) - get_clock_ms();
+    return clamp(delay, 0, MAX_DELAY);
+}
+
+/* Perform the pending redisplay unless a frame was already produced
+ * in the last frame period or keyboard input is pending: the key
+ * handlers redisplay after processing the input, redrawing now would
+ * only delay them.
+ */
+static void url_display(QEmacsState *qs)
+{
+    int cur_time;
+
+    if (dpy_is_user_input_pending(qs->screen))
+        return;
+
+    cur_time = get_clock_ms();
+    if (cur_time - url_display_time < url_frame_delay(qs))
+        return;
+
+    if (url_display_request & URL_DISPLAY_REFRESH) {
+        //qs->complete_refresh = 1;
+        do_refresh(NULL);
+    }
+    url_display_request = 0;
+    url_display_time = cur_time;
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
 void url_main_loop(void (*init)(void *opaque), void *opaque)
 {
+    QEmacsState *qs = &qe_state;
+
     url_block_reset();
     (*init)(opaque);
     while (true) {
         if (url_exit_request)
             break;
-        url_block();
-        if (url_display_request) {
-            QEmacsState *qs = &qe_state;
-
-            //qs->complete_refresh = 1;
-            do_refresh(NULL);
-            edit_display(qs);
-            dpy_flush(qs->screen);
-            url_display_request = 0;
-        }
+        url_block(url_display_delay(qs));
+        if (url_display_request)
+            url_display(qs);
     }
 }
 
@@ -341,5 +1022,12 @@ void url_exit(void)
 /* asynchronous redisplay signal received */
 void url_redisplay(void)
 {
-    url_display_request = 1;
+    url_display_request |= URL_DISPLAY_REFRESH;
+}
+
+/* schedule a redisplay: requests are coalesced and performed by the
+   main loop at most `display-frame-rate` times per second */
+void url_request_display(void)
+{
+    url_display_request |= URL_DISPLAY_UPDATE;
 }
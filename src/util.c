@@ -138,6 +138,38 @@ int is_directory(const char *path)
         return 0;
 }
 
+/* Open a temporary file for writing next to `filename`, creating its
+ * directory if needed. The temporary name is stored into `tmpname`.
+ * Return NULL on error, including when the name does not fit.
+ */
+FILE *qe_fopen_tmp(char *tmpname, int size, const char *filename)
+{
+    get_dirname(tmpname, size, filename);
+#ifdef CONFIG_WIN32
+    mkdir(tmpname);
+#else
+    mkdir(tmpname, 0755);
+#endif
+    if (snprintf(tmpname, size, "%s.tmp", filename) >= size) {
+        /* do not write to a truncated temporary name */
+        return NULL;
+    }
+    return fopen(tmpname, "w");
+}
+
+/* Close a stream opened by qe_fopen_tmp() and rename the temporary
+ * file to `filename`, or remove it if any write failed.
+ * Return 0 on success, -1 on error.
+ */
+int qe_fclose_tmp(FILE *f, const char *tmpname, const char *filename)
+{
+    /* always close the stream, even after a write error */
+    if ((ferror(f) | fclose(f)) == 0 && rename(tmpname, filename) == 0)
+        return 0;
+    unlink(tmpname);
+    return -1;
+}
+
 int is_filepattern(const char *filespec)
 {
     // XXX: should also accept character ranges and {} comprehensions
@@ -2090,6 +2122,89 @@ void free_strings(StringArray *cs)
     memset(cs, 0, sizeof(StringArray));
 }
 
+static unsigned int qe_hash_name(const char *name, int nocase)
+{
+    /* FNV-1a */
+    unsigned int h = 2166136261U;
+    int c;
+
+    while ((c = (unsigned char)*name++) != '\0') {
+        if (nocase)
+            c = qe_tolower(c);
+        h = (h ^ c) * 16777619U;
+    }
+    return h;
+}
+
+static int qe_hash_match(QEHashIndex *h, const char *s1, const char *s2)
+{
+    return h->nocase ? !strcasecmp(s1, s2) : strequal(s1, s2);
+}
+
+/* return the slot for `name`: its entry or the empty slot where to add it */
+static QEHashEntry *qe_hash_lookup(QEHashIndex *h, const char *name)
+{
+    unsigned int mask = h->size - 1;
+    unsigned int i = qe_hash_name(name, h->nocase) & mask;
+    QEHashEntry *e;
+
+    /* linear probing, the table is never more than half full */
+    for (;; i = (i + 1) & mask) {
+        e = &h->table[i];
+        if (!e->name || qe_hash_match(h, e->name, name))
+            return e;
+    }
+}
+
+void *qe_hash_find(QEHashIndex *h, const char *name)
+{
+    if (!h->count)
+        return NULL;
+    return qe_hash_lookup(h, name)->data;
+}
+
+/* Index `data` under `name`. An existing entry for the same name is
+ * kept unless `replace` is true.
+ * Return 1 if the entry was added or replaced, 0 if kept, -1 on
+ * allocation failure.
+ */
+int qe_hash_add(QEHashIndex *h, const char *name, void *data, int replace)
+{
+    QEHashEntry *e;
+
+    if (2 * (h->count + 1) > h->size) {
+        QEHashIndex h1 = *h;
+        int i;
+
+        h1.size = h->size ? 2 * h->size : 256;
+        h1.table = qe_mallocz_array(QEHashEntry, h1.size);
+        if (!h1.table)
+            return -1;
+        for (i = 0; i < h->size; i++) {
+            if (h->table[i].name)
+                *qe_hash_lookup(&h1, h->table[i].name) = h->table[i];
+        }
+        qe_free(&h->table);
+        *h = h1;
+    }
+    e = qe_hash_lookup(h, name);
+    if (e->name) {
+        if (!replace)
+            return 0;
+    } else {
+        h->count++;
+    }
+    e->name = name;
+    e->data = data;
+    return 1;
+}
+
+void qe_hash_free(QEHashIndex *h)
+{
+    qe_free(&h->table);
+    h->size = h->count = 0;
+}
+
 /**
  * Add a memory region to a dynamic string. In case of allocation
  * failure, the data is not added. The dynamic string is guaranteed to
@@ -2500,3 +2615,178 @@ void qe_qsort_r(void *base, size_t nmemb, size_t size, void *thunk,
         }
     }
 }
+
+/*---------------- diff_run ----------------*/
+
+/* Shortest edit script between two sequences with Myers' algorithm,
+ * using the linear space middle snake refinement. The search is cut
+ * short on very expensive inputs: the result is then a common
+ * subsequence that may not be the longest.
+ */
+
+typedef struct DiffContext {
+    const unsigned int *a, *b;
+    u8 *ca, *cb;
+    int *fd, *bd;   /* furthest reaching x, indexed by diagonal x - y */
+    int max_cost;
+} DiffContext;
+
+/* Find the middle snake of the shortest edit script between
+ * a[xoff..xlim) and b[yoff..ylim), both searched from each end until
+ * the paths overlap. If the cost gets too high, the furthest reaching
+ * forward path is used as an approximate split point.
+ */
+static void diff_split(DiffContext *dc, int xoff, int xlim, int yoff, int ylim,
+                       int *xmidp, int *ymidp)
+{
+    const unsigned int *a = dc->a, *b = dc->b;
+    int *fd = dc->fd, *bd = dc->bd;
+    int dmin = xoff - ylim, dmax = xlim - yoff;
+    int fmid = xoff - yoff, bmid = xlim - ylim;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int odd = (fmid - bmid) & 1;
+    int c, d, x, y, tlo, thi, best;
+
+    fd[fmid] = xoff;
+    bd[bmid] = xlim;
+    for (c = 1;; c++) {
+        /* extend the forward paths by one edit */
+        if (fmin > dmin)
+            fd[--fmin - 1] = -1;
+        else
+            fmin++;
+        if (fmax < dmax)
+            fd[++fmax + 1] = -1;
+        else
+            fmax--;
+        for (d = fmax; d >= fmin; d -= 2) {
+            tlo = fd[d - 1];
+            thi = fd[d + 1];
+            x = tlo >= thi ? tlo + 1 : thi;
+            y = x - d;
+            while (x < xlim && y < ylim && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            fd[d] = x;
+            if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+                goto found;
+            }
+        }
+        /* extend the backward paths by one edit */
+        if (bmin > dmin)
+            bd[--bmin - 1] = INT_MAX;
+        else
+            bmin++;
+        if (bmax < dmax)
+            bd[++bmax + 1] = INT_MAX;
+        else
+            bmax--;
+        for (d = bmax; d >= bmin; d -= 2) {
+            tlo = bd[d - 1];
+            thi = bd[d + 1];
+            x = tlo < thi ? tlo : thi - 1;
+            y = x - d;
+            while (x > xoff && y > yoff && a[x - 1] == b[y - 1]) {
+                x--;
+                y--;
+            }
+            bd[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+                goto found;
+            }
+        }
+        if (c >= dc->max_cost) {
+            /* too expensive: split at the furthest forward point */
+            best = -1;
+            *xmidp = xoff;
+            *ymidp = yoff;
+            for (d = fmax; d >= fmin; d -= 2) {
+                x = min(fd[d], xlim);
+                y = x - d;
+                if (y > ylim) {
+                    x = ylim + d;
+                    y = ylim;
+                }
+                if (best < x + y) {
+                    best = x + y;
+                    *xmidp = x;
+                    *ymidp = y;
+                }
+            }
+            return;
+        }
+    }
+ found:
+    *xmidp = max(xoff, min(x, xlim));
+    *ymidp = max(yoff, min(y, ylim));
+}
+
+static void diff_compare(DiffContext *dc, int xoff, int xlim, int yoff, int ylim)
+{
+    const unsigned int *a = dc->a, *b = dc->b;
+    int x, y;
+
+    for (;;) {
+        /* skip the common prefix and suffix */
+        while (xoff < xlim && yoff < ylim && a[xoff] == b[yoff]) {
+            xoff++;
+            yoff++;
+        }
+        while (xlim > xoff && ylim > yoff && a[xlim - 1] == b[ylim - 1]) {
+            xlim--;
+            ylim--;
+        }
+        if (xoff == xlim || yoff == ylim)
+            break;
+
+        diff_split(dc, xoff, xlim, yoff, ylim, &x, &y);
+        if ((x == xoff && y == yoff) || (x == xlim && y == ylim))
+            break;
+
+        /* recurse on the smaller half to bound the stack depth */
+        if ((x - xoff) + (y - yoff) < (xlim - x) + (ylim - y)) {
+            diff_compare(dc, xoff, x, yoff, y);
+            xoff = x;
+            yoff = y;
+        } else {
+            diff_compare(dc, x, xlim, y, ylim);
+            xlim = x;
+            ylim = y;
+        }
+    }
+    /* whatever remains is changed */
+    memset(dc->ca + xoff, 1, xlim - xoff);
+    memset(dc->cb + yoff, 1, ylim - yoff);
+}
+
+/* Mark in ca and cb the elements of a and b that are not part of
+ * their longest common subsequence. Return -1 if out of memory.
+ */
+int diff_run(const unsigned int *a, int n, const unsigned int *b, int m,
+             u8 *ca, u8 *cb)
+{
+    DiffContext dc;
+    int *v;
+    int i, cost;
+
+    memset(ca, 0, n);
+    memset(cb, 0, m);
+    v = qe_malloc_array(int, 2 * (n + m + 3));
+    if (!v)
+        return -1;
+
+    dc.a = a;
+    dc.b = b;
+    dc.ca = ca;
+    dc.cb = cb;
+    dc.fd = v + m + 1;
+    dc.bd = v + (n + m + 3) + m + 1;
+    /* allow about the square root of the size */
+    for (cost = 1, i = n + m; i > 0; i >>= 2)
+        cost <<= 1;
+    dc.max_cost = max(cost, 256);
+    diff_compare(&dc, 0, n, 0, m);
+    qe_free(&v);
+    return 0;
+}
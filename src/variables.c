@@ -50,12 +50,16 @@ static VarDef var_table[] = {
           "Set to ignore spaces in compare-windows." )
     S_VAR( "ignore-comments", ignore_comments, VAR_NUMBER, VAR_RW_SAVE,
           "Set to ignore comments in compare-windows." )
+    S_VAR( "compare-words", compare_words, VAR_NUMBER, VAR_RW_SAVE,
+          "Set to highlight changed words in lines that differ in compare-windows." )
     S_VAR( "hilite-region", hilite_region, VAR_NUMBER, VAR_RW_SAVE,
           "Set to highlight the region after setting the mark." )
     S_VAR( "mmap-threshold", mmap_threshold, VAR_NUMBER, VAR_RW_SAVE,
           "Size from which files are mmapped instead of loaded in memory." )
     S_VAR( "max-load-size", max_load_size, VAR_NUMBER, VAR_RW_SAVE,
           "Maximum size for files to be loaded or mmapped into a buffer." )
+    S_VAR( "sort-memory-limit", sort_memory_limit, VAR_NUMBER, VAR_RW_SAVE,
+          "Memory used to sort lines before sorted runs are spilled to disk." )
     S_VAR( "show-unicode", show_unicode, VAR_NUMBER, VAR_RW_SAVE,
           "Set to show non-ASCII characters as unicode escape sequences." )
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW_SAVE,
@@ -66,6 +70,12 @@ static VarDef var_table[] = {
           "Set to prevent automatic backups of modified files" )
     S_VAR( "c-label-indent", c_label_indent, VAR_NUMBER, VAR_RW_SAVE,
           "Number of columns to adjust indentation of C labels." )
+    S_VAR( "display-frame-rate", display_frame_rate, VAR_NUMBER, VAR_RW_SAVE,
+          "Maximum number of redisplays per second for process output, 0 for no limit." )
+    S_VAR( "shell-scrollback", shell_scrollback, VAR_NUMBER, VAR_RW_SAVE,
+          "Maximum number of lines kept in new shell buffers, 0 for no limit." )
+    S_VAR( "auto-revert", auto_revert, VAR_NUMBER, VAR_RW_SAVE,
+          "Set to reload unmodified file buffers when the file changes on disk." )
 
     //B_VAR( "screen-charset", charset, VAR_NUMBER, VAR_RW, NULL )
 
@@ -140,14 +150,11 @@ VarDef *qe_find_variable(const char *name)
     QEmacsState *qs = &qe_state;
     VarDef *vp;
 
-    for (vp = qs->first_variable; vp; vp = vp->next) {
-        if (strequal(vp->name, name))
-              return vp;
-    }
+    vp = qe_hash_find(&qs->variable_index, name);
     /* Should have a list of local variables for buffer/window/mode
      * instances
      */
-    return NULL;
+    return vp;
 }
 
 void variable_complete(CompleteState *cp)
@@ -163,9 +170,7 @@ QVarType qe_get_variable(EditState *s, const char *name,
                          char *buf, int size, int *pnum, int as_source)
 {
     const VarDef *vp;
-    int num = 0;
-    const char *str = NULL;
-    const void *ptr;
+    const char *str;
 
     vp = qe_find_variable(name);
     if (!vp) {
@@ -179,6 +184,17 @@ QVarType qe_get_variable(EditState *s, const char *name,
             pstrcpy(buf, size, str ? str : "");
         return str ? VAR_STRING : VAR_UNKNOWN;
     }
+    return qe_get_vardef(s, vp, buf, size, pnum, as_source);
+}
+
+/* same as qe_get_variable() for an already resolved variable */
+QVarType qe_get_vardef(EditState *s, const VarDef *vp,
+                       char *buf, int size, int *pnum, int as_source)
+{
+    int num = 0;
+    const char *str = NULL;
+    const void *ptr;
+
     switch (vp->domain) {
     case VAR_SELF:
         ptr = &vp->value;
@@ -283,7 +299,6 @@ static QVarType qe_generic_set_variable(EditState *s, VarDef *vp, void *ptr,
 QVarType qe_set_variable(EditState *s, const char *name,
                          const char *value, int num)
 {
-    void *ptr;
     VarDef *vp;
 
     vp = qe_find_variable(name);
@@ -303,39 +318,46 @@ QVarType qe_set_variable(EditState *s, const char *name,
         }
         qe_register_variables(vp, 1);
         return vp->type;
-    } else if (vp->rw == VAR_RO) {
+    }
+    return qe_set_vardef(s, vp, value, num);
+}
+
+/* same as qe_set_variable() for an already resolved variable */
+QVarType qe_set_vardef(EditState *s, VarDef *vp, const char *value, int num)
+{
+    void *ptr;
+
+    if (vp->rw == VAR_RO)
         return VAR_READONLY;
-    } else {
-        switch (vp->domain) {
-        case VAR_SELF:
-            ptr = &vp->value;
-            break;
-        case VAR_GLOBAL:
-            ptr = vp->value.ptr;
-            break;
-        case VAR_STATE:
-            ptr = (u8*)s->qe_state + vp->value.offset;
-            break;
-        case VAR_BUFFER:
-            ptr = (u8*)s->b + vp->value.offset;
-            break;
-        case VAR_WINDOW:
-            ptr = (u8*)s + vp->value.offset;
-            break;
-        case VAR_MODE:
-            ptr = (u8*)s->mode + vp->value.offset;
-            break;
-        default:
-            return VAR_UNKNOWN;
-        }
-        if (vp->type == VAR_NUMBER && value) {
-            char *p;
-            num = strtol(value, &p, 0);
-            if (!*p)
-                value = NULL;
-        }
-        return vp->set_value(s, vp, ptr, value, num);
+    switch (vp->domain) {
+    case VAR_SELF:
+        ptr = &vp->value;
+        break;
+    case VAR_GLOBAL:
+        ptr = vp->value.ptr;
+        break;
+    case VAR_STATE:
+        ptr = (u8*)s->qe_state + vp->value.offset;
+        break;
+    case VAR_BUFFER:
+        ptr = (u8*)s->b + vp->value.offset;
+        break;
+    case VAR_WINDOW:
+        ptr = (u8*)s + vp->value.offset;
+        break;
+    case VAR_MODE:
+        ptr = (u8*)s->mode + vp->value.offset;
+        break;
+    default:
+        return VAR_UNKNOWN;
     }
+    if (vp->type == VAR_NUMBER && value) {
+        char *p;
+        num = strtol(value, &p, 0);
+        if (!*p)
+            value = NULL;
+    }
+    return vp->set_value(s, vp, ptr, value, num);
 }
 
 void do_show_variable(EditState *s, const char *name)
@@ -378,6 +400,12 @@ void qe_register_variables(VarDef *vars, int count)
     }
     vp[-1].next = qs->first_variable;
     qs->first_variable = vars;
+
+    /* later registrations take precedence, as well as the first of
+       duplicate names in `vars` */
+    while (vp-- > vars) {
+        qe_hash_add(&qs->variable_index, vp->name, vp, 1);
+    }
 }
 
 /* should register this as help function */
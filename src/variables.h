@@ -103,6 +103,9 @@ QVarType qe_get_variable(EditState *s, const char *name,
                          char *buf, int size, int *pnum, int as_source);
 QVarType qe_set_variable(EditState *s, const char *name,
                          const char *value, int num);
+QVarType qe_get_vardef(EditState *s, const VarDef *vp,
+                       char *buf, int size, int *pnum, int as_source);
+QVarType qe_set_vardef(EditState *s, VarDef *vp, const char *value, int num);
 
 void qe_list_variables(EditState *s, EditBuffer *b);
 
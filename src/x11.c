@@ -60,6 +60,21 @@ static void xv_init(QEditScreen *s);
 #endif
 static void x11_handle_event(void *opaque);
 
+/* colormap visuals allocate each QEColor once from the server */
+#define X11_COLOR_HASH_BITS  8
+#define X11_COLOR_HASH_SIZE  (1 << X11_COLOR_HASH_BITS)
+
+typedef struct X11ColorEntry {
+    struct X11ColorEntry *next;
+    QEColor color;
+    int allocated;      /* color must be freed on close */
+#ifdef CONFIG_XFT
+    XftColor xft_color;
+#else
+    unsigned long pixel;
+#endif
+} X11ColorEntry;
+
 typedef struct X11State {
     Display *display;
     int xscreen;
@@ -96,6 +111,17 @@ typedef struct X11State {
 
     int visual_depth;
 
+    /* QEColor to pixel conversion: TrueColor visuals compute the pixel
+       locally, other visuals use the color cache */
+    int color_direct;
+    int red_shift, red_bits;
+    int green_shift, green_bits;
+    int blue_shift, blue_bits;
+    X11ColorEntry *color_hash[X11_COLOR_HASH_SIZE];
+    int color_count;
+    unsigned long color_lookups;   /* colors requested by the drawing code */
+    unsigned long color_allocs;    /* server round-trips to allocate colors */
+
 } X11State;
 
 /* global variables set from the command line */
@@ -180,6 +206,134 @@ static inline void update_rect(X11State *xs,
 }
 #endif // CONFIG_DOUBLE_BUFFER
 
+/* Colors: TrueColor visuals encode the RGB components directly in the
+   pixel value, which is computed locally.  Other visuals allocate each
+   color from the colormap once and keep it in a hash table until the
+   display is closed: XAllocColor is a synchronous server round-trip. */
+static void x11_mask_shift(unsigned long mask, int *shift, int *bits)
+{
+    int n = 0, b = 0;
+
+    if (mask) {
+        while (!(mask & 1)) {
+            mask >>= 1;
+            n++;
+        }
+        while (mask & 1) {
+            mask >>= 1;
+            b++;
+        }
+    }
+    *shift = n;
+    *bits = b;
+}
+
+static void x11_color_init(X11State *xs)
+{
+    Visual *visual = xs->attr.visual;
+
+    xs->color_direct = 0;
+    if (visual->class == TrueColor) {
+        x11_mask_shift(visual->red_mask, &xs->red_shift, &xs->red_bits);
+        x11_mask_shift(visual->green_mask, &xs->green_shift, &xs->green_bits);
+        x11_mask_shift(visual->blue_mask, &xs->blue_shift, &xs->blue_bits);
+        xs->color_direct = (xs->red_bits > 0 && xs->red_bits <= 16 &&
+                            xs->green_bits > 0 && xs->green_bits <= 16 &&
+                            xs->blue_bits > 0 && xs->blue_bits <= 16);
+    }
+}
+
+static unsigned long x11_direct_pixel(X11State *xs, QEColor color)
+{
+    /* scale the 8 bit components to 16 bits as XAllocColor does */
+    unsigned long r = (unsigned long)QERGB_RED(color) << 8;
+    unsigned long g = (unsigned long)QERGB_GREEN(color) << 8;
+    unsigned long b = (unsigned long)QERGB_BLUE(color) << 8;
+
+    return ((r >> (16 - xs->red_bits)) << xs->red_shift) |
+           ((g >> (16 - xs->green_bits)) << xs->green_shift) |
+           ((b >> (16 - xs->blue_bits)) << xs->blue_shift);
+}
+
+#ifdef CONFIG_XFT
+static void x11_render_color(QEColor color, XRenderColor *out)
+{
+    out->red = QERGB_RED(color) << 8;
+    out->green = QERGB_GREEN(color) << 8;
+    out->blue = QERGB_BLUE(color) << 8;
+    out->alpha = QERGB_ALPHA(color) << 8;
+}
+#endif
+
+static X11ColorEntry *x11_color_lookup(X11State *xs, QEColor color)
+{
+    unsigned int h = (color * 0x9E3779B1U) >> (32 - X11_COLOR_HASH_BITS);
+    X11ColorEntry *e;
+
+    for (e = xs->color_hash[h]; e; e = e->next) {
+        if (e->color == color)
+            return e;
+    }
+    e = qe_mallocz(X11ColorEntry);
+    if (!e)
+        return NULL;
+    e->color = color;
+    xs->color_allocs++;
+#ifdef CONFIG_XFT
+    {
+        XRenderColor render_color;
+
+        x11_render_color(color, &render_color);
+        e->allocated = XftColorAllocValue(xs->display, xs->attr.visual,
+                                          xs->attr.colormap, &render_color,
+                                          &e->xft_color);
+        if (!e->allocated) {
+            /* colormap full: keep the failure to avoid retrying */
+            e->xft_color.color = render_color;
+            e->xft_color.pixel = BlackPixel(xs->display, xs->xscreen);
+        }
+    }
+#else
+    {
+        XColor xcolor;
+
+        xcolor.red = QERGB_RED(color) << 8;
+        xcolor.green = QERGB_GREEN(color) << 8;
+        xcolor.blue = QERGB_BLUE(color) << 8;
+        e->allocated = XAllocColor(xs->display, xs->attr.colormap, &xcolor);
+        e->pixel = e->allocated ? xcolor.pixel :
+                   BlackPixel(xs->display, xs->xscreen);
+    }
+#endif
+    e->next = xs->color_hash[h];
+    xs->color_hash[h] = e;
+    xs->color_count++;
+    return e;
+}
+
+static void x11_color_free(X11State *xs)
+{
+    X11ColorEntry *e, *next;
+    int h;
+
+    for (h = 0; h < X11_COLOR_HASH_SIZE; h++) {
+        for (e = xs->color_hash[h]; e; e = next) {
+            next = e->next;
+            if (e->allocated) {
+#ifdef CONFIG_XFT
+                XftColorFree(xs->display, xs->attr.visual, xs->attr.colormap,
+                             &e->xft_color);
+#else
+                XFreeColors(xs->display, xs->attr.colormap, &e->pixel, 1, 0);
+#endif
+            }
+            qe_free(&e);
+        }
+        xs->color_hash[h] = NULL;
+    }
+    xs->color_count = 0;
+}
+
 static int x11_dpy_probe(void)
 {
     char *dpy;
@@ -316,9 +470,12 @@ static int x11_dpy_init(QEditScreen *s, int w, int h)
         int n;
         templ.visualid = xs->attr.visual->visualid;
         XVisualInfo *vinfo = XGetVisualInfo(xs->display, VisualIDMask, &templ, &n);
-        if (vinfo)
+        if (vinfo) {
             xs->visual_depth = vinfo->depth;
+            XFree(vinfo);
+        }
     }
+    x11_color_init(xs);
 
     xs->xim = XOpenIM(xs->display, NULL, NULL, NULL);
     xs->xic = XCreateIC(xs->xim, XNInputStyle,
@@ -450,6 +607,7 @@ static void x11_dpy_close(QEditScreen *s)
 #ifdef CONFIG_DOUBLE_BUFFER
     XFreePixmap(xs->display, xs->dbuffer);
 #endif // CONFIG_DOUBLE_BUFFER
+    x11_color_free(xs);
     XCloseDisplay(xs->display);
     qe_free(&s->priv_data);
 }
@@ -479,13 +637,22 @@ static int x11_term_resize(QEditScreen *s, int w, int h)
 #ifdef CONFIG_XFT
 static void get_xft_color(X11State *xs, QEColor in, XftColor *out)
 {
-    const int a = QERGB_ALPHA (in) << 8;
-    const int r = QERGB_RED(in) << 8;
-    const int g = QERGB_GREEN(in) << 8;
-    const int b = QERGB_BLUE(in) << 8;
-    XRenderColor render_color = { .red = r, .green = g, .blue = b, .alpha = a };
+    X11ColorEntry *e;
 
-    XftColorAllocValue(xs->display, xs->attr.visual, xs->attr.colormap, &render_color, out);
+    xs->color_lookups++;
+    if (xs->color_direct) {
+        /* same values as XftColorAllocValue without the library call */
+        x11_render_color(in, &out->color);
+        out->pixel = x11_direct_pixel(xs, in);
+        return;
+    }
+    e = x11_color_lookup(xs, in);
+    if (e) {
+        *out = e->xft_color;
+    } else {
+        x11_render_color(in, &out->color);
+        out->pixel = BlackPixel(xs->display, xs->xscreen);
+    }
 }
 
 
@@ -647,16 +814,15 @@ static void x11_dpy_draw_text(QEditScreen *s, QEFont *font,
 
 #else  // CONFIG_XFT
 
-static void get_x11_color(X11State *xs, QEColor in, XColor *out)
+static unsigned long get_x11_pixel(X11State *xs, QEColor in)
 {
-    const int r = QERGB_RED(in);
-    const int g = QERGB_GREEN(in);
-    const int b = QERGB_BLUE(in);
-
-    out->red = r << 8;
-    out->green = g << 8;
-    out->blue = b << 8;
-    XAllocColor(xs->display, xs->attr.colormap, out);
+    X11ColorEntry *e;
+
+    xs->color_lookups++;
+    if (xs->color_direct)
+        return x11_direct_pixel(xs, in);
+    e = x11_color_lookup(xs, in);
+    return e ? e->pixel : BlackPixel(xs->display, xs->xscreen);
 }
 
 
@@ -666,12 +832,10 @@ static void x11_dpy_fill_rectangle(QEditScreen *s,
                                    QEColor color)
 {
     X11State *xs = s->priv_data;
-    XColor xcolor;
 
     update_rect(xs, x1, y1, x1 + w, y1 + h);
 
-    get_x11_color(xs, color, &xcolor);
-    XSetForeground(xs->display, xs->gc, xcolor.pixel);
+    XSetForeground(xs->display, xs->gc, get_x11_pixel(xs, color));
     XFillRectangle(xs->display, xs->dbuffer, xs->gc, x1, y1, w, h);
 }
 
@@ -960,10 +1124,8 @@ static void x11_dpy_draw_text(QEditScreen *s, QEFont *font,
     XChar2b *q = x11_str;
     int i = 0, l, x, x_start;
     unsigned int cc;
-    XColor xcolor;
-    get_x11_color(xs, color, &xcolor);;
 
-    XSetForeground(xs->display, xs->gc, xcolor.pixel);
+    XSetForeground(xs->display, xs->gc, get_x11_pixel(xs, color));
     x = x1;
     x_start = x;
 
@@ -1987,6 +2149,30 @@ static int x11_dpy_draw_picture(QEditScreen *s,
     return status;
 }
 
+static void x11_dpy_describe(QEditScreen *s, EditBuffer *b)
+{
+    X11State *xs = s->priv_data;
+    int w = 16;
+
+    eb_printf(b, "Device Description\n\n");
+
+    eb_printf(b, "%*s: %s\n", w, "display", DisplayString(xs->display));
+    eb_printf(b, "%*s: %d  %s\n", w, "visual class", xs->attr.visual->class,
+              xs->attr.visual->class == TrueColor ? "TrueColor" :
+              xs->attr.visual->class == DirectColor ? "DirectColor" :
+              xs->attr.visual->class == PseudoColor ? "PseudoColor" :
+              xs->attr.visual->class == StaticColor ? "StaticColor" :
+              xs->attr.visual->class == GrayScale ? "GrayScale" :
+              xs->attr.visual->class == StaticGray ? "StaticGray" :
+              "");
+    eb_printf(b, "%*s: %d\n", w, "depth", xs->attr.depth);
+    eb_printf(b, "%*s: %s\n", w, "color pixels",
+              xs->color_direct ? "computed locally" : "colormap cache");
+    eb_printf(b, "%*s: %d\n", w, "cached colors", xs->color_count);
+    eb_printf(b, "%*s: %lu\n", w, "color lookups", xs->color_lookups);
+    eb_printf(b, "%*s: %lu\n", w, "color allocs", xs->color_allocs);
+}
+
 static  QEDisplay x11_dpy = {
     "x11", 1, 1,
     x11_dpy_probe,
@@ -2012,7 +2198,7 @@ static  QEDisplay x11_dpy = {
     x11_dpy_bmp_unlock,
     x11_dpy_draw_picture,
     x11_dpy_full_screen,
-    NULL, /* dpy_describe */
+    x11_dpy_describe,
     NULL, /* next */
 };
 
@@ -2048,10 +2234,51 @@ static void x11_list_fonts(EditState *s, int argval)
     show_popup(s, b, "X11 Font list");
 }
 
+/* Redraw the whole screen argval times and report the time spent and
+   the number of requests and color round-trips sent to the server. */
+static void x11_redraw_benchmark(EditState *s, int argval)
+{
+    QEmacsState *qs = s->qe_state;
+    QEditScreen *screen = qs->screen;
+    X11State *xs = screen->priv_data;
+    unsigned long requests, lookups, allocs;
+    int i, n, start_time, elapsed_time;
+
+    if (screen->dpy.dpy_init != x11_dpy_init) {
+        put_status(s, "Not an X11 display");
+        return;
+    }
+    n = (argval == NO_ARG) ? 20 : argval;
+    if (n <= 0)
+        return;
+
+    XSync(xs->display, False);
+    requests = NextRequest(xs->display);
+    lookups = xs->color_lookups;
+    allocs = xs->color_allocs;
+    start_time = get_clock_ms();
+
+    for (i = 0; i < n; i++) {
+        qs->complete_refresh = 1;
+        do_refresh(s);
+        edit_display(qs);
+        dpy_flush(screen);
+        XSync(xs->display, False);
+    }
+
+    elapsed_time = get_clock_ms() - start_time;
+    put_status(s, "%d redraws: %d ms, %lu requests, "
+               "%lu color lookups, %lu color round-trips",
+               n, elapsed_time, NextRequest(xs->display) - requests,
+               xs->color_lookups - lookups, xs->color_allocs - allocs);
+}
+
 static CmdDef x11_commands[] = {
 
     CMD2( KEY_CTRLH('f'), KEY_CTRLH(KEY_CTRL('F')),
           "x11-list-fonts", x11_list_fonts, ESi, "ui")
+    CMD2( KEY_NONE, KEY_NONE,
+          "x11-redraw-benchmark", x11_redraw_benchmark, ESi, "ui")
 
     CMD_DEF_END,
 };
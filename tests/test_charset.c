@@ -0,0 +1,240 @@
+/*
+ * Tests for the bulk UTF-8 transcoding hooks of the charsets.
+ *
+ * Copyright (c) 2002-2020 Charlie Gordon.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* the checks must also run in release builds */
+#undef NDEBUG
+#include <assert.h>
+#include "qe.h"
+
+#define NB_CHARS   20000
+#define BUF_SIZE   (NB_CHARS * 6 + 64)
+
+static u8 src[BUF_SIZE], ref[BUF_SIZE], out[BUF_SIZE];
+
+static unsigned int seed = 1;
+
+static int test_rand(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* a code point in the range of the charset, mostly in ASCII runs */
+static int test_char(int max_char)
+{
+    int c;
+
+    for (;;) {
+        if (test_rand(4))
+            c = 0x20 + test_rand(0x5f);
+        else
+        if (test_rand(4))
+            c = test_rand(0x800);
+        else
+            c = test_rand(max_char + 1);
+        /* skip code points that do not survive a UTF-8 round trip */
+        if (c > max_char || (c >= 0xd800 && c <= 0xdfff)
+        ||  c == 0xfffe || c == 0xffff)
+            continue;
+        return c;
+    }
+}
+
+/* make a sample text for the charset, return its size */
+static int make_sample(QECharset *charset)
+{
+    u8 *q = src;
+    int i, max_char;
+
+    if (charset->char_size == 1 && !charset->variable_size) {
+        /* every byte value */
+        for (i = 0; i < NB_CHARS; i++)
+            *q++ = test_rand(3) ? 0x20 + test_rand(0x5f) : test_rand(256);
+        return q - src;
+    }
+    max_char = (charset->char_size == 2) ? 0xffff : 0x10ffff;
+    for (i = 0; i < NB_CHARS; i++)
+        q = charset->encode_func(charset, q, test_char(max_char));
+    if (charset == &charset_utf8) {
+        /* invalid and truncated sequences */
+        memcpy(q, "a\xff" "b\xe0\x80" "c\xc3", 7);
+        q += 7;
+        memcpy(q, "\xc3\xa9" "d", 3);
+        q += 3;
+    }
+    return q - src;
+}
+
+/* convert with the bulk hook, feeding at most `slice` input bytes and
+   `chunk` output bytes at a time */
+static int to_utf8_bulk(QECharset *charset, const u8 *buf, int size,
+                        int slice, int chunk)
+{
+    CharsetDecodeState s;
+    const u8 *p = buf, *end = buf + size;
+    int len = 0, n;
+
+    charset_decode_init(&s, charset, EOL_UNIX);
+    while (p < end) {
+        const u8 *p0 = p;
+        n = charset->to_utf8_func(&s, out + len, chunk, &p,
+                                  end - p > slice ? p + slice : end);
+        /* only complete characters are converted */
+        assert(n > 0 && p > p0);
+        len += n;
+    }
+    charset_decode_close(&s);
+    return len;
+}
+
+static int from_utf8_bulk(QECharset *charset, const u8 *buf, int size,
+                          int slice, int chunk)
+{
+    const u8 *p = buf, *end = buf + size;
+    int len = 0, n;
+
+    while (p < end) {
+        const u8 *p0 = p;
+        n = charset->from_utf8_func(charset, out + len, chunk, &p,
+                                    end - p > slice ? p + slice : end);
+        assert(n > 0 && p > p0);
+        len += n;
+    }
+    return len;
+}
+
+static void test_charset(QECharset *charset)
+{
+    static const int slices[] = { 7, 64, BUF_SIZE };
+    static const int chunks[] = { 8, 61, BUF_SIZE };
+    CharsetDecodeState s;
+    const u8 *p;
+    u8 *q;
+    int size, ref_len, len, i, j;
+
+    printf("Test %s\n", charset->name);
+    assert(charset->to_utf8_func && charset->from_utf8_func);
+    size = make_sample(charset);
+
+    /* decode one character at a time */
+    charset_decode_init(&s, charset, EOL_UNIX);
+    s.p = src;
+    for (q = ref; s.p < src + size;)
+        q += utf8_encode((char *)q, s.decode_func(&s));
+    charset_decode_close(&s);
+    ref_len = q - ref;
+
+    for (i = 0; i < countof(slices); i++) {
+        for (j = 0; j < countof(chunks); j++) {
+            len = to_utf8_bulk(charset, src, size, slices[i], chunks[j]);
+            assert(len == ref_len && !memcmp(out, ref, len));
+        }
+    }
+
+    /* encode one character at a time */
+    for (p = ref, q = src; p < ref + ref_len;) {
+        u8 *q1 = charset->encode_func(charset, q, utf8_decode((const char **)(void *)&p));
+        q = q1 ? q1 : (*q = '?', q + 1);
+    }
+    size = q - src;
+
+    for (i = 0; i < countof(slices); i++) {
+        for (j = 0; j < countof(chunks); j++) {
+            len = from_utf8_bulk(charset, ref, ref_len, slices[i], chunks[j]);
+            assert(len == size && !memcmp(out, src, len));
+        }
+    }
+}
+
+/* table driven charsets as generated by cptoqe */
+static unsigned short table_upper[128], table_permuted[256];
+
+static struct QECharset charset_upper = {
+    "test-upper",
+    "",
+    NULL,
+    decode_8bit_init,
+    decode_8bit,
+    encode_8bit,
+    charset_get_pos_8bit,
+    charset_get_chars_8bit,
+    charset_goto_char_8bit,
+    charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
+    .char_size = 1,
+    .variable_size = 0,
+    .table_alloc = 1,
+    .eol_char = 10,
+    .min_char = 0x80,
+    .max_char = 0xff,
+    .private_table = table_upper,
+};
+
+/* ASCII is remapped too, as in EBCDIC charsets */
+static struct QECharset charset_permuted = {
+    "test-permuted",
+    "",
+    NULL,
+    decode_8bit_init,
+    decode_8bit,
+    encode_8bit,
+    charset_get_pos_8bit,
+    charset_get_chars_8bit,
+    charset_goto_char_8bit,
+    charset_goto_line_8bit,
+    to_utf8_8bit,
+    from_utf8_8bit,
+    .char_size = 1,
+    .variable_size = 0,
+    .table_alloc = 1,
+    .eol_char = 10,
+    .min_char = 0,
+    .max_char = 0xff,
+    .private_table = table_permuted,
+};
+
+int main ()
+{
+    static const char * const names[] = {
+        "raw", "8859-1", "vt100", "7bit", "utf-8",
+        "ucs2le", "ucs2be", "ucs4le", "ucs4be",
+    };
+    int i;
+
+    charset_init();
+    for (i = 0; i < countof(names); i++) {
+        QECharset *charset = find_charset(names[i]);
+        assert(charset != NULL);
+        test_charset(charset);
+    }
+
+    for (i = 0; i < 128; i++)
+        table_upper[i] = 0x400 + i;
+    /* some code points of the range are not mapped */
+    table_upper[0x10] = 0x2500;
+    table_upper[0x11] = 0x20ac;
+    test_charset(&charset_upper);
+
+    for (i = 0; i < 256; i++)
+        table_permuted[i] = (i * 7 + 3) & 0xff;
+    test_charset(&charset_permuted);
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Tests for the diff engine used by compare-windows.
+ *
+ * Copyright (c) 2002-2020 Charlie Gordon.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* the checks must also run in release builds */
+#undef NDEBUG
+#include <assert.h>
+#include "qe.h"
+
+#define MAX_SMALL  100
+#define NB_LARGE   200000
+
+static unsigned int seed = 1;
+
+static int test_rand(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* check that the unchanged elements of a and b are the same sequence,
+   return its length */
+static int check_common(const unsigned int *a, int n, const u8 *ca,
+                        const unsigned int *b, int m, const u8 *cb)
+{
+    int i = 0, j = 0, len = 0;
+
+    for (;;) {
+        while (i < n && ca[i])
+            i++;
+        while (j < m && cb[j])
+            j++;
+        if (i == n || j == m)
+            break;
+        assert(a[i] == b[j]);
+        i++;
+        j++;
+        len++;
+    }
+    /* both sequences are exhausted together */
+    for (; i < n; i++)
+        assert(ca[i]);
+    for (; j < m; j++)
+        assert(cb[j]);
+    return len;
+}
+
+/* length of the longest common subsequence by dynamic programming */
+static int lcs_length(const unsigned int *a, int n, const unsigned int *b, int m)
+{
+    static int row[2][MAX_SMALL + 1];
+    int i, j, *prev, *cur;
+
+    memset(row, 0, sizeof(row));
+    for (i = 1; i <= n; i++) {
+        prev = row[(i - 1) & 1];
+        cur = row[i & 1];
+        for (j = 1; j <= m; j++) {
+            if (a[i - 1] == b[j - 1])
+                cur[j] = prev[j - 1] + 1;
+            else
+                cur[j] = max(prev[j], cur[j - 1]);
+        }
+    }
+    return row[n & 1][m];
+}
+
+static void test_small(void)
+{
+    unsigned int a[MAX_SMALL], b[MAX_SMALL];
+    u8 ca[MAX_SMALL], cb[MAX_SMALL];
+    int k, i, n, m, alpha, ret, len;
+
+    printf("Test small sequences against dynamic programming\n");
+    for (k = 0; k < 2000; k++) {
+        n = test_rand(MAX_SMALL + 1);
+        m = test_rand(MAX_SMALL + 1);
+        alpha = 1 + test_rand(8);
+        for (i = 0; i < n; i++)
+            a[i] = test_rand(alpha);
+        for (i = 0; i < m; i++)
+            b[i] = test_rand(alpha);
+        ret = diff_run(a, n, b, m, ca, cb);
+        assert(ret == 0);
+        len = check_common(a, n, ca, b, m, cb);
+        assert(len == lcs_length(a, n, b, m));
+    }
+
+    printf("Test empty and identical sequences\n");
+    for (i = 0; i < MAX_SMALL; i++)
+        a[i] = i;
+    ret = diff_run(a, MAX_SMALL, a, MAX_SMALL, ca, cb);
+    assert(ret == 0);
+    len = check_common(a, MAX_SMALL, ca, a, MAX_SMALL, cb);
+    assert(len == MAX_SMALL);
+    ret = diff_run(a, 0, a, MAX_SMALL, ca, cb);
+    assert(ret == 0);
+    len = check_common(a, 0, ca, a, MAX_SMALL, cb);
+    assert(len == 0);
+    ret = diff_run(a, MAX_SMALL, a, 0, ca, cb);
+    assert(ret == 0);
+    len = check_common(a, MAX_SMALL, ca, a, 0, cb);
+    assert(len == 0);
+}
+
+static void test_large(void)
+{
+    unsigned int *a, *b;
+    u8 *ca, *cb;
+    int i, n, m, nb_edits, len, ret;
+
+    a = qe_malloc_array(unsigned int, NB_LARGE);
+    b = qe_malloc_array(unsigned int, NB_LARGE * 2);
+    ca = qe_malloc_array(u8, NB_LARGE);
+    cb = qe_malloc_array(u8, NB_LARGE * 2);
+    assert(a && b && ca && cb);
+
+    printf("Test few edits in %d lines\n", NB_LARGE);
+    /* unique lines: each edit costs exactly one insertion or deletion */
+    n = NB_LARGE;
+    for (i = 0; i < n; i++)
+        a[i] = i;
+    for (i = m = nb_edits = 0; i < n; i++) {
+        if (test_rand(1000) == 0) {
+            /* delete a line */
+            nb_edits++;
+            continue;
+        }
+        if (test_rand(1000) == 0) {
+            /* insert a line */
+            b[m++] = NB_LARGE + i;
+            nb_edits++;
+        }
+        b[m++] = a[i];
+    }
+    ret = diff_run(a, n, b, m, ca, cb);
+    assert(ret == 0);
+    len = check_common(a, n, ca, b, m, cb);
+    assert((n - len) + (m - len) == nb_edits);
+
+    printf("Test unrelated sequences of %d lines\n", NB_LARGE);
+    /* the search is cut short but must still give a common subsequence */
+    for (i = 0; i < n; i++)
+        a[i] = test_rand(16);
+    for (i = 0; i < n; i++)
+        b[i] = test_rand(16);
+    ret = diff_run(a, n, b, n, ca, cb);
+    assert(ret == 0);
+    check_common(a, n, ca, b, n, cb);
+
+    qe_free(&a);
+    qe_free(&b);
+    qe_free(&ca);
+    qe_free(&cb);
+}
+
+int main ()
+{
+    test_small();
+    test_large();
+    return 0;
+}
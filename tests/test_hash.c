@@ -0,0 +1,97 @@
+/*
+ * Tests for the hash index of named objects.
+ *
+ * Copyright (c) 2002-2020 Charlie Gordon.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* the checks must also run in release builds */
+#undef NDEBUG
+#include <assert.h>
+#include "qe.h"
+
+#define NB_NAMES  2000
+
+static char names[NB_NAMES][16];
+
+int main ()
+{
+    QEHashIndex h;
+    int i, ret, data[NB_NAMES];
+    void *found;
+
+    memset(&h, 0, sizeof(h));
+
+    printf("Test empty index\n");
+    found = qe_hash_find(&h, "none");
+    assert(found == NULL);
+
+    printf("Test add and find %d names\n", NB_NAMES);
+    for (i = 0; i < NB_NAMES; i++) {
+        snprintf(names[i], sizeof(names[i]), "name-%d", i);
+        ret = qe_hash_add(&h, names[i], &data[i], 0);
+        assert(ret == 1);
+    }
+    assert(h.count == NB_NAMES);
+    /* the table is never more than half full */
+    assert(h.size >= 2 * h.count);
+    assert((h.size & (h.size - 1)) == 0);
+    for (i = 0; i < NB_NAMES; i++) {
+        found = qe_hash_find(&h, names[i]);
+        assert(found == &data[i]);
+    }
+    found = qe_hash_find(&h, "name-");
+    assert(found == NULL);
+    found = qe_hash_find(&h, "NAME-1");
+    assert(found == NULL);
+
+    printf("Test duplicate names\n");
+    ret = qe_hash_add(&h, "name-1", &data[2], 0);
+    assert(ret == 0);
+    found = qe_hash_find(&h, "name-1");
+    assert(found == &data[1]);
+    ret = qe_hash_add(&h, "name-1", &data[2], 1);
+    assert(ret == 1);
+    found = qe_hash_find(&h, "name-1");
+    assert(found == &data[2]);
+    assert(h.count == NB_NAMES);
+
+    printf("Test free\n");
+    qe_hash_free(&h);
+    assert(h.table == NULL && h.size == 0 && h.count == 0);
+    found = qe_hash_find(&h, "name-1");
+    assert(found == NULL);
+
+    printf("Test case insensitive index\n");
+    h.nocase = 1;
+    ret = qe_hash_add(&h, "Text", &data[0], 0);
+    assert(ret == 1);
+    ret = qe_hash_add(&h, "c", &data[1], 0);
+    assert(ret == 1);
+    ret = qe_hash_add(&h, "TEXT", &data[2], 0);
+    assert(ret == 0);
+    found = qe_hash_find(&h, "text");
+    assert(found == &data[0]);
+    found = qe_hash_find(&h, "tExT");
+    assert(found == &data[0]);
+    found = qe_hash_find(&h, "C");
+    assert(found == &data[1]);
+    found = qe_hash_find(&h, "Tex");
+    assert(found == NULL);
+    qe_hash_free(&h);
+
+    return 0;
+}
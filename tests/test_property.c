@@ -0,0 +1,220 @@
+/*
+ * Tests for the buffer properties.
+ *
+ * Copyright (c) 2002-2020 Charlie Gordon.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* the checks must also run in release builds */
+#undef NDEBUG
+#include <assert.h>
+#include "qe.h"
+
+#define NB_OPS     20000
+#define NB_NAMES   64
+#define MAX_PROPS  4096
+#define QE_PROP_TEST  2     /* a property type whose data is not freed */
+
+/* reference model: a plain array sorted by offset */
+typedef struct TestProp {
+    int offset;
+    int type;
+    const char *name;
+} TestProp;
+
+static TestProp props[MAX_PROPS];
+static int nb_props;
+static char names[NB_NAMES][8];
+
+/* buffer.c dependencies on the editor and the main loop: the test
+   buffer is never displayed, saved or watched */
+QEmacsState qe_state;
+
+void put_status(qe__unused__ EditState *s, qe__unused__ const char *fmt, ...)
+{
+}
+
+void url_request_display(void)
+{
+}
+
+QETimer *qe_add_timer(qe__unused__ int delay, qe__unused__ void *opaque,
+                      qe__unused__ void (*cb)(void *opaque))
+{
+    return NULL;
+}
+
+void qe_kill_timer(QETimer **tip)
+{
+    *tip = NULL;
+}
+
+QEWatch *qe_watch_add(qe__unused__ const char *path,
+                      qe__unused__ void (*cb)(void *opaque, int event, const char *name),
+                      qe__unused__ void *opaque)
+{
+    return NULL;
+}
+
+void qe_watch_remove(QEWatch **wp)
+{
+    *wp = NULL;
+}
+
+static unsigned int seed = 1;
+
+static int test_rand(int n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static void model_add(int offset, int type, const char *name)
+{
+    int i, j;
+
+    for (i = 0; i < nb_props && props[i].offset <= offset; i++) {
+        if (props[i].offset == offset && type == QE_PROP_TAG
+        &&  props[i].type == type && strequal(props[i].name, name))
+            return;
+    }
+    for (j = i; j < nb_props && props[j].offset == offset; j++) {
+        continue;
+    }
+    memmove(props + j + 1, props + j, (nb_props - j) * sizeof(*props));
+    props[j].offset = offset;
+    props[j].type = type;
+    props[j].name = name;
+    nb_props++;
+}
+
+/* remove the properties in [offset, offset2), shift the others by delta */
+static void model_remove(int offset, int offset2, int delta)
+{
+    int i, j;
+
+    for (i = j = 0; i < nb_props; i++) {
+        if (props[i].offset >= offset && props[i].offset < offset2)
+            continue;
+        if (props[i].offset >= offset2)
+            props[i].offset += delta;
+        props[j++] = props[i];
+    }
+    nb_props = j;
+}
+
+static void check_props(EditBuffer *b)
+{
+    QEProperty *p, *found;
+    int i, k, offset, offset2, type, last;
+
+    for (i = 0, p = eb_first_property(b); p; p = eb_next_property(p), i++) {
+        assert(i < nb_props);
+        assert(eb_property_offset(p) == props[i].offset);
+        assert(p->type == props[i].type);
+        assert(strequal(p->data, props[i].name));
+    }
+    assert(i == nb_props);
+
+    for (k = 0; k < 8; k++) {
+        offset = test_rand(b->total_size + 1);
+        offset2 = offset + test_rand(b->total_size + 1 - offset + 1);
+        type = test_rand(2) ? QE_PROP_TAG : QE_PROP_TEST;
+        for (i = 0, last = -1; i < nb_props; i++) {
+            if (props[i].offset >= offset && props[i].offset < offset2
+            &&  props[i].type == type)
+                last = i;
+        }
+        found = eb_find_property(b, offset, offset2, type);
+        if (last < 0) {
+            assert(found == NULL);
+        } else {
+            assert(found != NULL);
+            assert(eb_property_offset(found) == props[last].offset);
+            assert(strequal(found->data, props[last].name));
+        }
+    }
+
+    for (k = 0; k < 8; k++) {
+        const char *name = names[test_rand(NB_NAMES)];
+        for (i = 0; i < nb_props; i++) {
+            if (props[i].type == QE_PROP_TAG && strequal(props[i].name, name))
+                break;
+        }
+        found = eb_find_tag(b, name);
+        if (i == nb_props) {
+            assert(found == NULL);
+        } else {
+            assert(found != NULL && found->type == QE_PROP_TAG);
+            assert(eb_property_offset(found) == props[i].offset);
+            assert(strequal(found->data, name));
+        }
+    }
+}
+
+int main ()
+{
+    static const char text[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    EditBuffer *b;
+    int i, op, offset, size, type;
+    const char *name;
+
+    for (i = 0; i < NB_NAMES; i++)
+        snprintf(names[i], sizeof(names[i]), "tag%d", i);
+
+    b = eb_new("*test*", BF_SYSTEM);
+    assert(b != NULL);
+    eb_insert(b, 0, text, strlen(text));
+
+    printf("Test %d random edits against a sorted list\n", NB_OPS);
+    for (i = 0; i < NB_OPS; i++) {
+        op = test_rand(16);
+        offset = test_rand(b->total_size + 1);
+        if (op < 8 && nb_props < MAX_PROPS) {
+            /* few names and offsets to get duplicates */
+            type = test_rand(4) ? QE_PROP_TAG : QE_PROP_TEST;
+            name = names[test_rand(NB_NAMES)];
+            if (type == QE_PROP_TAG)
+                eb_add_property(b, offset, type, qe_strdup(name));
+            else
+                eb_add_property(b, offset, type, (void *)name);
+            model_add(offset, type, name);
+        } else
+        if (op < 11) {
+            size = 1 + test_rand(8);
+            eb_insert(b, offset, text, size);
+            model_remove(offset, offset, size);
+        } else
+        if (op < 14) {
+            size = eb_delete(b, offset, test_rand(8));
+            model_remove(offset, offset + size, -size);
+        } else
+        if (op < 15) {
+            size = test_rand(8);
+            eb_delete_properties(b, offset, offset + size);
+            model_remove(offset, offset + size, 0);
+        }
+        check_props(b);
+    }
+
+    printf("Test removing all properties\n");
+    eb_delete_properties(b, 0, INT_MAX);
+    model_remove(0, INT_MAX, 0);
+    check_props(b);
+    assert(eb_find_tag(b, names[0]) == NULL);
+    eb_free(&b);
+    return 0;
+}